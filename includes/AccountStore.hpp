@@ -0,0 +1,38 @@
+#ifndef ACCOUNTSTORE_HPP
+#define ACCOUNTSTORE_HPP
+
+#include <map>
+#include <string>
+#include <ctime>
+
+// Accounts for SASL: one "<account> <password hash> [oper]" per line of a
+// text file ('#' starts a comment; see PasswordHash for the hash format, and
+// `ircserv --hash-password` to produce one). A client logged in to an account
+// marked oper is a server operator. The file is read again whenever its
+// modification time changes, so accounts can be added without a restart.
+class AccountStore {
+private:
+    struct Account {
+        std::string name;       // as written in the file
+        std::string hash;
+        bool oper;
+    };
+
+    std::string _path;
+    time_t _loadedMtime;
+    std::map<std::string, Account> _accounts;    // casefolded name → account
+
+    void reloadIfChanged();
+
+public:
+    AccountStore();
+
+    void open(const std::string& path);
+    size_t size() const;
+
+    // Fills the account's own spelling and hash; false for an unknown account
+    bool find(const std::string& account, std::string& name, std::string& hash);
+    bool isOperator(const std::string& account);
+};
+
+#endif
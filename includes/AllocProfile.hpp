@@ -0,0 +1,56 @@
+#ifndef ALLOCPROFILE_HPP
+#define ALLOCPROFILE_HPP
+
+#include <string>
+#include <vector>
+
+// Heap traffic by what the event loop was doing, for builds made with
+// `make re ALLOC_PROFILE=1`: the global operator new and delete are replaced
+// with counting versions, and every allocation made while a scope is open on
+// the loop thread is charged to it and to the scopes around it. Scopes are
+// the command verbs, "(parse)" for splitting lines into commands and
+// "(fanout)" for channel broadcasts, NICK and QUIT to common channels and
+// relays to linked servers, so PRIVMSG includes its fan-out and "(fanout)"
+// shows that part across all commands. Read it with STATS a, or
+// on stdout at shutdown. In a normal build the scopes compile to nothing.
+namespace AllocProfile {
+    struct Counters {
+        unsigned long long entered;       // times the scope was opened
+        unsigned long long allocations;
+        unsigned long long bytes;
+
+        Counters();
+    };
+
+    // Charges allocations to counters until it goes out of scope
+    class Scope {
+    private:
+        Counters* _counters;
+        Scope* _outer;
+
+        Scope(const Scope&);
+        Scope& operator=(const Scope&);
+
+    public:
+        explicit Scope(Counters& counters);
+        ~Scope();
+
+        static void charge(size_t bytes);     // for operator new
+    };
+
+    bool enabled();
+
+    // The counters for a scope name, created on first use; loop thread only
+    Counters& counters(const std::string& name);
+
+    // A totals line, then one line per scope, most allocations first
+    void report(std::vector<std::string>& lines);
+}
+
+#ifdef IRCSERV_ALLOC_PROFILE
+#define IRCSERV_ALLOC_SCOPE(name) AllocProfile::Scope allocScope(AllocProfile::counters(name))
+#else
+#define IRCSERV_ALLOC_SCOPE(name)
+#endif
+
+#endif
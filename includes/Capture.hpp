@@ -0,0 +1,97 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <pthread.h>
+#include "Mask.hpp"
+
+class Client; // Forward declaration
+
+// Records the lines clients send, with their timing, so real sessions can be
+// replayed against another build (see Replay). Enabled for the whole
+// listener, or only for clients whose IP matches a mask.
+//
+// The file starts with CAPTURE_MAGIC, followed by records
+//     <type> <serial> <delta> <length> <bytes>
+// where type is one byte (RECORD_OPEN with the IP as bytes, RECORD_LINE,
+// RECORD_CLOSE), serial identifies the session, delta is microseconds since
+// the previous record and the numbers are LEB128 varints. A process taking
+// over the file (upgrade, standby) appends without a header, its first delta 0.
+//
+// The loop only appends to a buffer; once a tick the buffer goes to a writer
+// thread. Passwords and resume tokens are not recorded; the file is
+// readable by the owner only.
+class Capture {
+public:
+    enum RecordType {
+        RECORD_OPEN = 'O',
+        RECORD_LINE = 'L',
+        RECORD_CLOSE = 'C'
+    };
+
+    struct Record {
+        char type;
+        unsigned long serial;
+        unsigned long long at;      // microseconds since the start of the file
+        std::string data;
+    };
+
+    static const size_t MAX_BACKLOG = 64 * 1024 * 1024;    // bytes queued for the writer before batches are dropped
+
+private:
+    std::string _path;
+    Mask _ipMask;
+    bool _filtered;
+    int _fd;
+    std::string _buffer;            // this tick's records
+    unsigned long long _lastRecordAt;
+    unsigned long _dropped;
+
+    bool _threadStarted;
+    bool _stopping;
+    bool _writerBusy;
+    std::deque<std::string> _batches;
+    size_t _queuedBytes;
+    pthread_t _thread;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _wake;
+    pthread_cond_t _idle;
+
+    void append(char type, unsigned long serial, const std::string& data);
+    static void putVarint(std::string& out, unsigned long long value);
+    static bool getVarint(const std::string& in, size_t& pos, unsigned long long& value);
+
+    static void* writerMain(void* capture);
+    void runWriter();
+
+    Capture(const Capture&);
+    Capture& operator=(const Capture&);
+
+public:
+    static const char* const CAPTURE_MAGIC;
+
+    Capture();
+    ~Capture();
+
+    // ipMask empty: every client
+    bool open(const std::string& path, const std::string& ipMask);
+    void close();
+    bool isOpen() const;
+
+    // Sessions: a new connection, or one handed over already recorded
+    void sessionOpened(Client* client);
+    void sessionResumed(Client* client);
+    void lineReceived(Client* client, const std::string& line);
+    void sessionClosed(Client* client);
+
+    // End of tick: hand the buffer to the writer. sync() waits until it is on disk.
+    void flush();
+    void sync();
+
+    // Replay side: every record of a capture file, in order
+    static bool load(const std::string& path, std::vector<Record>& records);
+};
+
+#endif
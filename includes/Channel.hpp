@@ -1,71 +1,236 @@
-#ifndef CHANNEL_HPP
-#define CHANNEL_HPP
-
-#include <string>
-#include <set>
-#include <map>
-
-class Client; // Forward declaration
-
-class Channel {
-private:
-    std::string _name;
-    std::string _topic;
-    std::set<Client*> _members;
-    std::set<Client*> _operators;
-    
-    // Channel modes
-    bool _inviteOnly;      // +i mode
-    bool _topicRestricted; // +t mode
-    std::string _key;      // +k mode (password)
-    size_t _userLimit;     // +l mode (0 = no limit)
-    
-    // Invite list (simple session-based)
-    std::set<Client*> _invitedClients;
-
-public:
-    Channel(const std::string& name);
-    ~Channel();
-
-    // Basic info
-    const std::string& getName() const;
-    const std::string& getTopic() const;
-    void setTopic(const std::string& topic);
-
-    // Membership
-    void addClient(Client* client);
-    void removeClient(Client* client);
-    bool hasClient(Client* client) const;
-    const std::set<Client*>& getMembers() const;
-
-
-    // Operators
-    void addOperator(Client* client);
-    void removeOperator(Client* client);
-    bool isOperator(Client* client) const;
-
-    // Messaging
-    void broadcast(const std::string& message, Client* sender);
-    
-    // Modes
-    bool isInviteOnly() const;
-    bool isTopicRestricted() const;
-    const std::string& getKey() const;
-    size_t getUserLimit() const;
-    
-    void setInviteOnly(bool inviteOnly);
-    void setTopicRestricted(bool topicRestricted);
-    void setKey(const std::string& key);
-    void setUserLimit(size_t limit);
-    
-    std::string getModeString() const;
-    
-    // Invite management
-    void addInvite(Client* client);
-    void removeInvite(Client* client);
-    bool isInvited(Client* client) const;
-    void promoteNewOperatorIfNeeded();
-
-};
-
-#endif
+#ifndef CHANNEL_HPP
+#define CHANNEL_HPP
+
+#include <string>
+#include <set>
+#include <map>
+#include <vector>
+#include <ctime>
+#include "Mask.hpp"
+#include "MessageHistory.hpp"
+
+class Client;      // Forward declaration
+class StateWriter; // Forward declaration
+class StateReader; // Forward declaration
+
+class Channel {
+public:
+    // +b / +e / +I mask lists
+    enum ListMode {
+        LIST_BAN,
+        LIST_EXCEPT,
+        LIST_INVEX,
+        LIST_COUNT
+    };
+
+    struct MaskEntry {
+        std::string mask;
+        std::string setBy;
+        time_t setAt;
+        Mask compiled;      // compiled once when the entry is added
+    };
+
+    static const size_t MAX_LIST_ENTRIES = 500;
+
+    // How a mode letter is applied. The first four are the ISUPPORT CHANMODES
+    // types: A adds to or removes from a list, B takes a parameter both ways,
+    // C only when set, D never. Prefix modes set a member flag on a nickname.
+    enum ModeType {
+        MODE_TYPE_LIST,     // A
+        MODE_TYPE_PARAM,    // B
+        MODE_TYPE_SETTING,  // C
+        MODE_TYPE_FLAG,     // D
+        MODE_TYPE_PREFIX
+    };
+
+    // Channel mode bits, one per mode that is set (lists aside)
+    enum ModeBit {
+        MODE_INVITE_ONLY = 1 << 0,      // +i
+        MODE_MODERATED = 1 << 1,        // +m
+        MODE_NO_EXTERNAL = 1 << 2,      // +n
+        MODE_PRIVATE = 1 << 3,          // +p
+        MODE_SECRET = 1 << 4,           // +s
+        MODE_TOPIC_RESTRICTED = 1 << 5, // +t
+        MODE_DELAYED_JOIN = 1 << 6,     // +D
+        MODE_KEY = 1 << 7,              // +k, key in its slot
+        MODE_LIMIT = 1 << 8             // +l, limit in its slot
+    };
+
+    struct ModeSpec {
+        char letter;
+        ModeType type;
+        unsigned bit;       // ModeBit, ListMode for lists, MemberFlag for prefixes
+        char prefix;        // NAMES/WHO symbol of a prefix mode
+    };
+
+    // Every channel mode, in the order a mode string lists them
+    static const ModeSpec MODE_TABLE[];
+    static const size_t MODE_COUNT;
+    static const unsigned DEFAULT_MODES = MODE_NO_EXTERNAL | MODE_TOPIC_RESTRICTED;
+
+    // Per-member flag bits
+    enum MemberFlag {
+        MEMBER_OP = 1 << 0,
+        MEMBER_VOICE = 1 << 1,
+        MEMBER_BAN_CHECKED = 1 << 2,   // MEMBER_BANNED holds a valid cached verdict
+        MEMBER_BANNED = 1 << 3,
+        MEMBER_HIDDEN = 1 << 4         // joined under +D and not yet revealed
+    };
+
+    // What changed since the channel was last published (see Server::publishChanges)
+    enum DirtyFlag {
+        DIRTY_SETTINGS = 1 << 0,    // persisted and mirrored
+        DIRTY_MEMBERS = 1 << 1,     // mirrored only
+        DIRTY_HISTORY = 1 << 2      // mirrored only
+    };
+
+    struct Member {
+        Client* client;
+        unsigned flags;
+        time_t joinedAt;
+        unsigned long joinSeq;
+    };
+
+private:
+    std::string _name;
+    std::string _topic;
+    time_t _createdAt;     // channel TS, compared when nodes merge after a link
+
+    // Members in join order, with an open-addressing index Client* -> position
+    std::vector<Member> _members;
+    std::vector<int> _memberIndex;     // slot -> position in _members, -1 = empty
+    unsigned _indexShift;              // bits of size_t minus log2 of the index size
+    size_t _operatorCount;
+    unsigned long _nextJoinSeq;
+    
+    // Channel modes: ModeBit set, with the parameters of +k and +l in their slots
+    unsigned _modes;
+    std::string _key;
+    size_t _userLimit;
+    std::string _modeString;   // "+<letters>", rebuilt when _modes changes
+    
+    // Invite list (simple session-based)
+    std::set<Client*> _invitedClients;
+
+    // Ban/exception/invite-exception lists
+    std::vector<MaskEntry> _lists[LIST_COUNT];
+
+    // Recent PRIVMSG/NOTICE lines for CHATHISTORY
+    MessageHistory _history;
+
+    // Changes queue the channel name for the store and the standby
+    std::vector<std::string>* _dirtyList;
+    unsigned long* _stateEpoch;        // bumped by changes other than history
+    unsigned _dirtyFlags;
+    unsigned long _version;            // New with every change but history (see QuerySnapshot)
+    static unsigned long _lastVersion; // Process-wide, so a version names one channel in one state
+
+    static bool listMatches(const std::vector<MaskEntry>& list, const std::string& foldedHostmask);
+    bool computeBanned(Client* client) const;
+    void clearBanCache();
+
+    // Member index
+    static size_t hashClient(const Client* client, unsigned shift);
+    int findSlot(const Client* client) const;
+    int findMember(const Client* client) const;
+    void unindexSlot(size_t slot);
+    void rebuildMemberIndex();
+
+    void rebuildModeString();
+
+public:
+    Channel(const std::string& name);
+    ~Channel();
+
+    // Basic info
+    const std::string& getName() const;
+    const std::string& getTopic() const;
+    void setTopic(const std::string& topic);
+    time_t getCreatedAt() const;
+    void setCreatedAt(time_t ts);
+
+    // Membership
+    void addClient(Client* client);
+    void removeClient(Client* client);
+    size_t removeDisconnectingClients();
+    bool hasClient(Client* client) const;
+    const std::vector<Member>& getMembers() const;
+    size_t getMemberCount() const;
+    unsigned getMemberFlags(Client* client) const;
+    void setMemberFlag(Client* client, unsigned flag, bool enabled);
+
+
+    // Operators
+    void addOperator(Client* client);
+    void removeOperator(Client* client);
+    bool isOperator(Client* client) const;
+
+    // Messaging
+    char sendRestriction(Client* client);   // mode stopping client from speaking (n, m, b), 0 if none
+    void broadcast(const std::string& message, Client* sender, bool addToHistory = false);
+
+    // History
+    void attachHistory(HistoryBudget* budget);
+    const MessageHistory& getHistory() const;
+    
+    // Modes; the setters return false when nothing changed
+    static const ModeSpec* findMode(char letter);
+    static std::string chanModesToken();            // ISUPPORT CHANMODES, from the table
+    static std::string prefixToken();               // ISUPPORT PREFIX
+    static char memberPrefix(unsigned memberFlags); // highest prefix symbol, 0 if none
+    static char namesSymbol(unsigned modes);        // '@' secret, '*' private, '=' public
+
+    unsigned getModes() const;
+    bool hasMode(unsigned bit) const;
+    bool setMode(unsigned bit, bool enabled);   // type D modes
+    const std::string& getKey() const;
+    size_t getUserLimit() const;
+    bool setKey(const std::string& key);        // empty removes +k
+    bool setUserLimit(size_t limit);            // 0 removes +l
+    void clearModes();
+    
+    const std::string& getModeString() const;   // empty when no mode is set
+    
+    // Invite management
+    void addInvite(Client* client);
+    void removeInvite(Client* client);
+    bool isInvited(Client* client) const;
+    void promoteNewOperatorIfNeeded();
+
+    // Delayed join (+D)
+    bool isHidden(Client* client) const;
+    bool isVisibleTo(Client* member, Client* viewer) const;
+    void revealMember(Client* client);
+    void revealAllMembers();
+
+    // Mask lists
+    bool addListMask(ListMode list, const std::string& mask, const std::string& setBy);
+    bool removeListMask(ListMode list, const std::string& mask);
+    const std::vector<MaskEntry>& getListMasks(ListMode list) const;
+    bool isBanned(Client* client);
+    bool isInviteExempt(Client* client) const;
+    void invalidateBanCache(Client* client);
+
+    // Change tracking
+    void setDirtyList(std::vector<std::string>* dirtyList, unsigned long* stateEpoch);
+    void markDirty(unsigned flags);
+    unsigned takeDirtyFlags();
+    unsigned long getVersion() const;
+
+    // Persistent settings: topic, TS, modes and mask lists, but not members
+    void saveSettings(StateWriter& out) const;
+    void loadSettings(StateReader& in);
+
+    // Members and invites, written as client serials; loading replaces both
+    void saveMembership(StateWriter& out) const;
+    void loadMembership(StateReader& in, const std::map<unsigned long, Client*>& clients);
+
+    // Binary upgrade: settings, membership and history
+    void saveState(StateWriter& out) const;
+    void loadState(StateReader& in, const std::map<unsigned long, Client*>& clients);
+    void saveHistorySince(StateWriter& out, unsigned long msgid) const;
+    void loadHistory(StateReader& in);
+
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef CHANNELSTORE_HPP
+#define CHANNELSTORE_HPP
+
+#include <map>
+#include <set>
+#include <deque>
+#include <vector>
+#include <string>
+#include <ctime>
+#include <pthread.h>
+#include "StateCodec.hpp"
+
+// Channel settings that survive a restart. State lives in two files: a
+// compacted snapshot, mmap'd at startup and indexed in place (entries are
+// sorted by name, so lookups are a binary search and nothing is copied), and
+// an append-only log of changes since that snapshot, kept in an overlay map.
+// All file I/O runs on a writer thread so the event loop only ever queues bytes.
+//
+// Both files hold entries "<op> <name> <savedAt> <settings>" in the
+// StateCodec encoding; a put carries the full settings, so replaying the log
+// over the snapshot is idempotent.
+class ChannelStore {
+public:
+    static const size_t COMPACT_MIN_LOG_BYTES = 1024 * 1024;
+    static const time_t DORMANT_TTL = 7 * 24 * 60 * 60;    // records of channels nobody rejoined
+
+private:
+    enum EntryOp {
+        ENTRY_REMOVE = 0,
+        ENTRY_PUT = 1
+    };
+
+    // An entry of the mapped snapshot
+    struct Slot {
+        const char* name;
+        size_t nameLength;
+        const char* settings;
+        size_t length;
+        time_t savedAt;
+    };
+
+    // A change since the snapshot was loaded; removed shadows the snapshot entry
+    struct Record {
+        std::string settings;
+        time_t savedAt;
+        bool removed;
+    };
+
+    // Writer thread work, processed in order
+    struct Job {
+        bool snapshot;              // false: append to the log
+        std::string data;
+    };
+
+    std::string _snapshotPath;
+    std::string _logPath;
+    void* _mapping;
+    size_t _mappingLength;
+    std::string _image;                         // the last compacted snapshot, replacing the mapping
+    std::vector<Slot> _snapshot;                // sorted by name, pointing into the mapping or the image
+    std::map<std::string, Record> _overlay;
+    size_t _logBytes;               // appended since the last snapshot
+    size_t _snapshotBytes;
+    time_t _openedAt;
+
+    int _logFd;
+    bool _threadStarted;
+    bool _stopping;
+    bool _writerBusy;
+    std::deque<Job> _jobs;
+    pthread_t _thread;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _wake;
+    pthread_cond_t _idle;
+
+    bool loadSnapshot();
+    bool indexSnapshot(const char* data, size_t length);
+    void unmap();
+    bool replayLog();
+    bool applyLogEntry(StateReader& in);
+    const Slot* findSlot(const std::string& name) const;
+    static bool slotLess(const Slot& a, const Slot& b);
+    void queueJob(bool snapshot, const std::string& data);
+
+    static void* writerMain(void* store);
+    void runWriter();
+    void writeLog(const std::string& data);
+    void writeSnapshot(const std::string& data);
+
+    ChannelStore(const ChannelStore&);
+    ChannelStore& operator=(const ChannelStore&);
+
+public:
+    ChannelStore();
+    ~ChannelStore();
+
+    // Load "<prefix>.snap" and "<prefix>.log" and start the writer
+    bool open(const std::string& prefix);
+    void close();
+    bool isOpen() const;
+
+    bool find(const std::string& name, const char*& settings, size_t& length) const;
+    void put(const std::string& name, const std::string& settings);
+    void remove(const std::string& name);
+
+    // Rewrite the snapshot once the log outgrows it; live channels are kept,
+    // dormant ones until DORMANT_TTL after their last save or our startup
+    bool compactionDue() const;
+    void compact(const std::set<std::string>& live);
+
+    // Block until everything queued so far is on disk
+    void sync();
+
+    // BENCH_CHANNELS records through the log, a compaction and a reopen from
+    // the snapshot, timed. Exit status for main.
+    static const size_t BENCH_CHANNELS = 100000;
+    static int benchmark();
+};
+
+#endif
@@ -1,71 +1,249 @@
-#ifndef CLIENT_HPP
-#define CLIENT_HPP
-
-#include <string>
-#include <deque>
-#include <ctime>
-
-class Client {
-private:
-    int _fd;
-    std::string _nickname;
-    std::string _username;
-    std::string _realname;
-    std::string _hostname;
-    bool _receivedPass;
-    bool _receivedNick;
-    bool _receivedUser;
-    bool _registered;
-    bool _welcomeSent;
-
-    std::string _inputBuffer;
-    std::string _outputBuffer;
-    std::deque<std::string> _outBufQ;  // Message queue for better I/O handling
-    time_t _lastActive;                // For timeout tracking
-
-public:
-    Client(int fd);
-    ~Client();
-
-    // Getters
-    int getFd() const;
-    const std::string& getNickname() const;
-    const std::string& getUsername() const;
-    const std::string& getRealname() const;
-    const std::string& getHostname() const;
-    std::string getHostmask() const;
-    bool isRegistered() const;
-    time_t getLastActive() const;
-    bool welcomeSent() const;
-    
-    // Check if ready to register
-    bool canRegister() const;
-
-    // Setters
-    void setNickname(const std::string& nick);
-    void setUsername(const std::string& user);
-    void setRealname(const std::string& realname);
-    void setHostname(const std::string& hostname);
-    void setReceivedPass(bool);
-    void setReceivedNick(bool);
-    void setReceivedUser(bool);
-    void tryRegister();
-    void updateLastActive();
-    void setWelcomeSent(bool v);
-
-    // Buffers
-    void appendToInputBuffer(const std::string& data);
-    std::string& getInputBuffer();
-    std::string& getOutputBuffer();
-
-    // Message queue handling
-    void enqueueMessage(const std::string& message);
-    bool hasMessagesToSend() const;
-    void flushMessagesToOutputBuffer();
-
-    // Line extraction for IRC command parsing
-    std::string extractNextLine();
-    bool hasCompleteLine() const;
-};
-
+#ifndef CLIENT_HPP
+#define CLIENT_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <set>
+#include <ctime>
+
+class ReplyStream; // Forward declaration
+class Channel;     // Forward declaration
+class StateWriter; // Forward declaration
+class StateReader; // Forward declaration
+
+class Client {
+public:
+    // Role of a connection in server-to-server linking (see Network)
+    enum LinkState {
+        LINK_NONE,          // ordinary user connection
+        LINK_CONNECTING,    // outgoing link, handshake sent
+        LINK_ESTABLISHED    // peer server
+    };
+
+    // Progress of a SASL exchange (see CommandHandlers::handleAuthenticate)
+    enum SaslState {
+        SASL_NONE,
+        SASL_STARTED,       // mechanism accepted, collecting the response
+        SASL_VERIFYING      // password check running on the worker pool
+    };
+
+    // Longest line accepted, CRLF excluded: a message, plus its tags when it
+    // starts with '@'. Peer servers relay lines of any client and get more room.
+    static const size_t MAX_LINE_LENGTH = 510;
+    static const size_t MAX_TAGS_LENGTH = 8191;
+    static const size_t MAX_LINK_LINE_LENGTH = 64 * 1024;
+
+private:
+    int _fd;
+    unsigned long _serial;             // Unique for the life of the server, kept across upgrades
+    std::string _nickname;
+    std::string _username;
+    std::string _realname;
+    std::string _hostname;
+    std::string _ip;                   // Peer address; the hostname until a lookup confirms a name
+    std::string _hostmask;             // nick!user@host, rebuilt when one of the three changes
+    std::string _prefix;               // ":nick!user@host " leading every message from this client
+    bool _receivedPass;
+    bool _receivedNick;
+    bool _receivedUser;
+    bool _registered;
+    bool _welcomeSent;
+
+    std::string _inputBuffer;
+    std::vector<size_t> _lineEnds;     // Offset of every '\n' in _inputBuffer
+    size_t _nextLine;                  // First entry of _lineEnds not extracted yet
+    size_t _inputConsumed;             // Bytes of _inputBuffer already extracted
+    bool _discardingLine;              // Over-long line cut short; drop input up to its '\n'
+    std::string _outputBuffer;
+    std::deque<std::string> _outBufQ;  // Message queue for better I/O handling
+    size_t _outBufQBytes;              // Bytes held in _outBufQ
+    std::deque<ReplyStream*> _replyStreams; // Pending multi-line replies (owned)
+    std::vector<int>* _flushList;      // Server list of fds with output produced this tick
+    bool _flushScheduled;              // Already on _flushList
+    bool _needsPollOut;                // Last send hit EAGAIN; wait for POLLOUT
+    unsigned long long _queuedSince;   // Metrics::now() when output last found the sendQ empty (0 = empty)
+
+    std::vector<Channel*> _channels;   // Channels joined, maintained by Channel
+    std::vector<Channel*> _invitedTo;  // Channels holding an invite for us, maintained by Channel
+    bool _disconnecting;               // Scheduled for removal at the end of the tick
+    std::string _quitReason;
+    unsigned long _fanoutMark;         // Last fan-out epoch this client was visited in
+    std::set<std::string> _caps;       // IRCv3 capabilities enabled with CAP REQ
+    std::string _account;              // Logged-in account (empty = none)
+    SaslState _saslState;
+    std::string _saslBuffer;           // AUTHENTICATE chunks received so far
+    size_t _pendingLogins;             // password checks queued, including aborted ones
+    std::string _resumeToken;          // Secret presented by RESUME to reclaim this session
+    time_t _detachedAt;                // When the connection was lost (0 = attached)
+    Client* _resumeTarget;             // Detached session this connection is taking over
+    std::string _serverName;           // Server a remote user is connected to (empty = local)
+    Client* _uplink;                   // Link a remote user is reached through
+    LinkState _linkState;
+    std::string _linkPassword;         // From "PASS <password> TS", checked by SERVER
+    time_t _nickTs;                    // When the current nick was taken, for collisions
+    time_t _lastActive;                // For timeout tracking
+    time_t _lookupDeadline;            // Registration waits for the hostname lookup until then (0 = not waiting)
+    bool _captured;                    // Inbound lines go to the traffic capture
+    std::vector<Client*>* _dirtyList;  // Server list of clients whose identity changed this tick
+    bool _dirtyScheduled;              // Already on _dirtyList
+    unsigned long* _stateEpoch;        // Server counter bumped by every identity change
+    unsigned long _version;            // New whenever the identity or socket changes (see QuerySnapshot)
+    static unsigned long _lastVersion; // Process-wide, so a version names one client in one state
+
+    void markDirty();
+    void bumpVersion();
+    void rebuildHostmask();
+    size_t lineLimit(size_t start) const;
+    void compactInput();
+
+public:
+    Client(int fd);
+    ~Client();
+
+    // Getters
+    int getFd() const;
+    unsigned long getSerial() const;
+    void setSerial(unsigned long serial);
+    const std::string& getNickname() const;
+    const std::string& getUsername() const;
+    const std::string& getRealname() const;
+    const std::string& getHostname() const;
+    const std::string& getIp() const;
+    time_t getLookupDeadline() const;
+    const std::string& getHostmask() const;
+    const std::string& getPrefix() const;
+    bool isRegistered() const;
+    bool hasReceivedPass() const;
+    time_t getLastActive() const;
+    bool welcomeSent() const;
+    
+    // Check if ready to register
+    bool canRegister() const;
+
+    // Setters
+    void setNickname(const std::string& nick);
+    void setUsername(const std::string& user);
+    void setRealname(const std::string& realname);
+    void setHostname(const std::string& hostname);
+    void setIp(const std::string& ip);
+    void setLookupDeadline(time_t deadline);
+    void setReceivedPass(bool);
+    void setReceivedNick(bool);
+    void setReceivedUser(bool);
+    void tryRegister();
+    void updateLastActive();
+    void setWelcomeSent(bool v);
+
+    // A message from this client, "<prefix><command> <params>[ :<trailing>]\r\n",
+    // built in one allocation; params may be empty
+    std::string buildMessage(const char* command, const std::string& params) const;
+    std::string buildMessage(const char* command, const std::string& params, const std::string& trailing) const;
+
+    // Buffers
+    void appendToInputBuffer(const char* data, size_t length);
+    void appendToInputBuffer(const std::string& data);
+    const std::string& getInputBuffer();   // What is left to extract
+    void clearInputBuffer();
+    std::string& getOutputBuffer();
+
+    // Message queue handling
+    void enqueueMessage(const std::string& message);
+    bool hasMessagesToSend() const;
+    void flushMessagesToOutputBuffer();
+    size_t getSendQueueSize() const;
+    unsigned long long takeQueuedSince();  // For the sendQ wait histogram; resets it
+
+    // Write scheduling
+    void setFlushList(std::vector<int>* flushList);
+    void clearFlushScheduled();
+    bool needsPollOut() const;
+    void setNeedsPollOut(bool v);
+
+    // Channel membership (kept in sync by Channel::addClient/removeClient)
+    void addChannel(Channel* channel);
+    void removeChannel(Channel* channel);
+    const std::vector<Channel*>& getChannels() const;
+    void addInvitedTo(Channel* channel);
+    void removeInvitedTo(Channel* channel);
+    const std::vector<Channel*>& getInvitedTo() const;
+
+    // Disconnection (processed in batches by Server::processPendingDisconnections)
+    void markDisconnecting(const std::string& reason);
+    bool isDisconnecting() const;
+    const std::string& getQuitReason() const;
+
+    // Detachable sessions (see Server::handleConnectionLost)
+    void detach(const std::string& reason);
+    void attachFd(int fd);
+    void setFd(int fd);
+    bool isDetached() const;
+    time_t getDetachedAt() const;
+    const std::string& getResumeToken() const;
+    void setResumeToken(const std::string& token);
+    Client* getResumeTarget() const;
+    void setResumeTarget(Client* session);
+    std::string takePendingOutput();
+
+    // Server linking
+    bool isRemote() const;
+    const std::string& getServerName() const;
+    Client* getUplink() const;
+    void setRemote(const std::string& serverName, Client* uplink);
+    void setUplink(Client* uplink);
+    LinkState getLinkState() const;
+    void setLinkState(LinkState state);
+    const std::string& getLinkPassword() const;
+    void setLinkPassword(const std::string& password);
+    bool isServerLink() const;
+    time_t getNickTs() const;
+    void setNickTs(time_t ts);
+
+    // Traffic capture
+    bool isCaptured() const;
+    void setCaptured(bool captured);
+
+    // IRCv3 capabilities
+    bool hasCap(const std::string& cap) const;
+    void setCap(const std::string& cap, bool enabled);
+
+    // SASL
+    const std::string& getAccount() const;
+    void setAccount(const std::string& account);
+    SaslState getSaslState() const;
+    void setSaslState(SaslState state);     // leaving SASL_STARTED drops the buffer
+    std::string& getSaslBuffer();
+    size_t getPendingLogins() const;
+    void setPendingLogins(size_t count);
+
+    // Fan-out deduplication
+    unsigned long getFanoutMark() const;
+    void setFanoutMark(unsigned long mark);
+
+    // Streamed replies, resumed by Server::pumpReplyStreams
+    void pushReplyStream(ReplyStream* stream);
+    ReplyStream* currentReplyStream() const;
+    void popReplyStream();
+    bool hasReplyStreams() const;
+    bool hasReadyReplyStream() const;   // the front one can produce now
+
+    // Identity tracking for the standby (see Replication)
+    void setDirtyList(std::vector<Client*>* dirtyList, unsigned long* stateEpoch);
+    bool isDirtyScheduled() const;
+    void clearDirtyScheduled();
+    unsigned long getVersion() const;
+
+    // Binary upgrade: everything but the socket, which is passed separately.
+    // The identity part alone (no buffers) is what the standby mirrors.
+    void saveIdentity(StateWriter& out) const;
+    void loadIdentity(StateReader& in);
+    void saveState(StateWriter& out) const;
+    void loadState(StateReader& in);
+
+    // Line extraction for IRC command parsing. A line over the limit comes
+    // back cut to it, with tooLong set.
+    std::string extractNextLine(bool& tooLong);
+    bool hasCompleteLine() const;
+};
+
 #endif
\ No newline at end of file
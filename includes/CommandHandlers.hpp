@@ -1,62 +1,81 @@
-#ifndef COMMANDHANDLERS_HPP
-#define COMMANDHANDLERS_HPP
-
-#include <string>
-#include <vector>
-#include "Client.hpp"
-#include "Server.hpp"
-#include "IRCProtocol.hpp"
-#include <iostream>
-#include <cstdlib>
-
-class Server; // Forward declaration
-class Client; // Forward declaration
-
-class CommandHandlers {
-private:
-    Server* _server;
-    
-    // Helper method for registration flow
-    void checkRegistration(Client* client);
-
-public:
-    CommandHandlers(Server* server);
-    ~CommandHandlers();
-
-    // Authentication commands
-    void handlePass(Client* client, const std::vector<std::string>& params);
-    void handleNick(Client* client, const std::vector<std::string>& params);
-    void handleUser(Client* client, const std::vector<std::string>& params);
-
-    // Communication commands
-    void handleJoin(Client* client, const std::vector<std::string>& params);
-    void handlePart(Client* client, const std::vector<std::string>& params);
-    void handlePrivmsg(Client* client, const std::vector<std::string>& params);
-    void handleNotice(Client* client, const std::vector<std::string>& params);
-    void handleQuit(Client* client, const std::vector<std::string>& params);
-
-    // Keepalive
-    void handlePing(Client* client, const std::vector<std::string>& params);
-    void handlePong(Client* client, const std::vector<std::string>& params);
-
-    // Channel operator commands
-    void handleKick(Client* client, const std::vector<std::string>& params);
-    void handleInvite(Client* client, const std::vector<std::string>& params);
-    void handleTopic(Client* client, const std::vector<std::string>& params);
-    void handleMode(Client* client, const std::vector<std::string>& params);
-
-    // Information commands
-    void handleCap(Client* client, const std::vector<std::string>& params);
-    void handleWho(Client* client, const std::vector<std::string>& params);
-    void handleWhois(Client* client, const std::vector<std::string>& params);
-    void handleList(Client* client, const std::vector<std::string>& params);
-    void handleNames(Client* client, const std::vector<std::string>& params);
-
-    // Utility functions
-    void sendWelcomeSequence(Client* client);
-    void sendErrorReply(Client* client, const std::string& code, const std::string& message);
-    bool validateNickname(const std::string& nickname);
-    bool validateChannelName(const std::string& channel);
-};
-
+#ifndef COMMANDHANDLERS_HPP
+#define COMMANDHANDLERS_HPP
+
+#include <string>
+#include <vector>
+#include "Client.hpp"
+#include "Server.hpp"
+#include "IRCProtocol.hpp"
+#include <iostream>
+#include <cstdlib>
+
+class Server; // Forward declaration
+class Client; // Forward declaration
+class Channel; // Forward declaration
+
+class CommandHandlers {
+private:
+    Server* _server;
+    unsigned long _batchCounter;
+    
+public:
+    CommandHandlers(Server* server);
+    ~CommandHandlers();
+
+    // Registration flow; also resumed once a held-up hostname lookup settles
+    void checkRegistration(Client* client);
+
+    // Authentication commands
+    void handlePass(Client* client, const std::vector<std::string>& params);
+    void handleNick(Client* client, const std::vector<std::string>& params);
+    void handleUser(Client* client, const std::vector<std::string>& params);
+    void handleResume(Client* client, const std::vector<std::string>& params);
+    void handleAuthenticate(Client* client, const std::vector<std::string>& params);
+    void handleServer(Client* client, const std::vector<std::string>& params);
+
+    // Communication commands
+    void handleJoin(Client* client, const std::vector<std::string>& params);
+    void handlePart(Client* client, const std::vector<std::string>& params);
+    void handlePrivmsg(Client* client, const std::vector<std::string>& params);
+    void handleNotice(Client* client, const std::vector<std::string>& params);
+    void handleQuit(Client* client, const std::vector<std::string>& params);
+
+    // Keepalive
+    void handlePing(Client* client, const std::vector<std::string>& params);
+    void handlePong(Client* client, const std::vector<std::string>& params);
+
+    // Channel operator commands
+    void handleKick(Client* client, const std::vector<std::string>& params);
+    void handleInvite(Client* client, const std::vector<std::string>& params);
+    void handleTopic(Client* client, const std::vector<std::string>& params);
+    void handleMode(Client* client, const std::vector<std::string>& params);
+
+    // Information commands
+    void handleCap(Client* client, const std::vector<std::string>& params);
+    void handleWho(Client* client, const std::vector<std::string>& params);
+    void handleWhois(Client* client, const std::vector<std::string>& params);
+    void handleList(Client* client, const std::vector<std::string>& params);
+    void handleNames(Client* client, const std::vector<std::string>& params);
+    void handleChathistory(Client* client, const std::vector<std::string>& params);
+    void handleMotd(Client* client, const std::vector<std::string>& params);
+    void handleStats(Client* client, const std::vector<std::string>& params);
+
+    // Result of a SASL password check, back on the event loop
+    void finishAuthentication(int fd, unsigned long serial, const std::string& account, bool accepted);
+
+    // Utility functions
+    void sendWelcomeSequence(Client* client);
+    void sendResumeToken(Client* client);
+    void sendErrorReply(Client* client, const std::string& code, const std::string& message);
+    void sendFailReply(Client* client, const std::string& command, const std::string& code, const std::string& message);
+    void sendChannelList(Client* client, Channel* channel, char mode);
+    std::string buildNamesList(Channel* channel, Client* viewer);
+    bool validateNickname(const std::string& nickname);
+    bool validateChannelName(const std::string& channel);
+
+private:
+    bool checkJoinRestrictions(Client* client, Channel* channel, const std::string& key);
+    bool applyChannelMode(Client* client, Channel* channel, const Channel::ModeSpec& spec, bool adding, std::string& param);
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,26 @@
+#ifndef HISTORYQUERY_HPP
+#define HISTORYQUERY_HPP
+
+#include <string>
+#include <vector>
+#include "ReplyStream.hpp"
+#include "MessageHistory.hpp"
+
+// Streams a CHATHISTORY result, wrapped in a chathistory BATCH and tagged
+// with server-time/msgid when the client negotiated those capabilities.
+class HistoryQuery : public ReplyStream {
+private:
+    std::string _target;
+    std::vector<HistoryRecord> _records;
+    size_t _next;
+    std::string _batchId;
+    bool _started;
+
+public:
+    HistoryQuery(const std::string& target, const std::vector<HistoryRecord>& records, const std::string& batchId);
+    virtual ~HistoryQuery();
+
+    virtual bool produce(Server& server, Client* client);
+};
+
+#endif
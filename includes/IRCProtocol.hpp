@@ -1,72 +1,115 @@
-#ifndef IRCPROTOCOL_HPP
-#define IRCPROTOCOL_HPP
-
-#include <string>
-#include <vector>
-
-// IRC Numeric Reply Codes
-namespace IRC {
-    // Welcome messages
-    const std::string RPL_WELCOME = "001";
-    const std::string RPL_YOURHOST = "002";
-    const std::string RPL_CREATED = "003";
-    const std::string RPL_MYINFO = "004";
-    
-    // Channel operations
-    const std::string RPL_LISTSTART = "321";
-    const std::string RPL_LIST = "322";
-    const std::string RPL_LISTEND = "323";
-    const std::string RPL_NOTOPIC = "331";
-    const std::string RPL_TOPIC = "332";
-    const std::string RPL_WHOREPLY = "352";
-    const std::string RPL_ENDOFWHO = "315";
-    const std::string RPL_NAMREPLY = "353";
-    const std::string RPL_ENDOFNAMES = "366";
-    
-    // WHOIS replies
-    const std::string RPL_WHOISUSER = "311";
-    const std::string RPL_WHOISSERVER = "312";
-    const std::string RPL_ENDOFWHOIS = "318";
-    const std::string RPL_WHOISCHANNELS = "319";
-    
-    // Error codes
-    const std::string ERR_NOSUCHNICK = "401";
-    const std::string ERR_NOSUCHCHANNEL = "403";
-    const std::string ERR_CANNOTSENDTOCHAN = "404";
-    const std::string ERR_TOOMANYCHANNELS = "405";
-    const std::string ERR_UNKNOWNCOMMAND = "421";
-    const std::string ERR_NONICKNAMEGIVEN = "431";
-    const std::string ERR_ERRONEUSNICKNAME = "432";
-    const std::string ERR_NICKNAMEINUSE = "433";
-    const std::string ERR_NORECIPIENT = "411";
-    const std::string ERR_NOTEXTTOSEND = "412";
-    const std::string ERR_USERNOTINCHANNEL = "441";
-    const std::string ERR_NOTONCHANNEL = "442";
-    const std::string ERR_USERONCHANNEL = "443";
-    const std::string ERR_NOTREGISTERED = "451";
-    const std::string ERR_NEEDMOREPARAMS = "461";
-    const std::string ERR_ALREADYREGISTRED = "462";
-    const std::string ERR_PASSWDMISMATCH = "464";
-    const std::string ERR_CHANNELISFULL = "471";
-    const std::string ERR_UNKNOWNMODE = "472";
-    const std::string ERR_INVITEONLYCHAN = "473";
-    const std::string ERR_BANNEDFROMCHAN = "474";
-    const std::string ERR_BADCHANNELKEY = "475";
-    const std::string ERR_CHANOPRIVSNEEDED = "482";
-}
-
-// IRC Command structure
-struct IRCCommand {
-    std::string prefix;
-    std::string command;
-    std::vector<std::string> params;
-    std::string trailing;
-};
-
-// Protocol utility functions
-std::string formatIRCMessage(const std::string& prefix, const std::string& command, 
-                             const std::string& target, const std::string& message);
-std::string formatNumericReply(const std::string& code, const std::string& target, 
-                              const std::string& message);
-
+#ifndef IRCPROTOCOL_HPP
+#define IRCPROTOCOL_HPP
+
+#include <string>
+#include <vector>
+
+// IRC Numeric Reply Codes
+namespace IRC {
+    // Welcome messages
+    const std::string RPL_WELCOME = "001";
+    const std::string RPL_YOURHOST = "002";
+    const std::string RPL_CREATED = "003";
+    const std::string RPL_MYINFO = "004";
+    const std::string RPL_ISUPPORT = "005";
+
+    // Message of the day
+    const std::string RPL_MOTDSTART = "375";
+    const std::string RPL_MOTD = "372";
+    const std::string RPL_ENDOFMOTD = "376";
+    const std::string ERR_NOMOTD = "422";
+    
+    // Channel operations
+    const std::string RPL_LISTSTART = "321";
+    const std::string RPL_LIST = "322";
+    const std::string RPL_LISTEND = "323";
+    const std::string RPL_NOTOPIC = "331";
+    const std::string RPL_TOPIC = "332";
+    const std::string RPL_WHOREPLY = "352";
+    const std::string RPL_WHOSPCRPL = "354";
+    const std::string RPL_ENDOFWHO = "315";
+    const std::string RPL_NAMREPLY = "353";
+    const std::string RPL_ENDOFNAMES = "366";
+    const std::string RPL_INVITELIST = "346";
+    const std::string RPL_ENDOFINVITELIST = "347";
+    const std::string RPL_EXCEPTLIST = "348";
+    const std::string RPL_ENDOFEXCEPTLIST = "349";
+    const std::string RPL_BANLIST = "367";
+    const std::string RPL_ENDOFBANLIST = "368";
+    
+    // WHOIS replies
+    const std::string RPL_WHOISUSER = "311";
+    const std::string RPL_WHOISSERVER = "312";
+    const std::string RPL_ENDOFWHOIS = "318";
+    const std::string RPL_WHOISCHANNELS = "319";
+    const std::string RPL_WHOISACCOUNT = "330";
+
+    // STATS replies
+    const std::string RPL_STATSCOMMANDS = "212";
+    const std::string RPL_ENDOFSTATS = "219";
+    const std::string RPL_STATSDEBUG = "249";
+
+    // SASL
+    const std::string RPL_LOGGEDIN = "900";
+    const std::string RPL_SASLSUCCESS = "903";
+    const std::string ERR_SASLFAIL = "904";
+    const std::string ERR_SASLTOOLONG = "905";
+    const std::string ERR_SASLABORTED = "906";
+    const std::string ERR_SASLALREADY = "907";
+    const std::string RPL_SASLMECHS = "908";
+    
+    // Error codes
+    const std::string ERR_NOSUCHNICK = "401";
+    const std::string ERR_NOSUCHCHANNEL = "403";
+    const std::string ERR_CANNOTSENDTOCHAN = "404";
+    const std::string ERR_TOOMANYCHANNELS = "405";
+    const std::string ERR_UNKNOWNCOMMAND = "421";
+    const std::string ERR_NONICKNAMEGIVEN = "431";
+    const std::string ERR_ERRONEUSNICKNAME = "432";
+    const std::string ERR_NICKNAMEINUSE = "433";
+    const std::string ERR_NORECIPIENT = "411";
+    const std::string ERR_NOTEXTTOSEND = "412";
+    const std::string ERR_INPUTTOOLONG = "417";
+    const std::string ERR_USERNOTINCHANNEL = "441";
+    const std::string ERR_NOTONCHANNEL = "442";
+    const std::string ERR_USERONCHANNEL = "443";
+    const std::string ERR_NOTREGISTERED = "451";
+    const std::string ERR_NEEDMOREPARAMS = "461";
+    const std::string ERR_ALREADYREGISTRED = "462";
+    const std::string ERR_PASSWDMISMATCH = "464";
+    const std::string ERR_CHANNELISFULL = "471";
+    const std::string ERR_UNKNOWNMODE = "472";
+    const std::string ERR_INVITEONLYCHAN = "473";
+    const std::string ERR_BANNEDFROMCHAN = "474";
+    const std::string ERR_BADCHANNELKEY = "475";
+    const std::string ERR_BANLISTFULL = "478";
+    const std::string ERR_NOPRIVILEGES = "481";
+    const std::string ERR_CHANOPRIVSNEEDED = "482";
+
+    // IRCv3 capabilities offered in CAP LS
+    const std::string SUPPORTED_CAPS = "batch draft/chathistory draft/resume-0.5 message-tags sasl server-time";
+    const std::string CAP_RESUME = "draft/resume-0.5";
+
+    // AUTHENTICATE payloads come in chunks of this size; a shorter one ends the response
+    const size_t SASL_CHUNK_SIZE = 400;
+    const size_t SASL_MAX_RESPONSE = 4096;
+
+    // Largest CHATHISTORY page (advertised as CHATHISTORY= in ISUPPORT)
+    const size_t CHATHISTORY_MAX_LIMIT = 100;
+}
+
+// IRC Command structure
+struct IRCCommand {
+    std::string prefix;
+    std::string command;
+    std::vector<std::string> params;
+    std::string trailing;
+};
+
+// Protocol utility functions
+std::string formatIRCMessage(const std::string& prefix, const std::string& command, 
+                             const std::string& target, const std::string& message);
+std::string formatNumericReply(const std::string& code, const std::string& target, 
+                              const std::string& message);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,23 @@
+#ifndef LINESCANNER_HPP
+#define LINESCANNER_HPP
+
+#include <cstddef>
+#include <vector>
+
+// Finds the line boundaries in what a client sent, in one pass over each
+// received chunk. On x86 the kernel compares 32 (AVX2) or 16 (SSE2) bytes per
+// step; it is picked once, at first use, from what the CPU reports. Elsewhere
+// a memchr() loop does the same job.
+namespace LineScanner {
+    // Offset of every '\n' in data, appended to newlines
+    void findNewlines(const char* data, size_t length, std::vector<size_t>& newlines);
+
+    // "avx2", "sse2" or "scalar"
+    const char* kernelName();
+
+    // Bytes/s of every kernel the CPU supports, and of the find() scan it
+    // replaced, over a buffer of synthetic IRC lines. Exit status for main.
+    int benchmark();
+}
+
+#endif
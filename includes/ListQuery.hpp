@@ -0,0 +1,28 @@
+#ifndef LISTQUERY_HPP
+#define LISTQUERY_HPP
+
+#include <string>
+#include <set>
+#include "QuerySnapshot.hpp"
+
+class Client; // Forward declaration
+
+// LIST [<channel>{,<channel>}]
+//
+// One RPL_LIST per channel with its member count (members hidden by +D are
+// not counted) and topic, between RPL_LISTSTART and RPL_LISTEND. Channels
+// under +s or +p are left out unless the requester is on them.
+class ListQuery : public SnapshotQuery {
+private:
+    std::string _requester;
+    unsigned long _requesterSerial;
+    std::set<std::string> _channels;   // empty: every channel
+
+public:
+    ListQuery(const Client* requester, const std::set<std::string>& channels);
+    virtual ~ListQuery();
+
+    virtual void render(const QuerySnapshot& snapshot, std::string& out) const;
+};
+
+#endif
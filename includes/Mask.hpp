@@ -0,0 +1,36 @@
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <string>
+
+// Compiled IRC glob mask ('*' and '?' wildcards, rfc1459 casemapping).
+// The pattern is casefolded and normalised once at construction so matching
+// never allocates; the literal prefix lets callers narrow lookups through a
+// sorted index before running the full match.
+class Mask {
+private:
+    std::string _pattern;        // casefolded, runs of '*' collapsed
+    std::string _prefix;         // literal characters before the first wildcard
+    bool _hasWildcards;
+
+public:
+    Mask();
+    Mask(const std::string& pattern);
+    ~Mask();
+
+    void compile(const std::string& pattern);
+
+    const std::string& getPattern() const;
+    const std::string& getLiteralPrefix() const;
+    bool isLiteral() const;
+    bool matchesEverything() const;
+
+    // Subject must already be casefolded (see IRCUtils::casefold)
+    bool matchesFolded(const std::string& folded) const;
+    bool matches(const std::string& subject) const;
+
+    // Expand a partial ban-style mask to nick!user@host form ("foo" -> "foo!*@*")
+    static std::string normalizeHostmask(const std::string& mask);
+};
+
+#endif
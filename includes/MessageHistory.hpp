@@ -0,0 +1,98 @@
+#ifndef MESSAGEHISTORY_HPP
+#define MESSAGEHISTORY_HPP
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <set>
+#include <ctime>
+
+class MessageHistory; // Forward declaration
+class StateWriter;    // Forward declaration
+class StateReader;    // Forward declaration
+
+// One stored PRIVMSG/NOTICE: the wire line (without CRLF) plus its msgid and time
+struct HistoryRecord {
+    unsigned long msgid;
+    time_t time;
+    unsigned short millis;
+    std::string line;
+};
+
+// Reference point for CHATHISTORY BEFORE/AFTER/LATEST ("msgid=..." or "timestamp=...")
+struct HistoryRef {
+    bool byMsgid;
+    unsigned long msgid;
+    time_t time;
+    unsigned short millis;
+};
+
+// Server-wide memory budget shared by every channel history. Records are
+// charged in arrival order so that, once the budget is exceeded, the globally
+// oldest records are evicted first regardless of which channel holds them.
+class HistoryBudget {
+private:
+    size_t _limit;
+    size_t _used;
+    size_t _records;
+    unsigned long _nextMsgid;
+    std::deque<std::pair<MessageHistory*, unsigned long> > _order;
+    std::set<MessageHistory*> _live;
+
+    void compactOrder();
+
+public:
+    HistoryBudget(size_t limit);
+    ~HistoryBudget();
+
+    unsigned long nextMsgid();
+    unsigned long lastMsgid() const;     // newest handed out, 0 before the first
+    void reserveMsgid(unsigned long msgid);
+    void registerHistory(MessageHistory* history);
+    void unregisterHistory(MessageHistory* history);
+    void charge(MessageHistory* history, unsigned long msgid, size_t bytes);
+    void release(size_t bytes);
+    size_t getUsed() const;
+};
+
+// Per-channel ring buffer bounded by record count and bytes
+class MessageHistory {
+private:
+    HistoryBudget* _budget;
+    std::deque<HistoryRecord> _records;
+    size_t _bytes;
+
+    static size_t recordSize(const HistoryRecord& record);
+    size_t lowerBound(const HistoryRef& ref) const;
+    size_t upperBound(const HistoryRef& ref) const;
+
+public:
+    static const size_t MAX_RECORDS = 500;
+    static const size_t MAX_BYTES = 64 * 1024;
+
+    MessageHistory();
+    ~MessageHistory();
+
+    void attach(HistoryBudget* budget);
+    void append(const std::string& line);
+    void restore(const HistoryRecord& record);
+    void evictOldest();
+    bool empty() const;
+    unsigned long oldestMsgid() const;
+
+    // Binary upgrade
+    void saveState(StateWriter& out, unsigned long afterMsgid = 0) const;
+    void loadState(StateReader& in);     // appends, so it also takes the output of a later save
+
+    // Selections are returned oldest first
+    void latest(const HistoryRef* after, size_t limit, std::vector<HistoryRecord>& out) const;
+    void before(const HistoryRef& ref, size_t limit, std::vector<HistoryRecord>& out) const;
+    void after(const HistoryRef& ref, size_t limit, std::vector<HistoryRecord>& out) const;
+
+    // IRCv3 server-time format: YYYY-MM-DDThh:mm:ss.sssZ
+    static std::string formatTime(time_t time, unsigned short millis);
+    static bool parseRef(const std::string& token, HistoryRef& ref);
+    static std::string formatMsgid(unsigned long msgid);
+};
+
+#endif
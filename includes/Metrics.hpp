@@ -0,0 +1,74 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ctime>
+
+// Latency distribution in the style of HdrHistogram: values in nanoseconds
+// go into log-linear buckets, 16 per power of two, so any percentile read
+// back is within 1/16 of the true value, and recording is a few shifts and
+// an increment. Values under 16 ns are exact; past ~18 minutes they clamp.
+class LatencyHistogram {
+public:
+    static const int SUB_BUCKET_BITS = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BUCKET_BITS;
+    static const int MAX_MAGNITUDE = 40;            // 2^40 ns
+    static const int BUCKET_COUNT = (MAX_MAGNITUDE - SUB_BUCKET_BITS + 2) * SUB_BUCKETS;
+
+private:
+    unsigned long long _counts[BUCKET_COUNT];
+    unsigned long long _total;
+    unsigned long long _sum;
+    unsigned long long _max;
+
+    static int bucketFor(unsigned long long value);
+    static unsigned long long bucketLimit(int bucket);  // highest value in the bucket
+
+public:
+    LatencyHistogram();
+
+    void record(unsigned long long nanoseconds);
+    unsigned long long count() const;
+    unsigned long long mean() const;
+    unsigned long long max() const;
+    unsigned long long percentile(double fraction) const;  // 0.99 = p99
+
+    // "<n> p50 <t> p90 <t> p99 <t> max <t>" with readable units
+    std::string summary() const;
+};
+
+// Counters and latencies for the STATS command and the periodic dump: every
+// command verb, the event loop's ticks (work between two poll() calls) and
+// the time output waits in a client's sendQ (from the first message queued
+// on an empty queue until the queue is written out). Loop thread only.
+class Metrics {
+private:
+    std::map<std::string, LatencyHistogram> _commands;   // by verb
+    LatencyHistogram _ticks;
+    LatencyHistogram _sendQueue;
+    time_t _startedAt;
+    std::string _dumpPath;
+
+public:
+    Metrics();
+
+    // Monotonic nanoseconds, from the vDSO clock: cheap enough per command
+    static unsigned long long now();
+
+    void recordCommand(const std::string& verb, unsigned long long nanoseconds);
+    void recordTick(unsigned long long nanoseconds);
+    void recordSendQueue(unsigned long long nanoseconds);
+
+    // Report lines: STATS m (calls per verb) and STATS L (latencies)
+    void commandCounts(std::vector<std::string>& lines) const;
+    void latencyReport(std::vector<std::string>& lines) const;
+
+    // The latency report and extra lines from elsewhere (replication), rewritten
+    // by the loop's minute housekeeping while a path is set
+    void setDumpPath(const std::string& path);
+    bool dump(const std::vector<std::string>& extra) const;
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef NAMESQUERY_HPP
+#define NAMESQUERY_HPP
+
+#include <string>
+#include <vector>
+#include "QuerySnapshot.hpp"
+
+class Client; // Forward declaration
+
+// NAMES [<channel>{,<channel>}]
+//
+// Members are listed in join order, split over as many RPL_NAMREPLY lines as
+// the 512-byte limit requires. Members hidden by +D only show to themselves
+// and to the channel's operators; +s and +p channels only to their members.
+class NamesQuery : public SnapshotQuery {
+private:
+    std::string _requester;
+    unsigned long _requesterSerial;
+    std::vector<std::string> _channels;
+
+public:
+    static const size_t MAX_LINE = 512;
+
+    NamesQuery(const Client* requester, const std::vector<std::string>& channels);
+    virtual ~NamesQuery();
+
+    virtual void render(const QuerySnapshot& snapshot, std::string& out) const;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef NETWORK_HPP
+#define NETWORK_HPP
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "IRCProtocol.hpp"
+
+class Server;  // Forward declaration
+class Client;  // Forward declaration
+class Channel; // Forward declaration
+class Command; // Forward declaration
+
+// Server-to-server linking. Nodes form a spanning tree: on link each side sends
+// a burst of its servers, users and channels, then every state change is
+// relayed to all links except the one it came from. Users are keyed by nick;
+// nick collisions go to the older nick timestamp and channels merge by their
+// creation timestamp, so every node reaches the same verdict on its own.
+//
+// A server may link only with a connect block naming it: one
+// "<server name> <link password> [<source address>]" per line of a text file
+// ('#' starts a comment), read again when its modification time changes. Both
+// sides send "PASS <link password> TS" before SERVER; the client password is
+// never enough, and an address, when given, must be the incoming link's.
+class Network {
+public:
+    // A server somewhere on the network
+    struct Peer {
+        std::string uplink;         // server it is attached to
+        int hops;
+        Client* link;               // our direct link towards it
+        std::string description;
+    };
+
+    // A server allowed to link
+    struct ConnectBlock {
+        std::string password;
+        std::string address;        // empty: any source
+    };
+
+    // An outgoing link from the command line, retried after every split
+    struct LinkTarget {
+        std::string name;           // the server expected to answer
+        std::string host;
+        int port;
+        Client* connection;         // NULL while not connected
+        time_t nextAttempt;
+    };
+
+    static const time_t RECONNECT_INTERVAL = 10;
+    static const size_t BURST_LINE_LENGTH = 400;   // keeps burst lines under the 512-byte limit
+
+private:
+    Server& _server;
+    Command* _dispatcher;
+    std::string _name;
+    std::map<std::string, Peer> _peers;         // every other server, by name
+    std::map<Client*, std::string> _links;      // established direct links → peer name
+    std::vector<LinkTarget> _targets;
+    std::string _connectPath;
+    time_t _connectMtime;
+    std::map<std::string, ConnectBlock> _connectBlocks;     // by server name
+    std::set<Client*> _silentQuits;             // users removed without relaying a QUIT
+
+    void reloadConnectBlocks();
+    const ConnectBlock* findConnectBlock(const std::string& name);
+    void sendBurst(Client* link);
+    std::string uidLine(Client* user) const;
+    static std::string channelModes(Channel* channel);
+    static void sendChunked(Client* link, const std::string& head, const std::vector<std::string>& items);
+
+    // Incoming messages
+    void handleServerIntro(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleSquit(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleUid(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleSjoin(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleBmask(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleTopicBurst(Client* link, const std::string& source, const std::vector<std::string>& params);
+    void handleRemoteNick(Client* link, Client* user, const std::vector<std::string>& params);
+
+    // State changes
+    bool resolveCollision(Client* holder, time_t ts);
+    void killUser(Client* user, const std::string& reason);
+    void removeServers(const std::string& root);
+    void splitLink(Client* link, const std::string& reason);
+    void loseChannelTs(Channel* channel, const std::string& source, time_t ts);
+    void applyModes(Channel* channel, const std::string& source, const std::vector<std::string>& params, size_t first, size_t last);
+
+public:
+    Network(Server& server);
+    ~Network();
+
+    // Configuration
+    void setName(const std::string& name);
+    const std::string& getName() const;
+    void setDispatcher(Command* dispatcher);
+    void addLinkTarget(const std::string& name, const std::string& host, int port);
+    void openConnectBlocks(const std::string& path);
+    void addConnectBlock(const std::string& name, const std::string& password, const std::string& address);
+
+    // Link lifecycle; the event loop opens the sockets for collectDueLinks()
+    void collectDueLinks(std::vector<LinkTarget*>& due);
+    bool beginOutgoingLink(LinkTarget* target, Client* connection);
+    void linkAttemptFailed(LinkTarget* target);
+    // False with the reason the link was refused
+    bool acceptLink(Client* connection, const std::string& name, const std::string& description, std::string& refusal);
+    void handleMessage(Client* link, const IRCCommand& cmd);
+    void forgetClient(Client* client);
+    void pingLinks();
+    void closeLinks(const std::string& reason);
+
+    // Relaying local changes
+    bool isKnownServer(const std::string& name) const;
+    void introduceUser(Client* user);
+    void propagate(const std::string& line, Client* except);
+    void propagateJoin(Channel* channel, Client* user);
+    void propagateQuit(Client* user, const std::string& quitMsg);
+    void relayToChannel(Channel* channel, const std::string& line, Client* except);
+
+    // Channel fan-out across chains of linked servers over a MemoryTransport,
+    // the same clients spread over more nodes each time. Exit status for main.
+    static int benchmark();
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef PASSWORDHASH_HPP
+#define PASSWORDHASH_HPP
+
+#include <string>
+
+// Slow password hashes for the account database: scrypt (RFC 7914) built on
+// SHA-256, encoded as "scrypt$<log2 N>$<r>$<p>$<salt>$<hex key>". Costly by
+// design, so callers on the event loop go through the WorkerPool.
+namespace PasswordHash {
+    static const unsigned DEFAULT_LOG2_N = 14;     // 16 MB of scratch memory per hash
+    static const unsigned DEFAULT_R = 8;
+    static const unsigned DEFAULT_P = 1;
+    static const unsigned MAX_LOG2_N = 20;         // refuse encodings that would exhaust memory
+    static const size_t KEY_LENGTH = 32;
+    static const size_t MAX_PASSWORD_LENGTH = 256;  // longer ones are refused before hashing
+
+    // Empty when no salt could be drawn
+    std::string hash(const std::string& password);
+
+    // Constant-time comparison; false for a malformed encoding or an overlong password
+    bool verify(const std::string& password, const std::string& encoded);
+
+    // Exposed for verify() against unknown accounts, which must cost the same
+    std::string derive(const std::string& password, const std::string& salt,
+                       unsigned log2N, unsigned r, unsigned p);
+}
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef PROBES_HPP
+#define PROBES_HPP
+
+// USDT probes, provider "ircserv", for bpftrace, perf and SystemTap on a
+// running server; list them with `bpftrace -l 'usdt:./ircserv:*'` and see
+// tools/*.bt for examples. A probe compiles to a single nop plus an ELF note
+// describing where its arguments live, so detached it costs the nop and
+// whatever the arguments take to compute: keep them to integers and pointers
+// already at hand. Built in when <sys/sdt.h> is found (see the Makefile);
+// otherwise the macros expand to nothing.
+//
+//   client__accept        fd, ip
+//   client__register      fd, nick
+//   command__dispatch     fd, verb, nanoseconds
+//   channel__broadcast    channel, members, bytes       (before the fan-out)
+//   channel__broadcast__done  channel                   (after it)
+//   client__recv          fd, bytes
+//   client__send          fd, bytes sent, bytes left
+//   client__send__blocked fd, bytes left                (EAGAIN)
+//   client__disconnect    fd, reason
+
+#ifdef IRCSERV_USDT
+#include <sys/sdt.h>
+#define IRCSERV_PROBE1(name, a) DTRACE_PROBE1(ircserv, name, a)
+#define IRCSERV_PROBE2(name, a, b) DTRACE_PROBE2(ircserv, name, a, b)
+#define IRCSERV_PROBE3(name, a, b, c) DTRACE_PROBE3(ircserv, name, a, b, c)
+#else
+#define IRCSERV_PROBE1(name, a)
+#define IRCSERV_PROBE2(name, a, b)
+#define IRCSERV_PROBE3(name, a, b, c)
+#endif
+
+#endif
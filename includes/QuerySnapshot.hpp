@@ -0,0 +1,134 @@
+#ifndef QUERYSNAPSHOT_HPP
+#define QUERYSNAPSHOT_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "ReplyStream.hpp"
+#include "WorkerPool.hpp"
+
+class Server;  // Forward declaration
+class Client;  // Forward declaration
+class Channel;  // Forward declaration
+
+// Read-only copy of the users and channels that informational queries look
+// at, so WHO, NAMES and LIST can be rendered on worker threads while the
+// loop keeps changing the real objects. A snapshot is never modified once
+// captured; the server shares it between queries until its state epoch
+// moves on (see Server::startSnapshotQuery).
+//
+// Each user and channel is a separate piece, shared by every snapshot it is
+// still current in: a new snapshot copies only the clients and channels
+// whose version changed since the previous one, plus users whose idle time
+// drifted past Server::SNAPSHOT_MAX_AGE. Members name their user by serial,
+// so a nick change does not copy the channels. Reference counts, of the
+// snapshots and of the pieces, are only touched on the loop thread.
+class QuerySnapshot {
+public:
+    struct User {
+        unsigned long serial;
+        int fd;
+        std::string nickname;
+        std::string username;
+        std::string hostname;
+        std::string ip;
+        std::string realname;
+        std::string account;
+        std::string server;     // the network name here, or the remote user's server
+        std::string foldedNickname;     // casefolded, for mask matching
+        std::string foldedUsername;
+        std::string foldedHostname;
+        std::string foldedRealname;
+        time_t lastActive;
+        bool registered;
+        bool connected;         // a local connection, as opposed to a remote user or detached session
+        unsigned long version;  // Client::getVersion() when copied
+        mutable size_t refs;    // snapshots sharing the piece
+    };
+
+    struct Member {
+        unsigned long serial;   // see findUser()
+        unsigned flags;         // Channel::MemberFlag bits
+    };
+
+    struct ChannelInfo {
+        std::string name;
+        std::string topic;
+        unsigned modes;         // Channel::ModeBit bits
+        std::vector<Member> members;
+        unsigned long version;  // Channel::getVersion() when copied
+        mutable size_t refs;
+    };
+
+private:
+    std::vector<const User*> _users;            // local connections by fd, then the others by serial
+    std::vector<const User*> _bySerial;
+    std::vector<const ChannelInfo*> _channels;  // by name
+    unsigned long _epoch;
+    time_t _capturedAt;
+    size_t _refs;
+
+    const User* captureUser(const Client* client, bool connected, const std::string& localServer, const QuerySnapshot* previous) const;
+    static const ChannelInfo* captureChannel(const Channel* channel);
+    static bool userSerialLess(const User* user, unsigned long serial);
+    static bool userLess(const User* a, const User* b);
+    static bool channelNameLess(const ChannelInfo* channel, const std::string& name);
+
+    ~QuerySnapshot();
+    QuerySnapshot(const QuerySnapshot&);
+    QuerySnapshot& operator=(const QuerySnapshot&);
+
+public:
+    // previous, when given, lends the pieces that are still current
+    QuerySnapshot(Server& server, unsigned long epoch, const QuerySnapshot* previous);
+
+    void retain();
+    void release();             // deletes the snapshot with its last reference
+
+    unsigned long getEpoch() const;
+    time_t getCapturedAt() const;
+
+    const std::vector<const User*>& getUsers() const;
+    const std::vector<const ChannelInfo*>& getChannels() const;
+    const User* findUser(unsigned long serial) const;
+    const ChannelInfo* findChannel(const std::string& name) const;
+    const Member* findMember(const ChannelInfo& channel, unsigned long serial) const;
+};
+
+// A query rendered against a snapshot on a worker thread. render() must only
+// read the snapshot and its own fields: the requesting client may be gone.
+class SnapshotQuery {
+public:
+    virtual ~SnapshotQuery() {}
+    virtual void render(const QuerySnapshot& snapshot, std::string& out) const = 0;
+};
+
+// Loop side of a snapshot query: queued on the client like any reply stream,
+// it holds back the streams behind it until the worker hands over the
+// prepared output, then releases it line by line under sendQ control.
+class PreparedReply : public ReplyStream {
+public:
+    class Job;
+
+private:
+    Job* _job;                  // while the query is being rendered
+    std::string _output;
+    size_t _sent;
+    bool _ready;
+
+public:
+    PreparedReply();
+    virtual ~PreparedReply();
+
+    // Takes ownership of query and a reference to snapshot
+    static PreparedReply* submit(WorkerPool& pool, QuerySnapshot* snapshot, SnapshotQuery* query);
+
+    void deliver(std::string& output);
+    void detach();
+
+    virtual bool isReady() const;
+    virtual bool produce(Server& server, Client* client);
+};
+
+#endif
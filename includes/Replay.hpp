@@ -0,0 +1,84 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Capture.hpp"
+
+// Drives the sessions of a capture file against a running server, at the
+// recorded pace, N times faster or as fast as possible, then reports
+// throughput and latency. Latency comes from PING probes sent behind the
+// replayed lines, one outstanding per session. Masked passwords are replaced
+// with the one given; masked SASL exchanges cannot be replayed.
+//
+// Switching from one session to another waits until every session's lines
+// have been answered (and a registration its welcome), so the server
+// processes them in capture order and runs are reproducible; the recorded
+// pace is a lower bound.
+//
+// Each session's output is reduced to a digest of its sorted lines, with
+// tags and timestamps stripped, so runs compare equal whatever the
+// interleaving between sessions. The first run against a baseline file
+// writes it; later runs report the sessions that differ.
+class Replay {
+public:
+    static const int DRAIN_TIMEOUT_MS = 2000;      // quiet time before the last replies are considered in
+    static const int CLOSE_GRACE_MS = 200;         // quiet time before a settled session is closed
+
+private:
+    struct Session {
+        int fd;
+        bool connecting;
+        bool closing;           // capture saw the connection end: close once settled
+        bool awaitingWelcome;   // USER sent, 001 not seen yet
+        bool unprobed;          // lines sent since the outstanding probe
+        std::string output;
+        std::string input;
+        std::vector<std::string> lines;
+        unsigned long long probeSentAt;     // 0: no probe outstanding
+        unsigned long long lastInputAt;
+    };
+
+    std::string _capturePath;
+    std::string _host;
+    std::string _port;
+    std::string _password;
+    double _speed;              // 0: as fast as possible
+    std::string _baselinePath;
+
+    std::vector<Capture::Record> _records;
+    std::map<unsigned long, Session> _sessions;
+    unsigned long _lastSerial;                  // session of the last record dispatched
+    unsigned long long _barrierSince;           // waiting for the sessions to settle since, 0: not waiting
+    std::vector<unsigned long long> _latencies;
+    unsigned long _linesSent;
+    unsigned long _bytesReceived;
+    unsigned long _skipped;
+    unsigned long _barrierTimeouts;
+
+    static unsigned long long now();
+    static unsigned long long digest(std::vector<std::string> lines);
+
+    bool openSession(unsigned long serial);
+    void sendLine(Session& session, const std::string& line);
+    void sendProbe(Session& session);
+    bool isSettled(const Session& session) const;
+    bool mayDispatch(size_t next, unsigned long long start, unsigned long long firstAt);
+    void closeSession(Session& session);
+    void readSession(Session& session);
+    bool writeSession(Session& session);
+    size_t compareBaseline(std::map<unsigned long, unsigned long long>& digests);
+
+public:
+    Replay(const std::string& capturePath, const std::string& target, const std::string& password,
+           const std::string& speed, const std::string& baselinePath);
+
+    // Exit status for main
+    int run();
+
+    // A reply as compared across runs: tags and timestamps stripped
+    static std::string normalize(const std::string& line);
+};
+
+#endif
@@ -0,0 +1,127 @@
+#ifndef REPLICATION_HPP
+#define REPLICATION_HPP
+
+#include <map>
+#include <set>
+#include <deque>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+class Server;      // Forward declaration
+class Client;      // Forward declaration
+class Channel;     // Forward declaration
+class StateReader; // Forward declaration
+
+// Hot standby. The primary listens on a local SEQPACKET socket; a standby
+// that connects gets a snapshot (Server::saveState) together with duplicates
+// of the listening and client sockets, then one batch per tick carrying the
+// full record of every client and channel that changed, numbered in sequence.
+// The standby only reads. When the primary dies the sockets stay open through
+// the standby's copies, so it takes over the listener and every session. The
+// socket file is private to our user, and both ends check SO_PEERCRED too.
+//
+// Messages are one type byte plus payload: 'F' passes sockets (SCM_RIGHTS),
+// 'D' carries a piece of the batch stream and 'A' acknowledges a batch.
+class Replication {
+public:
+    static const size_t MESSAGE_SIZE = 60 * 1024;
+    static const size_t FDS_PER_MESSAGE = 250;
+    static const size_t MAX_BACKLOG = 64 * 1024 * 1024;    // queued for a slow standby before it is dropped
+
+private:
+    enum RecordType {
+        REC_SNAPSHOT,
+        REC_CLIENT,
+        REC_CLIENT_GONE,
+        REC_CHANNEL,
+        REC_CHANNEL_GONE,
+        REC_HISTORY
+    };
+
+    // Socket slot in a client record besides a position in the passed sockets
+    enum {
+        SLOT_UNCHANGED = -1,
+        SLOT_NONE = -2
+    };
+
+    struct Message {
+        char type;
+        std::string data;
+        std::vector<int> fds;       // duplicates, closed once sent
+    };
+
+    Server& _server;
+
+    // Primary side
+    std::string _path;
+    int _serverFd;                  // listening socket: handed over in the snapshot
+    int _listenFd;
+    int _standbyFd;
+    std::deque<Message> _outbox;
+    size_t _outboxBytes;
+    std::string _batch;             // records of the current tick
+    unsigned long _seq;
+    unsigned long _ackedSeq;
+    std::deque<std::pair<unsigned long, struct timeval> > _unacked;
+    std::map<unsigned long, int> _mirroredClients;     // serial → socket the standby holds (-1: none)
+    std::set<std::string> _mirroredChannels;
+    unsigned long _historyMark;     // newest msgid the standby has
+    size_t _fdsSent;
+
+    // Standby side
+    int _primaryFd;
+    std::string _inbox;
+    std::vector<int> _receivedFds;
+    std::map<unsigned long, Client*> _clients;         // by serial
+    unsigned long _appliedSeq;
+    bool _refused;                  // the snapshot was from an incompatible build
+
+    long _lagUs;
+
+    void acceptStandby();
+    void readAcks();
+    void dropStandby(const std::string& reason);
+    void sendSnapshot();
+    void passSocket(int fd);
+    void addRecord(RecordType type, const std::string& body);
+    void queue(char type, const std::string& data, const std::vector<int>& fds);
+    bool sendOutbox();
+
+    bool receive();
+    void applyBatches();
+    void applyRecord(int type, StateReader& in);
+    int takeSocket(long slot);
+
+    Replication(const Replication&);
+    Replication& operator=(const Replication&);
+
+public:
+    Replication(Server& server);
+    ~Replication();
+
+    // Primary: listen for a standby; each tick collect changes, then flush
+    bool listen(const std::string& path, int serverFd);
+    void poll();
+    void clientChanged(Client* client);
+    void clientGone(Client* client);
+    void channelChanged(Channel* channel, unsigned flags);
+    void channelGone(const std::string& name);
+    void flush();
+    bool hasStandby() const;
+    void logStatus() const;
+
+    // Standby: follow() returns false once the primary is gone or asked us to resync
+    bool connectToPrimary(const std::string& path);
+    bool follow(int timeoutMs);
+    bool isSynced() const;
+    bool refusedSnapshot() const;
+    int getServerFd() const;
+    static bool primaryAlive(const std::string& path);
+
+    // Replication lag: primary, batch sent to acknowledged; standby, batch sent to applied
+    long getLagMillis() const;
+    void report(std::vector<std::string>& lines) const;
+};
+
+#endif
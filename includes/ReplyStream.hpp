@@ -0,0 +1,28 @@
+#ifndef REPLYSTREAM_HPP
+#define REPLYSTREAM_HPP
+
+#include <cstddef>
+
+class Server; // Forward declaration
+class Client; // Forward declaration
+
+// A multi-line reply produced incrementally. The server resumes it whenever the
+// client's sendQ drains below SENDQ_LOW_WATERMARK, so large result sets never
+// have to be materialised in one go.
+class ReplyStream {
+public:
+    static const size_t SENDQ_LOW_WATERMARK = 4096;
+    static const size_t SENDQ_HIGH_WATERMARK = 32768;
+
+    virtual ~ReplyStream() {}
+
+    // Queue replies until the sendQ reaches SENDQ_HIGH_WATERMARK.
+    // Returns true once the reply (including its terminator) is complete.
+    virtual bool produce(Server& server, Client* client) = 0;
+
+    // False while the reply is still being prepared elsewhere; the streams
+    // queued behind it wait too
+    virtual bool isReady() const { return true; }
+};
+
+#endif
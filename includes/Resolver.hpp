@@ -0,0 +1,74 @@
+#ifndef RESOLVER_HPP
+#define RESOLVER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ctime>
+#include "WorkerPool.hpp"
+
+class Server;  // Forward declaration
+class Client;  // Forward declaration
+class Command; // Forward declaration
+
+// Reverse DNS for client hostnames, on worker threads of its own so that a
+// slow nameserver never holds up the event loop or password checks. A name
+// counts only when it maps back to the address (forward confirmation);
+// otherwise the client keeps its IP as hostname. Lookups go through the
+// system resolver, so /etc/hosts or a stub nameserver in /etc/resolv.conf
+// is enough to exercise them offline.
+//
+// Registration waits for the lookup, but never past LOOKUP_TIMEOUT. With
+// MAX_INFLIGHT addresses already queued, a new one is not looked up at all.
+class Resolver {
+public:
+    typedef std::string (*ResolveFunction)(const std::string& ip);
+
+    static const size_t THREADS = 4;
+    static const size_t MAX_INFLIGHT = 1024;    // addresses queued or being looked up
+    static const time_t LOOKUP_TIMEOUT = 3;     // seconds registration may wait
+    static const time_t POSITIVE_TTL = 3600;
+    static const time_t NEGATIVE_TTL = 300;
+    static const size_t CACHE_LIMIT = 65536;
+    static const size_t HOSTNAME_MAX = 63;
+
+private:
+    struct CacheEntry {
+        std::string hostname;       // empty: no confirmed name
+        time_t expires;
+    };
+
+    Server& _server;
+    Command* _dispatcher;           // resumes registration once the hostname is settled
+    ResolveFunction _resolve;
+    WorkerPool _pool;
+    std::map<std::string, CacheEntry> _cache;                                       // by IP
+    std::map<std::string, std::vector<std::pair<int, unsigned long> > > _inflight;  // IP → waiting fd, serial
+    std::map<int, unsigned long> _waiting;                                         // fd → serial
+
+    void settle(Client* client, const std::string& hostname, bool cached);
+    void remember(const std::string& ip, const std::string& hostname);
+
+    Resolver(const Resolver&);
+    Resolver& operator=(const Resolver&);
+
+public:
+    Resolver(Server& server);
+
+    bool start();
+    void setDispatcher(Command* dispatcher);
+    void setResolveFunction(ResolveFunction resolve);   // resolve() unless stubbed for tests
+    int getWakeFd() const;
+
+    // The client's IP must be set; its hostname stays the IP until settled
+    void lookup(Client* client);
+
+    // Each tick: apply finished lookups, give up on those past their deadline
+    void poll();
+
+    // Worker side, also used by the tasks' completion
+    static std::string resolve(const std::string& ip);
+    void finish(const std::string& ip, const std::string& hostname);
+};
+
+#endif
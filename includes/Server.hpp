@@ -1,57 +1,222 @@
-#ifndef SERVER_HPP
-#define SERVER_HPP
-
-#include <map>
-#include <string>
-#include <vector>
-#include <set>
-#include "Client.hpp"
-#include "Channel.hpp"
-
-class Server {
-private:
-    std::map<int, Client*> _clients;                     // socket fd → Client
-    std::map<std::string, Channel*> _channels;           // channel name → Channel
-    std::string _password;                               // server password
-
-public:
-    Server();
-    Server(const std::string& password);
-    ~Server();
-
-    // Configuration
-    void setPassword(const std::string& password);
-    const std::string& getPassword() const;
-
-    // Client management
-    void addClient(int fd);
-    void removeClient(int fd);
-    Client* getClient(int fd);
-    Client* findClientByNick(const std::string& nickname);
-    bool isNicknameInUse(const std::string& nickname);
-
-    // Channel management
-    Channel* getChannel(const std::string& name);
-    Channel* createChannel(const std::string& name);
-    void removeClientFromAllChannels(Client* client);
-    void deleteChannelIfEmpty(Channel* channel);
-
-    // Messaging - Enhanced for I/O layer
-    void queueMessage(int clientFd, const std::string& message);
-        
-    // Channel utilities
-    std::vector<Channel*> getClientChannels(Client* client);
-    void sendMessage(int clientFd, const std::string& message);
-    void broadcast(const std::set<int>& targets, const std::string& message);
-
-    // I/O Interface methods
-    void flushClientMessages(int clientFd);
-    bool hasClientMessagesToSend(int clientFd) const;
-
-    // Timeout handling
-    void disconnectIdleClients(int timeoutSeconds);
-    void handleClientDisconnection(int fd);
-
-};
-
-#endif
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <set>
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Mask.hpp"
+#include "ReplyStream.hpp"
+#include "MessageHistory.hpp"
+#include "Network.hpp"
+#include "StateCodec.hpp"
+#include "ChannelStore.hpp"
+#include "Replication.hpp"
+#include "AccountStore.hpp"
+#include "WorkerPool.hpp"
+#include "Resolver.hpp"
+#include "QuerySnapshot.hpp"
+#include "Capture.hpp"
+#include "Transport.hpp"
+#include "Metrics.hpp"
+#include "SocketTuning.hpp"
+#include "WelcomeBurst.hpp"
+
+class Command; // Forward declaration
+
+class Server {
+private:
+    std::map<int, Client*> _clients;                     // socket fd → Client
+    std::map<std::string, Channel*> _channels;           // channel name → Channel
+    std::string _password;                               // server password
+
+    // Sorted lookup indexes, keyed by casefolded value
+    std::map<std::string, Client*> _nickIndex;
+    std::multimap<std::string, Client*> _userIndex;
+    std::multimap<std::string, Client*> _hostIndex;
+
+    std::set<int> _streamingFds;                         // clients with pending reply streams
+    std::vector<int> _pendingFlush;                      // clients whose output grew this tick
+    std::vector<Client*> _pendingDisconnects;            // clients to tear down at the end of the tick
+    std::vector<int> _releasedFds;                       // sockets of sessions detached this tick
+    std::map<std::string, Client*> _detachedSessions;    // resume token → detached session
+    std::set<Client*> _remoteClients;                    // users on other servers
+    Network _network;                                    // links to other servers
+    unsigned long _fanoutEpoch;                          // stamp for deduplicated fan-out
+    HistoryBudget _historyBudget;                        // memory shared by all channel histories
+    ChannelStore _store;                                 // channel settings kept across restarts
+    std::vector<std::string> _dirtyChannels;             // channels changed this tick
+    std::vector<Client*> _dirtyClients;                  // local clients whose identity changed this tick
+    unsigned long _nextSerial;                           // next Client serial
+    Replication _replication;                            // hot standby (primary or standby side)
+    AccountStore _accounts;                              // SASL credentials
+    WelcomeBurst _welcome;                               // 001 to 005 and the MOTD, pre-rendered
+    WorkerPool _workers;                                 // password hashing off the event loop
+    Resolver _resolver;                                  // client hostnames, off the event loop too
+    WorkerPool _queryWorkers;                            // WHO, NAMES and LIST rendered off the event loop
+    unsigned long _stateEpoch;                           // bumped by every change a query could see
+    QuerySnapshot* _querySnapshot;                       // shared by queries until the epoch moves on
+    Capture _capture;                                    // inbound traffic recorded for replay
+    TcpTransport _tcp;
+    Transport* _transport;                               // client connections: _tcp, or the simulation's
+    bool _rejectLongLines;                               // drop over-long lines instead of truncating them
+    Metrics _metrics;                                    // command latencies, tick and sendQ times
+    SocketTuning _socketTuning;                          // options for accepted sockets, cork on flush
+
+    static void indexRemove(std::multimap<std::string, Client*>& index, const std::string& key, Client* client);
+    void pumpReplyStream(Client* client);
+    void destroyClient(Client* client);
+    void indexClient(Client* client);
+    void unindexClient(Client* client);
+    void reattachSession(Client* fresh, Client* session);
+
+public:
+    // Fields selectable for indexed mask lookups
+    enum IndexField {
+        INDEX_NICK = 1,
+        INDEX_USER = 2,
+        INDEX_HOST = 4
+    };
+
+    static const size_t HISTORY_MEMORY_BUDGET = 32 * 1024 * 1024;
+    static const time_t RESUME_GRACE_PERIOD = 120;           // seconds a detached session is kept
+    static const size_t RESUME_BACKLOG_LIMIT = 64 * 1024;    // bytes buffered for a detached session
+    static const size_t PASSWORD_WORKERS = 2;
+    static const size_t MAX_PENDING_LOGINS = 256;           // SASL checks queued before new ones fail fast
+    static const size_t MAX_CLIENT_LOGINS = 1;              // of those, queued for one connection
+    static const size_t QUERY_WORKERS = 2;
+    static const time_t SNAPSHOT_MAX_AGE = 2;               // seconds, so idle times stay close
+    static const long STATE_VERSION = 1;                    // bump whenever saveState's layout changes
+
+    Server();
+    Server(const std::string& password);
+    ~Server();
+
+    // Configuration
+    void setPassword(const std::string& password);
+    const std::string& getPassword() const;
+    void setTransport(Transport* transport);
+    Transport& getTransport();
+    void setRejectLongLines(bool reject);
+    bool rejectsLongLines() const;
+    void setSocketTuning(const SocketTuning& tuning);
+    const SocketTuning& getSocketTuning() const;
+
+    // Client management
+    void addClient(int fd);
+    void removeClient(int fd);
+    Client* getClient(int fd);
+    Client* findClientByNick(const std::string& nickname);
+    bool isNicknameInUse(const std::string& nickname);
+    const std::map<int, Client*>& getClients() const;
+    const std::map<std::string, Client*>& getUsersByNick() const;
+    void addRemoteClient(Client* client);
+    Network& getNetwork();
+
+    // Identity setters that keep the lookup indexes in sync
+    void setClientNickname(Client* client, const std::string& nickname);
+    void setClientUsername(Client* client, const std::string& username);
+    void setClientHostname(Client* client, const std::string& hostname);
+
+    // Serials of clients whose selected fields may match the mask (narrowed by its literal prefix)
+    void collectClientsByMask(const Mask& mask, int fields, std::set<unsigned long>& serials) const;
+
+    // Channel management
+    Channel* getChannel(const std::string& name);
+    Channel* createChannel(const std::string& name, bool* restored = NULL);   // restored: settings came from the store
+    const std::map<std::string, Channel*>& getChannels() const;
+    void removeClientFromAllChannels(Client* client);
+    void deleteChannelIfEmpty(Channel* channel);
+
+    // Accounts and offloaded work
+    void openAccounts(const std::string& path);
+    AccountStore& getAccounts();
+    WelcomeBurst& getWelcome();
+    WorkerPool& getWorkers();
+    Resolver& getResolver();
+    WorkerPool& getQueryWorkers();
+    Capture& getCapture();
+    Metrics& getMetrics();
+
+    // Channel persistence
+    bool openChannelStore(const std::string& prefix);
+    void syncChannelStore();
+
+    // End of tick: settings changes to the store, clients and channels to the
+    // standby, captured traffic to its writer
+    void publishChanges();
+    Replication& getReplication();
+    unsigned long getLastMsgid() const;
+
+    // Messaging - Enhanced for I/O layer
+    void queueMessage(int clientFd, const std::string& message);
+    void queueMessage(Client* client, const std::string& message);
+        
+    // Channel utilities
+    std::vector<Channel*> getClientChannels(Client* client);
+    void broadcastToCommonChannels(Client* client, const std::string& message, bool includeSelf);
+    void sendMessage(int clientFd, const std::string& message);
+    void broadcast(const std::set<int>& targets, const std::string& message);
+
+    // I/O Interface methods
+    void flushClientMessages(int clientFd);
+    bool hasClientMessagesToSend(int clientFd) const;
+    void takePendingFlush(std::vector<int>& fds);
+
+    // Connection I/O through the transport: the caller says when a connection
+    // is readable or writable (poll() or the simulation)
+    void readFromClient(int fd, Command& commands);
+    void writeToClient(int fd);
+    void flushPendingWrites();
+
+    // Streamed replies
+    void startReplyStream(Client* client, ReplyStream* stream);
+    void startSnapshotQuery(Client* client, SnapshotQuery* query);
+    void pumpReplyStreams();
+
+    // Timeout handling
+    void disconnectIdleClients(int timeoutSeconds);
+    void handleClientDisconnection(int fd, const std::string& reason = "Client disconnected");
+    void scheduleDisconnection(Client* client, const std::string& reason);
+
+    // Lost socket: detach resumable sessions, disconnect everyone else
+    void handleConnectionLost(int fd, const std::string& reason);
+
+    // Detached sessions
+    Client* findDetachedSession(const std::string& token);
+    const std::map<std::string, Client*>& getDetachedSessions() const;
+    const std::set<Client*>& getRemoteClients() const;
+    void resumeSession(Client* fresh, Client* session);
+    void expireDetachedSessions();
+
+    // Batched teardown: clients scheduled above are removed together; the caller closes closedFds
+    bool hasPendingDisconnections() const;
+    const std::vector<Client*>& getPendingDisconnections() const;
+    void processPendingDisconnections(std::vector<int>& closedFds);
+
+    // Start of tick: expire detached sessions, then the batch above with a
+    // last write to each connection before the transport closes it. False if
+    // there was nothing to tear down.
+    bool reapDisconnections();
+
+    // Binary upgrade and standby snapshot: local clients, detached sessions and
+    // channels. Sockets are written as positions in fds, which travel alongside
+    // the state; loading fills clients by serial.
+    // The state opens with a magic and STATE_VERSION: a build that does not
+    // recognize them loads nothing and returns false.
+    void saveState(StateWriter& out, std::vector<int>& fds) const;
+    bool loadState(StateReader& in, const std::vector<int>& fds, std::map<unsigned long, Client*>& clients);
+    static bool readStateHeader(StateReader& in);
+
+    // Standby: apply the primary's records without telling anyone; also drops a
+    // restored channel whose first joiner was refused, leaving the store as it was
+    Client* mirrorClient(Client* client, int fd, StateReader& in);
+    void discardClient(Client* client);
+    void discardChannel(const std::string& name);
+    void dropChanges();     // after each batch: the primary already published it
+
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef SIMULATION_HPP
+#define SIMULATION_HPP
+
+#include <string>
+#include <vector>
+#include "Server.hpp"
+#include "Command.hpp"
+#include "Transport.hpp"
+
+// Drives the command layer with virtual clients over a MemoryTransport: no
+// sockets and no poll(), so 100k clients fit in one process and a profile
+// shows the server, not the kernel. Ticks follow the event loop in main.cpp.
+//
+// Every client registers and joins a few channels, then each round sends one
+// line picked by a seeded generator (mostly channel and private messages,
+// some PING, TOPIC, NAMES, WHO and rejoins); a last round quits everyone.
+// The same arguments produce the same traffic, and the report carries a
+// digest of everything the clients received, compared as in Replay, so two
+// builds can be checked against each other. Fails if a client never got its
+// welcome or outlived its QUIT.
+class Simulation {
+public:
+    static const size_t CLIENTS_PER_CHANNEL = 25;
+    static const size_t CHANNELS_PER_CLIENT = 2;
+    static const size_t QUIET_TICKS = 2;        // ticks without traffic before a phase is over
+
+private:
+    struct VirtualClient {
+        int fd;
+        std::string nickname;
+        std::vector<size_t> channels;   // indexes in _channelNames
+        bool welcomed;
+        std::string partial;            // start of a line not complete yet
+    };
+
+    size_t _clientCount;
+    size_t _rounds;
+    unsigned long long _seed;
+    unsigned long long _state;          // generator
+
+    MemoryTransport _transport;
+    Server _server;
+    Command _commands;
+    std::vector<VirtualClient> _clients;
+    std::vector<std::string> _channelNames;
+
+    unsigned long long _linesSent;
+    unsigned long long _linesReceived;
+    unsigned long long _bytesReceived;
+    unsigned long long _digest;
+    unsigned long _ticks;
+
+    unsigned long random(unsigned long bound);
+    void send(VirtualClient& client, const std::string& line);
+    const std::string& pickChannel(const VirtualClient& client);
+    void playRound(size_t round);
+    bool tick();
+    void settle();
+    bool collectOutput();
+
+public:
+    Simulation(size_t clients, size_t rounds, unsigned long long seed);
+
+    // Exit status for main
+    int run();
+};
+
+#endif
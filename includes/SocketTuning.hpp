@@ -0,0 +1,53 @@
+#ifndef SOCKETTUNING_HPP
+#define SOCKETTUNING_HPP
+
+#include <string>
+
+// Socket options, 0 meaning "leave the kernel default". Buffer sizes and
+// TCP_DEFER_ACCEPT go on the listener (accepted sockets inherit the buffers,
+// and they must be set before listen() to count for window scaling); the rest
+// on every accepted client; cork is applied by the server around its writes.
+struct SocketProfile {
+    int nodelay;            // TCP_NODELAY: no Nagle delay on small replies
+    int cork;               // TCP_CORK while a flush is being written
+    int notsentLowat;       // TCP_NOTSENT_LOWAT bytes: keep the backlog in our sendQ, not the kernel's
+    int deferAccept;        // TCP_DEFER_ACCEPT seconds: wake on the first line, not the handshake
+    int rcvbuf;             // SO_RCVBUF bytes
+    int sndbuf;             // SO_SNDBUF bytes
+    int busyPoll;           // SO_BUSY_POLL microseconds of spinning on the device queue
+    int keepalive;          // SO_KEEPALIVE with TCP_KEEPIDLE seconds
+    int keepInterval;       // TCP_KEEPINTVL seconds
+    int keepCount;          // TCP_KEEPCNT probes
+
+    SocketProfile();
+};
+
+// The profile from --socket-profile=<name>[,<option>=<value>...]: "default"
+// (only what the server always set), "latency" (interactive chat: no Nagle,
+// a small unsent backlog, busy polling) or "bulk" (large channels: corked
+// flushes, big send buffers), then options as named in describe().
+class SocketTuning {
+private:
+    std::string _name;
+    SocketProfile _profile;
+    mutable unsigned _warned;       // options that already failed once, by table index
+
+    void apply(int fd, int target) const;
+
+public:
+    SocketTuning();
+
+    bool configure(const std::string& spec, std::string& error);
+    const SocketProfile& profile() const;
+    std::string describe() const;       // "latency: nodelay=1 ..." for the log
+
+    void applyToListener(int fd) const; // before listen()
+    void applyToClient(int fd) const;   // after accept()
+    static void setCorked(int fd, bool corked);
+
+    // Each profile over loopback: round trips of one client, then lines fanned
+    // out to many. Exit status for main.
+    static int benchmark();
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef STATECODEC_HPP
+#define STATECODEC_HPP
+
+#include <string>
+
+// Flat encoding of server state handed to a freshly exec'd binary on upgrade,
+// also used for the channel store on disk. Integers are decimal followed by a space; strings are "<length>:<bytes>" so
+// buffers may hold CR, LF or anything else.
+class StateWriter {
+private:
+    std::string _data;
+
+public:
+    void putInt(long value);
+    void putString(const std::string& value);
+    void putBytes(const char* bytes, size_t length);
+    const std::string& data() const;
+};
+
+class StateReader {
+private:
+    const char* _data;
+    size_t _length;
+    size_t _pos;
+    bool _ok;
+
+    long readNumber(char terminator);
+
+public:
+    StateReader(const std::string& data);
+    StateReader(const char* data, size_t length);     // e.g. straight from an mmap'd file
+
+    long getInt();
+    std::string getString();
+    bool getBytes(const char*& bytes, size_t& length);     // a string left in place, no copy
+    bool ok() const;    // false once anything was truncated or malformed
+    bool atEnd() const;
+    size_t position() const;
+};
+
+#endif
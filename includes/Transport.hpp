@@ -0,0 +1,72 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+// What the server does with a client connection once it exists: read from it,
+// write to it, close it. Sockets go through TcpTransport; the simulation swaps
+// in a MemoryTransport so the command layer runs without the kernel.
+//
+// Both follow recv()/send(): -1 with errno EAGAIN when nothing can move right
+// now, 0 from receive() once the peer hung up.
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    virtual ssize_t receive(int fd, char* buffer, size_t length) = 0;
+    virtual ssize_t transmit(int fd, const char* data, size_t length) = 0;
+    virtual void close(int fd) = 0;
+
+    // Hold partial frames while a flush is written (TCP_CORK); sockets only
+    virtual void setCorked(int fd, bool corked) { (void)fd; (void)corked; }
+};
+
+class TcpTransport : public Transport {
+public:
+    virtual ssize_t receive(int fd, char* buffer, size_t length);
+    virtual ssize_t transmit(int fd, const char* data, size_t length);
+    virtual void close(int fd);
+    virtual void setCorked(int fd, bool corked);
+};
+
+// Connections as pairs of buffers. The far side (a simulated client) writes
+// with deliver() and reads with takeOutput(); the server sees a socket whose
+// send buffer holds SEND_CAPACITY bytes, so backpressure behaves as on TCP.
+class MemoryTransport : public Transport {
+public:
+    static const int FIRST_FD = 1024;                   // clear of every descriptor the process holds
+    static const size_t SEND_CAPACITY = 64 * 1024;
+
+private:
+    struct Endpoint {
+        std::string inbound;        // client to server
+        size_t inboundRead;
+        std::string outbound;       // server to client, not taken yet
+        bool open;                  // server side not closed
+        bool hungUp;                // client side closed
+    };
+
+    std::vector<Endpoint> _endpoints;   // by fd - FIRST_FD
+
+    Endpoint* find(int fd);
+    const Endpoint* find(int fd) const;
+
+public:
+    MemoryTransport();
+
+    // Far side
+    int connect();
+    void deliver(int fd, const std::string& data);
+    void hangUp(int fd);
+    bool hasInput(int fd) const;
+    bool isOpen(int fd) const;
+    void takeOutput(int fd, std::string& out);     // appended to out
+
+    virtual ssize_t receive(int fd, char* buffer, size_t length);
+    virtual ssize_t transmit(int fd, const char* data, size_t length);
+    virtual void close(int fd);
+};
+
+#endif
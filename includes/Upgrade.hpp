@@ -0,0 +1,37 @@
+#ifndef UPGRADE_HPP
+#define UPGRADE_HPP
+
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+// Zero-downtime binary upgrade. The running process forks, execs the binary at
+// the path it was started from and passes it the serialized server state plus
+// the listening and client sockets (SCM_RIGHTS) over a socketpair. Clients
+// keep their TCP connections; the old process exits once the new one
+// acknowledges.
+namespace Upgrade {
+    // Set in the new process to the inherited end of the socketpair
+    extern const char* const ENV_FD;
+
+    // The binary's absolute path, resolved at startup: argv[0] may be relative
+    // to a directory the process has left since. Exec'ing the path (not
+    // /proc/self/exe itself) picks up a binary replaced in the meantime.
+    void rememberExecutable(const char* argv0);
+    const char* executable();
+
+    static const size_t FDS_PER_MESSAGE = 250;     // stays under SCM_MAX_FD
+    static const int ACK_TIMEOUT_MS = 10000;
+
+    // Old process: true once the new process has taken over and this one must exit.
+    // On failure the child is reaped and the caller keeps serving.
+    bool handOver(char* argv[], const struct timeval& startedAt, const std::string& state,
+                  const std::vector<int>& fds, const std::vector<int>& openFds);
+
+    // New process: the channel fd from the environment, or -1 on a normal start
+    int takeoverChannel();
+    bool receive(int channel, std::string& state, std::vector<int>& fds, struct timeval& startedAt);
+    void acknowledge(int channel);
+}
+
+#endif
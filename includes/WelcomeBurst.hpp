@@ -0,0 +1,54 @@
+#ifndef WELCOMEBURST_HPP
+#define WELCOMEBURST_HPP
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+// What a client gets on registering, 001 to 005 and the MOTD, rendered once
+// into templates whose only holes are the nick and the hostmask: a
+// registration is a few appends into one string and a single enqueue. The
+// MOTD comes from a text file, mapped and split into 372 lines at load, and
+// is loaded again when the file's modification time changes; without the
+// file clients get 422.
+class WelcomeBurst {
+public:
+    static const size_t MOTD_LINE_LENGTH = 400;    // longer lines are cut, to stay inside 512 bytes
+
+private:
+    enum Hole { NICK, HOSTMASK };
+
+    struct Template {
+        std::vector<std::string> pieces;    // literal text, each but the last followed by a hole
+        std::vector<Hole> holes;
+        size_t literalLength;
+
+        Template();
+        void clear();
+        void text(const std::string& literal);
+        void hole(Hole hole);
+        void render(const std::string& nick, const std::string& hostmask, std::string& out) const;
+    };
+
+    Template _registration;     // 001 to 005
+    Template _motd;             // 375, 372..., 376, or 422
+    time_t _createdAt;
+    std::string _motdPath;
+    time_t _motdMtime;          // 0: no file
+
+    void buildRegistration();
+    void buildMotd(const std::vector<std::string>* lines);
+    bool readMotd(std::vector<std::string>& lines);
+
+public:
+    WelcomeBurst();
+
+    void open(const std::string& motdPath);
+    void reloadIfChanged();
+
+    // Appended to out, complete lines
+    void render(const std::string& nick, const std::string& hostmask, std::string& out) const;
+    void renderMotd(const std::string& nick, std::string& out) const;
+};
+
+#endif
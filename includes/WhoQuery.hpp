@@ -0,0 +1,55 @@
+#ifndef WHOQUERY_HPP
+#define WHOQUERY_HPP
+
+#include <string>
+#include <set>
+#include "QuerySnapshot.hpp"
+#include "Mask.hpp"
+
+class Server;  // Forward declaration
+class Client;  // Forward declaration
+
+// WHO <mask> [<flags>[%<fields>[,<token>]]]
+//
+// <flags> select the fields the mask is matched against (n, u, h, s, r;
+// default "nuhs"). A '%' switches to WHOX replies (354) carrying only the
+// requested <fields> in canonical order "tcuihsnfdlaor". %i is
+// 255.255.255.255 unless the requester is the target or an IRC operator.
+class WhoQuery : public SnapshotQuery {
+private:
+    enum MatchField {
+        MATCH_NICK = 1,
+        MATCH_USER = 2,
+        MATCH_HOST = 4,
+        MATCH_SERVER = 8,
+        MATCH_REALNAME = 16
+    };
+
+    std::string _requester;    // nickname the replies are addressed to
+    unsigned long _requesterSerial;
+    bool _requesterIsOper;     // sees every IP in WHOX %i, others only their own
+    std::string _target;       // echoed in RPL_ENDOFWHO
+    std::string _channel;      // set for channel queries
+    Mask _mask;
+    int _matchFields;
+    bool _serverMatches;       // the mask against the network name, the server of every local user
+    bool _whox;
+    std::string _whoxFields;
+    std::string _token;
+
+    bool _narrowed;            // only _candidates can match
+    std::set<unsigned long> _candidates;    // serials
+
+    void parseOptions(const std::string& options);
+    void collectCandidates(Server& server);
+    bool matchesUser(const QuerySnapshot::User& target) const;
+    std::string formatReply(const QuerySnapshot::User& target, const std::string& channelName, char prefix, time_t now) const;
+
+public:
+    WhoQuery(Server& server, const Client* requester, const std::string& target, const std::string& options);
+    virtual ~WhoQuery();
+
+    virtual void render(const QuerySnapshot& snapshot, std::string& out) const;
+};
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef WORKERPOOL_HPP
+#define WORKERPOOL_HPP
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+// Small thread pool for CPU-heavy work (password hashing) that must not stall
+// the event loop. A task's run() executes on a worker; its complete() runs
+// later on the loop thread, from runCompletions(). Each finished task writes
+// a byte to the wake pipe so that the loop's poll() returns at once.
+class WorkerPool {
+public:
+    class Task {
+    public:
+        virtual ~Task() {}
+        virtual void run() = 0;         // worker thread: touch nothing shared
+        virtual void complete() = 0;    // loop thread
+    };
+
+private:
+    std::vector<pthread_t> _threads;
+    bool _stopping;
+    std::deque<Task*> _queued;
+    std::deque<Task*> _finished;
+    size_t _pending;                // submitted and not yet completed
+    pthread_mutex_t _mutex;
+    pthread_cond_t _wake;
+    int _wakePipe[2];
+
+    static void* workerMain(void* pool);
+    void runWorker();
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+public:
+    WorkerPool();
+    ~WorkerPool();
+
+    bool start(size_t threads);
+    void stop();                    // tasks not yet completed are dropped
+    bool isStarted() const;
+
+    // Takes ownership. Without workers the task runs and completes inline.
+    void submit(Task* task);
+    size_t getPending() const;
+
+    // Loop side: the fd to poll for POLLIN, and the call that drains it
+    int getWakeFd() const;
+    void runCompletions();
+};
+
+#endif
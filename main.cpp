@@ -1,389 +1,753 @@
-#include <iostream>
-#include <cstdlib>
-#include <cstdio>
-#include <csignal>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <poll.h>
-#include <vector>
-#include <cstring>
-#include <cerrno>
-#include <ctime>
-#include "Server.hpp"
-#include "Command.hpp"
-#include "utils.hpp"
-
-// Global variables for signal handling
-volatile sig_atomic_t g_shutdown = 0;
-Server* g_server = NULL;
-Command* g_commandProcessor = NULL;
-
-void signalHandler(int signal) {
-    if (signal == SIGINT) {
-        std::cout << "\nReceived SIGINT, shutting down gracefully..." << std::endl;
-        g_shutdown = 1;
-    }
-}
-
-void setupSignalHandling() {
-    struct sigaction sa;
-    sa.sa_handler = signalHandler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-
-    if (sigaction(SIGINT, &sa, NULL) == -1) {
-        perror("sigaction");
-        exit(1);
-    }
-}
-
-int createListeningSocket(int port) {
-    int serverFd = socket(AF_INET, SOCK_STREAM, 0);
-    if (serverFd == -1) {
-        perror("socket");
-        return -1;
-    }
-
-    // Set SO_REUSEADDR
-    int opt = 1;
-    if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
-        perror("setsockopt SO_REUSEADDR");
-        close(serverFd);
-        return -1;
-    }
-
-    // Set non-blocking
-    if (fcntl(serverFd, F_SETFL, O_NONBLOCK) == -1) {
-        perror("fcntl O_NONBLOCK");
-        close(serverFd);
-        return -1;
-    }
-
-    // Bind
-    struct sockaddr_in serverAddr;
-    std::memset(&serverAddr, 0, sizeof(serverAddr));
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(port);
-
-    if (bind(serverFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
-        perror("bind");
-        close(serverFd);
-        return -1;
-    }
-
-    // Listen
-    if (listen(serverFd, SOMAXCONN) == -1) {
-        perror("listen");
-        close(serverFd);
-        return -1;
-    }
-
-    std::cout << "Server is listening on port " << port << std::endl;
-    return serverFd;
-}
-
-void handleNewConnection(int serverFd, Server& server, std::vector<pollfd>& pollFds) {
-    struct sockaddr_in clientAddr;
-    socklen_t clientAddrLen = sizeof(clientAddr);
-
-    // Accept all available connections
-    while (true) {
-        int clientFd = accept(serverFd, (struct sockaddr*)&clientAddr, &clientAddrLen);
-
-        if (clientFd == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // No more connections to accept
-                break;
-            } else {
-                perror("accept");
-                break;
-            }
-        }
-
-        // Set client socket non-blocking
-        if (fcntl(clientFd, F_SETFL, O_NONBLOCK) == -1) {
-            perror("fcntl client O_NONBLOCK");
-            close(clientFd);
-            continue;
-        }
-
-        // Add client to server
-        server.addClient(clientFd);
-
-        // Set hostname for the client
-        Client* client = server.getClient(clientFd);
-        if (client) {
-            client->setHostname("localhost");
-        }
-
-        // Add to poll vector
-        pollfd clientPollFd;
-        clientPollFd.fd = clientFd;
-        clientPollFd.events = POLLIN;
-        clientPollFd.revents = 0;
-        pollFds.push_back(clientPollFd);
-
-        // Get client IP address
-        char clientIP[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
-
-        std::cout << "New client connected: " << clientFd << " (IP: " << clientIP << ")" << std::endl;
-    }
-}
-
-std::string getClientDisplayName(Client* client) {
-    if (client->getNickname().empty()) {
-        return "(unknown)";
-    }
-    return client->getNickname();
-}
-
-void logCommand(int clientFd, const std::string& command, Server& server) {
-    Client* client = server.getClient(clientFd);
-    if (client) {
-        std::cout << "Command from client " << clientFd << " ("
-                  << getClientDisplayName(client) << "): " << command << std::endl;
-    }
-}
-
-void handleClientRead(int clientFd, Server& server, Command& commandProcessor) {
-    Client* client = server.getClient(clientFd);
-    if (!client) {
-        return;
-    }
-
-    char buffer[4096];
-    ssize_t bytesRead = recv(clientFd, buffer, sizeof(buffer) - 1, 0);
-
-    if (bytesRead <= 0) {
-    if (bytesRead == 0) {
-        std::cout << "Client " << clientFd << " (" << getClientDisplayName(client)
-                  << ") disconnected" << std::endl;
-    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return;
-    } else {
-        std::cout << "Client " << clientFd << " (" << getClientDisplayName(client)
-                  << ") connection error: " << strerror(errno) << std::endl;
-    }
-
-    server.handleClientDisconnection(clientFd);
-    return;
-    }
-
-    buffer[bytesRead] = '\0';
-
-    // Simply append data without complex line ending conversion
-    std::string data(buffer, bytesRead);
-    client->appendToInputBuffer(data);
-
-    // Store registration state before processing
-    bool wasRegistered = client->isRegistered();
-
-    // Process commands using the improved command processor
-    commandProcessor.processClientBuffer(client);
-
-    // Check if client became registered
-    if (!wasRegistered && client->isRegistered()) {
-        std::cout << "Client " << clientFd << " (" << client->getNickname() << ") registered successfully" << std::endl;
-    }
-}
-
-void handleClientWrite(int clientFd, Server& server) {
-    Client* client = server.getClient(clientFd);
-    if (!client) {
-        return;
-    }
-
-    // Flush queued messages to output buffer
-    server.flushClientMessages(clientFd);
-
-    std::string& outputBuffer = client->getOutputBuffer();
-    if (outputBuffer.empty()) {
-        return;
-    }
-
-    ssize_t bytesSent = send(clientFd, outputBuffer.c_str(), outputBuffer.length(), 0);
-
-    if (bytesSent == -1) {
-        if (errno != EAGAIN && errno != EWOULDBLOCK) {
-            perror("send");
-        }
-        return;
-    }
-
-    // Remove sent bytes from buffer
-    outputBuffer.erase(0, bytesSent);
-}
-
-void removeClientFromPoll(int clientFd, std::vector<pollfd>& pollFds) {
-    for (std::vector<pollfd>::iterator it = pollFds.begin(); it != pollFds.end(); ++it) {
-        if (it->fd == clientFd) {
-            pollFds.erase(it);
-            break;
-        }
-    }
-}
-
-void updatePollEvents(std::vector<pollfd>& pollFds, Server& server) {
-    for (size_t i = 1; i < pollFds.size(); ++i) { // Skip server socket at index 0
-        Client* client = server.getClient(pollFds[i].fd);
-        if (client) {
-            pollFds[i].events = POLLIN;
-            // Add POLLOUT if there's data to send
-            if (server.hasClientMessagesToSend(pollFds[i].fd)) {
-                pollFds[i].events |= POLLOUT;
-            }
-        }
-    }
-}
-
-// Prune poll fds that no longer correspond to active clients
-static void pruneStalePollFds(Server& server, std::vector<pollfd>& pollFds) {
-    for (size_t i = 1; i < pollFds.size(); ) {
-        int fd = pollFds[i].fd;
-        if (server.getClient(fd) == NULL) {
-            pollFds.erase(pollFds.begin() + i);
-            continue;
-        }
-        ++i;
-    }
-}
-
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " <port> <password>" << std::endl;
-        return 1;
-    }
-
-    int port = std::atoi(argv[1]);
-    if (port <= 0 || port > 65535) {
-        std::cerr << "Error: Invalid port number" << std::endl;
-        return 1;
-    }
-
-    std::string password = argv[2];
-    if (password.empty()) {
-        std::cerr << "Error: Password cannot be empty" << std::endl;
-        return 1;
-    }
-
-    // Setup signal handling
-    setupSignalHandling();
-
-    // Create listening socket
-    int serverFd = createListeningSocket(port);
-    if (serverFd == -1) {
-        return 1;
-    }
-
-    // Create server instance
-    Server server;
-    server.setPassword(password);
-    g_server = &server;
-
-    // Create command processor
-    Command commandProcessor(&server);
-    g_commandProcessor = &commandProcessor;
-
-    // Setup poll vector
-    std::vector<pollfd> pollFds;
-    pollfd serverPollFd;
-    serverPollFd.fd = serverFd;
-    serverPollFd.events = POLLIN;
-    serverPollFd.revents = 0;
-    pollFds.push_back(serverPollFd);
-
-    // Variables for timeout handling
-    time_t lastTimeoutCheck = time(NULL);
-    const int TIMEOUT_CHECK_INTERVAL = 60;
-    const int CLIENT_TIMEOUT = 300;
-
-    // Main poll loop
-    while (!g_shutdown) {
-        // Update poll events for clients with data to send
-        updatePollEvents(pollFds, server);
-
-        // Check for idle clients periodically
-        time_t currentTime = time(NULL);
-        if (currentTime - lastTimeoutCheck >= TIMEOUT_CHECK_INTERVAL) {
-            server.disconnectIdleClients(CLIENT_TIMEOUT);
-            pruneStalePollFds(server, pollFds);
-            lastTimeoutCheck = currentTime;
-        }
-
-        // Poll with 1000ms timeout for better responsiveness
-        int pollResult = poll(&pollFds[0], pollFds.size(), 1000);
-
-        if (pollResult == -1) {
-            if (errno == EINTR) {
-                continue;
-            }
-            perror("poll");
-            break;
-        }
-
-        if (pollResult == 0) {
-            continue;
-        }
-
-        // Check server socket for new connections
-        if (pollFds[0].revents & POLLIN) {
-            handleNewConnection(serverFd, server, pollFds);
-        }
-
-        // Check client sockets
-        for (size_t i = 1; i < pollFds.size(); ) {
-            int clientFd = pollFds[i].fd;
-            short revents = pollFds[i].revents;
-
-            // Check for errors or hangup
-            if (revents & (POLLERR | POLLHUP)) {
-                Client* client = server.getClient(clientFd);
-                std::cout << "Client " << clientFd << " (" << getClientDisplayName(client)
-                        << ") error/hangup" << std::endl;
-
-                close(clientFd);
-                server.handleClientDisconnection(clientFd);
-                removeClientFromPoll(clientFd, pollFds);
-                continue;
-            }
-
-            // Handle read
-            if (revents & POLLIN) {
-                handleClientRead(clientFd, server, commandProcessor);
-
-                // Check if client disconnected during command processing
-                Client* client = server.getClient(clientFd);
-                if (!client) {
-                    close(clientFd);
-                    removeClientFromPoll(clientFd, pollFds);
-                    continue;
-                }
-            }
-
-            // Handle write
-            if (revents & POLLOUT) {
-                handleClientWrite(clientFd, server);
-            }
-
-            ++i;
-        }
-    }
-
-    // Cleanup
-    std::cout << "Shutting down server..." << std::endl;
-    close(serverFd);
-
-    // Close all client connections
-    for (size_t i = 1; i < pollFds.size(); ++i) {
-        int clientFd = pollFds[i].fd;
-        close(clientFd);
-    }
-
-    std::cout << "Server shutdown complete." << std::endl;
-    return 0;
+#include <iostream>
+#include <cstdlib>
+#include <cstdio>
+#include <csignal>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <sys/time.h>
+#include "Server.hpp"
+#include "Command.hpp"
+#include "StateCodec.hpp"
+#include "Upgrade.hpp"
+#include "PasswordHash.hpp"
+#include "Replay.hpp"
+#include "Simulation.hpp"
+#include "LineScanner.hpp"
+#include "Probes.hpp"
+#include "AllocProfile.hpp"
+#include "utils.hpp"
+
+// Layout of the poll set: the listening socket, the wake pipes of the worker
+// pools and of the resolver, then one entry per connection
+static const size_t LISTEN_SLOT = 0;
+static const size_t WAKE_SLOT = 1;
+static const size_t RESOLVER_WAKE_SLOT = 2;
+static const size_t QUERY_WAKE_SLOT = 3;
+static const size_t FIRST_CLIENT_SLOT = 4;
+
+// Global variables for signal handling
+volatile sig_atomic_t g_shutdown = 0;
+volatile sig_atomic_t g_upgrade = 0;
+Server* g_server = NULL;
+Command* g_commandProcessor = NULL;
+
+void signalHandler(int signal) {
+    if (signal == SIGINT) {
+        std::cout << "\nReceived SIGINT, shutting down gracefully..." << std::endl;
+        g_shutdown = 1;
+    } else if (signal == SIGUSR2) {
+        g_upgrade = 1;
+    }
+}
+
+void setupSignalHandling() {
+    struct sigaction sa;
+    sa.sa_handler = signalHandler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+
+    if (sigaction(SIGINT, &sa, NULL) == -1 || sigaction(SIGUSR2, &sa, NULL) == -1) {
+        perror("sigaction");
+        exit(1);
+    }
+
+    // Writes to a peer that already hung up must fail with EPIPE, not kill the server
+    signal(SIGPIPE, SIG_IGN);
+}
+
+int createListeningSocket(int port, const SocketTuning& tuning) {
+    int serverFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverFd == -1) {
+        perror("socket");
+        return -1;
+    }
+
+    // Set SO_REUSEADDR
+    int opt = 1;
+    if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt SO_REUSEADDR");
+        close(serverFd);
+        return -1;
+    }
+
+    // Set non-blocking
+    if (fcntl(serverFd, F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl O_NONBLOCK");
+        close(serverFd);
+        return -1;
+    }
+
+    // Buffer sizes before listen(), so accepted sockets start with them
+    tuning.applyToListener(serverFd);
+
+    // Bind
+    struct sockaddr_in serverAddr;
+    std::memset(&serverAddr, 0, sizeof(serverAddr));
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_addr.s_addr = INADDR_ANY;
+    serverAddr.sin_port = htons(port);
+
+    if (bind(serverFd, (struct sockaddr*)&serverAddr, sizeof(serverAddr)) == -1) {
+        perror("bind");
+        close(serverFd);
+        return -1;
+    }
+
+    // Listen
+    if (listen(serverFd, SOMAXCONN) == -1) {
+        perror("listen");
+        close(serverFd);
+        return -1;
+    }
+
+    std::cout << "Server is listening on port " << port << std::endl;
+    return serverFd;
+}
+
+void handleNewConnection(int serverFd, Server& server, std::vector<pollfd>& pollFds) {
+    struct sockaddr_in clientAddr;
+    socklen_t clientAddrLen = sizeof(clientAddr);
+
+    // Accept all available connections
+    while (true) {
+        int clientFd = accept(serverFd, (struct sockaddr*)&clientAddr, &clientAddrLen);
+
+        if (clientFd == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // No more connections to accept
+                break;
+            } else {
+                perror("accept");
+                break;
+            }
+        }
+
+        // Set client socket non-blocking
+        if (fcntl(clientFd, F_SETFL, O_NONBLOCK) == -1) {
+            perror("fcntl client O_NONBLOCK");
+            close(clientFd);
+            continue;
+        }
+        server.getSocketTuning().applyToClient(clientFd);
+
+        // Add client to server
+        server.addClient(clientFd);
+
+        // Get client IP address
+        char clientIP[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, INET_ADDRSTRLEN);
+
+        // The IP stands in as hostname until the lookup settles
+        Client* client = server.getClient(clientFd);
+        if (client) {
+            client->setIp(clientIP);
+            server.setClientHostname(client, clientIP);
+            server.getCapture().sessionOpened(client);
+            server.getResolver().lookup(client);
+        }
+        IRCSERV_PROBE2(client__accept, clientFd, static_cast<const char*>(clientIP));
+
+        // Add to poll vector
+        pollfd clientPollFd;
+        clientPollFd.fd = clientFd;
+        clientPollFd.events = POLLIN;
+        clientPollFd.revents = 0;
+        pollFds.push_back(clientPollFd);
+
+        std::cout << "New client connected: " << clientFd << " (IP: " << clientIP << ")" << std::endl;
+    }
+}
+
+std::string getClientDisplayName(Client* client) {
+    if (client->getNickname().empty()) {
+        return "(unknown)";
+    }
+    return client->getNickname();
+}
+
+void logCommand(int clientFd, const std::string& command, Server& server) {
+    Client* client = server.getClient(clientFd);
+    if (client) {
+        std::cout << "Command from client " << clientFd << " ("
+                  << getClientDisplayName(client) << "): " << command << std::endl;
+    }
+}
+
+void updatePollEvents(std::vector<pollfd>& pollFds, Server& server) {
+    for (size_t i = FIRST_CLIENT_SLOT; i < pollFds.size(); ++i) {
+        Client* client = server.getClient(pollFds[i].fd);
+        if (client) {
+            pollFds[i].events = POLLIN;
+            // Add POLLOUT only when the socket was full, or a streamed reply is waiting to resume.
+            // A reply still rendering on a worker wakes the loop through the query wake pipe.
+            if (client->needsPollOut() || client->hasReadyReplyStream()) {
+                pollFds[i].events |= POLLOUT;
+            }
+        }
+    }
+}
+
+// Prune poll fds that no longer correspond to active clients
+static void pruneStalePollFds(Server& server, std::vector<pollfd>& pollFds) {
+    for (size_t i = FIRST_CLIENT_SLOT; i < pollFds.size(); ) {
+        int fd = pollFds[i].fd;
+        if (server.getClient(fd) == NULL) {
+            pollFds.erase(pollFds.begin() + i);
+            continue;
+        }
+        ++i;
+    }
+}
+
+// Open the outgoing server links that are due: the first attempt, or a
+// reconnect after a netsplit
+static void connectLinks(Server& server, std::vector<pollfd>& pollFds) {
+    std::vector<Network::LinkTarget*> due;
+    server.getNetwork().collectDueLinks(due);
+
+    for (std::vector<Network::LinkTarget*>::iterator it = due.begin(); it != due.end(); ++it) {
+        Network::LinkTarget* target = *it;
+
+        struct sockaddr_in addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(target->port);
+        std::string host = (target->host == "localhost") ? "127.0.0.1" : target->host;
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            std::cerr << "Invalid link address: " << target->host << std::endl;
+            server.getNetwork().linkAttemptFailed(target);
+            continue;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || fcntl(fd, F_SETFL, O_NONBLOCK) == -1) {
+            perror("link socket");
+            if (fd != -1) {
+                close(fd);
+            }
+            server.getNetwork().linkAttemptFailed(target);
+            continue;
+        }
+
+        // Completes in the background; the handshake is sent once the socket is writable
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+            close(fd);
+            server.getNetwork().linkAttemptFailed(target);
+            continue;
+        }
+
+        server.addClient(fd);
+        Client* connection = server.getClient(fd);
+        server.setClientHostname(connection, target->host);
+        if (!server.getNetwork().beginOutgoingLink(target, connection)) {
+            server.removeClient(fd);
+            close(fd);
+            continue;
+        }
+
+        pollfd linkPollFd;
+        linkPollFd.fd = fd;
+        linkPollFd.events = POLLIN | POLLOUT;
+        linkPollFd.revents = 0;
+        pollFds.push_back(linkPollFd);
+
+        std::cout << "Connecting to server " << target->host << ":" << target->port << " (fd=" << fd << ")" << std::endl;
+    }
+}
+
+// Process the batch of disconnections scheduled since the last tick: the
+// server fans out QUITs, cleans up channels once and closes the connections,
+// then the poll set is compacted in a single pass.
+static void reapDisconnectedClients(Server& server, std::vector<pollfd>& pollFds) {
+    if (server.reapDisconnections()) {
+        pruneStalePollFds(server, pollFds);
+    }
+}
+
+// SIGUSR2: hand the listening socket, every client socket and the server state
+// to a freshly exec'd copy of the binary. Links are dropped first (their QUITs
+// go out as in a netsplit) and re-established by the new process.
+static bool upgradeBinary(char* argv[], Server& server, std::vector<pollfd>& pollFds) {
+    struct timeval startedAt;
+    gettimeofday(&startedAt, NULL);
+    std::cout << "Received SIGUSR2, handing over to a new binary..." << std::endl;
+
+    server.getNetwork().closeLinks("Server upgrading");
+    reapDisconnectedClients(server, pollFds);   // the links
+    reapDisconnectedClients(server, pollFds);   // the users behind them
+    server.flushPendingWrites();
+    server.syncChannelStore();                  // the new process reads the store at startup
+    server.getCapture().sync();                 // and appends to the capture after us
+
+    StateWriter state;
+    std::vector<int> fds(1, pollFds[LISTEN_SLOT].fd);   // the listening socket goes first
+    server.saveState(state, fds);
+
+    std::vector<int> openFds;
+    for (size_t i = 0; i < pollFds.size(); ++i) {
+        openFds.push_back(pollFds[i].fd);
+    }
+    return Upgrade::handOver(argv, startedAt, state.data(), fds, openFds);
+}
+
+// Standby: mirror the primary until its stream ends. Returns true once this
+// process must take over. A standby whose stream broke while the primary still
+// answers (or that never got a snapshot) starts over as a fresh standby.
+static bool followPrimary(Server& server, const std::string& path, char* argv[], struct timeval& lostAt) {
+    Replication& replication = server.getReplication();
+    std::cout << "Standby: waiting for the primary on " << path << std::endl;
+    while (!replication.connectToPrimary(path)) {
+        if (g_shutdown) {
+            return false;
+        }
+        sleep(1);
+    }
+    std::cout << "Standby: connected to the primary" << std::endl;
+
+    time_t lastStatus = time(NULL);
+    while (replication.follow(1000)) {
+        if (g_shutdown) {
+            return false;
+        }
+        if (time(NULL) - lastStatus >= 60) {
+            replication.logStatus();
+            lastStatus = time(NULL);
+        }
+    }
+    gettimeofday(&lostAt, NULL);
+
+    if (replication.refusedSnapshot()) {
+        std::cerr << "Standby: the primary's state is not loadable by this build, not following" << std::endl;
+        exit(1);
+    }
+    if (!replication.isSynced() || Replication::primaryAlive(path)) {
+        std::cout << "Standby: lost the primary's stream, resyncing" << std::endl;
+        execv(Upgrade::executable(), argv);
+        perror("execv");
+        exit(1);
+    }
+    std::cout << "Standby: primary is gone, taking over" << std::endl;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    Upgrade::rememberExecutable(argv[0]);
+
+    // Options may appear anywhere; argv itself is kept intact for re-exec
+    bool standby = false;
+    bool rejectLongLines = false;
+    std::string capturePath;
+    std::string captureMask;
+    std::string statsPath;
+    SocketTuning socketTuning;
+    std::vector<char*> args;
+    for (int i = 0; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--standby") {
+            standby = true;
+        } else if (arg.compare(0, 10, "--capture=") == 0) {
+            capturePath = arg.substr(10);
+        } else if (arg.compare(0, 13, "--capture-ip=") == 0) {
+            captureMask = arg.substr(13);
+        } else if (arg == "--long-lines=truncate" || arg == "--long-lines=reject") {
+            rejectLongLines = (arg == "--long-lines=reject");
+        } else if (arg.compare(0, 13, "--stats-file=") == 0) {
+            statsPath = arg.substr(13);
+        } else if (arg.compare(0, 17, "--socket-profile=") == 0) {
+            std::string error;
+            if (!socketTuning.configure(arg.substr(17), error)) {
+                std::cerr << "Error: " << error << std::endl;
+                return 1;
+            }
+        } else {
+            args.push_back(argv[i]);
+        }
+    }
+
+    // Helper for the account file: read a password, print its hash
+    if (args.size() == 2 && std::string(args[1]) == "--hash-password") {
+        std::string password;
+        std::getline(std::cin, password);
+        if (password.length() > PasswordHash::MAX_PASSWORD_LENGTH) {
+            std::cerr << "Error: passwords are at most " << PasswordHash::MAX_PASSWORD_LENGTH << " bytes" << std::endl;
+            return 1;
+        }
+        std::string encoded = PasswordHash::hash(password);
+        if (encoded.empty())
+            return 1;
+        std::cout << encoded << std::endl;
+        return 0;
+    }
+
+    // Re-drive a capture against a running server
+    if (args.size() >= 5 && args.size() <= 7 && std::string(args[1]) == "--replay") {
+        Replay replay(args[2], args[3], args[4], args.size() > 5 ? args[5] : "", args.size() > 6 ? args[6] : "");
+        return replay.run();
+    }
+
+    // Line scanner throughput, per kernel the CPU supports
+    if (args.size() == 2 && std::string(args[1]) == "--bench-lines") {
+        return LineScanner::benchmark();
+    }
+
+    // Socket profiles compared over loopback
+    if (args.size() == 2 && std::string(args[1]) == "--bench-sockets") {
+        return SocketTuning::benchmark();
+    }
+
+    // Channel fan-out over chains of linked servers, in memory
+    if (args.size() == 2 && std::string(args[1]) == "--bench-links") {
+        return Network::benchmark();
+    }
+
+    // Channel settings store at its 100k-channel target
+    if (args.size() == 2 && std::string(args[1]) == "--bench-store") {
+        return ChannelStore::benchmark();
+    }
+
+    // Virtual clients over an in-memory transport, for profiling the command layer
+    if (args.size() >= 3 && args.size() <= 5 && std::string(args[1]) == "--simulate") {
+        Simulation simulation(std::strtoul(args[2], NULL, 10), args.size() > 3 ? std::strtoul(args[3], NULL, 10) : 10,
+                              args.size() > 4 ? std::strtoull(args[4], NULL, 10) : 1);
+        return simulation.run();
+    }
+
+    if (args.size() < 3) {
+        std::cerr << "Usage: " << argv[0] << " [--standby] [--capture=<file> [--capture-ip=<mask>]] [--long-lines=truncate|reject] [--stats-file=<file>]" << std::endl;
+        std::cerr << "       " << std::string(std::strlen(argv[0]), ' ') << " [--socket-profile=default|latency|bulk[,<option>=<value>...]] <port> <password> [<server name> [<name@host:port>...]]" << std::endl;
+        std::cerr << "       " << argv[0] << " --hash-password < password" << std::endl;
+        std::cerr << "       " << argv[0] << " --replay <capture file> <host:port> <password> [<speed>|max [<baseline file>]]" << std::endl;
+        std::cerr << "       " << argv[0] << " --simulate <clients> [<rounds> [<seed>]]" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-lines" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-sockets" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-links" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-store" << std::endl;
+        return 1;
+    }
+
+    int port = std::atoi(args[1]);
+    if (port <= 0 || port > 65535) {
+        std::cerr << "Error: Invalid port number" << std::endl;
+        return 1;
+    }
+
+    std::string password = args[2];
+    if (password.empty()) {
+        std::cerr << "Error: Password cannot be empty" << std::endl;
+        return 1;
+    }
+
+    // Setup signal handling
+    setupSignalHandling();
+
+    // Started by an upgrade: take over the previous process's sockets instead of binding
+    int upgradeChannel = Upgrade::takeoverChannel();
+    std::string inheritedState;
+    std::vector<int> inheritedFds;
+    struct timeval upgradeStartedAt;
+    int serverFd = -1;
+    if (upgradeChannel >= 0) {
+        if (!Upgrade::receive(upgradeChannel, inheritedState, inheritedFds, upgradeStartedAt) || inheritedFds.empty()) {
+            std::cerr << "Error: Upgrade handoff failed" << std::endl;
+            return 1;
+        }
+        serverFd = inheritedFds[0];
+    } else if (!standby) {
+        serverFd = createListeningSocket(port, socketTuning);
+        if (serverFd == -1) {
+            return 1;
+        }
+    }
+
+    // Create server instance
+    Server server;
+    server.setPassword(password);
+    server.setRejectLongLines(rejectLongLines);
+    server.getMetrics().setDumpPath(statsPath);
+    server.setSocketTuning(socketTuning);
+    std::cout << "Sockets: " << socketTuning.describe() << std::endl;
+    g_server = &server;
+
+    // Started as a standby: mirror the primary, then take over its listening socket.
+    // An upgrade started from a standby that took over is a primary like any other.
+    std::string replicationPath = std::string("ircserv-") + args[1] + ".repl";
+    bool tookOver = false;
+    struct timeval primaryLostAt;
+    if (standby && upgradeChannel < 0) {
+        if (!followPrimary(server, replicationPath, argv, primaryLostAt)) {
+            return 0;
+        }
+        tookOver = true;
+        serverFd = server.getReplication().getServerFd();
+    }
+
+    // Channel settings from before the last restart, per port so nodes sharing a directory don't clash
+    if (!server.openChannelStore(std::string("ircserv-") + args[1])) {
+        std::cerr << "Warning: channel store unavailable, channel settings will not persist" << std::endl;
+    }
+
+    // SASL accounts, checked on worker threads
+    server.openAccounts(std::string("ircserv-") + args[1] + ".accounts");
+
+    // Message of the day, rendered into the registration burst
+    server.getWelcome().open(std::string("ircserv-") + args[1] + ".motd");
+    if (!server.getWorkers().start(Server::PASSWORD_WORKERS)) {
+        std::cerr << "Warning: no worker threads, password checks will run on the event loop" << std::endl;
+    }
+    if (!capturePath.empty() && !server.getCapture().open(capturePath, captureMask)) {
+        std::cerr << "Warning: traffic capture unavailable" << std::endl;
+    }
+    if (!server.getQueryWorkers().start(Server::QUERY_WORKERS)) {
+        std::cerr << "Warning: no query threads, WHO, NAMES and LIST will run on the event loop" << std::endl;
+    }
+    if (!server.getResolver().start()) {
+        std::cerr << "Warning: no resolver threads, hostname lookups will run on the event loop" << std::endl;
+    }
+
+    // Optional network membership: our name, then the servers to link to. Links
+    // in either direction need a connect block for the server.
+    if (args.size() > 3) {
+        server.getNetwork().setName(args[3]);
+        server.getNetwork().openConnectBlocks(std::string("ircserv-") + args[1] + ".links");
+    }
+    for (size_t i = 4; i < args.size(); ++i) {
+        std::string target = args[i];
+        size_t at = target.find('@');
+        size_t colon = target.rfind(':');
+        int linkPort = (at != std::string::npos && at > 0 && colon != std::string::npos && colon > at)
+            ? std::atoi(target.c_str() + colon + 1) : 0;
+        if (linkPort <= 0 || linkPort > 65535) {
+            std::cerr << "Error: Invalid link " << target << " (expected name@host:port)" << std::endl;
+            return 1;
+        }
+        server.getNetwork().addLinkTarget(target.substr(0, at), target.substr(at + 1, colon - at - 1), linkPort);
+    }
+
+    // Create command processor
+    Command commandProcessor(&server);
+    g_commandProcessor = &commandProcessor;
+
+    // Setup poll vector
+    std::vector<pollfd> pollFds;
+    pollfd serverPollFd;
+    serverPollFd.fd = serverFd;
+    serverPollFd.events = POLLIN;
+    serverPollFd.revents = 0;
+    pollFds.push_back(serverPollFd);
+
+    pollfd wakePollFd;
+    wakePollFd.fd = server.getWorkers().getWakeFd();
+    wakePollFd.events = POLLIN;
+    wakePollFd.revents = 0;
+    pollFds.push_back(wakePollFd);
+    wakePollFd.fd = server.getResolver().getWakeFd();
+    pollFds.push_back(wakePollFd);
+    wakePollFd.fd = server.getQueryWorkers().getWakeFd();
+    pollFds.push_back(wakePollFd);
+
+    if (upgradeChannel >= 0) {
+        // State from a build with another layout: keep the listener, drop the
+        // clients (they reconnect) and start as after a normal restart
+        StateReader header(inheritedState);
+        if (!Server::readStateHeader(header)) {
+            std::cerr << "Warning: upgrade state not loadable by this build, restarting without it" << std::endl;
+            for (size_t i = 1; i < inheritedFds.size(); ++i) {
+                close(inheritedFds[i]);
+            }
+        } else {
+            StateReader reader(inheritedState);
+            std::map<unsigned long, Client*> restored;
+            if (!server.loadState(reader, inheritedFds, restored)) {
+                std::cerr << "Error: Upgrade state is corrupt" << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    // Clients handed over by an upgrade or mirrored from the old primary
+    const std::map<int, Client*>& clients = server.getClients();
+    for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        pollfd clientPollFd;
+        clientPollFd.fd = it->first;
+        clientPollFd.events = POLLIN;
+        clientPollFd.revents = 0;
+        pollFds.push_back(clientPollFd);
+        if (tookOver) {
+            it->second->updateLastActive();     // the primary's last reads were not mirrored
+        }
+        server.getCapture().sessionResumed(it->second);
+    }
+
+    // Listening before an upgrade is acknowledged lets the old process's
+    // standby tell the handover from a crash
+    if (!server.getReplication().listen(replicationPath, serverFd)) {
+        std::cerr << "Warning: replication socket unavailable, no standby can attach" << std::endl;
+    }
+
+    if (tookOver) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long elapsedUs = (now.tv_sec - primaryLostAt.tv_sec) * 1000000L + (now.tv_usec - primaryLostAt.tv_usec);
+        std::cout << "Takeover complete: serving " << clients.size() << " clients, "
+                  << elapsedUs / 1000 << "." << (elapsedUs % 1000) / 100 << " ms after losing the primary" << std::endl;
+    }
+
+    if (upgradeChannel >= 0) {
+        Upgrade::acknowledge(upgradeChannel);
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        long elapsedUs = (now.tv_sec - upgradeStartedAt.tv_sec) * 1000000L + (now.tv_usec - upgradeStartedAt.tv_usec);
+        std::cout << "Upgrade complete: serving " << clients.size() << " clients, restart-to-serving "
+                  << elapsedUs / 1000 << "." << (elapsedUs % 1000) / 100 << " ms" << std::endl;
+    }
+
+    // Variables for timeout handling
+    time_t lastTimeoutCheck = time(NULL);
+    const int TIMEOUT_CHECK_INTERVAL = 60;
+    const int CLIENT_TIMEOUT = 300;
+
+    // Work done between two poll() calls, for the tick histogram
+    unsigned long long tickStartedAt = 0;
+
+    // Main poll loop
+    while (!g_shutdown) {
+        if (g_upgrade) {
+            g_upgrade = 0;
+            if (upgradeBinary(argv, server, pollFds)) {
+                std::cout << "Upgrade handed over, exiting" << std::endl;
+                return 0;
+            }
+        }
+
+        // Check for idle clients periodically
+        time_t currentTime = time(NULL);
+        if (currentTime - lastTimeoutCheck >= TIMEOUT_CHECK_INTERVAL) {
+            server.disconnectIdleClients(CLIENT_TIMEOUT);
+            server.getNetwork().pingLinks();
+            server.getReplication().logStatus();
+            server.getWelcome().reloadIfChanged();
+            std::vector<std::string> replicationStatus;
+            server.getReplication().report(replicationStatus);
+            if (!server.getMetrics().dump(replicationStatus))
+                std::cerr << "Metrics: cannot write " << statsPath << std::endl;
+            lastTimeoutCheck = currentTime;
+        }
+
+        // Tear down everything that disconnected during the last tick in one batch
+        reapDisconnectedClients(server, pollFds);
+
+        // Link (or relink) to the configured servers
+        connectLinks(server, pollFds);
+
+        // Queries rendered on the query workers, ready to stream out below
+        server.getQueryWorkers().runCompletions();
+
+        // Resume streamed replies for clients whose sendQ has drained
+        server.pumpReplyStreams();
+
+        // Results of password checks finished on the worker threads
+        server.getWorkers().runCompletions();
+
+        // Hostnames found by the resolver threads; registrations past their lookup deadline
+        server.getResolver().poll();
+
+        // Queue this tick's changes for the store's writer thread and the standby
+        server.publishChanges();
+
+        // Send what this tick produced before going back to poll
+        server.flushPendingWrites();
+
+        // Update poll events for clients with data to send
+        updatePollEvents(pollFds, server);
+
+        if (tickStartedAt)
+            server.getMetrics().recordTick(Metrics::now() - tickStartedAt);
+
+        // Poll with 1000ms timeout for better responsiveness
+        int pollResult = poll(&pollFds[0], pollFds.size(), 1000);
+        tickStartedAt = Metrics::now();
+
+        if (pollResult == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        if (pollResult == 0) {
+            continue;
+        }
+
+        // Check server socket for new connections
+        if (pollFds[LISTEN_SLOT].revents & POLLIN) {
+            handleNewConnection(serverFd, server, pollFds);
+        }
+
+        // Check client sockets
+        for (size_t i = FIRST_CLIENT_SLOT; i < pollFds.size(); ) {
+            int clientFd = pollFds[i].fd;
+            short revents = pollFds[i].revents;
+
+            ++i;
+
+            Client* client = server.getClient(clientFd);
+            if (!client || client->isDisconnecting()) {
+                continue;
+            }
+
+            // Check for errors or hangup
+            if (revents & (POLLERR | POLLHUP)) {
+                std::cout << "Client " << clientFd << " (" << getClientDisplayName(client)
+                        << ") error/hangup" << std::endl;
+
+                server.handleConnectionLost(clientFd, "Connection reset by peer");
+                continue;
+            }
+
+            // Handle read
+            if (revents & POLLIN) {
+                server.readFromClient(clientFd, commandProcessor);
+
+                // Client quit, dropped or detached during command processing
+                if (server.getClient(clientFd) != client || client->isDisconnecting()) {
+                    continue;
+                }
+            }
+
+            // Handle write
+            if (revents & POLLOUT) {
+                server.writeToClient(clientFd);
+            }
+        }
+    }
+
+    // Cleanup
+    std::cout << "Shutting down server..." << std::endl;
+    close(serverFd);
+
+    // Close all client connections
+    for (size_t i = FIRST_CLIENT_SLOT; i < pollFds.size(); ++i) {
+        int clientFd = pollFds[i].fd;
+        server.getTransport().close(clientFd);
+    }
+
+    if (AllocProfile::enabled()) {
+        std::vector<std::string> lines;
+        AllocProfile::report(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+            std::cout << "Allocations: " << *it << std::endl;
+    }
+
+    std::cout << "Server shutdown complete." << std::endl;
+    return 0;
 }
\ No newline at end of file
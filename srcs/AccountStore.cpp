@@ -0,0 +1,67 @@
+#include "AccountStore.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+
+AccountStore::AccountStore() : _loadedMtime(0) {}
+
+void AccountStore::open(const std::string& path) {
+    _path = path;
+    _loadedMtime = 0;
+    reloadIfChanged();
+    std::cout << "Accounts: " << _accounts.size() << " from " << _path << std::endl;
+}
+
+size_t AccountStore::size() const {
+    return _accounts.size();
+}
+
+// A stat() per lookup: cheap next to the hash that follows every lookup
+void AccountStore::reloadIfChanged() {
+    struct stat info;
+    if (_path.empty() || stat(_path.c_str(), &info) == -1) {
+        _accounts.clear();
+        _loadedMtime = 0;
+        return;
+    }
+    if (info.st_mtime == _loadedMtime)
+        return;
+
+    std::ifstream file(_path.c_str());
+    if (!file)
+        return;
+
+    std::map<std::string, Account> accounts;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        Account account;
+        if (!(fields >> account.name) || account.name[0] == '#' || !(fields >> account.hash))
+            continue;
+        std::string flag;
+        account.oper = (fields >> flag) && flag == "oper";
+        accounts[IRCUtils::casefold(account.name)] = account;
+    }
+    _accounts.swap(accounts);
+    _loadedMtime = info.st_mtime;
+}
+
+bool AccountStore::find(const std::string& account, std::string& name, std::string& hash) {
+    reloadIfChanged();
+    std::map<std::string, Account>::const_iterator it = _accounts.find(IRCUtils::casefold(account));
+    if (it == _accounts.end())
+        return false;
+    name = it->second.name;
+    hash = it->second.hash;
+    return true;
+}
+
+bool AccountStore::isOperator(const std::string& account) {
+    if (account.empty())
+        return false;
+    reloadIfChanged();
+    std::map<std::string, Account>::const_iterator it = _accounts.find(IRCUtils::casefold(account));
+    return it != _accounts.end() && it->second.oper;
+}
@@ -0,0 +1,145 @@
+#include "AllocProfile.hpp"
+#include <map>
+#include <new>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+// The innermost open scope on this thread; only the loop thread opens any
+__thread AllocProfile::Scope* t_current = NULL;
+
+// Every thread's allocations, scoped or not
+unsigned long long g_allocations = 0;
+unsigned long long g_bytes = 0;
+unsigned long long g_frees = 0;
+
+std::map<std::string, AllocProfile::Counters>& registry() {
+    static std::map<std::string, AllocProfile::Counters> scopes;
+    return scopes;
+}
+
+typedef std::pair<std::string, AllocProfile::Counters> Entry;
+
+bool moreAllocations(const Entry& a, const Entry& b) {
+    return a.second.allocations > b.second.allocations;
+}
+
+}
+
+namespace AllocProfile {
+
+Counters::Counters() : entered(0), allocations(0), bytes(0) {}
+
+Scope::Scope(Counters& counters) : _counters(&counters), _outer(t_current) {
+    ++counters.entered;
+    t_current = this;
+}
+
+Scope::~Scope() {
+    t_current = _outer;
+}
+
+void Scope::charge(size_t bytes) {
+    __sync_fetch_and_add(&g_allocations, 1);
+    __sync_fetch_and_add(&g_bytes, bytes);
+    for (Scope* scope = t_current; scope; scope = scope->_outer) {
+        ++scope->_counters->allocations;
+        scope->_counters->bytes += bytes;
+    }
+}
+
+bool enabled() {
+#ifdef IRCSERV_ALLOC_PROFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+Counters& counters(const std::string& name) {
+    return registry()[name];
+}
+
+void report(std::vector<std::string>& lines) {
+    if (!enabled()) {
+        lines.push_back("allocation profiling is off (build with make re ALLOC_PROFILE=1)");
+        return;
+    }
+
+    // Copied first: building the report allocates too
+    std::vector<Entry> scopes(registry().begin(), registry().end());
+    unsigned long long allocations = g_allocations, bytes = g_bytes, frees = g_frees;
+    std::sort(scopes.begin(), scopes.end(), moreAllocations);
+
+    std::ostringstream total;
+    total << "total " << allocations << " allocations " << bytes << " bytes " << frees << " frees";
+    lines.push_back(total.str());
+    for (std::vector<Entry>::const_iterator it = scopes.begin(); it != scopes.end(); ++it) {
+        const Counters& c = it->second;
+        std::ostringstream line;
+        line << it->first << " " << c.entered << " calls " << c.allocations << " allocations " << c.bytes << " bytes";
+        if (c.entered)
+            line << " " << c.allocations / c.entered << "/call " << c.bytes / c.entered << " B/call";
+        lines.push_back(line.str());
+    }
+}
+
+}
+
+#ifdef IRCSERV_ALLOC_PROFILE
+
+// -------- GLOBAL OPERATOR NEW/DELETE --------
+
+static void* countedAllocation(std::size_t size) {
+    AllocProfile::Scope::charge(size);
+    return std::malloc(size ? size : 1);
+}
+
+static void countedFree(void* pointer) {
+    if (!pointer)
+        return;
+    __sync_fetch_and_add(&g_frees, 1);
+    std::free(pointer);
+}
+
+void* operator new(std::size_t size) throw(std::bad_alloc) {
+    void* pointer = countedAllocation(size);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new[](std::size_t size) throw(std::bad_alloc) {
+    void* pointer = countedAllocation(size);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) throw() {
+    return countedAllocation(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) throw() {
+    return countedAllocation(size);
+}
+
+void operator delete(void* pointer) throw() {
+    countedFree(pointer);
+}
+
+void operator delete[](void* pointer) throw() {
+    countedFree(pointer);
+}
+
+void operator delete(void* pointer, const std::nothrow_t&) throw() {
+    countedFree(pointer);
+}
+
+void operator delete[](void* pointer, const std::nothrow_t&) throw() {
+    countedFree(pointer);
+}
+
+#endif
@@ -0,0 +1,268 @@
+#include "Capture.hpp"
+#include "Client.hpp"
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+const char* const Capture::CAPTURE_MAGIC = "ircserv-capture-1\n";
+
+Capture::Capture()
+    : _filtered(false), _fd(-1), _lastRecordAt(0), _dropped(0),
+      _threadStarted(false), _stopping(false), _writerBusy(false), _queuedBytes(0) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_wake, NULL);
+    pthread_cond_init(&_idle, NULL);
+}
+
+Capture::~Capture() {
+    close();
+    pthread_cond_destroy(&_idle);
+    pthread_cond_destroy(&_wake);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool Capture::open(const std::string& path, const std::string& ipMask) {
+    if (isOpen())
+        return true;
+
+    _path = path;
+    _filtered = !ipMask.empty();
+    _ipMask.compile(ipMask);
+    _fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (_fd == -1) {
+        perror("capture");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && st.st_size == 0)
+        _buffer = CAPTURE_MAGIC;
+
+    // Signals must reach the event loop, never the writer
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int error = pthread_create(&_thread, NULL, &Capture::writerMain, this);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0) {
+        std::cerr << "Capture: cannot start writer thread" << std::endl;
+        close();
+        return false;
+    }
+    _threadStarted = true;
+
+    std::cout << "Capture: recording " << (_filtered ? "clients from " + ipMask : std::string("every client"))
+              << " to " << path << std::endl;
+    return true;
+}
+
+void Capture::close() {
+    if (_threadStarted) {
+        flush();
+        pthread_mutex_lock(&_mutex);
+        _stopping = true;
+        pthread_cond_signal(&_wake);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_thread, NULL);
+        _threadStarted = false;
+        _stopping = false;
+    }
+    if (_fd != -1) {
+        ::close(_fd);
+        _fd = -1;
+    }
+    _buffer.clear();
+    _lastRecordAt = 0;
+}
+
+bool Capture::isOpen() const {
+    return _threadStarted;
+}
+
+// -------- RECORDING --------
+
+void Capture::sessionOpened(Client* client) {
+    if (!isOpen() || (_filtered && !_ipMask.matches(client->getIp())))
+        return;
+    client->setCaptured(true);
+    append(RECORD_OPEN, client->getSerial(), client->getIp());
+}
+
+void Capture::sessionResumed(Client* client) {
+    if (isOpen() && (!_filtered || _ipMask.matches(client->getIp())))
+        client->setCaptured(true);
+}
+
+// Credentials are masked: PASS, RESUME tokens, and AUTHENTICATE once a
+// mechanism was chosen
+void Capture::lineReceived(Client* client, const std::string& line) {
+    if (!isOpen())
+        return;
+
+    size_t start = 0;
+    if (!line.empty() && line[0] == '@')
+        start = line.find(' ') == std::string::npos ? line.length() : line.find(' ') + 1;
+    size_t end = line.find(' ', start);
+    std::string command = line.substr(start, end == std::string::npos ? std::string::npos : end - start);
+    std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+
+    if (command == "PASS")
+        append(RECORD_LINE, client->getSerial(), "PASS *");
+    else if (command == "RESUME")
+        append(RECORD_LINE, client->getSerial(), "RESUME *");
+    else if (command == "AUTHENTICATE" && client->getSaslState() == Client::SASL_STARTED)
+        append(RECORD_LINE, client->getSerial(), "AUTHENTICATE *");
+    else
+        append(RECORD_LINE, client->getSerial(), line);
+}
+
+void Capture::sessionClosed(Client* client) {
+    if (isOpen())
+        append(RECORD_CLOSE, client->getSerial(), "");
+}
+
+void Capture::append(char type, unsigned long serial, const std::string& data) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long long at = static_cast<unsigned long long>(now.tv_sec) * 1000000ULL + now.tv_nsec / 1000;
+
+    _buffer += type;
+    putVarint(_buffer, serial);
+    putVarint(_buffer, (_lastRecordAt && at > _lastRecordAt) ? at - _lastRecordAt : 0);
+    putVarint(_buffer, data.length());
+    _buffer += data;
+    _lastRecordAt = at;
+}
+
+void Capture::putVarint(std::string& out, unsigned long long value) {
+    while (value >= 0x80) {
+        out += static_cast<char>((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += static_cast<char>(value);
+}
+
+bool Capture::getVarint(const std::string& in, size_t& pos, unsigned long long& value) {
+    value = 0;
+    for (unsigned shift = 0; pos < in.length() && shift < 64; shift += 7) {
+        unsigned char byte = in[pos++];
+        value |= static_cast<unsigned long long>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// -------- WRITER THREAD --------
+
+// A writer that cannot keep up loses whole batches rather than slowing the loop
+void Capture::flush() {
+    if (!_threadStarted || _buffer.empty())
+        return;
+
+    pthread_mutex_lock(&_mutex);
+    bool dropped = _queuedBytes + _buffer.length() > MAX_BACKLOG;
+    if (!dropped) {
+        _queuedBytes += _buffer.length();
+        _batches.push_back(std::string());
+        _batches.back().swap(_buffer);
+        pthread_cond_signal(&_wake);
+    }
+    pthread_mutex_unlock(&_mutex);
+
+    if (dropped) {
+        if (_dropped++ % 1000 == 0)
+            std::cerr << "Capture: writer behind, " << _dropped << " batches dropped so far" << std::endl;
+        _buffer.clear();
+    }
+}
+
+void Capture::sync() {
+    flush();
+    pthread_mutex_lock(&_mutex);
+    while (!_batches.empty() || _writerBusy)
+        pthread_cond_wait(&_idle, &_mutex);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void* Capture::writerMain(void* capture) {
+    static_cast<Capture*>(capture)->runWriter();
+    return NULL;
+}
+
+void Capture::runWriter() {
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        while (_batches.empty() && !_stopping)
+            pthread_cond_wait(&_wake, &_mutex);
+        if (_batches.empty())
+            break;
+
+        std::deque<std::string> batches;
+        batches.swap(_batches);
+        _writerBusy = true;
+        pthread_mutex_unlock(&_mutex);
+
+        size_t bytes = 0;
+        for (std::deque<std::string>::iterator it = batches.begin(); it != batches.end(); ++it) {
+            bytes += it->length();
+            size_t written = 0;
+            while (written < it->length()) {
+                ssize_t n = write(_fd, it->data() + written, it->length() - written);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1) {
+                    perror("capture");
+                    break;
+                }
+                written += n;
+            }
+        }
+
+        pthread_mutex_lock(&_mutex);
+        _queuedBytes -= bytes;
+        _writerBusy = false;
+        pthread_cond_broadcast(&_idle);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+// -------- LOADING --------
+
+bool Capture::load(const std::string& path, std::vector<Record>& records) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    size_t magic = std::strlen(CAPTURE_MAGIC);
+    if (data.compare(0, magic, CAPTURE_MAGIC) != 0)
+        return false;
+
+    unsigned long long at = 0;
+    size_t pos = magic;
+    while (pos < data.length()) {
+        Record record;
+        record.type = data[pos++];
+        unsigned long long serial, delta, length;
+        if (!getVarint(data, pos, serial) || !getVarint(data, pos, delta) || !getVarint(data, pos, length)
+            || length > data.length() - pos)
+            return false;
+        at += delta;
+        record.serial = serial;
+        record.at = at;
+        record.data = data.substr(pos, length);
+        pos += length;
+        records.push_back(record);
+    }
+    return true;
+}
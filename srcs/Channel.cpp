@@ -1,133 +1,715 @@
-#include "Channel.hpp"
-#include "Client.hpp"
-
-Channel::Channel(const std::string& name)
-    : _name(name), _topic(""), _inviteOnly(false), _topicRestricted(true), _key(""), _userLimit(0) {}
-
-Channel::~Channel() {}
-
-// Basic info
-const std::string& Channel::getName() const {
-    return _name;
-}
-
-const std::string& Channel::getTopic() const {
-    return _topic;
-}
-
-void Channel::setTopic(const std::string& topic) {
-    _topic = topic;
-}
-
-// Membership
-void Channel::addClient(Client* client) {
-    _members.insert(client);
-}
-
-void Channel::removeClient(Client* client) {
-    _members.erase(client);
-    _operators.erase(client); // Remove operator role if leaving
-    _invitedClients.erase(client); // Remove from invite list when leaving
-}
-
-bool Channel::hasClient(Client* client) const {
-    return _members.find(client) != _members.end();
-}
-
-const std::set<Client*>& Channel::getMembers() const {
-    return _members;
-}
-
-
-// Operators
-void Channel::addOperator(Client* client) {
-    _operators.insert(client);
-}
-
-void Channel::removeOperator(Client* client) {
-    _operators.erase(client);
-}
-
-bool Channel::isOperator(Client* client) const {
-    return _operators.find(client) != _operators.end();
-}
-
-// Messaging
-void Channel::broadcast(const std::string& message, Client* sender) {
-    for (std::set<Client*>::iterator it = _members.begin(); it != _members.end(); ++it) {
-        if (*it != sender) {
-            // Message is expected to already be a complete IRC line (ends with CRLF)
-            (*it)->getOutputBuffer() += message;
-        }
-    }
-}
-
-// Mode methods
-bool Channel::isInviteOnly() const {
-    return _inviteOnly;
-}
-
-bool Channel::isTopicRestricted() const {
-    return _topicRestricted;
-}
-
-const std::string& Channel::getKey() const {
-    return _key;
-}
-
-size_t Channel::getUserLimit() const {
-    return _userLimit;
-}
-
-void Channel::setInviteOnly(bool inviteOnly) {
-    _inviteOnly = inviteOnly;
-}
-
-void Channel::setTopicRestricted(bool topicRestricted) {
-    _topicRestricted = topicRestricted;
-}
-
-void Channel::setKey(const std::string& key) {
-    _key = key;
-}
-
-void Channel::setUserLimit(size_t limit) {
-    _userLimit = limit;
-}
-
-std::string Channel::getModeString() const {
-    std::string modes = "+";
-
-    if (_inviteOnly) modes += "i";
-    if (_topicRestricted) modes += "t";
-    if (!_key.empty()) modes += "k";
-    if (_userLimit > 0) modes += "l";
-
-    if (modes == "+") modes = "";
-
-    return modes;
-}
-
-// Invite management
-void Channel::addInvite(Client* client) {
-    _invitedClients.insert(client);
-}
-
-void Channel::removeInvite(Client* client) {
-    _invitedClients.erase(client);
-}
-
-bool Channel::isInvited(Client* client) const {
-    return _invitedClients.find(client) != _invitedClients.end();
-}
-
-
-void Channel::promoteNewOperatorIfNeeded() {
-    if (_operators.empty() && !_members.empty()) {
-        Client* newOperator = *_members.begin(); // Get first member
-        addOperator(newOperator);
-        
-        std::string modeMsg = ":ircserv MODE " + _name + " +o " + newOperator->getNickname() + "\r\n";
-        broadcast(modeMsg, NULL);
-    }
-}
\ No newline at end of file
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "utils.hpp"
+#include "StateCodec.hpp"
+#include "Probes.hpp"
+#include "AllocProfile.hpp"
+
+Channel::Channel(const std::string& name)
+    : _name(name), _topic(""), _createdAt(time(NULL)), _indexShift(0), _operatorCount(0), _nextJoinSeq(0), _modes(DEFAULT_MODES), _key(""), _userLimit(0), _dirtyList(NULL), _stateEpoch(NULL), _dirtyFlags(0), _version(++_lastVersion) {
+    rebuildModeString();
+}
+
+unsigned long Channel::_lastVersion = 0;
+
+const Channel::ModeSpec Channel::MODE_TABLE[] = {
+    { 'i', MODE_TYPE_FLAG, MODE_INVITE_ONLY, 0 },
+    { 'm', MODE_TYPE_FLAG, MODE_MODERATED, 0 },
+    { 'n', MODE_TYPE_FLAG, MODE_NO_EXTERNAL, 0 },
+    { 'p', MODE_TYPE_FLAG, MODE_PRIVATE, 0 },
+    { 's', MODE_TYPE_FLAG, MODE_SECRET, 0 },
+    { 't', MODE_TYPE_FLAG, MODE_TOPIC_RESTRICTED, 0 },
+    { 'D', MODE_TYPE_FLAG, MODE_DELAYED_JOIN, 0 },
+    { 'k', MODE_TYPE_PARAM, MODE_KEY, 0 },
+    { 'l', MODE_TYPE_SETTING, MODE_LIMIT, 0 },
+    { 'b', MODE_TYPE_LIST, LIST_BAN, 0 },
+    { 'e', MODE_TYPE_LIST, LIST_EXCEPT, 0 },
+    { 'I', MODE_TYPE_LIST, LIST_INVEX, 0 },
+    { 'o', MODE_TYPE_PREFIX, MEMBER_OP, '@' },      // highest rank first
+    { 'v', MODE_TYPE_PREFIX, MEMBER_VOICE, '+' }
+};
+
+const size_t Channel::MODE_COUNT = sizeof(MODE_TABLE) / sizeof(MODE_TABLE[0]);
+
+// Invites of clients that never joined still point back at us
+Channel::~Channel() {
+    for (std::set<Client*>::iterator it = _invitedClients.begin(); it != _invitedClients.end(); ++it)
+        (*it)->removeInvitedTo(this);
+}
+
+// Basic info
+const std::string& Channel::getName() const {
+    return _name;
+}
+
+const std::string& Channel::getTopic() const {
+    return _topic;
+}
+
+void Channel::setTopic(const std::string& topic) {
+    _topic = topic;
+    markDirty(DIRTY_SETTINGS);
+}
+
+time_t Channel::getCreatedAt() const {
+    return _createdAt;
+}
+
+void Channel::setCreatedAt(time_t ts) {
+    _createdAt = ts;
+    markDirty(DIRTY_SETTINGS);
+}
+
+// Membership
+void Channel::addClient(Client* client) {
+    if (findMember(client) != -1)
+        return;
+
+    Member member;
+    member.client = client;
+    member.flags = 0;
+    member.joinedAt = time(NULL);
+    member.joinSeq = _nextJoinSeq++;
+    _members.push_back(member);
+    client->addChannel(this);
+    markDirty(DIRTY_MEMBERS);
+
+    // Keep the index at most half full
+    if (_members.size() * 2 > _memberIndex.size()) {
+        rebuildMemberIndex();
+        return;
+    }
+    size_t mask = _memberIndex.size() - 1;
+    size_t slot = hashClient(client, _indexShift);
+    while (_memberIndex[slot] != -1)
+        slot = (slot + 1) & mask;
+    _memberIndex[slot] = static_cast<int>(_members.size() - 1);
+}
+
+void Channel::removeClient(Client* client) {
+    if (_invitedClients.erase(client)) // Remove from invite list when leaving
+        client->removeInvitedTo(this);
+
+    int slot = findSlot(client);
+    if (slot == -1)
+        return;
+    size_t pos = _memberIndex[slot];
+    if (_members[pos].flags & MEMBER_OP)
+        _operatorCount--; // Remove operator role if leaving
+
+    // Erase (not swap) so the remaining members keep their join order; only
+    // the index entries of the members that moved down change
+    unindexSlot(slot);
+    _members.erase(_members.begin() + pos);
+    size_t mask = _memberIndex.size() - 1;
+    for (size_t i = pos; i < _members.size(); ++i) {
+        size_t probe = hashClient(_members[i].client, _indexShift);
+        while (_memberIndex[probe] != static_cast<int>(i + 1))
+            probe = (probe + 1) & mask;
+        _memberIndex[probe] = static_cast<int>(i);
+    }
+    client->removeChannel(this);
+    markDirty(DIRTY_MEMBERS);
+}
+
+// Drop every member flagged as disconnecting in one compaction pass
+size_t Channel::removeDisconnectingClients() {
+    size_t kept = 0;
+    for (size_t i = 0; i < _members.size(); ++i) {
+        Client* client = _members[i].client;
+        if (client->isDisconnecting()) {
+            if (_members[i].flags & MEMBER_OP)
+                _operatorCount--;
+            if (_invitedClients.erase(client))
+                client->removeInvitedTo(this);
+            client->removeChannel(this);
+            continue;
+        }
+        _members[kept++] = _members[i];
+    }
+
+    size_t removed = _members.size() - kept;
+    if (removed > 0) {
+        _members.resize(kept);
+        rebuildMemberIndex();
+        markDirty(DIRTY_MEMBERS);
+    }
+    return removed;
+}
+
+bool Channel::hasClient(Client* client) const {
+    return findMember(client) != -1;
+}
+
+const std::vector<Channel::Member>& Channel::getMembers() const {
+    return _members;
+}
+
+size_t Channel::getMemberCount() const {
+    return _members.size();
+}
+
+unsigned Channel::getMemberFlags(Client* client) const {
+    int pos = findMember(client);
+    return (pos != -1) ? _members[pos].flags : 0;
+}
+
+void Channel::setMemberFlag(Client* client, unsigned flag, bool enabled) {
+    int pos = findMember(client);
+    if (pos == -1)
+        return;
+
+    unsigned& flags = _members[pos].flags;
+    if ((flag & MEMBER_OP) && enabled && !(flags & MEMBER_OP))
+        _operatorCount++;
+    else if ((flag & MEMBER_OP) && !enabled && (flags & MEMBER_OP))
+        _operatorCount--;
+
+    unsigned before = flags;
+    if (enabled)
+        flags |= flag;
+    else
+        flags &= ~flag;
+    if ((before ^ flags) & (MEMBER_OP | MEMBER_VOICE | MEMBER_HIDDEN))
+        markDirty(DIRTY_MEMBERS);
+}
+
+// Fibonacci hashing of the pointer: multiply by 2^bits / golden ratio and
+// keep the high bits, which every bit of the pointer reaches (its low bits
+// are always zero from alignment)
+size_t Channel::hashClient(const Client* client, unsigned shift) {
+    size_t key = reinterpret_cast<size_t>(client);
+    size_t golden = sizeof(size_t) > 4 ? static_cast<size_t>(0x9E3779B97F4A7C15ULL) : static_cast<size_t>(0x9E3779B9UL);
+    return (key * golden) >> shift;
+}
+
+int Channel::findSlot(const Client* client) const {
+    if (_memberIndex.empty())
+        return -1;
+
+    size_t mask = _memberIndex.size() - 1;
+    for (size_t slot = hashClient(client, _indexShift); _memberIndex[slot] != -1; slot = (slot + 1) & mask) {
+        if (_members[_memberIndex[slot]].client == client)
+            return static_cast<int>(slot);
+    }
+    return -1;
+}
+
+int Channel::findMember(const Client* client) const {
+    int slot = findSlot(client);
+    return (slot != -1) ? _memberIndex[slot] : -1;
+}
+
+// Linear-probing delete: pull later entries of the run back into the hole
+// unless that would move them before their home slot
+void Channel::unindexSlot(size_t hole) {
+    size_t mask = _memberIndex.size() - 1;
+    for (size_t next = (hole + 1) & mask; _memberIndex[next] != -1; next = (next + 1) & mask) {
+        size_t home = hashClient(_members[_memberIndex[next]].client, _indexShift);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            _memberIndex[hole] = _memberIndex[next];
+            hole = next;
+        }
+    }
+    _memberIndex[hole] = -1;
+}
+
+void Channel::rebuildMemberIndex() {
+    size_t capacity = 8;
+    unsigned bits = 3;
+    while (capacity < _members.size() * 2) {
+        capacity *= 2;
+        ++bits;
+    }
+
+    _memberIndex.assign(capacity, -1);
+    _indexShift = sizeof(size_t) * 8 - bits;
+    size_t mask = capacity - 1;
+    for (size_t i = 0; i < _members.size(); ++i) {
+        size_t slot = hashClient(_members[i].client, _indexShift);
+        while (_memberIndex[slot] != -1)
+            slot = (slot + 1) & mask;
+        _memberIndex[slot] = static_cast<int>(i);
+    }
+}
+
+
+// Operators
+void Channel::addOperator(Client* client) {
+    setMemberFlag(client, MEMBER_OP, true);
+}
+
+void Channel::removeOperator(Client* client) {
+    setMemberFlag(client, MEMBER_OP, false);
+}
+
+bool Channel::isOperator(Client* client) const {
+    return (getMemberFlags(client) & MEMBER_OP) != 0;
+}
+
+// Messaging
+
+// One member lookup, then bit tests: ops and voiced members always speak
+char Channel::sendRestriction(Client* client) {
+    int pos = findMember(client);
+    if (pos == -1) {
+        if (_modes & MODE_NO_EXTERNAL)
+            return 'n';
+        if (_modes & MODE_MODERATED)
+            return 'm';     // outsiders have no voice either
+        return isBanned(client) ? 'b' : 0;
+    }
+
+    if (_members[pos].flags & (MEMBER_OP | MEMBER_VOICE))
+        return 0;
+    if (_modes & MODE_MODERATED)
+        return 'm';
+    return isBanned(client) ? 'b' : 0;
+}
+
+void Channel::broadcast(const std::string& message, Client* sender, bool addToHistory) {
+    if (addToHistory) {
+        size_t len = message.length();
+        if (len >= 2 && message.compare(len - 2, 2, "\r\n") == 0)
+            len -= 2;
+        _history.append(message.substr(0, len));
+        markDirty(DIRTY_HISTORY);
+    }
+
+    IRCSERV_ALLOC_SCOPE("(fanout)");
+    IRCSERV_PROBE3(channel__broadcast, _name.c_str(), _members.size(), message.length());
+    for (std::vector<Member>::iterator it = _members.begin(); it != _members.end(); ++it) {
+        if (it->client != sender) {
+            // Message is expected to already be a complete IRC line (ends with CRLF).
+            // Queued (not appended to the output buffer) so it cannot overtake earlier replies
+            it->client->enqueueMessage(message);
+        }
+    }
+    IRCSERV_PROBE1(channel__broadcast__done, _name.c_str());
+}
+
+// History
+void Channel::attachHistory(HistoryBudget* budget) {
+    _history.attach(budget);
+}
+
+const MessageHistory& Channel::getHistory() const {
+    return _history;
+}
+
+// Mode methods
+const Channel::ModeSpec* Channel::findMode(char letter) {
+    for (size_t i = 0; i < MODE_COUNT; ++i) {
+        if (MODE_TABLE[i].letter == letter)
+            return &MODE_TABLE[i];
+    }
+    return NULL;
+}
+
+// "A,B,C,D": the letters of each type, in table order
+std::string Channel::chanModesToken() {
+    std::string token;
+    for (int type = MODE_TYPE_LIST; type <= MODE_TYPE_FLAG; ++type) {
+        if (type != MODE_TYPE_LIST)
+            token += ',';
+        for (size_t i = 0; i < MODE_COUNT; ++i) {
+            if (MODE_TABLE[i].type == type)
+                token += MODE_TABLE[i].letter;
+        }
+    }
+    return token;
+}
+
+// "(ov)@+"
+std::string Channel::prefixToken() {
+    std::string letters, symbols;
+    for (size_t i = 0; i < MODE_COUNT; ++i) {
+        if (MODE_TABLE[i].type == MODE_TYPE_PREFIX) {
+            letters += MODE_TABLE[i].letter;
+            symbols += MODE_TABLE[i].prefix;
+        }
+    }
+    return "(" + letters + ")" + symbols;
+}
+
+char Channel::memberPrefix(unsigned memberFlags) {
+    for (size_t i = 0; i < MODE_COUNT; ++i) {
+        if (MODE_TABLE[i].type == MODE_TYPE_PREFIX && (memberFlags & MODE_TABLE[i].bit))
+            return MODE_TABLE[i].prefix;
+    }
+    return 0;
+}
+
+char Channel::namesSymbol(unsigned modes) {
+    if (modes & MODE_SECRET)
+        return '@';
+    return (modes & MODE_PRIVATE) ? '*' : '=';
+}
+
+unsigned Channel::getModes() const {
+    return _modes;
+}
+
+bool Channel::hasMode(unsigned bit) const {
+    return (_modes & bit) != 0;
+}
+
+bool Channel::setMode(unsigned bit, bool enabled) {
+    unsigned modes = enabled ? (_modes | bit) : (_modes & ~bit);
+    if (modes == _modes)
+        return false;
+    _modes = modes;
+    rebuildModeString();
+    markDirty(DIRTY_SETTINGS);
+    return true;
+}
+
+const std::string& Channel::getKey() const {
+    return _key;
+}
+
+size_t Channel::getUserLimit() const {
+    return _userLimit;
+}
+
+bool Channel::setKey(const std::string& key) {
+    if (key == _key)
+        return false;
+    _key = key;
+    if (!setMode(MODE_KEY, !key.empty()))
+        markDirty(DIRTY_SETTINGS);
+    return true;
+}
+
+bool Channel::setUserLimit(size_t limit) {
+    if (limit == _userLimit)
+        return false;
+    _userLimit = limit;
+    if (!setMode(MODE_LIMIT, limit > 0))
+        markDirty(DIRTY_SETTINGS);
+    return true;
+}
+
+void Channel::clearModes() {
+    _key.clear();
+    _userLimit = 0;
+    setMode(_modes, false);
+}
+
+const std::string& Channel::getModeString() const {
+    return _modeString;
+}
+
+void Channel::rebuildModeString() {
+    _modeString.clear();
+    for (size_t i = 0; i < MODE_COUNT; ++i) {
+        const ModeSpec& spec = MODE_TABLE[i];
+        if ((spec.type == MODE_TYPE_FLAG || spec.type == MODE_TYPE_PARAM || spec.type == MODE_TYPE_SETTING) && (_modes & spec.bit))
+            _modeString += spec.letter;
+    }
+    if (!_modeString.empty())
+        _modeString.insert(0, 1, '+');
+}
+
+// Invite management
+void Channel::addInvite(Client* client) {
+    if (_invitedClients.insert(client).second)
+        client->addInvitedTo(this);
+    markDirty(DIRTY_MEMBERS);
+}
+
+void Channel::removeInvite(Client* client) {
+    if (_invitedClients.erase(client)) {
+        client->removeInvitedTo(this);
+        markDirty(DIRTY_MEMBERS);
+    }
+}
+
+bool Channel::isInvited(Client* client) const {
+    return _invitedClients.find(client) != _invitedClients.end();
+}
+
+
+void Channel::promoteNewOperatorIfNeeded() {
+    if (_operatorCount == 0 && !_members.empty()) {
+        Client* newOperator = _members.front().client; // Longest-standing member
+        revealMember(newOperator);
+        addOperator(newOperator);
+        
+        std::string modeMsg = ":ircserv MODE " + _name + " +o " + newOperator->getNickname() + "\r\n";
+        broadcast(modeMsg, NULL);
+    }
+}
+
+// Mask lists
+bool Channel::addListMask(ListMode list, const std::string& mask, const std::string& setBy) {
+    Mask compiled(mask);
+    std::vector<MaskEntry>& entries = _lists[list];
+
+    for (std::vector<MaskEntry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->compiled.getPattern() == compiled.getPattern())
+            return false;
+    }
+    if (entries.size() >= MAX_LIST_ENTRIES)
+        return false;
+
+    MaskEntry entry;
+    entry.mask = mask;
+    entry.setBy = setBy;
+    entry.setAt = time(NULL);
+    entry.compiled = compiled;
+    entries.push_back(entry);
+    markDirty(DIRTY_SETTINGS);
+
+    if (list != LIST_INVEX)
+        clearBanCache();
+    return true;
+}
+
+bool Channel::removeListMask(ListMode list, const std::string& mask) {
+    std::string pattern = Mask(mask).getPattern();
+    std::vector<MaskEntry>& entries = _lists[list];
+
+    for (std::vector<MaskEntry>::iterator it = entries.begin(); it != entries.end(); ++it) {
+        if (it->compiled.getPattern() == pattern) {
+            entries.erase(it);
+            markDirty(DIRTY_SETTINGS);
+            if (list != LIST_INVEX)
+                clearBanCache();
+            return true;
+        }
+    }
+    return false;
+}
+
+const std::vector<Channel::MaskEntry>& Channel::getListMasks(ListMode list) const {
+    return _lists[list];
+}
+
+bool Channel::listMatches(const std::vector<MaskEntry>& list, const std::string& foldedHostmask) {
+    for (std::vector<MaskEntry>::const_iterator it = list.begin(); it != list.end(); ++it) {
+        if (it->compiled.matchesFolded(foldedHostmask))
+            return true;
+    }
+    return false;
+}
+
+bool Channel::computeBanned(Client* client) const {
+    std::string hostmask = IRCUtils::casefold(client->getHostmask());
+    return listMatches(_lists[LIST_BAN], hostmask) && !listMatches(_lists[LIST_EXCEPT], hostmask);
+}
+
+bool Channel::isBanned(Client* client) {
+    if (_lists[LIST_BAN].empty())
+        return false;
+
+    // Non-members (JOIN attempts) are checked directly and never cached
+    int pos = findMember(client);
+    if (pos == -1)
+        return computeBanned(client);
+
+    unsigned& flags = _members[pos].flags;
+    if (!(flags & MEMBER_BAN_CHECKED)) {
+        flags |= MEMBER_BAN_CHECKED;
+        if (computeBanned(client))
+            flags |= MEMBER_BANNED;
+        else
+            flags &= ~MEMBER_BANNED;
+    }
+    return (flags & MEMBER_BANNED) != 0;
+}
+
+bool Channel::isInviteExempt(Client* client) const {
+    if (_lists[LIST_INVEX].empty())
+        return false;
+    return listMatches(_lists[LIST_INVEX], IRCUtils::casefold(client->getHostmask()));
+}
+
+void Channel::invalidateBanCache(Client* client) {
+    setMemberFlag(client, MEMBER_BAN_CHECKED, false);
+}
+
+void Channel::clearBanCache() {
+    for (std::vector<Member>::iterator it = _members.begin(); it != _members.end(); ++it)
+        it->flags &= ~MEMBER_BAN_CHECKED;
+}
+
+// Delayed join
+bool Channel::isHidden(Client* client) const {
+    return (getMemberFlags(client) & MEMBER_HIDDEN) != 0;
+}
+
+// Hidden members are listed only to themselves and to channel operators
+bool Channel::isVisibleTo(Client* member, Client* viewer) const {
+    return member == viewer || !isHidden(member) || isOperator(viewer);
+}
+
+// Announce a hidden member with the JOIN the rest of the channel never saw
+void Channel::revealMember(Client* client) {
+    int pos = findMember(client);
+    if (pos == -1 || !(_members[pos].flags & MEMBER_HIDDEN))
+        return;
+
+    _members[pos].flags &= ~MEMBER_HIDDEN;
+    markDirty(DIRTY_MEMBERS);
+    broadcast(client->buildMessage("JOIN", "", _name), client);
+}
+
+void Channel::revealAllMembers() {
+    for (size_t i = 0; i < _members.size(); ++i) {
+        if (_members[i].flags & MEMBER_HIDDEN)
+            revealMember(_members[i].client);
+    }
+}
+
+// -------- CHANGE TRACKING --------
+
+void Channel::setDirtyList(std::vector<std::string>* dirtyList, unsigned long* stateEpoch) {
+    _dirtyList = dirtyList;
+    _stateEpoch = stateEpoch;
+}
+
+void Channel::markDirty(unsigned flags) {
+    if (!_dirtyFlags && _dirtyList)
+        _dirtyList->push_back(_name);
+    if (flags & ~DIRTY_HISTORY) {
+        _version = ++_lastVersion;
+        if (_stateEpoch)
+            ++*_stateEpoch;
+    }
+    _dirtyFlags |= flags;
+}
+
+unsigned long Channel::getVersion() const {
+    return _version;
+}
+
+unsigned Channel::takeDirtyFlags() {
+    unsigned flags = _dirtyFlags;
+    _dirtyFlags = 0;
+    return flags;
+}
+
+// -------- PERSISTENCE --------
+
+void Channel::saveSettings(StateWriter& out) const {
+    out.putString(_topic);
+    out.putInt(_createdAt);
+    out.putInt(_modes);
+    out.putString(_key);
+    out.putInt(_userLimit);
+
+    for (int list = 0; list < LIST_COUNT; ++list) {
+        out.putInt(_lists[list].size());
+        for (std::vector<MaskEntry>::const_iterator it = _lists[list].begin(); it != _lists[list].end(); ++it) {
+            out.putString(it->mask);
+            out.putString(it->setBy);
+            out.putInt(it->setAt);
+        }
+    }
+}
+
+// Fields are assigned directly so that restoring does not queue a write
+void Channel::loadSettings(StateReader& in) {
+    _topic = in.getString();
+    _createdAt = in.getInt();
+    _modes = in.getInt();
+    _key = in.getString();
+    _userLimit = in.getInt();
+    rebuildModeString();
+    _version = ++_lastVersion;
+
+    for (int list = 0; list < LIST_COUNT; ++list) {
+        _lists[list].clear();
+        long entries = in.getInt();
+        for (long i = 0; i < entries && in.ok(); ++i) {
+            MaskEntry entry;
+            entry.mask = in.getString();
+            entry.setBy = in.getString();
+            entry.setAt = in.getInt();
+            entry.compiled = Mask(entry.mask);
+            _lists[list].push_back(entry);
+        }
+    }
+    clearBanCache();
+}
+
+// -------- MEMBERSHIP --------
+
+void Channel::saveMembership(StateWriter& out) const {
+    out.putInt(_members.size());
+    for (std::vector<Member>::const_iterator it = _members.begin(); it != _members.end(); ++it) {
+        out.putInt(it->client->getSerial());
+        out.putInt(it->flags & (MEMBER_OP | MEMBER_VOICE | MEMBER_HIDDEN));
+        out.putInt(it->joinedAt);
+        out.putInt(it->joinSeq);
+    }
+    out.putInt(_nextJoinSeq);
+
+    out.putInt(_invitedClients.size());
+    for (std::set<Client*>::const_iterator it = _invitedClients.begin(); it != _invitedClients.end(); ++it)
+        out.putInt((*it)->getSerial());
+}
+
+// Members missing from the table (e.g. users on other servers) are skipped
+void Channel::loadMembership(StateReader& in, const std::map<unsigned long, Client*>& clients) {
+    for (std::vector<Member>::iterator it = _members.begin(); it != _members.end(); ++it)
+        it->client->removeChannel(this);
+    _members.clear();
+    _operatorCount = 0;
+    _version = ++_lastVersion;
+    for (std::set<Client*>::iterator it = _invitedClients.begin(); it != _invitedClients.end(); ++it)
+        (*it)->removeInvitedTo(this);
+    _invitedClients.clear();
+
+    long count = in.getInt();
+    for (long i = 0; i < count && in.ok(); ++i) {
+        std::map<unsigned long, Client*>::const_iterator client = clients.find(in.getInt());
+        unsigned flags = in.getInt();
+        time_t joinedAt = in.getInt();
+        unsigned long joinSeq = in.getInt();
+        if (client == clients.end())
+            continue;
+
+        Member member;
+        member.client = client->second;
+        member.flags = flags;
+        member.joinedAt = joinedAt;
+        member.joinSeq = joinSeq;
+        _members.push_back(member);
+        client->second->addChannel(this);
+        if (flags & MEMBER_OP)
+            _operatorCount++;
+    }
+    rebuildMemberIndex();
+    _nextJoinSeq = in.getInt();
+
+    long invites = in.getInt();
+    for (long i = 0; i < invites && in.ok(); ++i) {
+        std::map<unsigned long, Client*>::const_iterator client = clients.find(in.getInt());
+        if (client != clients.end() && _invitedClients.insert(client->second).second)
+            client->second->addInvitedTo(this);
+    }
+}
+
+// -------- BINARY UPGRADE --------
+
+void Channel::saveState(StateWriter& out) const {
+    saveSettings(out);
+    saveMembership(out);
+    _history.saveState(out);
+}
+
+void Channel::loadState(StateReader& in, const std::map<unsigned long, Client*>& clients) {
+    loadSettings(in);
+    loadMembership(in, clients);
+    _history.loadState(in);
+}
+
+void Channel::saveHistorySince(StateWriter& out, unsigned long msgid) const {
+    _history.saveState(out, msgid);
+}
+
+void Channel::loadHistory(StateReader& in) {
+    _history.loadState(in);
+}
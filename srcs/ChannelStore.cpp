@@ -0,0 +1,593 @@
+#include "ChannelStore.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+static const char* const SNAPSHOT_MAGIC = "ircserv-channels-2";
+
+ChannelStore::ChannelStore()
+    : _mapping(NULL), _mappingLength(0), _logBytes(0), _snapshotBytes(0), _openedAt(0),
+      _logFd(-1), _threadStarted(false), _stopping(false), _writerBusy(false) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_wake, NULL);
+    pthread_cond_init(&_idle, NULL);
+}
+
+ChannelStore::~ChannelStore() {
+    close();
+    pthread_cond_destroy(&_idle);
+    pthread_cond_destroy(&_wake);
+    pthread_mutex_destroy(&_mutex);
+}
+
+// -------- LOADING --------
+
+bool ChannelStore::open(const std::string& prefix) {
+    if (isOpen())
+        return true;
+
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    _snapshotPath = prefix + ".snap";
+    _logPath = prefix + ".log";
+    _openedAt = start.tv_sec;
+
+    if (!loadSnapshot() || !replayLog()) {
+        close();
+        return false;
+    }
+
+    _logFd = ::open(_logPath.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (_logFd == -1) {
+        perror("channel store log");
+        close();
+        return false;
+    }
+
+    // Signals must reach the event loop, never the writer
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    int error = pthread_create(&_thread, NULL, &ChannelStore::writerMain, this);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (error != 0) {
+        std::cerr << "Channel store: cannot start writer thread" << std::endl;
+        close();
+        return false;
+    }
+    _threadStarted = true;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long elapsedUs = (now.tv_sec - start.tv_sec) * 1000000L + (now.tv_usec - start.tv_usec);
+    std::cout << "Channel store: " << _snapshot.size() << " snapshot and " << _overlay.size() << " log entries from " << prefix
+              << " in " << elapsedUs / 1000 << "." << (elapsedUs % 1000) / 100 << " ms" << std::endl;
+    return true;
+}
+
+// The mapping stays alive until the first compaction: slots point into it
+bool ChannelStore::loadSnapshot() {
+    int fd = ::open(_snapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT)
+            return true;
+        perror("channel store snapshot");
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("channel store mmap");
+        return false;
+    }
+    _mapping = mapping;
+    _mappingLength = st.st_size;
+    _snapshotBytes = st.st_size;
+    return indexSnapshot(static_cast<const char*>(_mapping), _mappingLength);
+}
+
+// Fills the slots in place over a snapshot image, mapped or compacted
+bool ChannelStore::indexSnapshot(const char* data, size_t length) {
+    StateReader in(data, length);
+    if (in.getString() != SNAPSHOT_MAGIC) {
+        std::cerr << "Channel store: " << _snapshotPath << " is not a channel snapshot" << std::endl;
+        return false;
+    }
+
+    long count = in.getInt();
+    _snapshot.reserve(count > 0 ? count : 0);
+    bool sorted = true;
+    for (long i = 0; i < count && in.ok(); ++i) {
+        Slot slot;
+        in.getInt();    // always a put
+        in.getBytes(slot.name, slot.nameLength);
+        slot.savedAt = in.getInt();
+        in.getBytes(slot.settings, slot.length);
+        if (!_snapshot.empty() && !slotLess(_snapshot.back(), slot))
+            sorted = false;
+        _snapshot.push_back(slot);
+    }
+    if (!in.ok()) {
+        std::cerr << "Channel store: " << _snapshotPath << " is corrupt" << std::endl;
+        return false;
+    }
+    if (!sorted)
+        std::sort(_snapshot.begin(), _snapshot.end(), &ChannelStore::slotLess);
+    return true;
+}
+
+// A crash can leave a torn entry at the end of the log; it is cut off
+bool ChannelStore::replayLog() {
+    int fd = ::open(_logPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("channel store log");
+        return false;
+    }
+
+    std::string data;
+    char buffer[65536];
+    ssize_t got;
+    while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+        data.append(buffer, got);
+
+    StateReader in(data);
+    size_t valid = 0;
+    while (!in.atEnd() && applyLogEntry(in))
+        valid = in.position();
+
+    if (valid < data.length()) {
+        std::cerr << "Channel store: dropping " << (data.length() - valid) << " bytes of torn log tail" << std::endl;
+        if (ftruncate(fd, valid) == -1)
+            perror("channel store log");
+    }
+    ::close(fd);
+    _logBytes = valid;
+    return true;
+}
+
+bool ChannelStore::applyLogEntry(StateReader& in) {
+    long op = in.getInt();
+    std::string name = in.getString();
+    time_t savedAt = in.getInt();
+    std::string settings = in.getString();
+    if (!in.ok())
+        return false;
+
+    Record& record = _overlay[name];
+    record.settings = settings;
+    record.savedAt = savedAt;
+    record.removed = (op == ENTRY_REMOVE);
+    return true;
+}
+
+void ChannelStore::close() {
+    if (_threadStarted) {
+        pthread_mutex_lock(&_mutex);
+        _stopping = true;
+        pthread_cond_signal(&_wake);
+        pthread_mutex_unlock(&_mutex);
+        pthread_join(_thread, NULL);
+        _threadStarted = false;
+        _stopping = false;
+    }
+    if (_logFd != -1) {
+        ::close(_logFd);
+        _logFd = -1;
+    }
+    _overlay.clear();
+    _snapshot.clear();
+    _image.clear();
+    unmap();
+}
+
+void ChannelStore::unmap() {
+    if (_mapping) {
+        munmap(_mapping, _mappingLength);
+        _mapping = NULL;
+        _mappingLength = 0;
+    }
+}
+
+bool ChannelStore::isOpen() const {
+    return _threadStarted;
+}
+
+// -------- RECORDS --------
+
+bool ChannelStore::slotLess(const Slot& a, const Slot& b) {
+    int order = std::memcmp(a.name, b.name, std::min(a.nameLength, b.nameLength));
+    return order < 0 || (order == 0 && a.nameLength < b.nameLength);
+}
+
+const ChannelStore::Slot* ChannelStore::findSlot(const std::string& name) const {
+    Slot key;
+    key.name = name.data();
+    key.nameLength = name.length();
+    std::vector<Slot>::const_iterator it = std::lower_bound(_snapshot.begin(), _snapshot.end(), key, &ChannelStore::slotLess);
+    if (it == _snapshot.end() || slotLess(key, *it))
+        return NULL;
+    return &*it;
+}
+
+bool ChannelStore::find(const std::string& name, const char*& settings, size_t& length) const {
+    std::map<std::string, Record>::const_iterator it = _overlay.find(name);
+    if (it != _overlay.end()) {
+        if (it->second.removed)
+            return false;
+        settings = it->second.settings.data();
+        length = it->second.settings.length();
+        return true;
+    }
+
+    const Slot* slot = findSlot(name);
+    if (!slot)
+        return false;
+    settings = slot->settings;
+    length = slot->length;
+    return true;
+}
+
+void ChannelStore::put(const std::string& name, const std::string& settings) {
+    if (!isOpen())
+        return;
+
+    time_t now = time(NULL);
+    Record& record = _overlay[name];
+    record.settings = settings;
+    record.savedAt = now;
+    record.removed = false;
+
+    StateWriter entry;
+    entry.putInt(ENTRY_PUT);
+    entry.putString(name);
+    entry.putInt(now);
+    entry.putString(settings);
+    _logBytes += entry.data().length();
+    queueJob(false, entry.data());
+}
+
+void ChannelStore::remove(const std::string& name) {
+    const char* settings;
+    size_t length;
+    if (!isOpen() || !find(name, settings, length))
+        return;
+
+    Record& record = _overlay[name];
+    record.settings.clear();
+    record.savedAt = time(NULL);
+    record.removed = true;
+
+    StateWriter entry;
+    entry.putInt(ENTRY_REMOVE);
+    entry.putString(name);
+    entry.putInt(record.savedAt);
+    entry.putString("");
+    _logBytes += entry.data().length();
+    queueJob(false, entry.data());
+}
+
+bool ChannelStore::compactionDue() const {
+    return isOpen() && _logBytes >= COMPACT_MIN_LOG_BYTES && _logBytes >= _snapshotBytes;
+}
+
+// Merges the snapshot and the overlay, both in name order. Encoding happens
+// here; the writer only copies the finished image to disk. The slots are then
+// rebuilt over our own copy of the image, which already holds everything the
+// overlay had, so the overlay empties and the old mapping can go.
+void ChannelStore::compact(const std::set<std::string>& live) {
+    time_t now = time(NULL);
+    StateWriter entries;
+    long count = 0;
+
+    std::vector<Slot>::const_iterator slot = _snapshot.begin();
+    std::map<std::string, Record>::iterator record = _overlay.begin();
+    while (slot != _snapshot.end() || record != _overlay.end()) {
+        std::string name;
+        const char* settings;
+        size_t length;
+        time_t savedAt;
+
+        if (record == _overlay.end() || (slot != _snapshot.end()
+                && record->first.compare(0, std::string::npos, slot->name, slot->nameLength) > 0)) {
+            name.assign(slot->name, slot->nameLength);
+            settings = slot->settings;
+            length = slot->length;
+            savedAt = slot->savedAt;
+            ++slot;
+        } else {
+            if (slot != _snapshot.end() && record->first.compare(0, std::string::npos, slot->name, slot->nameLength) == 0)
+                ++slot;     // shadowed by the overlay
+            const Record& current = record->second;
+            name = record->first;
+            ++record;
+            if (current.removed)
+                continue;
+            settings = current.settings.data();
+            length = current.settings.length();
+            savedAt = current.savedAt;
+        }
+
+        if (live.find(name) == live.end() && now - std::max(savedAt, _openedAt) > DORMANT_TTL) {
+            Record& expired = _overlay[name];
+            expired.settings.clear();
+            expired.savedAt = now;
+            expired.removed = true;
+            continue;
+        }
+
+        entries.putInt(ENTRY_PUT);
+        entries.putString(name);
+        entries.putInt(savedAt);
+        entries.putBytes(settings, length);
+        ++count;
+    }
+
+    StateWriter snapshot;
+    snapshot.putString(SNAPSHOT_MAGIC);
+    snapshot.putInt(count);
+    std::string image = snapshot.data() + entries.data();
+
+    _snapshotBytes = image.length();
+    _logBytes = 0;
+    queueJob(true, image);
+
+    _snapshot.clear();
+    _image.swap(image);
+    indexSnapshot(_image.data(), _image.length());
+    _overlay.clear();
+    unmap();
+}
+
+// -------- WRITER THREAD --------
+
+void ChannelStore::queueJob(bool snapshot, const std::string& data) {
+    Job job;
+    job.snapshot = snapshot;
+    job.data = data;
+
+    pthread_mutex_lock(&_mutex);
+    _jobs.push_back(job);
+    pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void ChannelStore::sync() {
+    pthread_mutex_lock(&_mutex);
+    while (!_jobs.empty() || _writerBusy)
+        pthread_cond_wait(&_idle, &_mutex);
+    pthread_mutex_unlock(&_mutex);
+}
+
+void* ChannelStore::writerMain(void* store) {
+    static_cast<ChannelStore*>(store)->runWriter();
+    return NULL;
+}
+
+// Takes the whole queue at once so a burst of changes costs one write and one fdatasync
+void ChannelStore::runWriter() {
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        while (_jobs.empty() && !_stopping)
+            pthread_cond_wait(&_wake, &_mutex);
+        if (_jobs.empty())
+            break;
+
+        std::deque<Job> jobs;
+        jobs.swap(_jobs);
+        _writerBusy = true;
+        pthread_mutex_unlock(&_mutex);
+
+        std::string batch;
+        for (std::deque<Job>::iterator it = jobs.begin(); it != jobs.end(); ++it) {
+            if (!it->snapshot) {
+                batch += it->data;
+                continue;
+            }
+            writeLog(batch);
+            batch.clear();
+            writeSnapshot(it->data);
+        }
+        writeLog(batch);
+
+        pthread_mutex_lock(&_mutex);
+        _writerBusy = false;
+        pthread_cond_broadcast(&_idle);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void ChannelStore::writeLog(const std::string& data) {
+    size_t written = 0;
+    while (written < data.length()) {
+        ssize_t n = write(_logFd, data.data() + written, data.length() - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror("channel store log");
+            return;
+        }
+        written += n;
+    }
+    if (written > 0)
+        fdatasync(_logFd);
+}
+
+// The rename itself lives in the directory; until that is on disk too a crash
+// can bring back the old snapshot
+static bool syncDirectory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string directory = (slash == std::string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    int fd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool synced = fsync(fd) == 0;
+    ::close(fd);
+    return synced;
+}
+
+// New snapshot under a temporary name, renamed over the old one, then the log
+// restarts empty, but only once the rename is durable: replaying the old log
+// over the new snapshot changes nothing, losing both would
+void ChannelStore::writeSnapshot(const std::string& data) {
+    std::string tmpPath = _snapshotPath + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        perror("channel store snapshot");
+        return;
+    }
+
+    size_t written = 0;
+    while (written < data.length()) {
+        ssize_t n = write(fd, data.data() + written, data.length() - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1) {
+            perror("channel store snapshot");
+            ::close(fd);
+            unlink(tmpPath.c_str());
+            return;
+        }
+        written += n;
+    }
+    fsync(fd);
+    ::close(fd);
+
+    if (rename(tmpPath.c_str(), _snapshotPath.c_str()) == -1) {
+        perror("channel store snapshot");
+        return;
+    }
+    if (!syncDirectory(_snapshotPath)) {
+        perror("channel store directory");
+        return;
+    }
+    if (ftruncate(_logFd, 0) == -1)
+        perror("channel store log");
+}
+
+// -------- BENCHMARK --------
+
+namespace {
+
+std::string benchName(size_t i) {
+    std::ostringstream name;
+    name << "#channel" << i;
+    return name.str();
+}
+
+double millisSince(unsigned long long started) {
+    return (Metrics::now() - started) / 1e6;
+}
+
+}
+
+int ChannelStore::benchmark() {
+    std::ostringstream prefix;
+    prefix << "/tmp/ircserv-bench-" << getpid();
+    std::string snapshotPath = prefix.str() + ".snap";
+    std::string logPath = prefix.str() + ".log";
+    unlink(snapshotPath.c_str());
+    unlink(logPath.c_str());
+
+    // Roughly what Channel::saveSettings writes for a channel with a topic and a few bans
+    std::vector<std::string> settings(BENCH_CHANNELS);
+    std::set<std::string> live;
+    for (size_t i = 0; i < BENCH_CHANNELS; ++i) {
+        StateWriter out;
+        out.putString("Topic of " + benchName(i) + ": release notes, meeting at noon, no spam please");
+        out.putInt(1700000000 + i);
+        out.putInt(i % 64);
+        out.putString(i % 7 ? "" : "sesame");
+        out.putInt(i % 5 ? 0 : 50);
+        out.putInt(3);
+        for (int ban = 0; ban < 3; ++ban) {
+            out.putString("*!*@spammer" + benchName(ban) + ".example");
+            out.putString("op!op@host");
+            out.putInt(1700000000);
+        }
+        settings[i] = out.data();
+    }
+
+    // The open() reports would interleave with ours
+    std::ofstream discard("/dev/null");
+    std::streambuf* console = std::cout.rdbuf(discard.rdbuf());
+    double putMs, logOpenMs, compactMs, snapshotOpenMs, findNs;
+    size_t snapshotBytes, found = 0;
+    bool ok;
+    {
+        ChannelStore store;
+        ok = store.open(prefix.str());
+        unsigned long long started = Metrics::now();
+        for (size_t i = 0; ok && i < BENCH_CHANNELS; ++i)
+            store.put(benchName(i), settings[i]);
+        store.sync();
+        putMs = millisSince(started);
+    }
+    {
+        ChannelStore store;
+        unsigned long long started = Metrics::now();
+        ok = ok && store.open(prefix.str());
+        logOpenMs = millisSince(started);
+
+        for (size_t i = 0; i < BENCH_CHANNELS; ++i)
+            live.insert(benchName(i));
+        started = Metrics::now();
+        if (ok)
+            store.compact(live);
+        store.sync();
+        compactMs = millisSince(started);
+        snapshotBytes = store._snapshotBytes;
+        ok = ok && store._overlay.empty() && store._snapshot.size() == BENCH_CHANNELS;
+    }
+    {
+        ChannelStore store;
+        unsigned long long started = Metrics::now();
+        ok = ok && store.open(prefix.str());
+        snapshotOpenMs = millisSince(started);
+
+        std::vector<std::string> names;
+        for (size_t i = 0; i < BENCH_CHANNELS; ++i)
+            names.push_back(benchName((i * 7919) % BENCH_CHANNELS));
+        started = Metrics::now();
+        for (size_t i = 0; ok && i < names.size(); ++i) {
+            const char* data;
+            size_t length;
+            if (store.find(names[i], data, length) && length == settings[(i * 7919) % BENCH_CHANNELS].length())
+                ++found;
+        }
+        findNs = (Metrics::now() - started) / static_cast<double>(names.size());
+        ok = ok && store._overlay.empty();
+    }
+    std::cout.rdbuf(console);
+    unlink(snapshotPath.c_str());
+    unlink(logPath.c_str());
+
+    if (!ok || found != BENCH_CHANNELS) {
+        std::cerr << "Channel store: benchmark failed (" << found << " of " << BENCH_CHANNELS << " found)" << std::endl;
+        return 1;
+    }
+    std::cout << std::fixed << std::setprecision(1)
+              << "Channel store: " << BENCH_CHANNELS << " channels, put and sync " << putMs << " ms, open from the log "
+              << logOpenMs << " ms" << std::endl
+              << "Channel store: compaction " << compactMs << " ms to " << snapshotBytes / 1024 << " KiB, open from the snapshot "
+              << snapshotOpenMs << " ms, lookup " << findNs << " ns" << std::endl;
+    return 0;
+}
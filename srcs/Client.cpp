@@ -1,137 +1,707 @@
-#include "Client.hpp"
-#include <ctime>
-
-Client::Client(int fd)
-    : _fd(fd),
-      _receivedPass(false),
-      _receivedNick(false),
-      _receivedUser(false),
-      _registered(false),
-      _welcomeSent(false),
-      _lastActive(time(NULL)) {}
-
-Client::~Client() {}
-
-// Getters
-int Client::getFd() const { return _fd; }
-
-const std::string& Client::getNickname() const { return _nickname; }
-
-const std::string& Client::getUsername() const { return _username; }
-
-const std::string& Client::getRealname() const { return _realname; }
-
-const std::string& Client::getHostname() const { return _hostname; }
-
-std::string Client::getHostmask() const {
-    return _nickname + "!" + _username + "@" + _hostname;
-}
-
-bool Client::isRegistered() const { return _registered; }
-
-time_t Client::getLastActive() const { return _lastActive; }
-
-bool Client::welcomeSent() const { return _welcomeSent; }
-
-// Setters
-void Client::setNickname(const std::string& nick) {
-    _nickname = nick;
-    _receivedNick = true;
-}
-
-void Client::setUsername(const std::string& user) {
-    _username = user;
-    _receivedUser = true;
-}
-
-void Client::setRealname(const std::string& realname) {
-    _realname = realname;
-}
-
-void Client::setHostname(const std::string& hostname) {
-    _hostname = hostname;
-}
-
-void Client::setReceivedPass(bool received) {
-    _receivedPass = received;
-}
-
-void Client::setReceivedNick(bool received) {
-    _receivedNick = received;
-}
-
-void Client::setReceivedUser(bool received) {
-    _receivedUser = received;
-}
-
-void Client::updateLastActive() {
-    _lastActive = time(NULL);
-}
-
-void Client::setWelcomeSent(bool v) {
-    _welcomeSent = v;
-}
-
-bool Client::canRegister() const {
-    return _receivedPass && _receivedNick && _receivedUser && !_registered && !_nickname.empty() && !_username.empty();
-}
-
-void Client::tryRegister() {
-    if (canRegister()) {
-        _registered = true;
-    }
-}
-
-void Client::appendToInputBuffer(const std::string& data) {
-    _inputBuffer += data;
-    updateLastActive();
-}
-
-std::string& Client::getInputBuffer() {
-    return _inputBuffer;
-}
-
-std::string& Client::getOutputBuffer() {
-    return _outputBuffer;
-}
-
-void Client::enqueueMessage(const std::string& message) {
-    _outBufQ.push_back(message);
-}
-
-bool Client::hasMessagesToSend() const {
-    return !_outBufQ.empty() || !_outputBuffer.empty();
-}
-
-void Client::flushMessagesToOutputBuffer() {
-    if (_outputBuffer.empty() && !_outBufQ.empty()) {
-        _outputBuffer = _outBufQ.front();
-        _outBufQ.pop_front();
-    }
-}
-
-std::string Client::extractNextLine() {
-    size_t pos = _inputBuffer.find("\r\n");
-    if (pos != std::string::npos) {
-        std::string line = _inputBuffer.substr(0, pos);
-        _inputBuffer.erase(0, pos + 2);
-        return line;
-    }
-    
-    pos = _inputBuffer.find("\n");
-    if (pos != std::string::npos) {
-        std::string line = _inputBuffer.substr(0, pos);
-        _inputBuffer.erase(0, pos + 1);
-        if (!line.empty() && line[line.length() - 1] == '\r') {
-            line.erase(line.length() - 1);
-        }
-        return line;
-    }
-    
-    return "";
-}
-
-bool Client::hasCompleteLine() const {
-    return _inputBuffer.find("\r\n") != std::string::npos ||
-           _inputBuffer.find("\n") != std::string::npos;
+#include "Client.hpp"
+#include "ReplyStream.hpp"
+#include "StateCodec.hpp"
+#include "LineScanner.hpp"
+#include "Metrics.hpp"
+#include <ctime>
+#include <cstring>
+
+unsigned long Client::_lastVersion = 0;
+
+Client::Client(int fd)
+    : _fd(fd),
+      _serial(0),
+      _receivedPass(false),
+      _receivedNick(false),
+      _receivedUser(false),
+      _registered(false),
+      _welcomeSent(false),
+      _nextLine(0),
+      _inputConsumed(0),
+      _discardingLine(false),
+      _outBufQBytes(0),
+      _flushList(NULL),
+      _flushScheduled(false),
+      _needsPollOut(false),
+      _queuedSince(0),
+      _disconnecting(false),
+      _fanoutMark(0),
+      _saslState(SASL_NONE),
+      _pendingLogins(0),
+      _detachedAt(0),
+      _resumeTarget(NULL),
+      _uplink(NULL),
+      _linkState(LINK_NONE),
+      _nickTs(0),
+      _lastActive(time(NULL)),
+      _lookupDeadline(0),
+      _captured(false),
+      _dirtyList(NULL),
+      _dirtyScheduled(false),
+      _stateEpoch(NULL),
+      _version(++_lastVersion) {
+    rebuildHostmask();
+}
+
+Client::~Client() {
+    while (!_replyStreams.empty()) {
+        popReplyStream();
+    }
+}
+
+// Getters
+int Client::getFd() const { return _fd; }
+
+unsigned long Client::getSerial() const { return _serial; }
+
+void Client::setSerial(unsigned long serial) { _serial = serial; }
+
+const std::string& Client::getNickname() const { return _nickname; }
+
+const std::string& Client::getUsername() const { return _username; }
+
+const std::string& Client::getRealname() const { return _realname; }
+
+const std::string& Client::getHostname() const { return _hostname; }
+
+const std::string& Client::getIp() const { return _ip; }
+
+time_t Client::getLookupDeadline() const { return _lookupDeadline; }
+
+const std::string& Client::getHostmask() const { return _hostmask; }
+
+const std::string& Client::getPrefix() const { return _prefix; }
+
+void Client::rebuildHostmask() {
+    _hostmask.clear();
+    _hostmask.reserve(_nickname.length() + _username.length() + _hostname.length() + 2);
+    _hostmask += _nickname;
+    _hostmask += '!';
+    _hostmask += _username;
+    _hostmask += '@';
+    _hostmask += _hostname;
+
+    _prefix.clear();
+    _prefix.reserve(_hostmask.length() + 2);
+    _prefix += ':';
+    _prefix += _hostmask;
+    _prefix += ' ';
+}
+
+std::string Client::buildMessage(const char* command, const std::string& params) const {
+    size_t commandLength = std::strlen(command);
+    std::string message;
+    message.reserve(_prefix.length() + commandLength + params.length() + 3);
+    message += _prefix;
+    message.append(command, commandLength);
+    if (!params.empty()) {
+        message += ' ';
+        message += params;
+    }
+    message += "\r\n";
+    return message;
+}
+
+std::string Client::buildMessage(const char* command, const std::string& params, const std::string& trailing) const {
+    size_t commandLength = std::strlen(command);
+    std::string message;
+    message.reserve(_prefix.length() + commandLength + params.length() + trailing.length() + 6);
+    message += _prefix;
+    message.append(command, commandLength);
+    if (!params.empty()) {
+        message += ' ';
+        message += params;
+    }
+    message += " :";
+    message += trailing;
+    message += "\r\n";
+    return message;
+}
+
+bool Client::isRegistered() const { return _registered; }
+
+bool Client::hasReceivedPass() const { return _receivedPass; }
+
+time_t Client::getLastActive() const { return _lastActive; }
+
+bool Client::welcomeSent() const { return _welcomeSent; }
+
+// Setters
+void Client::setNickname(const std::string& nick) {
+    _nickname = nick;
+    _receivedNick = true;
+    rebuildHostmask();
+    markDirty();
+}
+
+void Client::setUsername(const std::string& user) {
+    _username = user;
+    _receivedUser = true;
+    rebuildHostmask();
+    markDirty();
+}
+
+void Client::setRealname(const std::string& realname) {
+    _realname = realname;
+    markDirty();
+}
+
+void Client::setHostname(const std::string& hostname) {
+    _hostname = hostname;
+    rebuildHostmask();
+    markDirty();
+}
+
+void Client::setIp(const std::string& ip) {
+    _ip = ip;
+    markDirty();
+}
+
+void Client::setLookupDeadline(time_t deadline) {
+    _lookupDeadline = deadline;
+}
+
+void Client::setReceivedPass(bool received) {
+    _receivedPass = received;
+    markDirty();
+}
+
+void Client::setReceivedNick(bool received) {
+    _receivedNick = received;
+    markDirty();
+}
+
+void Client::setReceivedUser(bool received) {
+    _receivedUser = received;
+    markDirty();
+}
+
+void Client::updateLastActive() {
+    _lastActive = time(NULL);
+}
+
+void Client::setWelcomeSent(bool v) {
+    _welcomeSent = v;
+    markDirty();
+}
+
+bool Client::canRegister() const {
+    return _receivedPass && _receivedNick && _receivedUser && !_registered && !_nickname.empty() && !_username.empty();
+}
+
+void Client::tryRegister() {
+    if (canRegister()) {
+        _registered = true;
+        markDirty();
+    }
+}
+
+// Line ends are found once, as the bytes arrive, so extraction never searches.
+// A line still growing past its limit is cut there and the rest of it dropped
+// on arrival: a client never holds more than one line's worth of a flood.
+void Client::appendToInputBuffer(const char* data, size_t length) {
+    updateLastActive();
+    if (_discardingLine) {
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', length));
+        if (!newline)
+            return;
+        _discardingLine = false;
+        length -= newline - data;
+        data = newline;
+    }
+
+    size_t from = _inputBuffer.length();
+    size_t known = _lineEnds.size();
+    _inputBuffer.append(data, length);
+    LineScanner::findNewlines(_inputBuffer.data() + from, length, _lineEnds);
+    for (size_t i = known; i < _lineEnds.size(); ++i)
+        _lineEnds[i] += from;
+
+    // Two bytes over the limit, so the line still reads as too long once a
+    // trailing '\r' is stripped
+    size_t tail = _nextLine < _lineEnds.size() ? _lineEnds.back() + 1 : _inputConsumed;
+    size_t keep = lineLimit(tail) + 2;
+    if (_inputBuffer.length() - tail > keep) {
+        _inputBuffer.erase(tail + keep);
+        _discardingLine = true;
+    }
+}
+
+void Client::appendToInputBuffer(const std::string& data) {
+    appendToInputBuffer(data.data(), data.length());
+}
+
+const std::string& Client::getInputBuffer() {
+    compactInput();
+    return _inputBuffer;
+}
+
+void Client::clearInputBuffer() {
+    _inputBuffer.clear();
+    _lineEnds.clear();
+    _nextLine = 0;
+    _inputConsumed = 0;
+    _discardingLine = false;
+}
+
+size_t Client::lineLimit(size_t start) const {
+    if (isServerLink())
+        return MAX_LINK_LINE_LENGTH;
+    if (start < _inputBuffer.length() && _inputBuffer[start] == '@')
+        return MAX_TAGS_LENGTH + MAX_LINE_LENGTH;
+    return MAX_LINE_LENGTH;
+}
+
+// Drop what was extracted, keeping the offsets of the lines left in step
+void Client::compactInput() {
+    if (_inputConsumed == 0)
+        return;
+    _inputBuffer.erase(0, _inputConsumed);
+    _lineEnds.erase(_lineEnds.begin(), _lineEnds.begin() + _nextLine);
+    for (std::vector<size_t>::iterator it = _lineEnds.begin(); it != _lineEnds.end(); ++it)
+        *it -= _inputConsumed;
+    _nextLine = 0;
+    _inputConsumed = 0;
+}
+
+std::string& Client::getOutputBuffer() {
+    return _outputBuffer;
+}
+
+void Client::enqueueMessage(const std::string& message) {
+    // Remote users get their copy from their own server
+    if (!_serverName.empty())
+        return;
+
+    if (!_queuedSince && _fd >= 0 && !hasMessagesToSend())
+        _queuedSince = Metrics::now();
+    _outBufQ.push_back(message);
+    _outBufQBytes += message.length();
+
+    // Let the loop try an immediate send before it goes back to poll();
+    // a detached session just keeps the backlog for when it is resumed
+    if (!_flushScheduled && _flushList && _fd >= 0) {
+        _flushList->push_back(_fd);
+        _flushScheduled = true;
+    }
+}
+
+bool Client::hasMessagesToSend() const {
+    return !_outBufQ.empty() || !_outputBuffer.empty();
+}
+
+unsigned long long Client::takeQueuedSince() {
+    unsigned long long since = _queuedSince;
+    _queuedSince = 0;
+    return since;
+}
+
+void Client::flushMessagesToOutputBuffer() {
+    // Coalesce everything queued so it goes out in as few send() calls as possible
+    while (!_outBufQ.empty()) {
+        _outputBuffer += _outBufQ.front();
+        _outBufQ.pop_front();
+    }
+    _outBufQBytes = 0;
+}
+
+size_t Client::getSendQueueSize() const {
+    return _outputBuffer.length() + _outBufQBytes;
+}
+
+void Client::setDirtyList(std::vector<Client*>* dirtyList, unsigned long* stateEpoch) {
+    _dirtyList = dirtyList;
+    _stateEpoch = stateEpoch;
+}
+
+bool Client::isDirtyScheduled() const {
+    return _dirtyScheduled;
+}
+
+void Client::clearDirtyScheduled() {
+    _dirtyScheduled = false;
+}
+
+unsigned long Client::getVersion() const {
+    return _version;
+}
+
+void Client::bumpVersion() {
+    _version = ++_lastVersion;
+}
+
+void Client::markDirty() {
+    bumpVersion();
+    if (_stateEpoch)
+        ++*_stateEpoch;
+    if (!_dirtyScheduled && _dirtyList) {
+        _dirtyList->push_back(this);
+        _dirtyScheduled = true;
+    }
+}
+
+void Client::setFlushList(std::vector<int>* flushList) {
+    _flushList = flushList;
+}
+
+void Client::clearFlushScheduled() {
+    _flushScheduled = false;
+}
+
+bool Client::needsPollOut() const {
+    return _needsPollOut;
+}
+
+void Client::setNeedsPollOut(bool v) {
+    _needsPollOut = v;
+}
+
+void Client::addChannel(Channel* channel) {
+    _channels.push_back(channel);
+}
+
+void Client::removeChannel(Channel* channel) {
+    for (std::vector<Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        if (*it == channel) {
+            _channels.erase(it);
+            return;
+        }
+    }
+}
+
+const std::vector<Channel*>& Client::getChannels() const {
+    return _channels;
+}
+
+void Client::addInvitedTo(Channel* channel) {
+    _invitedTo.push_back(channel);
+}
+
+void Client::removeInvitedTo(Channel* channel) {
+    for (std::vector<Channel*>::iterator it = _invitedTo.begin(); it != _invitedTo.end(); ++it) {
+        if (*it == channel) {
+            _invitedTo.erase(it);
+            return;
+        }
+    }
+}
+
+const std::vector<Channel*>& Client::getInvitedTo() const {
+    return _invitedTo;
+}
+
+void Client::markDisconnecting(const std::string& reason) {
+    _disconnecting = true;
+    _quitReason = reason;
+}
+
+bool Client::isDisconnecting() const {
+    return _disconnecting;
+}
+
+const std::string& Client::getQuitReason() const {
+    return _quitReason;
+}
+
+// The socket is gone but the session lives on: output accumulates in the queue
+// as a backlog, and anything half-written to the old socket is discarded.
+void Client::detach(const std::string& reason) {
+    _fd = -1;
+    _detachedAt = time(NULL);
+    _quitReason = reason;
+    markDirty();
+    clearInputBuffer();
+    _outputBuffer.clear();
+    _flushScheduled = false;
+    _needsPollOut = false;
+    _queuedSince = 0;
+    while (!_replyStreams.empty()) {
+        popReplyStream();
+    }
+}
+
+void Client::attachFd(int fd) {
+    _fd = fd;
+    _detachedAt = 0;
+    _quitReason.clear();
+    markDirty();
+    updateLastActive();
+    if (!_outBufQ.empty() && _flushList) {
+        _flushList->push_back(_fd);
+        _flushScheduled = true;
+    }
+}
+
+// A mirrored session follows the primary's socket without the attach side effects
+void Client::setFd(int fd) {
+    _fd = fd;
+    bumpVersion();
+}
+
+bool Client::isDetached() const {
+    return _detachedAt != 0;
+}
+
+time_t Client::getDetachedAt() const {
+    return _detachedAt;
+}
+
+const std::string& Client::getResumeToken() const {
+    return _resumeToken;
+}
+
+void Client::setResumeToken(const std::string& token) {
+    _resumeToken = token;
+    markDirty();
+}
+
+Client* Client::getResumeTarget() const {
+    return _resumeTarget;
+}
+
+void Client::setResumeTarget(Client* session) {
+    _resumeTarget = session;
+}
+
+// Hand over everything queued so far as one block
+std::string Client::takePendingOutput() {
+    std::string output;
+    output.reserve(_outBufQBytes);
+    while (!_outBufQ.empty()) {
+        output += _outBufQ.front();
+        _outBufQ.pop_front();
+    }
+    _outBufQBytes = 0;
+    _queuedSince = 0;
+    return output;
+}
+
+bool Client::isRemote() const {
+    return !_serverName.empty();
+}
+
+const std::string& Client::getServerName() const {
+    return _serverName;
+}
+
+Client* Client::getUplink() const {
+    return _uplink;
+}
+
+void Client::setRemote(const std::string& serverName, Client* uplink) {
+    _serverName = serverName;
+    _uplink = uplink;
+}
+
+void Client::setUplink(Client* uplink) {
+    _uplink = uplink;
+}
+
+Client::LinkState Client::getLinkState() const {
+    return _linkState;
+}
+
+void Client::setLinkState(LinkState state) {
+    _linkState = state;
+    markDirty();
+}
+
+const std::string& Client::getLinkPassword() const {
+    return _linkPassword;
+}
+
+void Client::setLinkPassword(const std::string& password) {
+    _linkPassword = password;
+}
+
+bool Client::isServerLink() const {
+    return _linkState == LINK_ESTABLISHED;
+}
+
+bool Client::isCaptured() const {
+    return _captured;
+}
+
+void Client::setCaptured(bool captured) {
+    _captured = captured;
+}
+
+time_t Client::getNickTs() const {
+    return _nickTs;
+}
+
+void Client::setNickTs(time_t ts) {
+    _nickTs = ts;
+    markDirty();
+}
+
+bool Client::hasCap(const std::string& cap) const {
+    return _caps.count(cap) != 0;
+}
+
+void Client::setCap(const std::string& cap, bool enabled) {
+    if (enabled)
+        _caps.insert(cap);
+    else
+        _caps.erase(cap);
+    markDirty();
+}
+
+const std::string& Client::getAccount() const {
+    return _account;
+}
+
+void Client::setAccount(const std::string& account) {
+    _account = account;
+    markDirty();
+}
+
+Client::SaslState Client::getSaslState() const {
+    return _saslState;
+}
+
+void Client::setSaslState(SaslState state) {
+    _saslState = state;
+    if (state != SASL_STARTED)
+        _saslBuffer.clear();
+}
+
+std::string& Client::getSaslBuffer() {
+    return _saslBuffer;
+}
+
+size_t Client::getPendingLogins() const {
+    return _pendingLogins;
+}
+
+void Client::setPendingLogins(size_t count) {
+    _pendingLogins = count;
+}
+
+unsigned long Client::getFanoutMark() const {
+    return _fanoutMark;
+}
+
+void Client::setFanoutMark(unsigned long mark) {
+    _fanoutMark = mark;
+}
+
+void Client::pushReplyStream(ReplyStream* stream) {
+    _replyStreams.push_back(stream);
+}
+
+ReplyStream* Client::currentReplyStream() const {
+    return _replyStreams.empty() ? NULL : _replyStreams.front();
+}
+
+void Client::popReplyStream() {
+    if (!_replyStreams.empty()) {
+        delete _replyStreams.front();
+        _replyStreams.pop_front();
+    }
+}
+
+bool Client::hasReplyStreams() const {
+    return !_replyStreams.empty();
+}
+
+bool Client::hasReadyReplyStream() const {
+    return !_replyStreams.empty() && _replyStreams.front()->isReady();
+}
+
+void Client::saveIdentity(StateWriter& out) const {
+    out.putInt(_serial);
+    out.putString(_nickname);
+    out.putString(_username);
+    out.putString(_realname);
+    out.putString(_hostname);
+    out.putInt(_receivedPass);
+    out.putInt(_receivedNick);
+    out.putInt(_receivedUser);
+    out.putInt(_registered);
+    out.putInt(_welcomeSent);
+    out.putInt(_nickTs);
+    out.putInt(_lastActive);
+    out.putString(_resumeToken);
+    out.putInt(_detachedAt);
+    out.putString(_quitReason);
+    out.putString(_account);
+    out.putString(_ip);
+
+    out.putInt(_caps.size());
+    for (std::set<std::string>::const_iterator it = _caps.begin(); it != _caps.end(); ++it)
+        out.putString(*it);
+}
+
+// Fields are assigned directly so that restoring does not mark the client dirty
+void Client::loadIdentity(StateReader& in) {
+    _serial = in.getInt();
+    _nickname = in.getString();
+    _username = in.getString();
+    _realname = in.getString();
+    _hostname = in.getString();
+    _receivedPass = in.getInt();
+    _receivedNick = in.getInt();
+    _receivedUser = in.getInt();
+    _registered = in.getInt();
+    _welcomeSent = in.getInt();
+    _nickTs = in.getInt();
+    _lastActive = in.getInt();
+    _resumeToken = in.getString();
+    _detachedAt = in.getInt();
+    _quitReason = in.getString();
+    _account = in.getString();
+    _ip = in.getString();
+    rebuildHostmask();
+    bumpVersion();
+
+    _caps.clear();
+    long caps = in.getInt();
+    for (long i = 0; i < caps && in.ok(); ++i)
+        _caps.insert(in.getString());
+}
+
+void Client::saveState(StateWriter& out) const {
+    saveIdentity(out);
+
+    // Unread input and unsent output, byte for byte
+    std::string pending = _outputBuffer;
+    for (std::deque<std::string>::const_iterator it = _outBufQ.begin(); it != _outBufQ.end(); ++it)
+        pending += *it;
+    out.putString(_inputBuffer.substr(_inputConsumed));
+    out.putString(pending);
+}
+
+void Client::loadState(StateReader& in) {
+    loadIdentity(in);
+
+    clearInputBuffer();
+    _inputBuffer = in.getString();
+    LineScanner::findNewlines(_inputBuffer.data(), _inputBuffer.length(), _lineEnds);
+    std::string pending = in.getString();
+    if (!pending.empty())
+        enqueueMessage(pending);
+}
+
+std::string Client::extractNextLine(bool& tooLong) {
+    tooLong = false;
+    if (_nextLine >= _lineEnds.size())
+        return "";
+
+    size_t start = _inputConsumed;
+    size_t end = _lineEnds[_nextLine++];
+    _inputConsumed = end + 1;
+    if (end > start && _inputBuffer[end - 1] == '\r')
+        --end;
+
+    size_t limit = lineLimit(start);
+    tooLong = end - start > limit;
+    std::string line(_inputBuffer, start, tooLong ? limit : end - start);
+    if (_nextLine == _lineEnds.size())
+        compactInput();
+    return line;
+}
+
+bool Client::hasCompleteLine() const {
+    return _nextLine < _lineEnds.size();
 }
\ No newline at end of file
@@ -1,908 +1,1318 @@
-#include "CommandHandlers.hpp"
-#include "Server.hpp"
-#include "Channel.hpp"
-
-CommandHandlers::CommandHandlers(Server* server) : _server(server) {}
-
-CommandHandlers::~CommandHandlers() {}
-
-// Check if client should be registered and send welcome if needed
-void CommandHandlers::checkRegistration(Client* client) {
-    if (client->canRegister() && !client->welcomeSent()) {
-        client->tryRegister();
-        sendWelcomeSequence(client);
-        client->setWelcomeSent(true);
-        std::cout << "Client " << client->getFd() << " (" << client->getNickname() << ") registered successfully" << std::endl;
-    }
-}
-
-// Authentication commands
-void CommandHandlers::handlePass(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "PASS :Not enough parameters");
-        return;
-    }
-
-    if (client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
-        return;
-    }
-
-    const std::string& password = params[0];
-    if (password != _server->getPassword()) {
-        sendErrorReply(client, IRC::ERR_PASSWDMISMATCH, "Password incorrect");
-        return;
-    }
-
-    client->setReceivedPass(true);
-    checkRegistration(client);
-    std::cout << "PASS accepted from client " << client->getFd() << std::endl;
-}
-
-void CommandHandlers::handleNick(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NONICKNAMEGIVEN, "No nickname given");
-        return;
-    }
-
-    const std::string& nickname = params[0];
-
-    if (!validateNickname(nickname)) {
-        sendErrorReply(client, IRC::ERR_ERRONEUSNICKNAME, nickname + " :Erroneous nickname");
-        return;
-    }
-
-    if (_server->isNicknameInUse(nickname)) {
-        sendErrorReply(client, IRC::ERR_NICKNAMEINUSE, nickname + " :Nickname is already in use");
-        return;
-    }
-
-    std::string oldNick = client->getNickname();
-    client->setNickname(nickname);
-    client->setReceivedNick(true);
-
-    // If already registered, send nick change notification to channels
-    if (client->isRegistered() && !oldNick.empty()) {
-        std::vector<Channel*> channels = _server->getClientChannels(client);
-        std::string nickMsg = ":" + oldNick + "!" + client->getUsername() + "@" + client->getHostname() + " NICK :" + nickname + "\r\n";
-
-        for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
-            (*it)->broadcast(nickMsg, NULL); // Send to all including the client
-        }
-    }
-
-    checkRegistration(client);
-    std::cout << "Client " << client->getFd() << " set nickname to " << nickname << std::endl;
-}
-
-void CommandHandlers::handleUser(Client* client, const std::vector<std::string>& params) {
-    if (client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
-        return;
-    }
-
-    if (params.size() < 4) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "USER :Not enough parameters");
-        return;
-    }
-
-    client->setUsername(params[0]);
-    client->setRealname(params[3]);
-    client->setReceivedUser(true);
-
-    checkRegistration(client);
-    std::cout << "Client " << client->getFd() << " registered with username: " << params[0] << std::endl;
-}
-
-// Keepalive commands
-void CommandHandlers::handlePing(Client* client, const std::vector<std::string>& params) {
-    std::string token = params.empty() ? "ircserv" : params[0];
-    std::string pong = ":" + std::string("ircserv") + " PONG ircserv :" + token + "\r\n";
-    _server->queueMessage(client->getFd(), pong);
-}
-
-void CommandHandlers::handlePong(Client* client, const std::vector<std::string>& params) {
-    (void)params;
-    client->updateLastActive();
-}
-
-// Communication commands
-void CommandHandlers::handleJoin(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "JOIN :Not enough parameters");
-        return;
-    }
-
-    const std::string& channelName = params[0];
-    std::string channelKey = (params.size() > 1) ? params[1] : "";
-
-    if (!validateChannelName(channelName)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(channelName);
-    if (!channel) {
-        channel = _server->createChannel(channelName);
-        // Make the first client an operator
-        channel->addOperator(client);
-    } else {
-        // Check channel restrictions
-        if (channel->isInviteOnly() && !channel->isInvited(client)) {
-            sendErrorReply(client, IRC::ERR_INVITEONLYCHAN, channelName + " :Cannot join channel (+i)");
-            return;
-        }
-
-        if (channel->getUserLimit() > 0 && channel->getMembers().size() >= channel->getUserLimit()) {
-            sendErrorReply(client, IRC::ERR_CHANNELISFULL, channelName + " :Cannot join channel (+l)");
-            return;
-        }
-
-        if (!channel->getKey().empty()) {
-            if (channelKey != channel->getKey()) {
-                sendErrorReply(client, IRC::ERR_BADCHANNELKEY, channelName + " :Cannot join channel (+k)");
-                return;
-            }
-        }
-    }
-
-    channel->addClient(client);
-
-    // Remove from invite list once joined (invite consumed)
-    if (channel->isInvited(client)) {
-        channel->removeInvite(client);
-    }
-
-    // Send JOIN confirmation to all channel members
-    std::string joinMsg = ":" + client->getHostmask() + " JOIN :" + channelName + "\r\n";
-    channel->broadcast(joinMsg, NULL); // Broadcast to all including sender
-
-    // Send topic information to the joining client
-    const std::string& topic = channel->getTopic();
-    if (topic.empty()) {
-        std::string noTopicReply = ":" + std::string("ircserv") + " " + IRC::RPL_NOTOPIC + " " + client->getNickname() + " " + channelName + " :No topic is set\r\n";
-        _server->queueMessage(client->getFd(), noTopicReply);
-    } else {
-        std::string topicReply = ":" + std::string("ircserv") + " " + IRC::RPL_TOPIC + " " + client->getNickname() + " " + channelName + " :" + topic + "\r\n";
-        _server->queueMessage(client->getFd(), topicReply);
-    }
-
-    // Send NAMES list to the joining client
-    std::string namesList = "";
-    const std::set<Client*>& members = channel->getMembers();
-    for (std::set<Client*>::const_iterator it = members.begin(); it != members.end(); ++it) {
-        if (!namesList.empty()) namesList += " ";
-        if (channel->isOperator(*it)) {
-            namesList += "@" + (*it)->getNickname();
-        } else {
-            namesList += (*it)->getNickname();
-        }
-    }
-
-    std::string namesReply = ":" + std::string("ircserv") + " " + IRC::RPL_NAMREPLY + " " + client->getNickname() + " = " + channelName + " :" + namesList + "\r\n";
-    _server->queueMessage(client->getFd(), namesReply);
-
-    std::string endNamesReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + client->getNickname() + " " + channelName + " :End of /NAMES list\r\n";
-    _server->queueMessage(client->getFd(), endNamesReply);
-}
-
-void CommandHandlers::handlePrivmsg(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NORECIPIENT, ":No recipient given (PRIVMSG)");
-        return;
-    }
-
-    const std::string& target = params[0];
-    std::string message = (params.size() > 1) ? params[1] : "";
-    if (message.empty()) {
-        sendErrorReply(client, IRC::ERR_NOTEXTTOSEND, ":No text to send");
-        return;
-    }
-
-    if (target[0] == '#') {
-        // Channel message
-        Channel* channel = _server->getChannel(target);
-        if (!channel) {
-            sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
-            return;
-        }
-
-        if (!channel->hasClient(client)) {
-            sendErrorReply(client, IRC::ERR_NOTONCHANNEL, target + " :You're not on that channel");
-            return;
-        }
-
-        std::string privmsg = ":" + client->getHostmask() + " PRIVMSG " + target + " :" + message + "\r\n";
-        channel->broadcast(privmsg, client); // Don't send back to sender
-    } else {
-        // Private message to user
-        Client* targetClient = _server->findClientByNick(target);
-        if (!targetClient) {
-            sendErrorReply(client, IRC::ERR_NOSUCHNICK, target + " :No such nick/channel");
-            return;
-        }
-
-        std::string privmsg = ":" + client->getHostmask() + " PRIVMSG " + target + " :" + message + "\r\n";
-        _server->queueMessage(targetClient->getFd(), privmsg);
-    }
-}
-
-void CommandHandlers::handleNotice(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        return; // NOTICE doesn't send error replies
-    }
-
-    if (params.size() < 2) {
-        return; // NOTICE doesn't send error replies
-    }
-
-    const std::string& target = params[0];
-    const std::string& message = params[1];
-
-    if (target[0] == '#') {
-        // Channel notice
-        Channel* channel = _server->getChannel(target);
-        if (!channel || !channel->hasClient(client)) {
-            return; // NOTICE doesn't send error replies
-        }
-
-        std::string noticeMsg = ":" + client->getHostmask() + " NOTICE " + target + " :" + message + "\r\n";
-        channel->broadcast(noticeMsg, client);
-    } else {
-        // Private notice to user
-        Client* targetClient = _server->findClientByNick(target);
-        if (!targetClient) {
-            return; // NOTICE doesn't send error replies
-        }
-
-        std::string noticeMsg = ":" + client->getHostmask() + " NOTICE " + target + " :" + message + "\r\n";
-        _server->queueMessage(targetClient->getFd(), noticeMsg);
-    }
-}
-
-void CommandHandlers::handlePart(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "PART :Not enough parameters");
-        return;
-    }
-
-    const std::string& channelName = params[0];
-    std::string partMessage = (params.size() > 1) ? params[1] : "";
-
-    if (!validateChannelName(channelName)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(channelName);
-    if (!channel) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    if (!channel->hasClient(client)) {
-        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
-        return;
-    }
-
-    // Send PART message to all channel members (including sender)
-    std::string partMsg = ":" + client->getHostmask() + " PART " + channelName;
-    if (!partMessage.empty()) {
-        partMsg += " :" + partMessage;
-    }
-    partMsg += "\r\n";
-
-    channel->broadcast(partMsg, NULL); // Send to all including sender
-
-    // Remove client from channel
-    channel->removeClient(client);
-
-    channel->promoteNewOperatorIfNeeded();
-
-    // Delete channel if empty
-    _server->deleteChannelIfEmpty(channel);
-}
-
-void CommandHandlers::handleQuit(Client* client, const std::vector<std::string>& params) {
-    std::string quitMessage = params.empty() ? "Client Quit" : params[0];
-
-    // Send QUIT message to all channels the client is in
-    std::vector<Channel*> channelsWithClient = _server->getClientChannels(client);
-    std::string quitMsg = ":" + client->getHostmask() + " QUIT :" + quitMessage + "\r\n";
-
-    for (std::vector<Channel*>::iterator it = channelsWithClient.begin();
-         it != channelsWithClient.end(); ++it) {
-        (*it)->broadcast(quitMsg, client); // Don't send to the quitting client
-    }
-
-    // Remove client from all channels
-    std::vector<Channel*> channelsToCheck = channelsWithClient;
-
-    _server->removeClientFromAllChannels(client);
-
-    for (std::vector<Channel*>::iterator it = channelsToCheck.begin();
-         it != channelsToCheck.end(); ++it) {
-        (*it)->promoteNewOperatorIfNeeded();
-    }
-}
-
-// Operator commands (simplified implementations)
-void CommandHandlers::handleKick(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.size() < 2) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "KICK :Not enough parameters");
-        return;
-    }
-
-    const std::string& channelName = params[0];
-    const std::string& targetNick = params[1];
-    std::string kickReason = (params.size() > 2) ? params[2] : client->getNickname();
-
-    if (!validateChannelName(channelName)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(channelName);
-    if (!channel) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    if (!channel->hasClient(client)) {
-        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
-        return;
-    }
-
-    if (!channel->isOperator(client)) {
-        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
-        return;
-    }
-
-    Client* targetClient = _server->findClientByNick(targetNick);
-    if (!targetClient) {
-        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
-        return;
-    }
-
-    if (!channel->hasClient(targetClient)) {
-        sendErrorReply(client, IRC::ERR_USERNOTINCHANNEL, targetNick + " " + channelName + " :They aren't on that channel");
-        return;
-    }
-
-    // Send KICK message to all channel members
-    std::string kickMsg = ":" + client->getHostmask() + " KICK " + channelName + " " + targetNick + " :" + kickReason + "\r\n";
-    channel->broadcast(kickMsg, NULL);
-
-    // Remove target from channel
-    channel->removeClient(targetClient);
-
-    channel->promoteNewOperatorIfNeeded();
-
-    // Delete channel if empty
-    _server->deleteChannelIfEmpty(channel);
-}
-
-void CommandHandlers::handleInvite(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.size() < 2) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "INVITE :Not enough parameters");
-        return;
-    }
-
-    const std::string& targetNick = params[0];
-    const std::string& channelName = params[1];
-
-    if (!validateChannelName(channelName)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    Client* targetClient = _server->findClientByNick(targetNick);
-    if (!targetClient) {
-        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(channelName);
-    if (!channel) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    if (!channel->hasClient(client)) {
-        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
-        return;
-    }
-
-    if (!channel->isOperator(client)) {
-        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
-        return;
-    }
-
-    if (channel->hasClient(targetClient)) {
-        sendErrorReply(client, IRC::ERR_USERONCHANNEL, targetNick + " " + channelName + " :is already on channel");
-        return;
-    }
-
-    // Add target to invite list
-    channel->addInvite(targetClient);
-
-    // Send INVITE confirmation to inviter
-    std::string inviteReply = ":" + std::string("ircserv") + " 341 " + client->getNickname() + " " + targetNick + " " + channelName + "\r\n";
-    _server->queueMessage(client->getFd(), inviteReply);
-
-    // Send INVITE notification to target
-    std::string inviteMsg = ":" + client->getHostmask() + " INVITE " + targetNick + " :" + channelName + "\r\n";
-    _server->queueMessage(targetClient->getFd(), inviteMsg);
-}
-
-void CommandHandlers::handleTopic(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "TOPIC :Not enough parameters");
-        return;
-    }
-
-    const std::string& channelName = params[0];
-
-    if (!validateChannelName(channelName)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(channelName);
-    if (!channel) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
-        return;
-    }
-
-    if (!channel->hasClient(client)) {
-        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
-        return;
-    }
-
-    if (params.size() == 1) {
-        // View topic
-        const std::string& topic = channel->getTopic();
-        if (topic.empty()) {
-            std::string noTopicReply = ":" + std::string("ircserv") + " " + IRC::RPL_NOTOPIC + " " + client->getNickname() + " " + channelName + " :No topic is set\r\n";
-            _server->queueMessage(client->getFd(), noTopicReply);
-        } else {
-            std::string topicReply = ":" + std::string("ircserv") + " " + IRC::RPL_TOPIC + " " + client->getNickname() + " " + channelName + " :" + topic + "\r\n";
-            _server->queueMessage(client->getFd(), topicReply);
-        }
-    } else {
-        // Set topic - check if client has permission
-        if (channel->isTopicRestricted() && !channel->isOperator(client)) {
-            sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
-            return;
-        }
-
-        const std::string& newTopic = params[1];
-        channel->setTopic(newTopic);
-
-        // Broadcast topic change to all channel members
-        std::string topicMsg = ":" + client->getHostmask() + " TOPIC " + channelName + " :" + newTopic + "\r\n";
-        channel->broadcast(topicMsg, NULL);
-    }
-}
-
-void CommandHandlers::handleMode(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "MODE :Not enough parameters");
-        return;
-    }
-
-    const std::string& target = params[0];
-
-    // Only handle channel modes
-    if (target[0] != '#') {
-        sendErrorReply(client, IRC::ERR_UNKNOWNMODE, "User modes not supported");
-        return;
-    }
-
-    if (!validateChannelName(target)) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
-        return;
-    }
-
-    Channel* channel = _server->getChannel(target);
-    if (!channel) {
-        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
-        return;
-    }
-
-    if (!channel->hasClient(client)) {
-        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, target + " :You're not on that channel");
-        return;
-    }
-
-    if (params.size() == 1) {
-        // Query mode - return current channel modes
-        std::string modeString = channel->getModeString();
-        if (modeString.empty()) modeString = "+";
-
-        std::string modeReply = ":" + std::string("ircserv") + " 324 " + client->getNickname() + " " + target + " " + modeString + "\r\n";
-        _server->queueMessage(client->getFd(), modeReply);
-        return;
-    }
-
-    // Setting modes - check if client is operator
-    if (!channel->isOperator(client)) {
-        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, target + " :You're not channel operator");
-        return;
-    }
-
-    const std::string& modeString = params[1];
-    std::vector<std::string> modeParams;
-    for (size_t i = 2; i < params.size(); ++i) {
-        modeParams.push_back(params[i]);
-    }
-
-    // Parse and apply modes (simplified)
-    bool adding = true;
-    size_t paramIndex = 0;
-    std::string appliedModes = "";
-    std::string appliedParams = "";
-
-    for (size_t i = 0; i < modeString.length(); ++i) {
-        char mode = modeString[i];
-
-        if (mode == '+') {
-            adding = true;
-            continue;
-        }
-        if (mode == '-') {
-            adding = false;
-            continue;
-        }
-
-        switch (mode) {
-            case 'i': // Invite only
-                channel->setInviteOnly(adding);
-                if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != (adding ? '+' : '-')) {
-                    appliedModes += (adding ? '+' : '-');
-                }
-                appliedModes += "i";
-                break;
-
-            case 't': // Topic restricted
-                channel->setTopicRestricted(adding);
-                if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != (adding ? '+' : '-')) {
-                    appliedModes += (adding ? '+' : '-');
-                }
-                appliedModes += "t";
-                break;
-
-            case 'k': // Channel key
-                if (adding && paramIndex < modeParams.size()) {
-                    channel->setKey(modeParams[paramIndex]);
-                    if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != '+') {
-                        appliedModes += "+";
-                    }
-                    appliedModes += "k";
-                    appliedParams += " " + modeParams[paramIndex];
-                    paramIndex++;
-                } else if (!adding) {
-                    channel->setKey("");
-                    if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != '-') {
-                        appliedModes += "-";
-                    }
-                    appliedModes += "k";
-                }
-                break;
-
-            case 'l': // User limit
-                if (adding && paramIndex < modeParams.size()) {
-                    size_t limit = static_cast<size_t>(std::atoi(modeParams[paramIndex].c_str()));
-                    if (limit > 0) {
-                        channel->setUserLimit(limit);
-                        if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != '+') {
-                            appliedModes += "+";
-                        }
-                        appliedModes += "l";
-                        appliedParams += " " + modeParams[paramIndex];
-                    }
-                    paramIndex++;
-                } else if (!adding) {
-                    channel->setUserLimit(0);
-                    if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != '-') {
-                        appliedModes += "-";
-                    }
-                    appliedModes += "l";
-                }
-                break;
-
-            case 'o': // Operator privilege
-                if (paramIndex < modeParams.size()) {
-                    Client* targetClient = _server->findClientByNick(modeParams[paramIndex]);
-                    if (targetClient && channel->hasClient(targetClient)) {
-                        if (adding) {
-                            channel->addOperator(targetClient);
-                        } else {
-                            channel->removeOperator(targetClient);
-                        }
-                        if (appliedModes.empty() || appliedModes[appliedModes.length() - 1] != (adding ? '+' : '-')) {
-                            appliedModes += (adding ? '+' : '-');
-                        }
-                        appliedModes += "o";
-                        appliedParams += " " + modeParams[paramIndex];
-                    }
-                    paramIndex++;
-                }
-                break;
-
-            default:
-                sendErrorReply(client, IRC::ERR_UNKNOWNMODE, std::string(1, mode) + " :is unknown mode char to me");
-                // Continue processing remaining modes instead of aborting
-                break;
-        }
-    }
-
-    // Broadcast mode change to all channel members
-    if (!appliedModes.empty()) {
-        std::string modeMsg = ":" + client->getHostmask() + " MODE " + target + " " + appliedModes + appliedParams + "\r\n";
-        channel->broadcast(modeMsg, NULL);
-    }
-
-    // Check if we need to promote a new operator after mode changes
-    channel->promoteNewOperatorIfNeeded();
-}
-
-// Information commands
-void CommandHandlers::handleCap(Client* client, const std::vector<std::string>& params) {
-    if (params.empty()) {
-        return;
-    }
-
-    const std::string& subcommand = params[0];
-    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
-
-    if (subcommand == "LS") {
-        std::string capReply = ":" + std::string("ircserv") + " CAP " + nick + " LS :\r\n";
-        _server->queueMessage(client->getFd(), capReply);
-    } else if (subcommand == "REQ") {
-        std::string capReply = ":" + std::string("ircserv") + " CAP " + nick + " NAK :\r\n";
-        _server->queueMessage(client->getFd(), capReply);
-    } else if (subcommand == "END") {
-        // CAP negotiation finished
-    }
-}
-
-void CommandHandlers::handleWho(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    std::string target = params.empty() ? "*" : params[0];
-    std::string nick = client->getNickname();
-
-    if (target.empty() || target == "*") {
-        std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHO + " " + nick + " * :End of WHO list\r\n";
-        _server->queueMessage(client->getFd(), endReply);
-        return;
-    }
-
-    if (target[0] == '#') {
-        Channel* channel = _server->getChannel(target);
-        if (channel) {
-            const std::set<Client*>& members = channel->getMembers();
-            for (std::set<Client*>::const_iterator it = members.begin(); it != members.end(); ++it) {
-                Client* member = *it;
-                std::string flags = "H";
-                if (channel->isOperator(member)) flags += "@";
-
-                std::string whoReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOREPLY + " " + nick + " " + target + " " +
-                                     member->getUsername() + " " + member->getHostname() + " ircserv " +
-                                     member->getNickname() + " " + flags + " :0 " + member->getRealname() + "\r\n";
-                _server->queueMessage(client->getFd(), whoReply);
-            }
-        }
-    }
-
-    std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHO + " " + nick + " " + target + " :End of WHO list\r\n";
-    _server->queueMessage(client->getFd(), endReply);
-}
-
-void CommandHandlers::handleWhois(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    if (params.empty()) {
-        sendErrorReply(client, IRC::ERR_NONICKNAMEGIVEN, "No nickname given");
-        return;
-    }
-
-    const std::string& targetNick = params[0];
-    Client* target = _server->findClientByNick(targetNick);
-
-    if (!target) {
-        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
-        std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHOIS + " " + client->getNickname() + " " + targetNick + " :End of WHOIS list\r\n";
-        _server->queueMessage(client->getFd(), endReply);
-        return;
-    }
-
-    std::string nick = client->getNickname();
-
-    // RPL_WHOISUSER
-    std::string userReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISUSER + " " + nick + " " + targetNick + " " +
-                           target->getUsername() + " " + target->getHostname() + " * :" + target->getRealname() + "\r\n";
-    _server->queueMessage(client->getFd(), userReply);
-
-    // RPL_WHOISSERVER
-    std::string serverReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISSERVER + " " + nick + " " + targetNick + " ircserv :IRC Server\r\n";
-    _server->queueMessage(client->getFd(), serverReply);
-
-    // RPL_WHOISCHANNELS
-    std::vector<Channel*> channels = _server->getClientChannels(target);
-    if (!channels.empty()) {
-        std::string channelList;
-        for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
-            if (!channelList.empty()) channelList += " ";
-            if ((*it)->isOperator(target)) channelList += "@";
-            channelList += (*it)->getName();
-        }
-        std::string channelsReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISCHANNELS + " " + nick + " " + targetNick + " :" + channelList + "\r\n";
-        _server->queueMessage(client->getFd(), channelsReply);
-    }
-
-    // RPL_ENDOFWHOIS
-    std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHOIS + " " + nick + " " + targetNick + " :End of WHOIS list\r\n";
-    _server->queueMessage(client->getFd(), endReply);
-}
-
-void CommandHandlers::handleList(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    (void)params; // Unused for now
-    std::string nick = client->getNickname();
-
-    // RPL_LISTSTART
-    std::string startReply = ":" + std::string("ircserv") + " " + IRC::RPL_LISTSTART + " " + nick + " Channel :Users Name\r\n";
-    _server->queueMessage(client->getFd(), startReply);
-
-    // RPL_LISTEND
-    std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_LISTEND + " " + nick + " :End of LIST\r\n";
-    _server->queueMessage(client->getFd(), endReply);
-}
-
-void CommandHandlers::handleNames(Client* client, const std::vector<std::string>& params) {
-    if (!client->isRegistered()) {
-        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
-        return;
-    }
-
-    std::string nick = client->getNickname();
-
-    if (params.empty()) {
-        std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + nick + " * :End of NAMES list\r\n";
-        _server->queueMessage(client->getFd(), endReply);
-        return;
-    }
-
-    const std::string& channelName = params[0];
-    Channel* channel = _server->getChannel(channelName);
-
-    if (channel) {
-        std::string namesList;
-        const std::set<Client*>& members = channel->getMembers();
-        for (std::set<Client*>::const_iterator it = members.begin(); it != members.end(); ++it) {
-            if (!namesList.empty()) namesList += " ";
-            if (channel->isOperator(*it)) namesList += "@";
-            namesList += (*it)->getNickname();
-        }
-
-        if (!namesList.empty()) {
-            std::string namesReply = ":" + std::string("ircserv") + " " + IRC::RPL_NAMREPLY + " " + nick + " = " + channelName + " :" + namesList + "\r\n";
-            _server->queueMessage(client->getFd(), namesReply);
-        }
-    }
-
-    std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + nick + " " + channelName + " :End of NAMES list\r\n";
-    _server->queueMessage(client->getFd(), endReply);
-}
-
-// Utility functions
-void CommandHandlers::sendWelcomeSequence(Client* client) {
-    std::string nick = client->getNickname();
-    std::string hostname = client->getHostname();
-
-    std::string welcome = ":" + std::string("ircserv") + " " + IRC::RPL_WELCOME + " " + nick + " :Welcome to the IRC Network " + client->getHostmask() + "\r\n";
-    _server->queueMessage(client->getFd(), welcome);
-
-    std::string yourhost = ":" + std::string("ircserv") + " " + IRC::RPL_YOURHOST + " " + nick + " :Your host is ircserv, running version 1.0\r\n";
-    _server->queueMessage(client->getFd(), yourhost);
-
-    std::string created = ":" + std::string("ircserv") + " " + IRC::RPL_CREATED + " " + nick + " :This server was created today\r\n";
-    _server->queueMessage(client->getFd(), created);
-
-    std::string myinfo = ":" + std::string("ircserv") + " " + IRC::RPL_MYINFO + " " + nick + " ircserv 1.0 o o\r\n";
-    _server->queueMessage(client->getFd(), myinfo);
-
-    // ISUPPORT
-    std::string isupport = ":" + std::string("ircserv") + " 005 " + nick + " CHANTYPES=# PREFIX=(o)@ CASEMAPPING=rfc1459 :are supported by this server\r\n";
-    _server->queueMessage(client->getFd(), isupport);
-}
-
-void CommandHandlers::sendErrorReply(Client* client, const std::string& code, const std::string& message) {
-    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
-    std::string reply = ":" + std::string("ircserv") + " " + code + " " + nick + " " + message + "\r\n";
-    _server->queueMessage(client->getFd(), reply);
-}
-
-bool CommandHandlers::validateNickname(const std::string& nickname) {
-    if (nickname.empty() || nickname.length() > 9) {
-        return false;
-    }
-
-    char first = nickname[0];
-    if (!std::isalpha(first) && first != '[' && first != ']' && first != '\\' &&
-        first != '`' && first != '_' && first != '^' && first != '{' && first != '}') {
-        return false;
-    }
-
-    for (size_t i = 1; i < nickname.length(); ++i) {
-        char c = nickname[i];
-        if (!std::isalnum(c) && c != '[' && c != ']' && c != '\\' &&
-            c != '`' && c != '_' && c != '^' && c != '{' && c != '}' && c != '-') {
-            return false;
-        }
-    }
-
-    return true;
-}
-
-bool CommandHandlers::validateChannelName(const std::string& channel) {
-    if (channel.empty() || channel[0] != '#' || channel.length() > 50) {
-        return false;
-    }
-
-    for (size_t i = 1; i < channel.length(); ++i) {
-        char c = channel[i];
-        if (c == ' ' || c == ',' || c == '\r' || c == '\n' || c == '\0') {
-            return false;
-        }
-    }
-
-    return true;
-}
+#include "CommandHandlers.hpp"
+#include "Server.hpp"
+#include "Channel.hpp"
+#include "WhoQuery.hpp"
+#include "NamesQuery.hpp"
+#include "ListQuery.hpp"
+#include "HistoryQuery.hpp"
+#include "PasswordHash.hpp"
+#include "Probes.hpp"
+#include "AllocProfile.hpp"
+#include "utils.hpp"
+#include <algorithm>
+#include <sstream>
+
+CommandHandlers::CommandHandlers(Server* server) : _server(server), _batchCounter(0) {}
+
+CommandHandlers::~CommandHandlers() {}
+
+// Check if client should be registered and send welcome if needed
+void CommandHandlers::checkRegistration(Client* client) {
+    // A SASL exchange or hostname lookup in progress holds registration until it settles
+    if (client->getSaslState() != Client::SASL_NONE || client->getLookupDeadline() != 0) {
+        return;
+    }
+    if (client->canRegister() && !client->welcomeSent()) {
+        client->tryRegister();
+        sendWelcomeSequence(client);
+        client->setWelcomeSent(true);
+        if (client->hasCap(IRC::CAP_RESUME))
+            sendResumeToken(client);
+        _server->getNetwork().introduceUser(client);
+        IRCSERV_PROBE2(client__register, client->getFd(), client->getNickname().c_str());
+        std::cout << "Client " << client->getFd() << " (" << client->getNickname() << ") registered successfully" << std::endl;
+    }
+}
+
+// Authentication commands
+void CommandHandlers::handlePass(Client* client, const std::vector<std::string>& params) {
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "PASS :Not enough parameters");
+        return;
+    }
+
+    if (client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
+        return;
+    }
+
+    const std::string& password = params[0];
+
+    // A server's link password, for its connect block; the SERVER that follows checks it
+    if (params.size() > 1 && params[1] == "TS") {
+        client->setLinkPassword(password);
+        return;
+    }
+
+    if (password != _server->getPassword()) {
+        sendErrorReply(client, IRC::ERR_PASSWDMISMATCH, "Password incorrect");
+        return;
+    }
+
+    client->setReceivedPass(true);
+    checkRegistration(client);
+    std::cout << "PASS accepted from client " << client->getFd() << std::endl;
+}
+
+void CommandHandlers::handleNick(Client* client, const std::vector<std::string>& params) {
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NONICKNAMEGIVEN, "No nickname given");
+        return;
+    }
+
+    const std::string& nickname = params[0];
+
+    if (!validateNickname(nickname)) {
+        sendErrorReply(client, IRC::ERR_ERRONEUSNICKNAME, nickname + " :Erroneous nickname");
+        return;
+    }
+
+    Client* holder = _server->findClientByNick(nickname);
+    if (holder && holder != client) {
+        sendErrorReply(client, IRC::ERR_NICKNAMEINUSE, nickname + " :Nickname is already in use");
+        return;
+    }
+
+    std::string oldNick = client->getNickname();
+    std::string oldHostmask = client->getHostmask();
+    _server->setClientNickname(client, nickname);
+    client->setReceivedNick(true);
+
+    // If already registered, send nick change notification once to everyone sharing a channel
+    if (client->isRegistered() && !oldNick.empty()) {
+        std::vector<Channel*> channels = _server->getClientChannels(client);
+        for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+            (*it)->invalidateBanCache(client); // Hostmask changed
+        }
+
+        std::string nickMsg = ":" + oldHostmask + " NICK :" + nickname + "\r\n";
+        _server->broadcastToCommonChannels(client, nickMsg, true);
+
+        std::ostringstream linkMsg;
+        linkMsg << ":" << oldHostmask << " NICK " << nickname << " " << client->getNickTs() << "\r\n";
+        _server->getNetwork().propagate(linkMsg.str(), NULL);
+    }
+
+    checkRegistration(client);
+    std::cout << "Client " << client->getFd() << " set nickname to " << nickname << std::endl;
+}
+
+void CommandHandlers::handleUser(Client* client, const std::vector<std::string>& params) {
+    if (client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
+        return;
+    }
+
+    if (params.size() < 4) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "USER :Not enough parameters");
+        return;
+    }
+
+    _server->setClientUsername(client, params[0]);
+    client->setRealname(params[3]);
+    client->setReceivedUser(true);
+
+    checkRegistration(client);
+    std::cout << "Client " << client->getFd() << " registered with username: " << params[0] << std::endl;
+}
+
+// Keepalive commands
+void CommandHandlers::handlePing(Client* client, const std::vector<std::string>& params) {
+    std::string token = params.empty() ? "ircserv" : params[0];
+    std::string pong = ":" + std::string("ircserv") + " PONG ircserv :" + token + "\r\n";
+    _server->queueMessage(client->getFd(), pong);
+}
+
+void CommandHandlers::handlePong(Client* client, const std::vector<std::string>& params) {
+    (void)params;
+    client->updateLastActive();
+}
+
+// Communication commands
+void CommandHandlers::handleJoin(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "JOIN :Not enough parameters");
+        return;
+    }
+
+    const std::string& channelName = params[0];
+    std::string channelKey = (params.size() > 1) ? params[1] : "";
+
+    if (!validateChannelName(channelName)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    // A channel restored from the store keeps its bans, key and limits even
+    // for the first joiner; whoever gets in first is opped, as on a new one,
+    // so that somebody can manage it again
+    Channel* channel = _server->getChannel(channelName);
+    bool creating = (channel == NULL);
+    bool restored = false;
+    if (creating)
+        channel = _server->createChannel(channelName, &restored);
+    bool fresh = creating && !restored;
+    if (!fresh && !checkJoinRestrictions(client, channel, channelKey)) {
+        if (creating)
+            _server->discardChannel(channelName);
+        return;
+    }
+
+    channel->addClient(client);
+    if (creating) {
+        // Make the first client an operator
+        channel->addOperator(client);
+    }
+
+    // Remove from invite list once joined (invite consumed)
+    if (channel->isInvited(client)) {
+        channel->removeInvite(client);
+    }
+
+    // Send JOIN confirmation to all channel members; under +D only the joiner
+    // sees it until they speak or get opped
+    std::string joinMsg = client->buildMessage("JOIN", "", channelName);
+    if (channel->hasMode(Channel::MODE_DELAYED_JOIN) && !creating) {
+        channel->setMemberFlag(client, Channel::MEMBER_HIDDEN, true);
+        _server->queueMessage(client->getFd(), joinMsg);
+    } else {
+        channel->broadcast(joinMsg, NULL); // Broadcast to all including sender
+    }
+    _server->getNetwork().propagateJoin(channel, client);
+
+    // Send topic information to the joining client
+    const std::string& topic = channel->getTopic();
+    if (topic.empty()) {
+        std::string noTopicReply = ":" + std::string("ircserv") + " " + IRC::RPL_NOTOPIC + " " + client->getNickname() + " " + channelName + " :No topic is set\r\n";
+        _server->queueMessage(client->getFd(), noTopicReply);
+    } else {
+        std::string topicReply = ":" + std::string("ircserv") + " " + IRC::RPL_TOPIC + " " + client->getNickname() + " " + channelName + " :" + topic + "\r\n";
+        _server->queueMessage(client->getFd(), topicReply);
+    }
+
+    // Send NAMES list to the joining client
+    std::string namesList = buildNamesList(channel, client);
+
+    std::string namesReply = ":" + std::string("ircserv") + " " + IRC::RPL_NAMREPLY + " " + client->getNickname() + " " + Channel::namesSymbol(channel->getModes()) + " " + channelName + " :" + namesList + "\r\n";
+    _server->queueMessage(client->getFd(), namesReply);
+
+    std::string endNamesReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + client->getNickname() + " " + channelName + " :End of /NAMES list\r\n";
+    _server->queueMessage(client->getFd(), endNamesReply);
+}
+
+// Sends the refusal and returns false when the client may not join
+bool CommandHandlers::checkJoinRestrictions(Client* client, Channel* channel, const std::string& key) {
+    const std::string& channelName = channel->getName();
+    if (channel->isBanned(client) && !channel->isInvited(client)) {
+        sendErrorReply(client, IRC::ERR_BANNEDFROMCHAN, channelName + " :Cannot join channel (+b)");
+        return false;
+    }
+
+    if (channel->hasMode(Channel::MODE_INVITE_ONLY) && !channel->isInvited(client) && !channel->isInviteExempt(client)) {
+        sendErrorReply(client, IRC::ERR_INVITEONLYCHAN, channelName + " :Cannot join channel (+i)");
+        return false;
+    }
+
+    if (channel->getUserLimit() > 0 && channel->getMemberCount() >= channel->getUserLimit()) {
+        sendErrorReply(client, IRC::ERR_CHANNELISFULL, channelName + " :Cannot join channel (+l)");
+        return false;
+    }
+
+    if (!channel->getKey().empty() && key != channel->getKey()) {
+        sendErrorReply(client, IRC::ERR_BADCHANNELKEY, channelName + " :Cannot join channel (+k)");
+        return false;
+    }
+    return true;
+}
+
+void CommandHandlers::handlePrivmsg(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NORECIPIENT, ":No recipient given (PRIVMSG)");
+        return;
+    }
+
+    const std::string& target = params[0];
+    std::string message = (params.size() > 1) ? params[1] : "";
+    if (message.empty()) {
+        sendErrorReply(client, IRC::ERR_NOTEXTTOSEND, ":No text to send");
+        return;
+    }
+
+    if (target[0] == '#') {
+        // Channel message
+        Channel* channel = _server->getChannel(target);
+        if (!channel) {
+            sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
+            return;
+        }
+
+        if (char mode = channel->sendRestriction(client)) {
+            sendErrorReply(client, IRC::ERR_CANNOTSENDTOCHAN, target + " :Cannot send to channel (+" + mode + ")");
+            return;
+        }
+
+        channel->revealMember(client); // Speaking ends +D invisibility
+        std::string privmsg = client->buildMessage("PRIVMSG", target, message);
+        channel->broadcast(privmsg, client, true); // Don't send back to sender; keep for CHATHISTORY
+        _server->getNetwork().relayToChannel(channel, privmsg, client->getUplink());
+    } else {
+        // Private message to user
+        Client* targetClient = _server->findClientByNick(target);
+        if (!targetClient) {
+            sendErrorReply(client, IRC::ERR_NOSUCHNICK, target + " :No such nick/channel");
+            return;
+        }
+
+        std::string privmsg = client->buildMessage("PRIVMSG", target, message);
+        _server->queueMessage(targetClient, privmsg);
+    }
+}
+
+void CommandHandlers::handleNotice(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        return; // NOTICE doesn't send error replies
+    }
+
+    if (params.size() < 2) {
+        return; // NOTICE doesn't send error replies
+    }
+
+    const std::string& target = params[0];
+    const std::string& message = params[1];
+
+    if (target[0] == '#') {
+        // Channel notice
+        Channel* channel = _server->getChannel(target);
+        if (!channel || channel->sendRestriction(client)) {
+            return; // NOTICE doesn't send error replies
+        }
+
+        channel->revealMember(client); // Speaking ends +D invisibility
+        std::string noticeMsg = client->buildMessage("NOTICE", target, message);
+        channel->broadcast(noticeMsg, client, true);
+        _server->getNetwork().relayToChannel(channel, noticeMsg, client->getUplink());
+    } else {
+        // Private notice to user
+        Client* targetClient = _server->findClientByNick(target);
+        if (!targetClient) {
+            return; // NOTICE doesn't send error replies
+        }
+
+        std::string noticeMsg = client->buildMessage("NOTICE", target, message);
+        _server->queueMessage(targetClient, noticeMsg);
+    }
+}
+
+void CommandHandlers::handlePart(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "PART :Not enough parameters");
+        return;
+    }
+
+    const std::string& channelName = params[0];
+    std::string partMessage = (params.size() > 1) ? params[1] : "";
+
+    if (!validateChannelName(channelName)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    Channel* channel = _server->getChannel(channelName);
+    if (!channel) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    if (!channel->hasClient(client)) {
+        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
+        return;
+    }
+
+    // Send PART message to all channel members (including sender)
+    std::string partMsg = partMessage.empty() ? client->buildMessage("PART", channelName)
+                                              : client->buildMessage("PART", channelName, partMessage);
+
+    if (channel->isHidden(client)) {
+        _server->queueMessage(client->getFd(), partMsg); // Nobody else saw the JOIN
+    } else {
+        channel->broadcast(partMsg, NULL); // Send to all including sender
+    }
+    _server->getNetwork().propagate(partMsg, client->getUplink());
+
+    // Remove client from channel
+    channel->removeClient(client);
+
+    channel->promoteNewOperatorIfNeeded();
+
+    // Delete channel if empty
+    _server->deleteChannelIfEmpty(channel);
+}
+
+void CommandHandlers::handleQuit(Client* client, const std::vector<std::string>& params) {
+    std::string quitMessage = params.empty() ? "Client Quit" : params[0];
+
+    std::string errorMsg = "ERROR :Closing Link: " + client->getHostname() + " (" + quitMessage + ")\r\n";
+    _server->queueMessage(client->getFd(), errorMsg);
+
+    // QUIT fan-out and channel cleanup happen with the rest of this tick's disconnections
+    _server->handleClientDisconnection(client->getFd(), quitMessage);
+}
+
+// Operator commands (simplified implementations)
+void CommandHandlers::handleKick(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.size() < 2) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "KICK :Not enough parameters");
+        return;
+    }
+
+    const std::string& channelName = params[0];
+    const std::string& targetNick = params[1];
+    std::string kickReason = (params.size() > 2) ? params[2] : client->getNickname();
+
+    if (!validateChannelName(channelName)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    Channel* channel = _server->getChannel(channelName);
+    if (!channel) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    if (!channel->hasClient(client)) {
+        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
+        return;
+    }
+
+    if (!channel->isOperator(client)) {
+        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
+        return;
+    }
+
+    Client* targetClient = _server->findClientByNick(targetNick);
+    if (!targetClient) {
+        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
+        return;
+    }
+
+    if (!channel->hasClient(targetClient)) {
+        sendErrorReply(client, IRC::ERR_USERNOTINCHANNEL, targetNick + " " + channelName + " :They aren't on that channel");
+        return;
+    }
+
+    // Send KICK message to all channel members
+    std::string kickMsg = client->buildMessage("KICK", channelName + " " + targetNick, kickReason);
+    if (channel->isHidden(targetClient)) {
+        // Only the kicker and the target know the target was there
+        _server->queueMessage(client->getFd(), kickMsg);
+        targetClient->enqueueMessage(kickMsg); // a remote target hears it from its own server
+    } else {
+        channel->broadcast(kickMsg, NULL);
+    }
+    _server->getNetwork().propagate(kickMsg, client->getUplink());
+
+    // Remove target from channel
+    channel->removeClient(targetClient);
+
+    channel->promoteNewOperatorIfNeeded();
+
+    // Delete channel if empty
+    _server->deleteChannelIfEmpty(channel);
+}
+
+void CommandHandlers::handleInvite(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.size() < 2) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "INVITE :Not enough parameters");
+        return;
+    }
+
+    const std::string& targetNick = params[0];
+    const std::string& channelName = params[1];
+
+    if (!validateChannelName(channelName)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    Client* targetClient = _server->findClientByNick(targetNick);
+    if (!targetClient) {
+        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
+        return;
+    }
+
+    Channel* channel = _server->getChannel(channelName);
+    if (!channel) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    if (!channel->hasClient(client)) {
+        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
+        return;
+    }
+
+    if (!channel->isOperator(client)) {
+        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
+        return;
+    }
+
+    if (channel->hasClient(targetClient)) {
+        sendErrorReply(client, IRC::ERR_USERONCHANNEL, targetNick + " " + channelName + " :is already on channel");
+        return;
+    }
+
+    // Add target to invite list
+    channel->addInvite(targetClient);
+
+    // Send INVITE confirmation to inviter
+    std::string inviteReply = ":" + std::string("ircserv") + " 341 " + client->getNickname() + " " + targetNick + " " + channelName + "\r\n";
+    _server->queueMessage(client->getFd(), inviteReply);
+
+    // Send INVITE notification to target
+    std::string inviteMsg = client->buildMessage("INVITE", targetNick, channelName);
+    _server->queueMessage(targetClient, inviteMsg);
+}
+
+void CommandHandlers::handleTopic(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "TOPIC :Not enough parameters");
+        return;
+    }
+
+    const std::string& channelName = params[0];
+
+    if (!validateChannelName(channelName)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    Channel* channel = _server->getChannel(channelName);
+    if (!channel) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, channelName + " :No such channel");
+        return;
+    }
+
+    if (!channel->hasClient(client)) {
+        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, channelName + " :You're not on that channel");
+        return;
+    }
+
+    if (params.size() == 1) {
+        // View topic
+        const std::string& topic = channel->getTopic();
+        if (topic.empty()) {
+            std::string noTopicReply = ":" + std::string("ircserv") + " " + IRC::RPL_NOTOPIC + " " + client->getNickname() + " " + channelName + " :No topic is set\r\n";
+            _server->queueMessage(client->getFd(), noTopicReply);
+        } else {
+            std::string topicReply = ":" + std::string("ircserv") + " " + IRC::RPL_TOPIC + " " + client->getNickname() + " " + channelName + " :" + topic + "\r\n";
+            _server->queueMessage(client->getFd(), topicReply);
+        }
+    } else {
+        // Set topic - check if client has permission
+        if (channel->hasMode(Channel::MODE_TOPIC_RESTRICTED) && !channel->isOperator(client)) {
+            sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, channelName + " :You're not channel operator");
+            return;
+        }
+
+        const std::string& newTopic = params[1];
+        channel->setTopic(newTopic);
+        channel->revealMember(client);
+
+        // Broadcast topic change to all channel members
+        std::string topicMsg = client->buildMessage("TOPIC", channelName, newTopic);
+        channel->broadcast(topicMsg, NULL);
+        _server->getNetwork().propagate(topicMsg, client->getUplink());
+    }
+}
+
+void CommandHandlers::handleMode(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "MODE :Not enough parameters");
+        return;
+    }
+
+    const std::string& target = params[0];
+
+    // Only handle channel modes
+    if (target[0] != '#') {
+        sendErrorReply(client, IRC::ERR_UNKNOWNMODE, "User modes not supported");
+        return;
+    }
+
+    if (!validateChannelName(target)) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
+        return;
+    }
+
+    Channel* channel = _server->getChannel(target);
+    if (!channel) {
+        sendErrorReply(client, IRC::ERR_NOSUCHCHANNEL, target + " :No such channel");
+        return;
+    }
+
+    if (!channel->hasClient(client)) {
+        sendErrorReply(client, IRC::ERR_NOTONCHANNEL, target + " :You're not on that channel");
+        return;
+    }
+
+    if (params.size() == 1) {
+        // Query mode - return current channel modes
+        std::string modeString = channel->getModeString();
+        if (modeString.empty()) modeString = "+";
+
+        std::string modeReply = ":" + std::string("ircserv") + " 324 " + client->getNickname() + " " + target + " " + modeString + "\r\n";
+        _server->queueMessage(client->getFd(), modeReply);
+        return;
+    }
+
+    const std::string& modeString = params[1];
+
+    // Setting modes - check if client is operator (list queries like "MODE #chan b" are open to members)
+    bool listQuery = (params.size() == 2);
+    for (size_t i = 0; i < modeString.length() && listQuery; ++i) {
+        const Channel::ModeSpec* spec = Channel::findMode(modeString[i]);
+        listQuery = (modeString[i] == '+') || (spec && spec->type == Channel::MODE_TYPE_LIST);
+    }
+    if (!channel->isOperator(client) && !listQuery) {
+        sendErrorReply(client, IRC::ERR_CHANOPRIVSNEEDED, target + " :You're not channel operator");
+        return;
+    }
+
+    // Each letter is looked up in the mode table; its type says whether it
+    // takes the next parameter and how it is applied
+    bool adding = true;
+    size_t paramIndex = 2;
+    char appliedSign = 0;
+    std::string appliedModes = "";
+    std::string appliedParams = "";
+
+    for (size_t i = 0; i < modeString.length(); ++i) {
+        char mode = modeString[i];
+
+        if (mode == '+' || mode == '-') {
+            adding = (mode == '+');
+            continue;
+        }
+
+        const Channel::ModeSpec* spec = Channel::findMode(mode);
+        if (!spec) {
+            sendErrorReply(client, IRC::ERR_UNKNOWNMODE, std::string(1, mode) + " :is unknown mode char to me");
+            // Continue processing remaining modes instead of aborting
+            continue;
+        }
+
+        std::string param;
+        bool takesParam = spec->type == Channel::MODE_TYPE_LIST || spec->type == Channel::MODE_TYPE_PREFIX ||
+                          spec->type == Channel::MODE_TYPE_PARAM || (spec->type == Channel::MODE_TYPE_SETTING && adding);
+        if (takesParam && paramIndex < params.size()) {
+            param = params[paramIndex++];
+        } else if (takesParam && spec->type == Channel::MODE_TYPE_LIST) {
+            sendChannelList(client, channel, mode);
+            continue;
+        } else if (takesParam && (adding || spec->type != Channel::MODE_TYPE_PARAM)) {
+            continue;   // "-k" alone is accepted, nothing else goes without its parameter
+        }
+
+        if (!applyChannelMode(client, channel, *spec, adding, param))
+            continue;
+        if (appliedSign != (adding ? '+' : '-')) {
+            appliedSign = adding ? '+' : '-';
+            appliedModes += appliedSign;
+        }
+        appliedModes += mode;
+        if (!param.empty())
+            appliedParams += " " + param;
+    }
+
+    // Broadcast mode change to all channel members
+    if (!appliedModes.empty()) {
+        std::string modeMsg = client->buildMessage("MODE", target + " " + appliedModes + appliedParams);
+        channel->broadcast(modeMsg, NULL);
+        _server->getNetwork().propagate(modeMsg, client->getUplink());
+    }
+}
+
+// One mode change, by type; false if it changed nothing. param may be
+// rewritten into the form broadcast (a normalized mask, a limit as a number).
+bool CommandHandlers::applyChannelMode(Client* client, Channel* channel, const Channel::ModeSpec& spec, bool adding, std::string& param) {
+    switch (spec.type) {
+        case Channel::MODE_TYPE_FLAG:
+            if (spec.bit == Channel::MODE_DELAYED_JOIN && !adding)
+                channel->revealAllMembers();
+            return channel->setMode(spec.bit, adding);
+
+        case Channel::MODE_TYPE_PARAM:
+            if (!adding)
+                param.clear();
+            return channel->setKey(param);
+
+        case Channel::MODE_TYPE_SETTING: {
+            if (!adding)
+                return channel->setUserLimit(0);
+            int limit = std::atoi(param.c_str());
+            std::ostringstream number;
+            number << limit;
+            param = number.str();
+            return limit > 0 && channel->setUserLimit(limit);
+        }
+
+        case Channel::MODE_TYPE_LIST: {
+            Channel::ListMode list = static_cast<Channel::ListMode>(spec.bit);
+            param = Mask::normalizeHostmask(param);
+            if (!adding)
+                return channel->removeListMask(list, param);
+            if (channel->getListMasks(list).size() >= Channel::MAX_LIST_ENTRIES) {
+                sendErrorReply(client, IRC::ERR_BANLISTFULL, channel->getName() + " " + std::string(1, spec.letter) + " :Channel list is full");
+                return false;
+            }
+            return channel->addListMask(list, param, client->getHostmask());
+        }
+
+        case Channel::MODE_TYPE_PREFIX: {
+            Client* member = _server->findClientByNick(param);
+            if (!member || !channel->hasClient(member))
+                return false;
+            param = member->getNickname();
+            if (adding)
+                channel->revealMember(member);
+            if (((channel->getMemberFlags(member) & spec.bit) != 0) == adding)
+                return false;
+            channel->setMemberFlag(member, spec.bit, adding);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Information commands
+void CommandHandlers::handleCap(Client* client, const std::vector<std::string>& params) {
+    if (params.empty()) {
+        return;
+    }
+
+    const std::string& subcommand = params[0];
+    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+
+    if (subcommand == "LS") {
+        std::string capReply = ":" + std::string("ircserv") + " CAP " + nick + " LS :" + IRC::SUPPORTED_CAPS + "\r\n";
+        _server->queueMessage(client->getFd(), capReply);
+    } else if (subcommand == "LIST") {
+        std::string enabled;
+        std::istringstream supported(IRC::SUPPORTED_CAPS);
+        std::string cap;
+        while (supported >> cap) {
+            if (client->hasCap(cap)) enabled += (enabled.empty() ? "" : " ") + cap;
+        }
+        std::string capReply = ":" + std::string("ircserv") + " CAP " + nick + " LIST :" + enabled + "\r\n";
+        _server->queueMessage(client->getFd(), capReply);
+    } else if (subcommand == "REQ") {
+        std::string requested = (params.size() > 1) ? params[1] : "";
+        std::string supported = " " + IRC::SUPPORTED_CAPS + " ";
+
+        // All-or-nothing: ACK only if every requested capability is known
+        std::istringstream iss(requested);
+        std::string cap;
+        bool ok = !requested.empty();
+        while (ok && iss >> cap) {
+            std::string name = (cap[0] == '-') ? cap.substr(1) : cap;
+            ok = supported.find(" " + name + " ") != std::string::npos;
+        }
+
+        if (ok) {
+            std::istringstream apply(requested);
+            while (apply >> cap) {
+                if (cap[0] == '-') client->setCap(cap.substr(1), false);
+                else client->setCap(cap, true);
+            }
+        }
+        std::string capReply = ":" + std::string("ircserv") + " CAP " + nick + (ok ? " ACK :" : " NAK :") + requested + "\r\n";
+        _server->queueMessage(client->getFd(), capReply);
+
+        // Enabled after registration: hand out a token now; disabled: forget it
+        if (client->isRegistered() && client->hasCap(IRC::CAP_RESUME) && client->getResumeToken().empty())
+            sendResumeToken(client);
+        else if (!client->hasCap(IRC::CAP_RESUME))
+            client->setResumeToken("");
+    } else if (subcommand == "END") {
+        // CAP negotiation finished
+    }
+}
+
+void CommandHandlers::handleWho(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    std::string target = params.empty() ? "*" : params[0];
+    std::string options = (params.size() > 1) ? params[1] : "";
+
+    // Rendered on a query worker, then streamed under sendQ control
+    _server->startSnapshotQuery(client, new WhoQuery(*_server, client, target, options));
+}
+
+void CommandHandlers::handleWhois(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NONICKNAMEGIVEN, "No nickname given");
+        return;
+    }
+
+    const std::string& targetNick = params[0];
+    Client* target = _server->findClientByNick(targetNick);
+
+    if (!target) {
+        sendErrorReply(client, IRC::ERR_NOSUCHNICK, targetNick + " :No such nick/channel");
+        std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHOIS + " " + client->getNickname() + " " + targetNick + " :End of WHOIS list\r\n";
+        _server->queueMessage(client->getFd(), endReply);
+        return;
+    }
+
+    std::string nick = client->getNickname();
+
+    // RPL_WHOISUSER
+    std::string userReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISUSER + " " + nick + " " + targetNick + " " +
+                           target->getUsername() + " " + target->getHostname() + " * :" + target->getRealname() + "\r\n";
+    _server->queueMessage(client->getFd(), userReply);
+
+    // RPL_WHOISSERVER
+    std::string targetServer = target->isRemote() ? target->getServerName() : _server->getNetwork().getName();
+    std::string serverReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISSERVER + " " + nick + " " + targetNick + " " + targetServer + " :IRC Server\r\n";
+    _server->queueMessage(client->getFd(), serverReply);
+
+    // RPL_WHOISCHANNELS; +s and +p channels only to those on them too, and
+    // +D channels the target has not shown up in as NAMES would list them
+    std::vector<Channel*> channels = _server->getClientChannels(target);
+    std::string channelList;
+    for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        if ((*it)->hasMode(Channel::MODE_SECRET | Channel::MODE_PRIVATE) && target != client && !(*it)->hasClient(client))
+            continue;
+        if (!(*it)->isVisibleTo(target, client))
+            continue;
+        if (!channelList.empty()) channelList += " ";
+        if (char prefix = Channel::memberPrefix((*it)->getMemberFlags(target))) channelList += prefix;
+        channelList += (*it)->getName();
+    }
+    if (!channelList.empty()) {
+        std::string channelsReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISCHANNELS + " " + nick + " " + targetNick + " :" + channelList + "\r\n";
+        _server->queueMessage(client->getFd(), channelsReply);
+    }
+
+    // RPL_WHOISACCOUNT
+    if (!target->getAccount().empty()) {
+        std::string accountReply = ":" + std::string("ircserv") + " " + IRC::RPL_WHOISACCOUNT + " " + nick + " " + targetNick + " " + target->getAccount() + " :is logged in as\r\n";
+        _server->queueMessage(client->getFd(), accountReply);
+    }
+
+    // RPL_ENDOFWHOIS
+    std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHOIS + " " + nick + " " + targetNick + " :End of WHOIS list\r\n";
+    _server->queueMessage(client->getFd(), endReply);
+}
+
+void CommandHandlers::handleList(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    std::set<std::string> channels;
+    if (!params.empty()) {
+        std::istringstream names(params[0]);
+        std::string name;
+        while (std::getline(names, name, ','))
+            if (!name.empty())
+                channels.insert(name);
+    }
+    _server->startSnapshotQuery(client, new ListQuery(client, channels));
+}
+
+void CommandHandlers::handleNames(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        std::string endReply = ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + client->getNickname() + " * :End of NAMES list\r\n";
+        _server->queueMessage(client->getFd(), endReply);
+        return;
+    }
+
+    std::vector<std::string> channels;
+    std::istringstream names(params[0]);
+    std::string name;
+    while (std::getline(names, name, ','))
+        if (!name.empty())
+            channels.push_back(name);
+    _server->startSnapshotQuery(client, new NamesQuery(client, channels));
+}
+
+// CHATHISTORY LATEST|BEFORE|AFTER <channel> <*|msgid=..|timestamp=..> <limit>
+void CommandHandlers::handleChathistory(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.size() < 4) {
+        sendFailReply(client, "CHATHISTORY", "NEED_MORE_PARAMS", (params.empty() ? "" : params[0] + " ") + ":Insufficient parameters");
+        return;
+    }
+
+    std::string subcommand = params[0];
+    std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+    const std::string& target = params[1];
+
+    Channel* channel = _server->getChannel(target);
+    if (!channel || !channel->hasClient(client)) {
+        sendFailReply(client, "CHATHISTORY", "INVALID_TARGET", subcommand + " " + target + " :Messages could not be retrieved");
+        return;
+    }
+
+    int requested = std::atoi(params[3].c_str());
+    if (requested <= 0) {
+        sendFailReply(client, "CHATHISTORY", "INVALID_PARAMS", subcommand + " " + params[3] + " :Invalid limit");
+        return;
+    }
+    size_t limit = std::min(static_cast<size_t>(requested), IRC::CHATHISTORY_MAX_LIMIT);
+
+    HistoryRef ref;
+    bool haveRef = params[2] != "*" && MessageHistory::parseRef(params[2], ref);
+    if (!haveRef && (subcommand != "LATEST" || params[2] != "*")) {
+        sendFailReply(client, "CHATHISTORY", "INVALID_PARAMS", subcommand + " " + params[2] + " :Invalid message reference");
+        return;
+    }
+
+    std::vector<HistoryRecord> records;
+    const MessageHistory& history = channel->getHistory();
+    if (subcommand == "LATEST") {
+        history.latest(haveRef ? &ref : NULL, limit, records);
+    } else if (subcommand == "BEFORE") {
+        history.before(ref, limit, records);
+    } else if (subcommand == "AFTER") {
+        history.after(ref, limit, records);
+    } else {
+        sendFailReply(client, "CHATHISTORY", "INVALID_PARAMS", subcommand + " :Unknown subcommand");
+        return;
+    }
+
+    std::ostringstream batchId;
+    batchId << "hist" << ++_batchCounter;
+    _server->startReplyStream(client, new HistoryQuery(channel->getName(), records, batchId.str()));
+}
+
+void CommandHandlers::handleMotd(Client* client, const std::vector<std::string>& params) {
+    (void)params;
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    std::string motd;
+    _server->getWelcome().renderMotd(client->getNickname(), motd);
+    _server->queueMessage(client->getFd(), motd);
+}
+
+// STATS m (calls per command), L (latency percentiles) and a (heap allocations
+// per command, in ALLOC_PROFILE builds), for operators
+void CommandHandlers::handleStats(Client* client, const std::vector<std::string>& params) {
+    if (!client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_NOTREGISTERED, "You have not registered");
+        return;
+    }
+
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "STATS :Not enough parameters");
+        return;
+    }
+
+    if (!_server->getAccounts().isOperator(client->getAccount())) {
+        sendErrorReply(client, IRC::ERR_NOPRIVILEGES, ":Permission Denied- You're not an IRC operator");
+        return;
+    }
+
+    std::string query = params[0].substr(0, 1);
+    std::string nick = client->getNickname();
+    std::vector<std::string> lines;
+    if (query == "m" || query == "M") {
+        _server->getMetrics().commandCounts(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            _server->queueMessage(client->getFd(), ":" + std::string("ircserv") + " " + IRC::RPL_STATSCOMMANDS + " " + nick + " " + *it + "\r\n");
+        }
+    } else if (query == "L" || query == "l") {
+        _server->getMetrics().latencyReport(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            _server->queueMessage(client->getFd(), ":" + std::string("ircserv") + " " + IRC::RPL_STATSDEBUG + " " + nick + " L :" + *it + "\r\n");
+        }
+    } else if (query == "r" || query == "R") {
+        _server->getReplication().report(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            _server->queueMessage(client->getFd(), ":" + std::string("ircserv") + " " + IRC::RPL_STATSDEBUG + " " + nick + " r :" + *it + "\r\n");
+        }
+    } else if (query == "a" || query == "A") {
+        AllocProfile::report(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+            _server->queueMessage(client->getFd(), ":" + std::string("ircserv") + " " + IRC::RPL_STATSDEBUG + " " + nick + " a :" + *it + "\r\n");
+        }
+    }
+    _server->queueMessage(client->getFd(), ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFSTATS + " " + nick + " " + query + " :End of STATS report\r\n");
+}
+
+// RESUME <token>: take over a detached session instead of registering anew
+void CommandHandlers::handleResume(Client* client, const std::vector<std::string>& params) {
+    if (client->isRegistered()) {
+        sendFailReply(client, "RESUME", "REGISTRATION_IS_COMPLETED", ":Cannot resume after registration");
+        return;
+    }
+
+    if (params.empty()) {
+        sendFailReply(client, "RESUME", "NEED_MORE_PARAMS", ":Insufficient parameters");
+        return;
+    }
+
+    if (!client->hasReceivedPass()) {
+        sendErrorReply(client, IRC::ERR_PASSWDMISMATCH, "Password incorrect");
+        return;
+    }
+
+    Client* session = _server->findDetachedSession(params[0]);
+    if (!session) {
+        sendFailReply(client, "RESUME", "INVALID_TOKEN", ":Cannot resume connection, token is not valid");
+        return;
+    }
+
+    _server->resumeSession(client, session);
+}
+
+namespace {
+    // SASL password check, run on the worker pool. An unknown account costs
+    // a full hash too, so timing does not tell which accounts exist.
+    class PasswordCheck : public WorkerPool::Task {
+    private:
+        CommandHandlers* _handlers;
+        int _fd;
+        unsigned long _serial;
+        std::string _account;
+        std::string _password;
+        std::string _hash;
+        bool _accepted;
+
+    public:
+        PasswordCheck(CommandHandlers* handlers, Client* client, const std::string& account,
+                      const std::string& password, const std::string& hash)
+            : _handlers(handlers), _fd(client->getFd()), _serial(client->getSerial()), _account(account),
+              _password(password), _hash(hash), _accepted(false) {}
+
+        void run() {
+            if (!_hash.empty()) {
+                _accepted = PasswordHash::verify(_password, _hash);
+            } else {
+                PasswordHash::derive(_password, "unknown account", PasswordHash::DEFAULT_LOG2_N,
+                                     PasswordHash::DEFAULT_R, PasswordHash::DEFAULT_P);
+            }
+        }
+
+        void complete() {
+            _handlers->finishAuthentication(_fd, _serial, _account, _accepted);
+        }
+    };
+}
+
+// AUTHENTICATE: SASL PLAIN. The response is "authzid NUL authcid NUL password",
+// base64 in chunks of 400 bytes. Registration waits until the check is done.
+void CommandHandlers::handleAuthenticate(Client* client, const std::vector<std::string>& params) {
+    if (params.empty()) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "AUTHENTICATE :Not enough parameters");
+        return;
+    }
+
+    if (!client->getAccount().empty()) {
+        sendErrorReply(client, IRC::ERR_SASLALREADY, ":You have already authenticated using SASL");
+        return;
+    }
+
+    if (client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
+        return;
+    }
+
+    const std::string& data = params[0];
+    if (data == "*") {
+        client->setSaslState(Client::SASL_NONE);
+        sendErrorReply(client, IRC::ERR_SASLABORTED, ":SASL authentication aborted");
+        checkRegistration(client);
+        return;
+    }
+
+    if (client->getSaslState() == Client::SASL_VERIFYING) {
+        return;
+    }
+
+    if (client->getSaslState() == Client::SASL_NONE) {
+        if (data != "PLAIN") {
+            std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+            _server->queueMessage(client->getFd(), formatNumericReply(IRC::RPL_SASLMECHS, nick + " PLAIN", "are available SASL mechanisms"));
+            sendErrorReply(client, IRC::ERR_SASLFAIL, ":SASL authentication failed");
+            return;
+        }
+        client->setSaslState(Client::SASL_STARTED);
+        _server->queueMessage(client->getFd(), "AUTHENTICATE +\r\n");
+        return;
+    }
+
+    std::string& response = client->getSaslBuffer();
+    if (data.length() > IRC::SASL_CHUNK_SIZE || response.length() + data.length() > IRC::SASL_MAX_RESPONSE) {
+        client->setSaslState(Client::SASL_NONE);
+        sendErrorReply(client, IRC::ERR_SASLTOOLONG, ":SASL message too long");
+        checkRegistration(client);
+        return;
+    }
+    if (data != "+") {
+        response += data;
+    }
+    if (data.length() == IRC::SASL_CHUNK_SIZE) {
+        return;     // more to come
+    }
+
+    std::string decoded;
+    size_t first = std::string::npos, second = std::string::npos;
+    if (IRCUtils::base64Decode(response, decoded)) {
+        first = decoded.find('\0');
+        second = (first == std::string::npos) ? first : decoded.find('\0', first + 1);
+    }
+    std::string authzid = (second != std::string::npos) ? decoded.substr(0, first) : "";
+    std::string authcid = (second != std::string::npos) ? decoded.substr(first + 1, second - first - 1) : "";
+    std::string password = (second != std::string::npos) ? decoded.substr(second + 1) : "";
+    if (authcid.empty() || (!authzid.empty() && authzid != authcid)
+        || password.length() > PasswordHash::MAX_PASSWORD_LENGTH
+        || client->getPendingLogins() >= Server::MAX_CLIENT_LOGINS
+        || _server->getWorkers().getPending() >= Server::MAX_PENDING_LOGINS) {
+        client->setSaslState(Client::SASL_NONE);
+        sendErrorReply(client, IRC::ERR_SASLFAIL, ":SASL authentication failed");
+        checkRegistration(client);
+        return;
+    }
+
+    std::string account, hash;
+    if (!_server->getAccounts().find(authcid, account, hash)) {
+        account = authcid;
+    }
+    client->setSaslState(Client::SASL_VERIFYING);
+    client->setPendingLogins(client->getPendingLogins() + 1);
+    _server->getWorkers().submit(new PasswordCheck(this, client, account, password, hash));
+}
+
+// The client may have left, or been replaced by another on the same fd, meanwhile
+void CommandHandlers::finishAuthentication(int fd, unsigned long serial, const std::string& account, bool accepted) {
+    Client* client = _server->getClient(fd);
+    if (!client || client->getSerial() != serial)
+        return;
+    client->setPendingLogins(client->getPendingLogins() - 1);
+    if (client->getSaslState() != Client::SASL_VERIFYING || client->isDisconnecting())
+        return;
+
+    client->setSaslState(Client::SASL_NONE);
+    if (!accepted) {
+        std::cout << "SASL login failed for client " << fd << " (account " << account << ")" << std::endl;
+        sendErrorReply(client, IRC::ERR_SASLFAIL, ":SASL authentication failed");
+        checkRegistration(client);
+        return;
+    }
+
+    // An account stands in for the connection password
+    client->setAccount(account);
+    client->setReceivedPass(true);
+    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+    _server->queueMessage(client->getFd(), formatNumericReply(IRC::RPL_LOGGEDIN, nick + " " + client->getHostmask() + " " + account, "You are now logged in as " + account));
+    _server->queueMessage(client->getFd(), formatNumericReply(IRC::RPL_SASLSUCCESS, nick, "SASL authentication successful"));
+    std::cout << "Client " << fd << " logged in as " << account << std::endl;
+    checkRegistration(client);
+}
+
+// SERVER <name> <hopcount> :<description> — a peer opening a server link
+void CommandHandlers::handleServer(Client* client, const std::vector<std::string>& params) {
+    if (client->isRegistered()) {
+        sendErrorReply(client, IRC::ERR_ALREADYREGISTRED, "You may not reregister");
+        return;
+    }
+
+    if (params.size() < 3) {
+        sendErrorReply(client, IRC::ERR_NEEDMOREPARAMS, "SERVER :Not enough parameters");
+        return;
+    }
+
+    std::string refusal;
+    if (client->getLinkPassword().empty()) {
+        refusal = "No link password given";
+    } else {
+        _server->getNetwork().acceptLink(client, params[0], params[2], refusal);
+    }
+
+    if (!refusal.empty()) {
+        _server->queueMessage(client->getFd(), "ERROR :Closing Link: " + params[0] + " (" + refusal + ")\r\n");
+        _server->handleClientDisconnection(client->getFd(), refusal);
+    }
+}
+
+// Utility functions
+// Without a token the session cannot be detached, nor resumed
+void CommandHandlers::sendResumeToken(Client* client) {
+    client->setResumeToken(IRCUtils::randomToken(16));
+    if (client->getResumeToken().empty())
+        return;
+    std::string reply = ":" + std::string("ircserv") + " RESUME TOKEN " + client->getResumeToken() + "\r\n";
+    _server->queueMessage(client->getFd(), reply);
+}
+
+// 001 to 005 and the MOTD, rendered at startup: only the nick and hostmask go in here
+void CommandHandlers::sendWelcomeSequence(Client* client) {
+    std::string burst;
+    _server->getWelcome().render(client->getNickname(), client->getHostmask(), burst);
+    _server->queueMessage(client->getFd(), burst);
+}
+
+void CommandHandlers::sendErrorReply(Client* client, const std::string& code, const std::string& message) {
+    std::string nick = client->getNickname().empty() ? "*" : client->getNickname();
+    std::string reply = ":" + std::string("ircserv") + " " + code + " " + nick + " " + message + "\r\n";
+    _server->queueMessage(client->getFd(), reply);
+}
+
+// IRCv3 standard reply: FAIL <command> <code> [<context>...] :<description>
+void CommandHandlers::sendFailReply(Client* client, const std::string& command, const std::string& code, const std::string& message) {
+    std::string reply = ":" + std::string("ircserv") + " FAIL " + command + " " + code + " " + message + "\r\n";
+    _server->queueMessage(client->getFd(), reply);
+}
+
+void CommandHandlers::sendChannelList(Client* client, Channel* channel, char mode) {
+    Channel::ListMode list = Channel::LIST_BAN;
+    std::string entryCode = IRC::RPL_BANLIST;
+    std::string endCode = IRC::RPL_ENDOFBANLIST;
+    std::string endText = "End of channel ban list";
+
+    if (mode == 'e') {
+        list = Channel::LIST_EXCEPT;
+        entryCode = IRC::RPL_EXCEPTLIST;
+        endCode = IRC::RPL_ENDOFEXCEPTLIST;
+        endText = "End of channel exception list";
+    } else if (mode == 'I') {
+        list = Channel::LIST_INVEX;
+        entryCode = IRC::RPL_INVITELIST;
+        endCode = IRC::RPL_ENDOFINVITELIST;
+        endText = "End of channel invite list";
+    }
+
+    std::string nick = client->getNickname();
+    const std::vector<Channel::MaskEntry>& entries = channel->getListMasks(list);
+    for (std::vector<Channel::MaskEntry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+        std::ostringstream reply;
+        reply << ":ircserv " << entryCode << " " << nick << " " << channel->getName() << " "
+              << it->mask << " " << it->setBy << " " << it->setAt << "\r\n";
+        _server->queueMessage(client->getFd(), reply.str());
+    }
+
+    std::string endReply = ":" + std::string("ircserv") + " " + endCode + " " + nick + " " + channel->getName() + " :" + endText + "\r\n";
+    _server->queueMessage(client->getFd(), endReply);
+}
+
+// Space-separated NAMES entries in join order; +D members the viewer may not see are skipped
+std::string CommandHandlers::buildNamesList(Channel* channel, Client* viewer) {
+    std::string namesList;
+    bool viewerIsOp = channel->isOperator(viewer);
+
+    const std::vector<Channel::Member>& members = channel->getMembers();
+    for (std::vector<Channel::Member>::const_iterator it = members.begin(); it != members.end(); ++it) {
+        if ((it->flags & Channel::MEMBER_HIDDEN) && it->client != viewer && !viewerIsOp)
+            continue;
+        if (!namesList.empty()) namesList += " ";
+        if (char prefix = Channel::memberPrefix(it->flags)) namesList += prefix;
+        namesList += it->client->getNickname();
+    }
+    return namesList;
+}
+
+bool CommandHandlers::validateNickname(const std::string& nickname) {
+    if (nickname.empty() || nickname.length() > 9) {
+        return false;
+    }
+
+    char first = nickname[0];
+    if (!std::isalpha(first) && first != '[' && first != ']' && first != '\\' &&
+        first != '`' && first != '_' && first != '^' && first != '{' && first != '}') {
+        return false;
+    }
+
+    for (size_t i = 1; i < nickname.length(); ++i) {
+        char c = nickname[i];
+        if (!std::isalnum(c) && c != '[' && c != ']' && c != '\\' &&
+            c != '`' && c != '_' && c != '^' && c != '{' && c != '}' && c != '-') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CommandHandlers::validateChannelName(const std::string& channel) {
+    if (channel.empty() || channel[0] != '#' || channel.length() > 50) {
+        return false;
+    }
+
+    for (size_t i = 1; i < channel.length(); ++i) {
+        char c = channel[i];
+        if (c == ' ' || c == ',' || c == '\r' || c == '\n' || c == '\0') {
+            return false;
+        }
+    }
+
+    return true;
+}
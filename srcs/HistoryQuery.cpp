@@ -0,0 +1,48 @@
+#include "HistoryQuery.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+
+HistoryQuery::HistoryQuery(const std::string& target, const std::vector<HistoryRecord>& records, const std::string& batchId)
+    : _target(target), _records(records), _next(0), _batchId(batchId), _started(false) {}
+
+HistoryQuery::~HistoryQuery() {}
+
+bool HistoryQuery::produce(Server& server, Client* client) {
+    bool batch = client->hasCap("batch");
+    bool serverTime = client->hasCap("server-time");
+    bool messageTags = client->hasCap("message-tags");
+
+    if (!_started) {
+        _started = true;
+        if (batch) {
+            server.queueMessage(client->getFd(), ":ircserv BATCH +" + _batchId + " chathistory " + _target + "\r\n");
+        }
+    }
+
+    while (_next < _records.size() && client->getSendQueueSize() < SENDQ_HIGH_WATERMARK) {
+        const HistoryRecord& record = _records[_next++];
+
+        std::string tags;
+        if (batch) {
+            tags += "batch=" + _batchId;
+        }
+        if (serverTime) {
+            tags += (tags.empty() ? "" : ";") + std::string("time=") + MessageHistory::formatTime(record.time, record.millis);
+        }
+        if (messageTags) {
+            tags += (tags.empty() ? "" : ";") + std::string("msgid=") + MessageHistory::formatMsgid(record.msgid);
+        }
+
+        std::string line = tags.empty() ? record.line : "@" + tags + " " + record.line;
+        server.queueMessage(client->getFd(), line + "\r\n");
+    }
+
+    if (_next < _records.size()) {
+        return false;
+    }
+
+    if (batch) {
+        server.queueMessage(client->getFd(), ":ircserv BATCH -" + _batchId + "\r\n");
+    }
+    return true;
+}
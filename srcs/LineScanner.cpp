@@ -0,0 +1,207 @@
+#include "LineScanner.hpp"
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LINESCANNER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+typedef void (*Kernel)(const char* data, size_t length, std::vector<size_t>& newlines);
+
+// Offsets are reported from data - base, so the vector kernels can hand over their tail
+void scanScalar(const char* data, size_t length, std::vector<size_t>& newlines, size_t base) {
+    const char* end = data + length;
+    for (const char* p = data; p < end; ++p) {
+        p = static_cast<const char*>(std::memchr(p, '\n', end - p));
+        if (!p)
+            break;
+        newlines.push_back(base + (p - data));
+    }
+}
+
+void scanScalar(const char* data, size_t length, std::vector<size_t>& newlines) {
+    scanScalar(data, length, newlines, 0);
+}
+
+#ifdef LINESCANNER_X86
+
+// 64 bytes per step in both kernels: lines are tens of bytes long, so most
+// steps find at most one '\n' and the loop overhead is what matters
+
+__attribute__((target("sse2")))
+void scanSse2(const char* data, size_t length, std::vector<size_t>& newlines) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        const __m128i* block = reinterpret_cast<const __m128i*>(data + i);
+        unsigned long long mask =
+            static_cast<unsigned long long>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block), newline)))
+            | static_cast<unsigned long long>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 1), newline))) << 16
+            | static_cast<unsigned long long>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 2), newline))) << 32
+            | static_cast<unsigned long long>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128(block + 3), newline))) << 48;
+        for (; mask; mask &= mask - 1)
+            newlines.push_back(i + __builtin_ctzll(mask));
+    }
+    scanScalar(data + i, length - i, newlines, i);
+}
+
+__attribute__((target("avx2")))
+void scanAvx2(const char* data, size_t length, std::vector<size_t>& newlines) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 64 <= length; i += 64) {
+        const __m256i* block = reinterpret_cast<const __m256i*>(data + i);
+        unsigned long long mask =
+            static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block), newline)))
+            | static_cast<unsigned long long>(static_cast<unsigned>(
+                  _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256(block + 1), newline)))) << 32;
+        for (; mask; mask &= mask - 1)
+            newlines.push_back(i + __builtin_ctzll(mask));
+    }
+    scanScalar(data + i, length - i, newlines, i);
+}
+
+#endif
+
+struct KernelEntry {
+    const char* name;
+    Kernel scan;
+};
+
+// Best first
+void availableKernels(std::vector<KernelEntry>& kernels) {
+#ifdef LINESCANNER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        KernelEntry avx2 = { "avx2", &scanAvx2 };
+        kernels.push_back(avx2);
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        KernelEntry sse2 = { "sse2", &scanSse2 };
+        kernels.push_back(sse2);
+    }
+#endif
+    KernelEntry scalar = { "scalar", &scanScalar };
+    kernels.push_back(scalar);
+}
+
+const KernelEntry& selectedKernel() {
+    static KernelEntry selected = { NULL, NULL };
+    if (!selected.scan) {
+        std::vector<KernelEntry> kernels;
+        availableKernels(kernels);
+        selected = kernels.front();
+    }
+    return selected;
+}
+
+double secondsSince(const struct timespec& start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+}
+
+namespace LineScanner {
+
+void findNewlines(const char* data, size_t length, std::vector<size_t>& newlines) {
+    selectedKernel().scan(data, length, newlines);
+}
+
+const char* kernelName() {
+    return selectedKernel().name;
+}
+
+int benchmark() {
+    static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+    static const size_t CHUNK_SIZE = 4096;      // what Server reads per recv()
+    static const int PASSES = 32;
+
+    // Chat traffic: lines from a few bytes to a few hundred
+    std::string buffer;
+    buffer.reserve(BUFFER_SIZE + 512);
+    unsigned long state = 1;
+    while (buffer.length() < BUFFER_SIZE) {
+        state = state * 1103515245UL + 12345UL;
+        size_t textLength = (state >> 16) % 200;
+        buffer += "PRIVMSG #channel :";
+        buffer.append(textLength, 'x');
+        buffer += "\r\n";
+    }
+    double megabytes = buffer.length() * PASSES / 1e6;
+
+    std::vector<KernelEntry> kernels;
+    availableKernels(kernels);
+    std::vector<size_t> newlines;
+    newlines.reserve(buffer.length() / 16);
+
+    std::cout << std::fixed << std::setprecision(0);
+    for (std::vector<KernelEntry>::iterator it = kernels.begin(); it != kernels.end(); ++it) {
+        size_t lines = 0;
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int pass = 0; pass < PASSES; ++pass) {
+            for (size_t offset = 0; offset < buffer.length(); offset += CHUNK_SIZE) {
+                newlines.clear();
+                it->scan(buffer.data() + offset, std::min(CHUNK_SIZE, buffer.length() - offset), newlines);
+                lines += newlines.size();
+            }
+        }
+        std::cout << "LineScanner: scan " << std::setw(6) << it->name << " " << std::setw(6)
+                  << megabytes / secondsSince(start) << " MB/s, " << lines / PASSES << " lines"
+                  << (it == kernels.begin() ? " (selected)" : "") << std::endl;
+    }
+
+    // Whole input path, recv() chunks to extracted lines: as Client did it
+    // before (search, copy, erase from the front), then as it does it now
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t lines = 0;
+    for (int pass = 0; pass < PASSES; ++pass) {
+        std::string input;
+        for (size_t offset = 0; offset < buffer.length(); offset += CHUNK_SIZE) {
+            input.append(buffer, offset, CHUNK_SIZE);
+            size_t end;
+            while ((end = input.find("\r\n")) != std::string::npos) {
+                std::string line = input.substr(0, end);
+                input.erase(0, end + 2);
+                ++lines;
+            }
+        }
+    }
+    std::cout << "LineScanner: extract  find " << std::setw(6) << megabytes / secondsSince(start) << " MB/s, "
+              << lines / PASSES << " lines" << std::endl;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    lines = 0;
+    for (int pass = 0; pass < PASSES; ++pass) {
+        std::string input;
+        size_t consumed = 0;
+        for (size_t offset = 0; offset < buffer.length(); offset += CHUNK_SIZE) {
+            size_t from = input.length();
+            newlines.clear();
+            input.append(buffer, offset, CHUNK_SIZE);
+            findNewlines(input.data() + from, input.length() - from, newlines);
+            for (std::vector<size_t>::iterator it = newlines.begin(); it != newlines.end(); ++it) {
+                std::string line(input, consumed, from + *it - 1 - consumed);
+                consumed = from + *it + 1;
+                ++lines;
+            }
+            input.erase(0, consumed);
+            consumed = 0;
+        }
+    }
+    std::cout << "LineScanner: extract " << std::setw(5) << kernelName() << " " << std::setw(6)
+              << megabytes / secondsSince(start) << " MB/s, " << lines / PASSES << " lines" << std::endl;
+    return 0;
+}
+
+}
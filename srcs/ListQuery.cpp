@@ -0,0 +1,35 @@
+#include "ListQuery.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "IRCProtocol.hpp"
+#include <sstream>
+
+ListQuery::ListQuery(const Client* requester, const std::set<std::string>& channels)
+    : _requester(requester->getNickname()), _requesterSerial(requester->getSerial()), _channels(channels) {}
+
+ListQuery::~ListQuery() {}
+
+void ListQuery::render(const QuerySnapshot& snapshot, std::string& out) const {
+    out += ":" + std::string("ircserv") + " " + IRC::RPL_LISTSTART + " " + _requester + " Channel :Users Name\r\n";
+
+    const std::vector<const QuerySnapshot::ChannelInfo*>& channels = snapshot.getChannels();
+    for (std::vector<const QuerySnapshot::ChannelInfo*>::const_iterator cit = channels.begin(); cit != channels.end(); ++cit) {
+        const QuerySnapshot::ChannelInfo* it = *cit;
+        if (!_channels.empty() && !_channels.count(it->name))
+            continue;
+        if ((it->modes & (Channel::MODE_SECRET | Channel::MODE_PRIVATE)) && !snapshot.findMember(*it, _requesterSerial))
+            continue;
+
+        size_t visible = 0;
+        for (std::vector<QuerySnapshot::Member>::const_iterator mit = it->members.begin(); mit != it->members.end(); ++mit) {
+            if (!(mit->flags & Channel::MEMBER_HIDDEN))
+                ++visible;
+        }
+
+        std::ostringstream line;
+        line << ":ircserv " << IRC::RPL_LIST << " " << _requester << " " << it->name << " " << visible << " :" << it->topic << "\r\n";
+        out += line.str();
+    }
+
+    out += ":" + std::string("ircserv") + " " + IRC::RPL_LISTEND + " " + _requester + " :End of LIST\r\n";
+}
@@ -0,0 +1,102 @@
+#include "Mask.hpp"
+#include "utils.hpp"
+
+Mask::Mask() : _hasWildcards(false) {}
+
+Mask::Mask(const std::string& pattern) : _hasWildcards(false) {
+    compile(pattern);
+}
+
+Mask::~Mask() {}
+
+void Mask::compile(const std::string& pattern) {
+    std::string folded = IRCUtils::casefold(pattern);
+
+    _pattern.clear();
+    _pattern.reserve(folded.length());
+    _prefix.clear();
+    _hasWildcards = false;
+
+    for (size_t i = 0; i < folded.length(); ++i) {
+        char c = folded[i];
+        if (c == '*' && !_pattern.empty() && _pattern[_pattern.length() - 1] == '*') {
+            continue; // "**" is equivalent to "*"
+        }
+        if (c == '*' || c == '?') {
+            _hasWildcards = true;
+        } else if (!_hasWildcards) {
+            _prefix += c;
+        }
+        _pattern += c;
+    }
+}
+
+const std::string& Mask::getPattern() const {
+    return _pattern;
+}
+
+const std::string& Mask::getLiteralPrefix() const {
+    return _prefix;
+}
+
+bool Mask::isLiteral() const {
+    return !_hasWildcards;
+}
+
+bool Mask::matchesEverything() const {
+    return _pattern == "*";
+}
+
+bool Mask::matchesFolded(const std::string& folded) const {
+    if (!_hasWildcards) {
+        return folded == _pattern;
+    }
+    if (folded.compare(0, _prefix.length(), _prefix) != 0) {
+        return false;
+    }
+
+    // Iterative glob match with single-star backtracking, starting after the prefix
+    size_t p = _prefix.length();
+    size_t s = _prefix.length();
+    size_t starP = std::string::npos;
+    size_t starS = 0;
+
+    while (s < folded.length()) {
+        if (p < _pattern.length() && (_pattern[p] == '?' || _pattern[p] == folded[s])) {
+            ++p;
+            ++s;
+        } else if (p < _pattern.length() && _pattern[p] == '*') {
+            starP = p++;
+            starS = s;
+        } else if (starP != std::string::npos) {
+            p = starP + 1;
+            s = ++starS;
+        } else {
+            return false;
+        }
+    }
+    while (p < _pattern.length() && _pattern[p] == '*') {
+        ++p;
+    }
+    return p == _pattern.length();
+}
+
+bool Mask::matches(const std::string& subject) const {
+    return matchesFolded(IRCUtils::casefold(subject));
+}
+
+std::string Mask::normalizeHostmask(const std::string& mask) {
+    size_t bang = mask.find('!');
+    size_t at = mask.find('@');
+
+    if (bang == std::string::npos && at == std::string::npos) {
+        return mask + "!*@*";
+    }
+    if (bang == std::string::npos) {
+        return "*!" + mask;
+    }
+    if (at == std::string::npos || at < bang) {
+        return mask + "@*";
+    }
+    return mask;
+}
@@ -0,0 +1,284 @@
+#include "MessageHistory.hpp"
+#include "StateCodec.hpp"
+#include <sys/time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+// -------- HISTORY BUDGET --------
+
+HistoryBudget::HistoryBudget(size_t limit)
+    : _limit(limit), _used(0), _records(0), _nextMsgid(1) {}
+
+HistoryBudget::~HistoryBudget() {}
+
+unsigned long HistoryBudget::nextMsgid() {
+    return _nextMsgid++;
+}
+
+unsigned long HistoryBudget::lastMsgid() const {
+    return _nextMsgid - 1;
+}
+
+// Msgids carried over from a previous process must never be handed out again
+void HistoryBudget::reserveMsgid(unsigned long msgid) {
+    if (msgid >= _nextMsgid)
+        _nextMsgid = msgid + 1;
+}
+
+void HistoryBudget::registerHistory(MessageHistory* history) {
+    _live.insert(history);
+}
+
+void HistoryBudget::unregisterHistory(MessageHistory* history) {
+    _live.erase(history);
+}
+
+void HistoryBudget::charge(MessageHistory* history, unsigned long msgid, size_t bytes) {
+    _used += bytes;
+    _records++;
+    _order.push_back(std::make_pair(history, msgid));
+
+    // Evict globally oldest records. Entries whose record is already gone
+    // (evicted by its channel's own limits, or its channel was deleted) are skipped.
+    while (_used > _limit && !_order.empty()) {
+        MessageHistory* owner = _order.front().first;
+        unsigned long id = _order.front().second;
+        _order.pop_front();
+
+        if (_live.count(owner) && !owner->empty() && owner->oldestMsgid() == id)
+            owner->evictOldest();
+    }
+
+    // Stale entries only accumulate while under budget; drop them once they dominate
+    if (_order.size() > 2 * _records + 1024)
+        compactOrder();
+}
+
+void HistoryBudget::release(size_t bytes) {
+    _used -= bytes;
+    _records--;
+}
+
+size_t HistoryBudget::getUsed() const {
+    return _used;
+}
+
+void HistoryBudget::compactOrder() {
+    std::deque<std::pair<MessageHistory*, unsigned long> > kept;
+
+    for (size_t i = 0; i < _order.size(); ++i) {
+        MessageHistory* owner = _order[i].first;
+        if (_live.count(owner) && !owner->empty() && _order[i].second >= owner->oldestMsgid())
+            kept.push_back(_order[i]);
+    }
+    _order.swap(kept);
+}
+
+// -------- MESSAGE HISTORY --------
+
+MessageHistory::MessageHistory() : _budget(NULL), _bytes(0) {}
+
+MessageHistory::~MessageHistory() {
+    while (!_records.empty())
+        evictOldest();
+    if (_budget)
+        _budget->unregisterHistory(this);
+}
+
+void MessageHistory::attach(HistoryBudget* budget) {
+    _budget = budget;
+    if (_budget)
+        _budget->registerHistory(this);
+}
+
+// From the line's length, not its capacity: the copy stored in the deque need
+// not have the capacity of the record that was charged
+size_t MessageHistory::recordSize(const HistoryRecord& record) {
+    return sizeof(HistoryRecord) + record.line.size();
+}
+
+void MessageHistory::append(const std::string& line) {
+    if (!_budget)
+        return;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    HistoryRecord record;
+    record.msgid = _budget->nextMsgid();
+    record.time = now.tv_sec;
+    record.millis = static_cast<unsigned short>(now.tv_usec / 1000);
+    record.line = line;
+    restore(record);
+}
+
+// Store a record as is, keeping its msgid and time
+void MessageHistory::restore(const HistoryRecord& record) {
+    if (!_budget)
+        return;
+
+    _budget->reserveMsgid(record.msgid);
+    size_t size = recordSize(record);
+    _records.push_back(record);
+    _bytes += size;
+
+    while (_records.size() > MAX_RECORDS || (_bytes > MAX_BYTES && _records.size() > 1))
+        evictOldest();
+
+    _budget->charge(this, record.msgid, size);
+}
+
+void MessageHistory::evictOldest() {
+    if (_records.empty())
+        return;
+
+    size_t size = recordSize(_records.front());
+    _bytes -= size;
+    _records.pop_front();
+    if (_budget)
+        _budget->release(size);
+}
+
+void MessageHistory::saveState(StateWriter& out, unsigned long afterMsgid) const {
+    std::deque<HistoryRecord>::const_iterator first = _records.begin();
+    while (first != _records.end() && first->msgid <= afterMsgid)
+        ++first;
+
+    out.putInt(_records.end() - first);
+    for (std::deque<HistoryRecord>::const_iterator it = first; it != _records.end(); ++it) {
+        out.putInt(it->msgid);
+        out.putInt(it->time);
+        out.putInt(it->millis);
+        out.putString(it->line);
+    }
+}
+
+void MessageHistory::loadState(StateReader& in) {
+    long count = in.getInt();
+    for (long i = 0; i < count && in.ok(); ++i) {
+        HistoryRecord record;
+        record.msgid = in.getInt();
+        record.time = in.getInt();
+        record.millis = static_cast<unsigned short>(in.getInt());
+        record.line = in.getString();
+        restore(record);
+    }
+}
+
+bool MessageHistory::empty() const {
+    return _records.empty();
+}
+
+unsigned long MessageHistory::oldestMsgid() const {
+    return _records.empty() ? 0 : _records.front().msgid;
+}
+
+// Index of the first record at or after ref (msgids grow monotonically server-wide,
+// so both reference kinds can be binary searched)
+size_t MessageHistory::lowerBound(const HistoryRef& ref) const {
+    size_t lo = 0;
+    size_t hi = _records.size();
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const HistoryRecord& r = _records[mid];
+        bool less = ref.byMsgid ? (r.msgid < ref.msgid)
+                                : (r.time < ref.time || (r.time == ref.time && r.millis < ref.millis));
+        if (less)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Index of the first record strictly after ref
+size_t MessageHistory::upperBound(const HistoryRef& ref) const {
+    size_t lo = 0;
+    size_t hi = _records.size();
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const HistoryRecord& r = _records[mid];
+        bool lessOrEqual = ref.byMsgid ? (r.msgid <= ref.msgid)
+                                       : (r.time < ref.time || (r.time == ref.time && r.millis <= ref.millis));
+        if (lessOrEqual)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void MessageHistory::latest(const HistoryRef* after, size_t limit, std::vector<HistoryRecord>& out) const {
+    size_t end = _records.size();
+    size_t start = (end > limit) ? end - limit : 0;
+    if (after) {
+        size_t floor = upperBound(*after);
+        if (floor > start)
+            start = floor;
+    }
+    out.assign(_records.begin() + start, _records.begin() + end);
+}
+
+void MessageHistory::before(const HistoryRef& ref, size_t limit, std::vector<HistoryRecord>& out) const {
+    size_t end = lowerBound(ref);
+    size_t start = (end > limit) ? end - limit : 0;
+    out.assign(_records.begin() + start, _records.begin() + end);
+}
+
+void MessageHistory::after(const HistoryRef& ref, size_t limit, std::vector<HistoryRecord>& out) const {
+    size_t start = upperBound(ref);
+    size_t end = (_records.size() - start > limit) ? start + limit : _records.size();
+    out.assign(_records.begin() + start, _records.begin() + end);
+}
+
+std::string MessageHistory::formatTime(time_t time, unsigned short millis) {
+    struct tm tm;
+    gmtime_r(&time, &tm);
+
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ",
+             tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+             tm.tm_hour, tm.tm_min, tm.tm_sec, static_cast<unsigned>(millis));
+    return buffer;
+}
+
+std::string MessageHistory::formatMsgid(unsigned long msgid) {
+    std::ostringstream oss;
+    oss << std::hex << msgid;
+    return oss.str();
+}
+
+bool MessageHistory::parseRef(const std::string& token, HistoryRef& ref) {
+    if (token.compare(0, 6, "msgid=") == 0) {
+        const char* start = token.c_str() + 6;
+        char* end = NULL;
+        ref.byMsgid = true;
+        ref.msgid = std::strtoul(start, &end, 16);
+        ref.time = 0;
+        ref.millis = 0;
+        return end != start && *end == '\0';
+    }
+
+    if (token.compare(0, 10, "timestamp=") == 0) {
+        struct tm tm;
+        unsigned millis = 0;
+        std::memset(&tm, 0, sizeof(tm));
+        if (std::sscanf(token.c_str() + 10, "%d-%d-%dT%d:%d:%d.%uZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                        &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &millis) < 6) {
+            return false;
+        }
+        tm.tm_year -= 1900;
+        tm.tm_mon -= 1;
+        ref.byMsgid = false;
+        ref.msgid = 0;
+        ref.time = timegm(&tm);
+        ref.millis = static_cast<unsigned short>(millis % 1000);
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,154 @@
+#include "Metrics.hpp"
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+// -------- HISTOGRAM --------
+
+LatencyHistogram::LatencyHistogram() : _total(0), _sum(0), _max(0) {
+    std::memset(_counts, 0, sizeof(_counts));
+}
+
+// Values below SUB_BUCKETS index themselves; above, the magnitude picks the
+// group and the next SUB_BUCKET_BITS bits below the leading one the bucket
+int LatencyHistogram::bucketFor(unsigned long long value) {
+    if (value < static_cast<unsigned long long>(SUB_BUCKETS))
+        return static_cast<int>(value);
+    int magnitude = 63 - __builtin_clzll(value);
+    if (magnitude > MAX_MAGNITUDE)
+        return BUCKET_COUNT - 1;
+    int shift = magnitude - SUB_BUCKET_BITS;
+    int sub = static_cast<int>((value >> shift) & (SUB_BUCKETS - 1));
+    return (shift + 1) * SUB_BUCKETS + sub;
+}
+
+unsigned long long LatencyHistogram::bucketLimit(int bucket) {
+    if (bucket < SUB_BUCKETS)
+        return bucket;
+    int shift = bucket / SUB_BUCKETS - 1;
+    unsigned long long low = static_cast<unsigned long long>(SUB_BUCKETS + bucket % SUB_BUCKETS) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::record(unsigned long long nanoseconds) {
+    ++_counts[bucketFor(nanoseconds)];
+    ++_total;
+    _sum += nanoseconds;
+    if (nanoseconds > _max)
+        _max = nanoseconds;
+}
+
+unsigned long long LatencyHistogram::count() const {
+    return _total;
+}
+
+unsigned long long LatencyHistogram::mean() const {
+    return _total ? _sum / _total : 0;
+}
+
+unsigned long long LatencyHistogram::max() const {
+    return _max;
+}
+
+unsigned long long LatencyHistogram::percentile(double fraction) const {
+    if (_total == 0)
+        return 0;
+    unsigned long long rank = static_cast<unsigned long long>(fraction * _total + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    unsigned long long seen = 0;
+    for (int bucket = 0; bucket < BUCKET_COUNT; ++bucket) {
+        seen += _counts[bucket];
+        if (seen >= rank)
+            return std::min(bucketLimit(bucket), _max);
+    }
+    return _max;
+}
+
+static std::string formatDuration(unsigned long long nanoseconds) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(1);
+    if (nanoseconds < 1000ULL)
+        out << nanoseconds << "ns";
+    else if (nanoseconds < 1000000ULL)
+        out << nanoseconds / 1e3 << "us";
+    else if (nanoseconds < 1000000000ULL)
+        out << nanoseconds / 1e6 << "ms";
+    else
+        out << nanoseconds / 1e9 << "s";
+    return out.str();
+}
+
+std::string LatencyHistogram::summary() const {
+    std::ostringstream out;
+    out << _total << " p50 " << formatDuration(percentile(0.5)) << " p90 " << formatDuration(percentile(0.9))
+        << " p99 " << formatDuration(percentile(0.99)) << " max " << formatDuration(_max);
+    return out.str();
+}
+
+// -------- METRICS --------
+
+Metrics::Metrics() : _startedAt(time(NULL)) {}
+
+unsigned long long Metrics::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+void Metrics::recordCommand(const std::string& verb, unsigned long long nanoseconds) {
+    _commands[verb].record(nanoseconds);
+}
+
+void Metrics::recordTick(unsigned long long nanoseconds) {
+    _ticks.record(nanoseconds);
+}
+
+void Metrics::recordSendQueue(unsigned long long nanoseconds) {
+    _sendQueue.record(nanoseconds);
+}
+
+void Metrics::commandCounts(std::vector<std::string>& lines) const {
+    for (std::map<std::string, LatencyHistogram>::const_iterator it = _commands.begin(); it != _commands.end(); ++it) {
+        std::ostringstream line;
+        line << it->first << " " << it->second.count();
+        lines.push_back(line.str());
+    }
+}
+
+void Metrics::latencyReport(std::vector<std::string>& lines) const {
+    std::ostringstream uptime;
+    uptime << "uptime " << time(NULL) - _startedAt << "s";
+    lines.push_back(uptime.str());
+    lines.push_back("tick " + _ticks.summary());
+    lines.push_back("sendq " + _sendQueue.summary());
+    for (std::map<std::string, LatencyHistogram>::const_iterator it = _commands.begin(); it != _commands.end(); ++it)
+        lines.push_back(it->first + " " + it->second.summary());
+}
+
+void Metrics::setDumpPath(const std::string& path) {
+    _dumpPath = path;
+}
+
+// Written beside the target and renamed over it, so a reader never sees half a report
+bool Metrics::dump(const std::vector<std::string>& extra) const {
+    if (_dumpPath.empty())
+        return true;
+
+    std::vector<std::string> lines;
+    latencyReport(lines);
+    lines.insert(lines.end(), extra.begin(), extra.end());
+    std::string temporary = _dumpPath + ".tmp";
+    {
+        std::ofstream out(temporary.c_str(), std::ios::trunc);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+            out << *it << "\n";
+        if (!out)
+            return false;
+    }
+    return std::rename(temporary.c_str(), _dumpPath.c_str()) == 0;
+}
@@ -0,0 +1,43 @@
+#include "NamesQuery.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "IRCProtocol.hpp"
+
+NamesQuery::NamesQuery(const Client* requester, const std::vector<std::string>& channels)
+    : _requester(requester->getNickname()), _requesterSerial(requester->getSerial()), _channels(channels) {}
+
+NamesQuery::~NamesQuery() {}
+
+void NamesQuery::render(const QuerySnapshot& snapshot, std::string& out) const {
+    for (std::vector<std::string>::const_iterator cit = _channels.begin(); cit != _channels.end(); ++cit) {
+        const QuerySnapshot::ChannelInfo* channel = snapshot.findChannel(*cit);
+        const QuerySnapshot::Member* self = channel ? snapshot.findMember(*channel, _requesterSerial) : NULL;
+        if (channel && !self && (channel->modes & (Channel::MODE_SECRET | Channel::MODE_PRIVATE)))
+            channel = NULL;
+        if (channel) {
+            bool viewerIsOp = self && (self->flags & Channel::MEMBER_OP);
+            std::string prefix = ":" + std::string("ircserv") + " " + IRC::RPL_NAMREPLY + " " + _requester + " " +
+                                 Channel::namesSymbol(channel->modes) + " " + channel->name + " :";
+
+            std::string names;
+            for (std::vector<QuerySnapshot::Member>::const_iterator it = channel->members.begin(); it != channel->members.end(); ++it) {
+                const QuerySnapshot::User* member = snapshot.findUser(it->serial);
+                if (!member || ((it->flags & Channel::MEMBER_HIDDEN) && member->serial != _requesterSerial && !viewerIsOp))
+                    continue;
+                std::string entry = member->nickname;
+                if (char symbol = Channel::memberPrefix(it->flags))
+                    entry.insert(0, 1, symbol);
+                if (!names.empty() && prefix.length() + names.length() + 1 + entry.length() + 2 > MAX_LINE) {
+                    out += prefix + names + "\r\n";
+                    names.clear();
+                }
+                if (!names.empty()) names += " ";
+                names += entry;
+            }
+            if (!names.empty())
+                out += prefix + names + "\r\n";
+        }
+
+        out += ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFNAMES + " " + _requester + " " + *cit + " :End of NAMES list\r\n";
+    }
+}
@@ -0,0 +1,894 @@
+#include "Network.hpp"
+#include "Server.hpp"
+#include "Command.hpp"
+#include "Transport.hpp"
+#include "Metrics.hpp"
+#include "AllocProfile.hpp"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <sys/stat.h>
+
+static std::string numberToString(long value) {
+    std::ostringstream oss;
+    oss << value;
+    return oss.str();
+}
+
+// Re-serialize parameters for relaying, the last one as trailing
+static std::string joinParams(const std::vector<std::string>& params) {
+    std::string joined;
+    for (size_t i = 0; i < params.size(); ++i) {
+        if (i > 0)
+            joined += " ";
+        if (i + 1 == params.size())
+            joined += ":";
+        joined += params[i];
+    }
+    return joined;
+}
+
+Network::Network(Server& server) : _server(server), _dispatcher(NULL), _name("ircserv"), _connectMtime(0) {}
+
+Network::~Network() {}
+
+// -------- CONFIGURATION --------
+
+void Network::setName(const std::string& name) {
+    _name = name;
+}
+
+const std::string& Network::getName() const {
+    return _name;
+}
+
+void Network::setDispatcher(Command* dispatcher) {
+    _dispatcher = dispatcher;
+}
+
+void Network::addLinkTarget(const std::string& name, const std::string& host, int port) {
+    LinkTarget target;
+    target.name = name;
+    target.host = host;
+    target.port = port;
+    target.connection = NULL;
+    target.nextAttempt = 0;
+    _targets.push_back(target);
+}
+
+void Network::openConnectBlocks(const std::string& path) {
+    _connectPath = path;
+    _connectMtime = 0;
+    reloadConnectBlocks();
+    std::cout << "Connect blocks: " << _connectBlocks.size() << " from " << _connectPath << std::endl;
+}
+
+// Without a file, e.g. in the benchmark
+void Network::addConnectBlock(const std::string& name, const std::string& password, const std::string& address) {
+    ConnectBlock block;
+    block.password = password;
+    block.address = address;
+    _connectBlocks[name] = block;
+}
+
+// A stat() per handshake, as AccountStore does per lookup
+void Network::reloadConnectBlocks() {
+    if (_connectPath.empty())
+        return;
+    struct stat info;
+    if (stat(_connectPath.c_str(), &info) == -1) {
+        _connectBlocks.clear();
+        _connectMtime = 0;
+        return;
+    }
+    if (info.st_mtime == _connectMtime)
+        return;
+
+    std::ifstream file(_connectPath.c_str());
+    if (!file)
+        return;
+
+    std::map<std::string, ConnectBlock> blocks;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        ConnectBlock block;
+        if (!(fields >> name) || name[0] == '#' || !(fields >> block.password))
+            continue;
+        fields >> block.address;
+        blocks[name] = block;
+    }
+    _connectBlocks.swap(blocks);
+    _connectMtime = info.st_mtime;
+}
+
+const Network::ConnectBlock* Network::findConnectBlock(const std::string& name) {
+    reloadConnectBlocks();
+    std::map<std::string, ConnectBlock>::const_iterator it = _connectBlocks.find(name);
+    return (it != _connectBlocks.end()) ? &it->second : NULL;
+}
+
+// -------- LINK LIFECYCLE --------
+
+void Network::collectDueLinks(std::vector<LinkTarget*>& due) {
+    time_t now = time(NULL);
+    for (std::vector<LinkTarget>::iterator it = _targets.begin(); it != _targets.end(); ++it) {
+        if (!it->connection && now >= it->nextAttempt) {
+            it->nextAttempt = now + RECONNECT_INTERVAL;
+            due.push_back(&*it);
+        }
+    }
+}
+
+// False without a connect block for the target: there is no password to send
+bool Network::beginOutgoingLink(LinkTarget* target, Client* connection) {
+    const ConnectBlock* block = findConnectBlock(target->name);
+    if (!block) {
+        std::cerr << "No connect block for server " << target->name << std::endl;
+        linkAttemptFailed(target);
+        return false;
+    }
+    target->connection = connection;
+    connection->setLinkState(Client::LINK_CONNECTING);
+    connection->enqueueMessage("PASS " + block->password + " TS\r\n");
+    connection->enqueueMessage("SERVER " + _name + " 1 :ircserv node\r\n");
+    return true;
+}
+
+void Network::linkAttemptFailed(LinkTarget* target) {
+    target->connection = NULL;
+    target->nextAttempt = time(NULL) + RECONNECT_INTERVAL;
+}
+
+// A connection that sent its link password and SERVER becomes a link; the
+// side that accepted the socket answers the handshake, then both sides burst.
+bool Network::acceptLink(Client* connection, const std::string& name, const std::string& description, std::string& refusal) {
+    bool outgoing = connection->getLinkState() == Client::LINK_CONNECTING;
+    const ConnectBlock* block = findConnectBlock(name);
+    if (name == _name || _peers.find(name) != _peers.end()) {
+        refusal = "Server " + name + " already exists";
+    } else if (!block) {
+        refusal = "No connect block for " + name;
+    } else if (connection->getLinkPassword() != block->password) {
+        refusal = "Bad link password";
+    } else if (!outgoing && !block->address.empty() && block->address != connection->getIp()) {
+        refusal = "Source address " + connection->getIp() + " not allowed for " + name;
+    } else if (outgoing) {
+        for (std::vector<LinkTarget>::const_iterator it = _targets.begin(); it != _targets.end(); ++it) {
+            if (it->connection == connection && it->name != name)
+                refusal = "Expected server " + it->name + ", not " + name;
+        }
+    }
+    if (!refusal.empty())
+        return false;
+
+    if (!outgoing) {
+        connection->enqueueMessage("PASS " + block->password + " TS\r\n");
+        connection->enqueueMessage("SERVER " + _name + " 1 :ircserv node\r\n");
+    }
+    connection->setLinkState(Client::LINK_ESTABLISHED);
+
+    Peer peer;
+    peer.uplink = _name;
+    peer.hops = 1;
+    peer.link = connection;
+    peer.description = description;
+    _peers[name] = peer;
+    _links[connection] = name;
+
+    propagate(":" + _name + " SERVER " + name + " 2 :" + description + "\r\n", connection);
+    sendBurst(connection);
+    std::cout << "Linked to server " << name << " (fd=" << connection->getFd() << ")" << std::endl;
+    return true;
+}
+
+// Called for every client the server frees
+void Network::forgetClient(Client* client) {
+    _silentQuits.erase(client);
+    for (std::vector<LinkTarget>::iterator it = _targets.begin(); it != _targets.end(); ++it) {
+        if (it->connection == client)
+            linkAttemptFailed(&*it);
+    }
+    if (_links.find(client) != _links.end())
+        splitLink(client, client->getQuitReason());
+}
+
+void Network::pingLinks() {
+    for (std::map<Client*, std::string>::iterator it = _links.begin(); it != _links.end(); ++it)
+        it->first->enqueueMessage(":" + _name + " PING :" + _name + "\r\n");
+}
+
+// Drop every link, e.g. before a binary upgrade; the targets are retried as after a split
+void Network::closeLinks(const std::string& reason) {
+    for (std::map<Client*, std::string>::iterator it = _links.begin(); it != _links.end(); ++it)
+        _server.scheduleDisconnection(it->first, reason);
+    for (std::vector<LinkTarget>::iterator it = _targets.begin(); it != _targets.end(); ++it) {
+        if (it->connection)
+            _server.scheduleDisconnection(it->connection, reason);
+    }
+}
+
+// -------- BURST --------
+
+void Network::sendBurst(Client* link) {
+    // Servers nearest first, so every uplink is known before what hangs off it
+    std::vector<std::pair<int, std::string> > servers;
+    for (std::map<std::string, Peer>::iterator it = _peers.begin(); it != _peers.end(); ++it) {
+        if (it->second.link != link)
+            servers.push_back(std::make_pair(it->second.hops, it->first));
+    }
+    std::sort(servers.begin(), servers.end());
+    for (std::vector<std::pair<int, std::string> >::iterator it = servers.begin(); it != servers.end(); ++it) {
+        const Peer& peer = _peers[it->second];
+        link->enqueueMessage(":" + peer.uplink + " SERVER " + it->second + " " + numberToString(peer.hops + 1) + " :" + peer.description + "\r\n");
+    }
+
+    const std::map<std::string, Client*>& users = _server.getUsersByNick();
+    for (std::map<std::string, Client*>::const_iterator it = users.begin(); it != users.end(); ++it) {
+        Client* user = it->second;
+        if (user->isRegistered() && !user->isDisconnecting() && user->getUplink() != link)
+            link->enqueueMessage(uidLine(user));
+    }
+
+    const std::map<std::string, Channel*>& channels = _server.getChannels();
+    for (std::map<std::string, Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel* channel = it->second;
+        std::string ts = numberToString(channel->getCreatedAt());
+
+        std::vector<std::string> members;
+        const std::vector<Channel::Member>& list = channel->getMembers();
+        for (std::vector<Channel::Member>::const_iterator mit = list.begin(); mit != list.end(); ++mit) {
+            if (mit->client->getUplink() == link || mit->client->isDisconnecting())
+                continue;
+            std::string prefix = (mit->flags & Channel::MEMBER_OP) ? "@" : (mit->flags & Channel::MEMBER_HIDDEN) ? "!" :
+                                 (mit->flags & Channel::MEMBER_VOICE) ? "+" : "";
+            members.push_back(prefix + mit->client->getNickname());
+        }
+        if (members.empty())
+            continue;
+        sendChunked(link, ":" + _name + " SJOIN " + ts + " " + channel->getName() + " " + channelModes(channel) + " :", members);
+
+        static const char listModes[Channel::LIST_COUNT] = { 'b', 'e', 'I' };
+        for (int l = 0; l < Channel::LIST_COUNT; ++l) {
+            const std::vector<Channel::MaskEntry>& entries = channel->getListMasks(static_cast<Channel::ListMode>(l));
+            std::vector<std::string> masks;
+            for (std::vector<Channel::MaskEntry>::const_iterator eit = entries.begin(); eit != entries.end(); ++eit)
+                masks.push_back(eit->mask);
+            if (!masks.empty())
+                sendChunked(link, ":" + _name + " BMASK " + ts + " " + channel->getName() + " " + listModes[l] + " :", masks);
+        }
+
+        if (!channel->getTopic().empty())
+            link->enqueueMessage(":" + _name + " TB " + channel->getName() + " :" + channel->getTopic() + "\r\n");
+    }
+
+    link->enqueueMessage(":" + _name + " EOB\r\n");
+}
+
+std::string Network::uidLine(Client* user) const {
+    std::string server = user->isRemote() ? user->getServerName() : _name;
+    int hops = 1;
+    if (user->isRemote()) {
+        std::map<std::string, Peer>::const_iterator it = _peers.find(server);
+        hops = (it != _peers.end()) ? it->second.hops + 1 : 2;
+    }
+    return ":" + server + " UID " + user->getNickname() + " " + numberToString(hops) + " "
+        + numberToString(user->getNickTs()) + " " + user->getUsername() + " " + user->getHostname()
+        + " :" + user->getRealname() + "\r\n";
+}
+
+// "+modes [key] [limit]" as carried by SJOIN
+std::string Network::channelModes(Channel* channel) {
+    std::string modes = channel->getModeString();
+    if (modes.empty())
+        return "+";
+    if (!channel->getKey().empty())
+        modes += " " + channel->getKey();
+    if (channel->getUserLimit() > 0)
+        modes += " " + numberToString(channel->getUserLimit());
+    return modes;
+}
+
+void Network::sendChunked(Client* link, const std::string& head, const std::vector<std::string>& items) {
+    std::string line;
+    for (std::vector<std::string>::const_iterator it = items.begin(); it != items.end(); ++it) {
+        if (!line.empty() && head.length() + line.length() + it->length() + 1 > BURST_LINE_LENGTH) {
+            link->enqueueMessage(head + line + "\r\n");
+            line.clear();
+        }
+        line += (line.empty() ? "" : " ") + *it;
+    }
+    if (!line.empty())
+        link->enqueueMessage(head + line + "\r\n");
+}
+
+// -------- INCOMING --------
+
+void Network::handleMessage(Client* link, const IRCCommand& cmd) {
+    std::vector<std::string> params = cmd.params;
+    if (!cmd.trailing.empty())
+        params.push_back(cmd.trailing);
+
+    // Users are always sent as nick!user@host, servers by bare name
+    size_t bang = cmd.prefix.find('!');
+    if (bang != std::string::npos) {
+        Client* user = _server.findClientByNick(cmd.prefix.substr(0, bang));
+        // Unknown, or arriving from the wrong direction (e.g. a collision loser)
+        if (!user || user->getUplink() != link || user->isDisconnecting())
+            return;
+
+        if (cmd.command == "NICK") {
+            handleRemoteNick(link, user, params);
+        } else if (cmd.command == "QUIT") {
+            _server.scheduleDisconnection(user, params.empty() ? "Client Quit" : params[0]);
+        } else if (cmd.command == "PRIVMSG" || cmd.command == "NOTICE" || cmd.command == "PART"
+                   || cmd.command == "KICK" || cmd.command == "TOPIC" || cmd.command == "MODE"
+                   || cmd.command == "INVITE") {
+            // Same handlers as local users; they relay onwards themselves
+            if (_dispatcher)
+                _dispatcher->executeCommand(user, cmd);
+        }
+        return;
+    }
+
+    std::string source = cmd.prefix.empty() ? _links[link] : cmd.prefix;
+
+    if (cmd.command == "PING") {
+        link->enqueueMessage(":" + _name + " PONG " + _name + " :" + (params.empty() ? _name : params[0]) + "\r\n");
+    } else if (cmd.command == "SERVER") {
+        handleServerIntro(link, source, params);
+    } else if (cmd.command == "SQUIT") {
+        handleSquit(link, source, params);
+    } else if (cmd.command == "UID") {
+        handleUid(link, source, params);
+    } else if (cmd.command == "SJOIN") {
+        handleSjoin(link, source, params);
+    } else if (cmd.command == "BMASK") {
+        handleBmask(link, source, params);
+    } else if (cmd.command == "TB") {
+        handleTopicBurst(link, source, params);
+    } else if (cmd.command == "EOB") {
+        std::cout << "End of burst from " << source << std::endl;
+    } else if (cmd.command == "ERROR") {
+        std::cout << "Link " << _links[link] << " error: " << (params.empty() ? "" : params[0]) << std::endl;
+        _server.scheduleDisconnection(link, params.empty() ? "Link error" : params[0]);
+    }
+}
+
+// :<uplink> SERVER <name> <hops> :<description>
+void Network::handleServerIntro(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.size() < 3)
+        return;
+    const std::string& name = params[0];
+
+    // Already reachable another way: linking would close a loop
+    if (name == _name || _peers.find(name) != _peers.end()) {
+        link->enqueueMessage("ERROR :Server " + name + " already exists\r\n");
+        _server.scheduleDisconnection(link, "Server " + name + " already exists");
+        return;
+    }
+
+    Peer peer;
+    peer.uplink = source;
+    peer.hops = std::atoi(params[1].c_str());
+    peer.link = link;
+    peer.description = params[2];
+    _peers[name] = peer;
+
+    propagate(":" + source + " SERVER " + name + " " + numberToString(peer.hops + 1) + " :" + peer.description + "\r\n", link);
+}
+
+// :<source> SQUIT <name> :<reason>
+void Network::handleSquit(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.empty())
+        return;
+    const std::string& name = params[0];
+    std::string reason = (params.size() > 1) ? params[1] : name;
+
+    if (name == _links[link]) {
+        _server.scheduleDisconnection(link, reason);
+        return;
+    }
+
+    std::map<std::string, Peer>::iterator it = _peers.find(name);
+    if (it == _peers.end() || it->second.link != link)
+        return;
+
+    removeServers(name);
+    propagate(":" + source + " SQUIT " + name + " :" + reason + "\r\n", link);
+}
+
+// :<server> UID <nick> <hops> <nickTS> <user> <host> :<realname>
+void Network::handleUid(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.size() < 6)
+        return;
+    const std::string& nick = params[0];
+    time_t ts = std::atol(params[2].c_str());
+
+    // Relayed even when it loses: servers further on resolve the same collision
+    std::vector<std::string> relayed = params;
+    relayed[1] = numberToString(std::atoi(params[1].c_str()) + 1);
+    propagate(":" + source + " UID " + joinParams(relayed) + "\r\n", link);
+
+    Client* holder = _server.findClientByNick(nick);
+    if (holder && !holder->isDisconnecting() && !resolveCollision(holder, ts))
+        return;
+
+    Client* user = new Client(-1);
+    user->setRemote(source, link);
+    _server.addRemoteClient(user);
+    _server.setClientNickname(user, nick);
+    user->setNickTs(ts);
+    _server.setClientUsername(user, params[3]);
+    _server.setClientHostname(user, params[4]);
+    user->setRealname(params[5]);
+    user->setReceivedPass(true);
+    user->tryRegister();
+    user->setWelcomeSent(true);
+}
+
+// :<server> SJOIN <channelTS> <channel> <modes> [<mode args>...] :<[@+!]nick>...
+// ("!": a +D member whose join was not shown yet)
+void Network::handleSjoin(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.size() < 4)
+        return;
+    time_t ts = std::atol(params[0].c_str());
+    const std::string& name = params[1];
+
+    Channel* channel = _server.getChannel(name);
+    bool theirsCount = true;
+    if (!channel) {
+        channel = _server.createChannel(name);
+        channel->setCreatedAt(ts);
+    } else if (ts < channel->getCreatedAt()) {
+        loseChannelTs(channel, source, ts);
+    } else if (ts > channel->getCreatedAt()) {
+        theirsCount = false; // younger side: its joins stand, its ops and modes do not
+    }
+
+    if (theirsCount)
+        applyModes(channel, source, params, 2, params.size() - 1);
+
+    std::istringstream members(params[params.size() - 1]);
+    std::string token;
+    while (members >> token) {
+        size_t start = token.find_first_not_of("@+!");
+        if (start == std::string::npos)
+            continue;
+        Client* member = _server.findClientByNick(token.substr(start));
+        if (!member || member->getUplink() != link || channel->hasClient(member))
+            continue;
+
+        // A +D member nobody has seen join stays hidden here too, until it
+        // speaks; its PART and QUIT then go no further than on its own server
+        channel->addClient(member);
+        if (token.find('!') < start && channel->hasMode(Channel::MODE_DELAYED_JOIN))
+            channel->setMemberFlag(member, Channel::MEMBER_HIDDEN, true);
+        else
+            channel->broadcast(member->buildMessage("JOIN", "", name), NULL);
+        if (!theirsCount)
+            continue;
+        if (token.find('@') < start) {
+            channel->addOperator(member);
+            channel->broadcast(":" + source + " MODE " + name + " +o " + member->getNickname() + "\r\n", NULL);
+        } else if (token.find('+') < start) {
+            channel->setMemberFlag(member, Channel::MEMBER_VOICE, true);
+        }
+    }
+
+    propagate(":" + source + " SJOIN " + joinParams(params) + "\r\n", link);
+    _server.deleteChannelIfEmpty(channel);
+}
+
+// :<server> BMASK <channelTS> <channel> <b|e|I> :<mask>...
+void Network::handleBmask(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.size() < 4 || params[2].empty())
+        return;
+    Channel* channel = _server.getChannel(params[1]);
+    if (channel && std::atol(params[0].c_str()) <= channel->getCreatedAt()) {
+        char mode = params[2][0];
+        Channel::ListMode list = (mode == 'b') ? Channel::LIST_BAN :
+                                 (mode == 'e') ? Channel::LIST_EXCEPT : Channel::LIST_INVEX;
+        std::istringstream masks(params[3]);
+        std::string mask;
+        while (masks >> mask) {
+            if (channel->addListMask(list, mask, source))
+                channel->broadcast(":" + source + " MODE " + channel->getName() + " +" + mode + " " + mask + "\r\n", NULL);
+        }
+    }
+    propagate(":" + source + " BMASK " + joinParams(params) + "\r\n", link);
+}
+
+// :<server> TB <channel> :<topic> — only fills in a topic we do not have
+void Network::handleTopicBurst(Client* link, const std::string& source, const std::vector<std::string>& params) {
+    if (params.size() < 2)
+        return;
+    Channel* channel = _server.getChannel(params[0]);
+    if (channel && channel->getTopic().empty()) {
+        channel->setTopic(params[1]);
+        channel->broadcast(":" + source + " TOPIC " + params[0] + " :" + params[1] + "\r\n", NULL);
+    }
+    propagate(":" + source + " TB " + joinParams(params) + "\r\n", link);
+}
+
+// :<old hostmask> NICK <new> <nickTS>
+void Network::handleRemoteNick(Client* link, Client* user, const std::vector<std::string>& params) {
+    if (params.empty())
+        return;
+    const std::string& nick = params[0];
+    time_t ts = (params.size() > 1) ? std::atol(params[1].c_str()) : time(NULL);
+    std::string oldHostmask = user->getHostmask();
+
+    propagate(":" + oldHostmask + " NICK " + nick + " " + numberToString(ts) + "\r\n", link);
+
+    Client* holder = _server.findClientByNick(nick);
+    if (holder && holder != user && !holder->isDisconnecting() && !resolveCollision(holder, ts)) {
+        killUser(user, "Nick collision");
+        return;
+    }
+
+    const std::vector<Channel*>& channels = user->getChannels();
+    for (std::vector<Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+        (*it)->invalidateBanCache(user);
+    _server.setClientNickname(user, nick);
+    user->setNickTs(ts);
+    _server.broadcastToCommonChannels(user, ":" + oldHostmask + " NICK :" + nick + "\r\n", false);
+}
+
+// -------- STATE CHANGES --------
+
+// The older nick keeps it; on a tie both go. Every node applies the same rule
+// when it sees the other side's user, so no KILL has to cross the links.
+// Returns whether the newcomer may take the nick.
+bool Network::resolveCollision(Client* holder, time_t ts) {
+    if (holder->getNickTs() < ts)
+        return false;
+    bool tie = (holder->getNickTs() == ts);
+    killUser(holder, "Nick collision");
+    return !tie;
+}
+
+// The QUIT goes out and the channels are left right away, so members see it
+// before the JOIN of whoever takes the nick
+void Network::killUser(Client* user, const std::string& reason) {
+    if (!user->isRemote())
+        user->enqueueMessage("ERROR :Closing Link: " + user->getHostname() + " (" + reason + ")\r\n");
+    _server.broadcastToCommonChannels(user, user->buildMessage("QUIT", "", reason), false);
+
+    std::vector<Channel*> channels = user->getChannels();
+    for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        (*it)->removeClient(user);
+        (*it)->promoteNewOperatorIfNeeded();
+        _server.deleteChannelIfEmpty(*it);
+    }
+
+    _silentQuits.insert(user);
+    _server.scheduleDisconnection(user, reason);
+}
+
+// Forget a server and everything behind it; their users quit with the usual
+// "<uplink> <server>" netsplit reason
+void Network::removeServers(const std::string& root) {
+    std::set<std::string> gone;
+    gone.insert(root);
+    std::string reason = _peers[root].uplink + " " + root;
+
+    bool grew = true;
+    while (grew) {
+        grew = false;
+        for (std::map<std::string, Peer>::iterator it = _peers.begin(); it != _peers.end(); ++it) {
+            if (gone.find(it->first) == gone.end() && gone.find(it->second.uplink) != gone.end()) {
+                gone.insert(it->first);
+                grew = true;
+            }
+        }
+    }
+    for (std::set<std::string>::iterator it = gone.begin(); it != gone.end(); ++it)
+        _peers.erase(*it);
+
+    const std::map<std::string, Client*>& users = _server.getUsersByNick();
+    for (std::map<std::string, Client*>::const_iterator it = users.begin(); it != users.end(); ++it) {
+        Client* user = it->second;
+        if (user->isRemote() && gone.find(user->getServerName()) != gone.end()) {
+            user->setUplink(NULL);
+            killUser(user, reason);
+        }
+    }
+}
+
+void Network::splitLink(Client* link, const std::string& reason) {
+    std::map<Client*, std::string>::iterator it = _links.find(link);
+    std::string name = it->second;
+    _links.erase(it);
+
+    std::cout << "Netsplit: lost link to " << name << " (" << reason << ")" << std::endl;
+    removeServers(name);
+    propagate(":" + _name + " SQUIT " + name + " :" + reason + "\r\n", NULL);
+}
+
+// The other side's channel is older: drop our ops and modes, adopt its TS
+void Network::loseChannelTs(Channel* channel, const std::string& source, time_t ts) {
+    channel->setCreatedAt(ts);
+
+    std::string cleared = channel->getModeString();
+    channel->revealAllMembers();
+    channel->clearModes();
+    if (!cleared.empty())
+        channel->broadcast(":" + source + " MODE " + channel->getName() + " -" + cleared.substr(1) + "\r\n", NULL);
+
+    std::vector<Channel::Member> members = channel->getMembers();
+    for (std::vector<Channel::Member>::iterator it = members.begin(); it != members.end(); ++it) {
+        if (it->flags & Channel::MEMBER_OP) {
+            channel->removeOperator(it->client);
+            channel->broadcast(":" + source + " MODE " + channel->getName() + " -o " + it->client->getNickname() + "\r\n", NULL);
+        }
+    }
+}
+
+// Apply the simple modes of an SJOIN (params[first] is the mode string, its
+// arguments follow up to params[last])
+void Network::applyModes(Channel* channel, const std::string& source, const std::vector<std::string>& params, size_t first, size_t last) {
+    if (first >= last)
+        return;
+    const std::string& modes = params[first];
+    size_t arg = first + 1;
+    std::string applied;
+    std::string appliedArgs;
+
+    for (size_t i = 0; i < modes.length(); ++i) {
+        const Channel::ModeSpec* spec = Channel::findMode(modes[i]);
+        if (!spec)
+            continue;
+        switch (spec->type) {
+            case Channel::MODE_TYPE_FLAG:
+                if (channel->setMode(spec->bit, true))
+                    applied += spec->letter;
+                break;
+            case Channel::MODE_TYPE_PARAM:
+                if (arg < last) {
+                    const std::string& key = params[arg++];
+                    if (channel->setKey(key)) { applied += spec->letter; appliedArgs += " " + key; }
+                }
+                break;
+            case Channel::MODE_TYPE_SETTING:
+                if (arg < last) {
+                    size_t limit = static_cast<size_t>(std::atoi(params[arg++].c_str()));
+                    if (limit > 0 && channel->setUserLimit(limit)) {
+                        applied += spec->letter;
+                        appliedArgs += " " + numberToString(limit);
+                    }
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (!applied.empty())
+        channel->broadcast(":" + source + " MODE " + channel->getName() + " +" + applied + appliedArgs + "\r\n", NULL);
+}
+
+// -------- RELAYING LOCAL CHANGES --------
+
+bool Network::isKnownServer(const std::string& name) const {
+    return name == _name || _peers.find(name) != _peers.end();
+}
+
+void Network::introduceUser(Client* user) {
+    propagate(uidLine(user), NULL);
+}
+
+void Network::propagate(const std::string& line, Client* except) {
+    IRCSERV_ALLOC_SCOPE("(fanout)");
+    for (std::map<Client*, std::string>::iterator it = _links.begin(); it != _links.end(); ++it) {
+        if (it->first != except)
+            it->first->enqueueMessage(line);
+    }
+}
+
+void Network::propagateJoin(Channel* channel, Client* user) {
+    if (_links.empty())
+        return;
+    std::string prefix = channel->isOperator(user) ? "@" : channel->isHidden(user) ? "!" : "";
+    propagate(":" + _name + " SJOIN " + numberToString(channel->getCreatedAt()) + " " + channel->getName() + " "
+              + channelModes(channel) + " :" + prefix + user->getNickname() + "\r\n", NULL);
+}
+
+void Network::propagateQuit(Client* user, const std::string& quitMsg) {
+    if (_silentQuits.erase(user))
+        return;
+    propagate(quitMsg, user->getUplink());
+}
+
+// Channel traffic only goes down links that lead to at least one member
+void Network::relayToChannel(Channel* channel, const std::string& line, Client* except) {
+    if (_links.empty())
+        return;
+
+    IRCSERV_ALLOC_SCOPE("(fanout)");
+    std::set<Client*> links;
+    const std::vector<Channel::Member>& members = channel->getMembers();
+    for (std::vector<Channel::Member>::const_iterator it = members.begin(); it != members.end(); ++it) {
+        Client* uplink = it->client->getUplink();
+        if (uplink && uplink != except)
+            links.insert(uplink);
+    }
+    for (std::set<Client*>::iterator it = links.begin(); it != links.end(); ++it) {
+        if (_links.find(*it) != _links.end())
+            (*it)->enqueueMessage(line);
+    }
+}
+
+// -------- BENCHMARK --------
+
+namespace {
+
+const size_t BENCH_CLIENTS = 400;
+const size_t BENCH_MESSAGES = 200;
+
+// One server of the chain, ticked as the event loop would
+struct BenchNode {
+    struct Bridge {
+        BenchNode* peer;
+        int peerFd;
+    };
+
+    MemoryTransport transport;
+    Server server;
+    Command commands;
+    std::vector<int> fds;
+    std::map<int, Bridge> bridges;      // link fd -> the next or previous node's end
+    unsigned long long received;        // lines taken by this node's clients
+
+    BenchNode(const std::string& name) : server("bench"), commands(&server), received(0) {
+        server.setTransport(&transport);
+        server.getNetwork().setName(name);
+    }
+
+    int connect() {
+        int fd = transport.connect();
+        fds.push_back(fd);
+        server.addClient(fd);
+        server.getClient(fd)->setIp("127.0.0.1");
+        server.setClientHostname(server.getClient(fd), "127.0.0.1");
+        return fd;
+    }
+
+    bool tick() {
+        server.reapDisconnections();
+        server.publishChanges();
+        server.flushPendingWrites();
+
+        bool moved = false;
+        for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+            if (transport.hasInput(*it)) {
+                server.readFromClient(*it, commands);
+                moved = true;
+            }
+            Client* client = server.getClient(*it);
+            if (client && !client->isDisconnecting() && client->needsPollOut())
+                server.writeToClient(*it);
+        }
+
+        std::string output;
+        for (std::vector<int>::const_iterator it = fds.begin(); it != fds.end(); ++it) {
+            output.clear();
+            transport.takeOutput(*it, output);
+            if (output.empty())
+                continue;
+            moved = true;
+            std::map<int, Bridge>::iterator bridge = bridges.find(*it);
+            if (bridge != bridges.end())
+                bridge->second.peer->transport.deliver(bridge->second.peerFd, output);
+            else
+                received += std::count(output.begin(), output.end(), '\n');
+        }
+        return moved;
+    }
+};
+
+void settle(std::vector<BenchNode*>& nodes) {
+    for (int quiet = 0; quiet < 2; ) {
+        bool moved = false;
+        for (size_t i = 0; i < nodes.size(); ++i)
+            moved = nodes[i]->tick() || moved;
+        quiet = moved ? 0 : quiet + 1;
+    }
+}
+
+// BENCH_CLIENTS in one channel over a chain of servers; the first client
+// talks, and a message counts once every member has it
+bool benchmarkChain(size_t servers, LatencyHistogram& delivery, double& linesPerSecond) {
+    std::vector<BenchNode*> nodes;
+    for (size_t i = 0; i < servers; ++i) {
+        std::ostringstream name;
+        name << "bench" << i;
+        nodes.push_back(new BenchNode(name.str()));
+    }
+
+    // Connect and register the clients, then link the chain so the bursts carry them
+    std::vector<int> talkers;
+    for (size_t c = 0; c < BENCH_CLIENTS; ++c) {
+        BenchNode* node = nodes[c % servers];
+        int fd = node->connect();
+        std::ostringstream nick;
+        nick << "b" << c;
+        node->transport.deliver(fd, "PASS bench\r\nNICK " + nick.str() + "\r\nUSER " + nick.str() + " 0 * :bench\r\nJOIN #bench\r\n");
+        if (c == 0)
+            talkers.push_back(fd);
+    }
+    for (size_t i = 0; i + 1 < servers; ++i) {
+        BenchNode* from = nodes[i];
+        BenchNode* to = nodes[i + 1];
+        from->server.getNetwork().addConnectBlock(to->server.getNetwork().getName(), "bench-link", "");
+        to->server.getNetwork().addConnectBlock(from->server.getNetwork().getName(), "bench-link", "");
+        from->server.getNetwork().addLinkTarget(to->server.getNetwork().getName(), "memory", 0);
+
+        std::vector<Network::LinkTarget*> due;
+        from->server.getNetwork().collectDueLinks(due);
+        int fromFd = from->connect();
+        int toFd = to->connect();
+        BenchNode::Bridge forward = { to, toFd };
+        BenchNode::Bridge backward = { from, fromFd };
+        from->bridges[fromFd] = forward;
+        to->bridges[toFd] = backward;
+        from->server.getNetwork().beginOutgoingLink(due.back(), from->server.getClient(fromFd));
+    }
+    settle(nodes);
+
+    bool complete = true;
+    for (size_t i = 0; i < servers; ++i)
+        complete = complete && nodes[i]->server.getNetwork().isKnownServer(nodes[servers - 1 - i]->server.getNetwork().getName());
+
+    unsigned long long expected = 0;
+    for (size_t i = 0; i < servers; ++i)
+        nodes[i]->received = 0;
+    unsigned long long started = Metrics::now();
+    for (size_t m = 0; m < BENCH_MESSAGES && complete; ++m) {
+        unsigned long long sent = Metrics::now();
+        nodes[0]->transport.deliver(talkers[0], "PRIVMSG #bench :fan-out benchmark line\r\n");
+        settle(nodes);
+        delivery.record(Metrics::now() - sent);
+        expected += BENCH_CLIENTS - 1;
+    }
+    unsigned long long elapsed = Metrics::now() - started;
+
+    unsigned long long received = 0;
+    for (size_t i = 0; i < servers; ++i)
+        received += nodes[i]->received;
+    linesPerSecond = elapsed ? received * 1e9 / elapsed : 0;
+
+    for (size_t i = 0; i < servers; ++i)
+        delete nodes[i];
+    return complete && received == expected;
+}
+
+}
+
+int Network::benchmark() {
+    static const size_t CHAINS[] = { 1, 2, 4, 8 };
+
+    for (size_t i = 0; i < sizeof(CHAINS) / sizeof(CHAINS[0]); ++i) {
+        LatencyHistogram delivery;
+        double linesPerSecond = 0;
+
+        // The servers' own logging would swamp the report
+        std::ofstream discard("/dev/null");
+        std::streambuf* console = std::cout.rdbuf(discard.rdbuf());
+        bool ok = benchmarkChain(CHAINS[i], delivery, linesPerSecond);
+        std::cout.rdbuf(console);
+
+        if (!ok) {
+            std::cerr << "Network: " << CHAINS[i] << " servers benchmark failed" << std::endl;
+            return 1;
+        }
+        std::cout << "Network: " << CHAINS[i] << " servers x " << BENCH_CLIENTS / CHAINS[i] << " members, message to all "
+                  << delivery.summary() << ", " << std::fixed << std::setprecision(0) << linesPerSecond
+                  << " deliveries/s" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,301 @@
+#include "PasswordHash.hpp"
+#include "utils.hpp"
+#include <vector>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+// -------- SHA-256 --------
+
+namespace {
+    const uint32_t SHA256_K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    inline uint32_t rotr(uint32_t x, unsigned n) {
+        return (x >> n) | (x << (32 - n));
+    }
+
+    inline uint32_t rotl(uint32_t x, unsigned n) {
+        return (x << n) | (x >> (32 - n));
+    }
+
+    struct Sha256 {
+        uint32_t state[8];
+        unsigned char block[64];
+        size_t used;
+        uint64_t length;
+
+        Sha256() : used(0), length(0) {
+            static const uint32_t initial[8] = {
+                0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+            };
+            std::memcpy(state, initial, sizeof(state));
+        }
+
+        void compress() {
+            uint32_t w[64];
+            for (int i = 0; i < 16; ++i)
+                w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16
+                     | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+            for (int i = 16; i < 64; ++i) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (int i = 0; i < 64; ++i) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+            }
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+
+        void update(const unsigned char* data, size_t length) {
+            this->length += length;
+            while (length > 0) {
+                size_t take = std::min(length, sizeof(block) - used);
+                std::memcpy(block + used, data, take);
+                used += take;
+                data += take;
+                length -= take;
+                if (used == sizeof(block)) {
+                    compress();
+                    used = 0;
+                }
+            }
+        }
+
+        void finish(unsigned char digest[32]) {
+            uint64_t bits = length * 8;
+            unsigned char pad = 0x80;
+            update(&pad, 1);
+            pad = 0;
+            while (used != 56)
+                update(&pad, 1);
+            unsigned char encoded[8];
+            for (int i = 0; i < 8; ++i)
+                encoded[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+            update(encoded, 8);
+            for (int i = 0; i < 8; ++i) {
+                digest[i * 4] = static_cast<unsigned char>(state[i] >> 24);
+                digest[i * 4 + 1] = static_cast<unsigned char>(state[i] >> 16);
+                digest[i * 4 + 2] = static_cast<unsigned char>(state[i] >> 8);
+                digest[i * 4 + 3] = static_cast<unsigned char>(state[i]);
+            }
+        }
+    };
+
+    // -------- PBKDF2-HMAC-SHA256 --------
+
+    // Inner and outer hashes keyed once, then copied for every message
+    struct Hmac {
+        Sha256 inner;
+        Sha256 outer;
+
+        Hmac(const unsigned char* key, size_t length) {
+            unsigned char block[64];
+            std::memset(block, 0, sizeof(block));
+            if (length > sizeof(block)) {
+                Sha256 shortened;
+                shortened.update(key, length);
+                shortened.finish(block);
+            } else {
+                std::memcpy(block, key, length);
+            }
+
+            unsigned char pad[64];
+            for (int i = 0; i < 64; ++i)
+                pad[i] = block[i] ^ 0x36;
+            inner.update(pad, sizeof(pad));
+            for (int i = 0; i < 64; ++i)
+                pad[i] = block[i] ^ 0x5c;
+            outer.update(pad, sizeof(pad));
+        }
+    };
+
+    void pbkdf2(const std::string& password, const unsigned char* salt, size_t saltLength,
+                unsigned char* out, size_t outLength) {
+        Hmac hmac(reinterpret_cast<const unsigned char*>(password.data()), password.length());
+
+        // scrypt only ever uses one iteration, so each block is U1 alone
+        for (uint32_t index = 1; outLength > 0; ++index) {
+            unsigned char counter[4] = {
+                static_cast<unsigned char>(index >> 24), static_cast<unsigned char>(index >> 16),
+                static_cast<unsigned char>(index >> 8), static_cast<unsigned char>(index)
+            };
+            Sha256 inner = hmac.inner;
+            inner.update(salt, saltLength);
+            inner.update(counter, sizeof(counter));
+            unsigned char digest[32];
+            inner.finish(digest);
+
+            Sha256 outer = hmac.outer;
+            outer.update(digest, sizeof(digest));
+            outer.finish(digest);
+
+            size_t take = std::min(outLength, sizeof(digest));
+            std::memcpy(out, digest, take);
+            out += take;
+            outLength -= take;
+        }
+    }
+
+    // -------- SCRYPT CORE --------
+
+    void salsa208(uint32_t b[16]) {
+        uint32_t x[16];
+        std::memcpy(x, b, sizeof(x));
+        for (int i = 0; i < 8; i += 2) {
+            x[4] ^= rotl(x[0] + x[12], 7);   x[8] ^= rotl(x[4] + x[0], 9);
+            x[12] ^= rotl(x[8] + x[4], 13);  x[0] ^= rotl(x[12] + x[8], 18);
+            x[9] ^= rotl(x[5] + x[1], 7);    x[13] ^= rotl(x[9] + x[5], 9);
+            x[1] ^= rotl(x[13] + x[9], 13);  x[5] ^= rotl(x[1] + x[13], 18);
+            x[14] ^= rotl(x[10] + x[6], 7);  x[2] ^= rotl(x[14] + x[10], 9);
+            x[6] ^= rotl(x[2] + x[14], 13);  x[10] ^= rotl(x[6] + x[2], 18);
+            x[3] ^= rotl(x[15] + x[11], 7);  x[7] ^= rotl(x[3] + x[15], 9);
+            x[11] ^= rotl(x[7] + x[3], 13);  x[15] ^= rotl(x[11] + x[7], 18);
+            x[1] ^= rotl(x[0] + x[3], 7);    x[2] ^= rotl(x[1] + x[0], 9);
+            x[3] ^= rotl(x[2] + x[1], 13);   x[0] ^= rotl(x[3] + x[2], 18);
+            x[6] ^= rotl(x[5] + x[4], 7);    x[7] ^= rotl(x[6] + x[5], 9);
+            x[4] ^= rotl(x[7] + x[6], 13);   x[5] ^= rotl(x[4] + x[7], 18);
+            x[11] ^= rotl(x[10] + x[9], 7);  x[8] ^= rotl(x[11] + x[10], 9);
+            x[9] ^= rotl(x[8] + x[11], 13);  x[10] ^= rotl(x[9] + x[8], 18);
+            x[12] ^= rotl(x[15] + x[14], 7); x[13] ^= rotl(x[12] + x[15], 9);
+            x[14] ^= rotl(x[13] + x[12], 13); x[15] ^= rotl(x[14] + x[13], 18);
+        }
+        for (int i = 0; i < 16; ++i)
+            b[i] += x[i];
+    }
+
+    // b holds 2r blocks of 16 words; y is scratch of the same size
+    void blockMix(uint32_t* b, uint32_t* y, unsigned r) {
+        uint32_t x[16];
+        std::memcpy(x, b + (2 * r - 1) * 16, sizeof(x));
+        for (unsigned i = 0; i < 2 * r; ++i) {
+            for (int j = 0; j < 16; ++j)
+                x[j] ^= b[i * 16 + j];
+            salsa208(x);
+            // Even blocks to the first half, odd ones to the second
+            std::memcpy(y + ((i / 2) + (i & 1) * r) * 16, x, sizeof(x));
+        }
+        std::memcpy(b, y, 2 * r * 16 * sizeof(uint32_t));
+    }
+
+    void roMix(unsigned char* block, unsigned r, uint64_t n) {
+        size_t words = 32 * r;
+        std::vector<uint32_t> x(words), y(words), v(words * n);
+
+        for (size_t i = 0; i < words; ++i)
+            x[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8
+                 | (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+
+        for (uint64_t i = 0; i < n; ++i) {
+            std::memcpy(&v[i * words], &x[0], words * sizeof(uint32_t));
+            blockMix(&x[0], &y[0], r);
+        }
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t j = x[(2 * r - 1) * 16] & (n - 1);
+            for (size_t k = 0; k < words; ++k)
+                x[k] ^= v[j * words + k];
+            blockMix(&x[0], &y[0], r);
+        }
+
+        for (size_t i = 0; i < words; ++i) {
+            block[i * 4] = static_cast<unsigned char>(x[i]);
+            block[i * 4 + 1] = static_cast<unsigned char>(x[i] >> 8);
+            block[i * 4 + 2] = static_cast<unsigned char>(x[i] >> 16);
+            block[i * 4 + 3] = static_cast<unsigned char>(x[i] >> 24);
+        }
+    }
+
+    std::string toHex(const unsigned char* data, size_t length) {
+        static const char hex[] = "0123456789abcdef";
+        std::string out;
+        for (size_t i = 0; i < length; ++i) {
+            out += hex[data[i] >> 4];
+            out += hex[data[i] & 0x0f];
+        }
+        return out;
+    }
+
+    bool parseUnsigned(const std::string& text, unsigned& value) {
+        if (text.empty() || text.length() > 9 || text.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        value = static_cast<unsigned>(std::strtoul(text.c_str(), NULL, 10));
+        return true;
+    }
+}
+
+// -------- ENCODING --------
+
+namespace PasswordHash {
+    std::string derive(const std::string& password, const std::string& salt,
+                       unsigned log2N, unsigned r, unsigned p) {
+        size_t blockLength = 128 * r;
+        std::vector<unsigned char> blocks(blockLength * p);
+        pbkdf2(password, reinterpret_cast<const unsigned char*>(salt.data()), salt.length(),
+               &blocks[0], blocks.size());
+        for (unsigned i = 0; i < p; ++i)
+            roMix(&blocks[i * blockLength], r, static_cast<uint64_t>(1) << log2N);
+
+        unsigned char key[KEY_LENGTH];
+        pbkdf2(password, &blocks[0], blocks.size(), key, sizeof(key));
+        return toHex(key, sizeof(key));
+    }
+
+    std::string hash(const std::string& password) {
+        std::string salt = IRCUtils::randomToken(16);
+        if (salt.empty())
+            return "";
+        std::string key = derive(password, salt, DEFAULT_LOG2_N, DEFAULT_R, DEFAULT_P);
+
+        std::ostringstream encoded;
+        encoded << "scrypt$" << DEFAULT_LOG2_N << "$" << DEFAULT_R << "$" << DEFAULT_P << "$" << salt << "$" << key;
+        return encoded.str();
+    }
+
+    bool verify(const std::string& password, const std::string& encoded) {
+        if (password.length() > MAX_PASSWORD_LENGTH)
+            return false;
+
+        std::vector<std::string> fields;
+        size_t start = 0;
+        while (true) {
+            size_t end = encoded.find('$', start);
+            fields.push_back(encoded.substr(start, end - start));
+            if (end == std::string::npos)
+                break;
+            start = end + 1;
+        }
+
+        unsigned log2N, r, p;
+        if (fields.size() != 6 || fields[0] != "scrypt"
+            || !parseUnsigned(fields[1], log2N) || !parseUnsigned(fields[2], r) || !parseUnsigned(fields[3], p)
+            || log2N < 1 || log2N > MAX_LOG2_N || r < 1 || r > 32 || p < 1 || p > 16)
+            return false;
+
+        std::string key = derive(password, fields[4], log2N, r, p);
+        const std::string& expected = fields[5];
+        if (key.length() != expected.length())
+            return false;
+        unsigned char difference = 0;
+        for (size_t i = 0; i < key.length(); ++i)
+            difference |= static_cast<unsigned char>(key[i] ^ expected[i]);
+        return difference == 0;
+    }
+}
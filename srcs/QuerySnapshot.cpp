@@ -0,0 +1,241 @@
+#include "QuerySnapshot.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Network.hpp"
+#include "utils.hpp"
+#include <algorithm>
+
+// -------- SNAPSHOT --------
+
+// Local connections first, then users on other servers and detached
+// sessions, which only show up through the channels they are on
+QuerySnapshot::QuerySnapshot(Server& server, unsigned long epoch, const QuerySnapshot* previous)
+    : _epoch(epoch), _capturedAt(time(NULL)), _refs(1) {
+    const std::map<int, Client*>& clients = server.getClients();
+    const std::set<Client*>& remote = server.getRemoteClients();
+    const std::map<std::string, Client*>& sessions = server.getDetachedSessions();
+    const std::string& localServer = server.getNetwork().getName();
+    _users.reserve(clients.size() + remote.size() + sessions.size());
+    for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it)
+        _users.push_back(captureUser(it->second, true, localServer, previous));
+    size_t local = _users.size();
+    for (std::set<Client*>::const_iterator it = remote.begin(); it != remote.end(); ++it)
+        _users.push_back(captureUser(*it, false, localServer, previous));
+    for (std::map<std::string, Client*>::const_iterator it = sessions.begin(); it != sessions.end(); ++it)
+        _users.push_back(captureUser(it->second, false, localServer, previous));
+    std::sort(_users.begin() + local, _users.end(), &QuerySnapshot::userLess);
+    _bySerial = _users;
+    std::sort(_bySerial.begin(), _bySerial.end(), &QuerySnapshot::userLess);
+
+    // Both in name order: one pass pairs each channel with its previous piece
+    const std::map<std::string, Channel*>& channels = server.getChannels();
+    _channels.reserve(channels.size());
+    std::vector<const ChannelInfo*>::const_iterator old, oldEnd;
+    if (previous) {
+        old = previous->_channels.begin();
+        oldEnd = previous->_channels.end();
+    }
+    for (std::map<std::string, Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it) {
+        while (previous && old != oldEnd && (*old)->name < it->first)
+            ++old;
+        if (previous && old != oldEnd && (*old)->name == it->first && (*old)->version == it->second->getVersion()) {
+            ++(*old)->refs;
+            _channels.push_back(*old);
+        } else {
+            _channels.push_back(captureChannel(it->second));
+        }
+    }
+}
+
+QuerySnapshot::~QuerySnapshot() {
+    for (std::vector<const User*>::iterator it = _users.begin(); it != _users.end(); ++it) {
+        if (--(*it)->refs == 0)
+            delete *it;
+    }
+    for (std::vector<const ChannelInfo*>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        if (--(*it)->refs == 0)
+            delete *it;
+    }
+}
+
+// The previous piece serves while the client kept its version and its idle
+// time is still about right
+const QuerySnapshot::User* QuerySnapshot::captureUser(const Client* client, bool connected, const std::string& localServer, const QuerySnapshot* previous) const {
+    const User* old = previous ? previous->findUser(client->getSerial()) : NULL;
+    if (old && old->version == client->getVersion() && old->connected == connected
+        && client->getLastActive() - old->lastActive <= Server::SNAPSHOT_MAX_AGE) {
+        ++old->refs;
+        return old;
+    }
+
+    User* user = new User();
+    user->serial = client->getSerial();
+    user->fd = client->getFd();
+    user->nickname = client->getNickname();
+    user->username = client->getUsername();
+    user->hostname = client->getHostname();
+    user->ip = client->getIp();
+    user->realname = client->getRealname();
+    user->account = client->getAccount();
+    user->server = client->isRemote() ? client->getServerName() : localServer;
+    user->foldedNickname = IRCUtils::casefold(user->nickname);
+    user->foldedUsername = IRCUtils::casefold(user->username);
+    user->foldedHostname = IRCUtils::casefold(user->hostname);
+    user->foldedRealname = IRCUtils::casefold(user->realname);
+    user->lastActive = client->getLastActive();
+    user->registered = client->isRegistered();
+    user->connected = connected;
+    user->version = client->getVersion();
+    user->refs = 1;
+    return user;
+}
+
+const QuerySnapshot::ChannelInfo* QuerySnapshot::captureChannel(const Channel* channel) {
+    ChannelInfo* info = new ChannelInfo();
+    info->name = channel->getName();
+    info->topic = channel->getTopic();
+    info->modes = channel->getModes();
+    info->version = channel->getVersion();
+    info->refs = 1;
+
+    const std::vector<Channel::Member>& members = channel->getMembers();
+    info->members.reserve(members.size());
+    for (std::vector<Channel::Member>::const_iterator it = members.begin(); it != members.end(); ++it) {
+        Member member;
+        member.serial = it->client->getSerial();
+        member.flags = it->flags;
+        info->members.push_back(member);
+    }
+    return info;
+}
+
+bool QuerySnapshot::userSerialLess(const User* user, unsigned long serial) {
+    return user->serial < serial;
+}
+
+bool QuerySnapshot::userLess(const User* a, const User* b) {
+    return a->serial < b->serial;
+}
+
+bool QuerySnapshot::channelNameLess(const ChannelInfo* channel, const std::string& name) {
+    return channel->name < name;
+}
+
+void QuerySnapshot::retain() {
+    ++_refs;
+}
+
+void QuerySnapshot::release() {
+    if (--_refs == 0)
+        delete this;
+}
+
+unsigned long QuerySnapshot::getEpoch() const {
+    return _epoch;
+}
+
+time_t QuerySnapshot::getCapturedAt() const {
+    return _capturedAt;
+}
+
+const std::vector<const QuerySnapshot::User*>& QuerySnapshot::getUsers() const {
+    return _users;
+}
+
+const std::vector<const QuerySnapshot::ChannelInfo*>& QuerySnapshot::getChannels() const {
+    return _channels;
+}
+
+const QuerySnapshot::User* QuerySnapshot::findUser(unsigned long serial) const {
+    std::vector<const User*>::const_iterator it = std::lower_bound(_bySerial.begin(), _bySerial.end(), serial, &QuerySnapshot::userSerialLess);
+    return (it != _bySerial.end() && (*it)->serial == serial) ? *it : NULL;
+}
+
+const QuerySnapshot::ChannelInfo* QuerySnapshot::findChannel(const std::string& name) const {
+    std::vector<const ChannelInfo*>::const_iterator it = std::lower_bound(_channels.begin(), _channels.end(), name, &QuerySnapshot::channelNameLess);
+    return (it != _channels.end() && (*it)->name == name) ? *it : NULL;
+}
+
+const QuerySnapshot::Member* QuerySnapshot::findMember(const ChannelInfo& channel, unsigned long serial) const {
+    for (std::vector<Member>::const_iterator it = channel.members.begin(); it != channel.members.end(); ++it) {
+        if (it->serial == serial)
+            return &*it;
+    }
+    return NULL;
+}
+
+// -------- PREPARED REPLIES --------
+
+// Owned by the worker pool. The reply and the job point at each other while
+// both exist; whichever goes first unlinks itself (loop thread only).
+class PreparedReply::Job : public WorkerPool::Task {
+private:
+    PreparedReply* _reply;
+    QuerySnapshot* _snapshot;
+    SnapshotQuery* _query;
+    std::string _output;
+
+public:
+    Job(PreparedReply* reply, QuerySnapshot* snapshot, SnapshotQuery* query)
+        : _reply(reply), _snapshot(snapshot), _query(query) {}
+
+    ~Job() {
+        if (_reply)
+            _reply->detach();
+        delete _query;
+        _snapshot->release();
+    }
+
+    void run() {
+        _query->render(*_snapshot, _output);
+    }
+
+    void complete() {
+        if (_reply)
+            _reply->deliver(_output);
+    }
+
+    void forget() {
+        _reply = NULL;
+    }
+};
+
+PreparedReply::PreparedReply() : _job(NULL), _sent(0), _ready(false) {}
+
+PreparedReply::~PreparedReply() {
+    if (_job)
+        _job->forget();
+}
+
+PreparedReply* PreparedReply::submit(WorkerPool& pool, QuerySnapshot* snapshot, SnapshotQuery* query) {
+    PreparedReply* reply = new PreparedReply();
+    reply->_job = new Job(reply, snapshot, query);
+    pool.submit(reply->_job);
+    return reply;
+}
+
+void PreparedReply::deliver(std::string& output) {
+    _output.swap(output);
+    _ready = true;
+}
+
+// The job is gone: delivered, or dropped with the pool
+void PreparedReply::detach() {
+    _job = NULL;
+    _ready = true;
+}
+
+bool PreparedReply::isReady() const {
+    return _ready;
+}
+
+bool PreparedReply::produce(Server& server, Client* client) {
+    while (_sent < _output.size() && client->getSendQueueSize() < SENDQ_HIGH_WATERMARK) {
+        size_t end = _output.find('\n', _sent);
+        end = (end == std::string::npos) ? _output.size() : end + 1;
+        server.queueMessage(client->getFd(), _output.substr(_sent, end - _sent));
+        _sent = end;
+    }
+    return _sent >= _output.size();
+}
@@ -0,0 +1,379 @@
+#include "Replay.hpp"
+#include "IRCProtocol.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+static const char* const PROBE_TOKEN = "replay-probe";
+
+Replay::Replay(const std::string& capturePath, const std::string& target, const std::string& password,
+               const std::string& speed, const std::string& baselinePath)
+    : _capturePath(capturePath), _password(password), _speed(1.0), _baselinePath(baselinePath),
+      _lastSerial(0), _barrierSince(0), _linesSent(0), _bytesReceived(0), _skipped(0),
+      _barrierTimeouts(0) {
+    size_t colon = target.rfind(':');
+    _host = (colon != std::string::npos) ? target.substr(0, colon) : "127.0.0.1";
+    _port = (colon != std::string::npos) ? target.substr(colon + 1) : target;
+    if (speed == "max")
+        _speed = 0;
+    else if (!speed.empty())
+        _speed = std::strtod(speed.c_str(), NULL);
+}
+
+unsigned long long Replay::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// -------- SESSIONS --------
+
+bool Replay::openSession(unsigned long serial) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* address;
+    if (getaddrinfo(_host.c_str(), _port.c_str(), &hints, &address) != 0) {
+        std::cerr << "Replay: cannot resolve " << _host << std::endl;
+        return false;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd != -1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));     // probes must not wait on Nagle
+    bool started = fd != -1 && (connect(fd, address->ai_addr, address->ai_addrlen) == 0 || errno == EINPROGRESS);
+    freeaddrinfo(address);
+    if (!started) {
+        perror("replay connect");
+        if (fd != -1)
+            close(fd);
+        return false;
+    }
+
+    Session& session = _sessions[serial];
+    session.fd = fd;
+    session.connecting = true;
+    session.closing = false;
+    session.awaitingWelcome = false;
+    session.unprobed = false;
+    session.probeSentAt = 0;
+    session.lastInputAt = 0;
+    return true;
+}
+
+// Probes ride behind the line, so their round trip includes its processing.
+// Lines sent while one is outstanding are covered by the next.
+void Replay::sendLine(Session& session, const std::string& line) {
+    if (line == "PASS *")
+        session.output += "PASS " + _password + "\r\n";
+    else
+        session.output += line + "\r\n";
+    ++_linesSent;
+
+    if (line.compare(0, 5, "USER ") == 0)
+        session.awaitingWelcome = true;
+    session.unprobed = true;
+    if (!session.probeSentAt)
+        sendProbe(session);
+}
+
+void Replay::sendProbe(Session& session) {
+    session.output += std::string("PING :") + PROBE_TOKEN + "\r\n";
+    session.probeSentAt = now();
+    session.unprobed = false;
+}
+
+// Everything sent so far has been answered
+bool Replay::isSettled(const Session& session) const {
+    return session.fd == -1 || (!session.connecting && session.output.empty() && !session.probeSentAt
+                                && !session.unprobed && !session.awaitingWelcome);
+}
+
+void Replay::closeSession(Session& session) {
+    if (session.fd != -1)
+        close(session.fd);
+    session.fd = -1;
+}
+
+void Replay::readSession(Session& session) {
+    char buffer[65536];
+    while (true) {
+        ssize_t n = recv(session.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            session.input.append(buffer, n);
+            session.lastInputAt = now();
+            _bytesReceived += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            closeSession(session);
+        break;
+    }
+
+    size_t end;
+    while ((end = session.input.find('\n')) != std::string::npos) {
+        std::string line = session.input.substr(0, end);
+        session.input.erase(0, end + 1);
+        if (!line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+
+        if (line.find(" PONG ") != std::string::npos && line.find(PROBE_TOKEN) != std::string::npos) {
+            if (session.probeSentAt)
+                _latencies.push_back(now() - session.probeSentAt);
+            session.probeSentAt = 0;
+            if (session.unprobed)
+                sendProbe(session);
+            continue;
+        }
+        size_t space = line.find(' ');
+        if (space != std::string::npos && line.compare(space, 5, " 001 ") == 0)
+            session.awaitingWelcome = false;
+        session.lines.push_back(normalize(line));
+    }
+}
+
+bool Replay::writeSession(Session& session) {
+    while (!session.output.empty()) {
+        ssize_t n = send(session.fd, session.output.data(), session.output.length(), MSG_NOSIGNAL);
+        if (n > 0) {
+            session.output.erase(0, n);
+            continue;
+        }
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            return true;
+        closeSession(session);
+        return false;
+    }
+    return true;
+}
+
+// -------- REPLAY --------
+
+// Records go out no earlier than their time on the capture's clock, scaled
+// by the speed, and a record for another session than the last one waits
+// until every session is settled: the server then sees lines in capture
+// order, whatever the network did between sessions.
+bool Replay::mayDispatch(size_t next, unsigned long long start, unsigned long long firstAt) {
+    const Capture::Record& record = _records[next];
+    if (_speed != 0 && (record.at - firstAt) / _speed > now() - start)
+        return false;
+    if (record.serial == _lastSerial)
+        return true;
+
+    bool settled = true;
+    for (std::map<unsigned long, Session>::const_iterator it = _sessions.begin(); settled && it != _sessions.end(); ++it)
+        settled = isSettled(it->second);
+    if (settled) {
+        _barrierSince = 0;
+        return true;
+    }
+
+    // A session the server stopped answering does not hold the others forever
+    if (!_barrierSince)
+        _barrierSince = now();
+    if (now() - _barrierSince <= DRAIN_TIMEOUT_MS * 1000ULL)
+        return false;
+    ++_barrierTimeouts;
+    _barrierSince = 0;
+    return true;
+}
+
+int Replay::run() {
+    if (!Capture::load(_capturePath, _records)) {
+        std::cerr << "Replay: cannot read capture " << _capturePath << std::endl;
+        return 1;
+    }
+    if (_speed < 0) {
+        std::cerr << "Replay: invalid speed" << std::endl;
+        return 1;
+    }
+
+    unsigned long long firstAt = _records.empty() ? 0 : _records.front().at;
+    unsigned long long start = now();
+    unsigned long long lastActivity = start;
+    size_t next = 0;
+
+    while (true) {
+        while (next < _records.size() && mayDispatch(next, start, firstAt)) {
+            const Capture::Record& record = _records[next++];
+            _lastSerial = record.serial;
+            std::map<unsigned long, Session>::iterator it = _sessions.find(record.serial);
+            if (record.type == Capture::RECORD_OPEN) {
+                if (it == _sessions.end())
+                    openSession(record.serial);
+            } else if (it == _sessions.end() || it->second.fd == -1) {
+                ++_skipped;     // opened before the capture started, or already gone
+            } else if (record.type == Capture::RECORD_LINE) {
+                sendLine(it->second, record.data);
+            } else if (record.type == Capture::RECORD_CLOSE) {
+                it->second.closing = true;
+            }
+        }
+
+        std::vector<pollfd> fds;
+        std::vector<Session*> polled;
+        for (std::map<unsigned long, Session>::iterator it = _sessions.begin(); it != _sessions.end(); ++it) {
+            Session& session = it->second;
+            if (session.fd == -1)
+                continue;
+            // Closed once the replies to its last lines are in. Replies rendered
+            // off the loop (WHO, NAMES, LIST) may trail the probe's PONG.
+            if (session.closing && isSettled(session) && now() - session.lastInputAt >= CLOSE_GRACE_MS * 1000ULL) {
+                closeSession(session);
+                continue;
+            }
+            pollfd pfd;
+            pfd.fd = session.fd;
+            pfd.events = POLLIN | ((session.connecting || !session.output.empty()) ? POLLOUT : 0);
+            pfd.revents = 0;
+            fds.push_back(pfd);
+            polled.push_back(&session);
+        }
+
+        bool recordsLeft = next < _records.size();
+        if (!recordsLeft && (fds.empty() || now() - lastActivity > DRAIN_TIMEOUT_MS * 1000ULL))
+            break;
+
+        // Sleep until the next record is due; at a barrier, until a reply comes
+        int timeout = 100;
+        if (recordsLeft && (_records[next].serial == _lastSerial || !_barrierSince)) {
+            unsigned long long due = (_speed == 0) ? 0
+                : static_cast<unsigned long long>((_records[next].at - firstAt) / _speed);
+            unsigned long long elapsed = now() - start;
+            timeout = (due > elapsed) ? static_cast<int>(std::min(due - elapsed, 100000ULL) / 1000) : 0;
+        }
+
+        if (poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout) > 0) {
+            lastActivity = now();
+            for (size_t i = 0; i < fds.size(); ++i) {
+                Session& session = *polled[i];
+                if (fds[i].revents & POLLOUT) {
+                    session.connecting = false;
+                    if (!writeSession(session))
+                        continue;
+                }
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    readSession(session);
+            }
+        }
+    }
+
+    double seconds = (now() - start) / 1000000.0;
+    std::map<unsigned long, unsigned long long> digests;
+    for (std::map<unsigned long, Session>::iterator it = _sessions.begin(); it != _sessions.end(); ++it) {
+        closeSession(it->second);
+        digests[it->first] = digest(it->second.lines);
+    }
+
+    std::sort(_latencies.begin(), _latencies.end());
+    std::cout << std::fixed << std::setprecision(2)
+              << "Replay: " << _sessions.size() << " sessions, " << _linesSent << " lines sent, "
+              << _bytesReceived << " bytes received in " << seconds << " s ("
+              << (seconds > 0 ? _linesSent / seconds : 0) << " lines/s)" << std::endl;
+    if (!_latencies.empty()) {
+        std::cout << "Replay: latency over " << _latencies.size() << " probes: p50 "
+                  << _latencies[_latencies.size() / 2] / 1000.0 << " ms, p99 "
+                  << _latencies[_latencies.size() * 99 / 100] / 1000.0 << " ms, max "
+                  << _latencies.back() / 1000.0 << " ms" << std::endl;
+    }
+    if (_skipped)
+        std::cout << "Replay: " << _skipped << " records of sessions not opened in the capture" << std::endl;
+    if (_barrierTimeouts)
+        std::cout << "Replay: " << _barrierTimeouts << " times a session stayed unanswered for "
+                  << DRAIN_TIMEOUT_MS << " ms, ordering not guaranteed" << std::endl;
+
+    if (_baselinePath.empty())
+        return 0;
+    return compareBaseline(digests) == 0 ? 0 : 2;
+}
+
+// -------- OUTPUT EQUIVALENCE --------
+
+// Tags go, and so do timestamps: any run of nine digits or more, and the
+// server's start time in 003
+std::string Replay::normalize(const std::string& line) {
+    size_t start = 0;
+    if (!line.empty() && line[0] == '@') {
+        size_t space = line.find(' ');
+        start = (space == std::string::npos) ? line.length() : space + 1;
+    }
+    size_t command = line.find(' ', start);
+    if (command != std::string::npos && line.compare(command, 5, " " + IRC::RPL_CREATED + " ") == 0)
+        return line.substr(start, line.find(" :", command) - start) + " :#";
+
+    std::string result;
+    for (size_t i = start; i < line.length(); ) {
+        size_t run = i;
+        while (run < line.length() && line[run] >= '0' && line[run] <= '9')
+            ++run;
+        if (run - i >= 9) {
+            result += '#';
+            i = run;
+        } else if (run > i) {
+            result.append(line, i, run - i);
+            i = run;
+        } else {
+            result += line[i++];
+        }
+    }
+    return result;
+}
+
+// FNV-1a over the sorted lines
+unsigned long long Replay::digest(std::vector<std::string> lines) {
+    std::sort(lines.begin(), lines.end());
+    unsigned long long hash = 14695981039346656037ULL;
+    for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it) {
+        for (size_t i = 0; i <= it->length(); ++i) {
+            hash ^= static_cast<unsigned char>(i < it->length() ? (*it)[i] : '\n');
+            hash *= 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+// "<serial> <digest>" per session
+size_t Replay::compareBaseline(std::map<unsigned long, unsigned long long>& digests) {
+    std::ifstream in(_baselinePath.c_str());
+    if (!in) {
+        std::ofstream out(_baselinePath.c_str());
+        for (std::map<unsigned long, unsigned long long>::iterator it = digests.begin(); it != digests.end(); ++it)
+            out << it->first << " " << std::hex << it->second << std::dec << "\n";
+        std::cout << "Replay: baseline written to " << _baselinePath << std::endl;
+        return 0;
+    }
+
+    std::map<unsigned long, unsigned long long> expected;
+    unsigned long serial;
+    unsigned long long value;
+    while (in >> serial >> std::hex >> value >> std::dec)
+        expected[serial] = value;
+
+    size_t differing = 0;
+    for (std::map<unsigned long, unsigned long long>::iterator it = digests.begin(); it != digests.end(); ++it) {
+        std::map<unsigned long, unsigned long long>::iterator found = expected.find(it->first);
+        if (found == expected.end() || found->second != it->second) {
+            if (differing++ < 10)
+                std::cout << "Replay: session " << it->first << " output differs from the baseline" << std::endl;
+        }
+    }
+    differing += expected.size() > digests.size() ? expected.size() - digests.size() : 0;
+    std::cout << "Replay: " << (digests.size() - std::min(differing, digests.size())) << " of " << expected.size()
+              << " sessions match the baseline" << std::endl;
+    return differing;
+}
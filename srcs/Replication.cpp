@@ -0,0 +1,583 @@
+#include "Replication.hpp"
+#include "Server.hpp"
+#include "StateCodec.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+Replication::Replication(Server& server)
+    : _server(server), _serverFd(-1), _listenFd(-1), _standbyFd(-1), _outboxBytes(0), _seq(0),
+      _ackedSeq(0), _historyMark(0), _fdsSent(0), _primaryFd(-1), _appliedSeq(0), _refused(false), _lagUs(0) {}
+
+Replication::~Replication() {
+    if (_standbyFd != -1)
+        dropStandby("Server shutting down");
+    if (_listenFd != -1)
+        close(_listenFd);
+    if (_primaryFd != -1)
+        close(_primaryFd);
+}
+
+static bool fillAddress(const std::string& path, struct sockaddr_un& addr) {
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path))
+        return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.length() + 1);
+    return true;
+}
+
+// Sockets and client state only ever go to, or come from, a process of our own user
+static bool peerIsSameUser(int fd) {
+    struct ucred peer;
+    socklen_t length = sizeof(peer);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == -1)
+        return false;
+    return peer.uid == geteuid();
+}
+
+// -------- PRIMARY --------
+
+bool Replication::listen(const std::string& path, int serverFd) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        perror("replication socket");
+        return false;
+    }
+    unlink(path.c_str());
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || chmod(path.c_str(), 0600) == -1 || ::listen(fd, 1) == -1) {
+        perror("replication bind");
+        close(fd);
+        return false;
+    }
+
+    _path = path;
+    _serverFd = serverFd;
+    _listenFd = fd;
+    std::cout << "Replication: standbys connect to " << path << std::endl;
+    return true;
+}
+
+// Checked once per tick: a standby connecting waits at most one poll timeout
+void Replication::poll() {
+    if (_listenFd != -1)
+        acceptStandby();
+    if (_standbyFd != -1)
+        readAcks();
+}
+
+void Replication::acceptStandby() {
+    int fd = accept4(_listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    if (!peerIsSameUser(fd)) {
+        std::cout << "Replication: refusing a standby run by another user" << std::endl;
+        close(fd);
+        return;
+    }
+    if (_standbyFd != -1) {
+        std::cout << "Replication: refusing a second standby" << std::endl;
+        close(fd);
+        return;
+    }
+    _standbyFd = fd;
+    sendSnapshot();
+}
+
+void Replication::readAcks() {
+    char buffer[64];
+    while (true) {
+        ssize_t got = recv(_standbyFd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT);
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (got <= 0) {
+            dropStandby("standby disconnected");
+            return;
+        }
+        if (buffer[0] != 'A')
+            continue;
+
+        buffer[got] = '\0';
+        _ackedSeq = std::strtoul(buffer + 1, NULL, 10);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        while (!_unacked.empty() && _unacked.front().first <= _ackedSeq) {
+            const struct timeval& sent = _unacked.front().second;
+            _lagUs = (now.tv_sec - sent.tv_sec) * 1000000L + (now.tv_usec - sent.tv_usec);
+            _unacked.pop_front();
+        }
+    }
+}
+
+void Replication::dropStandby(const std::string& reason) {
+    std::cout << "Replication: dropping standby (" << reason << ")" << std::endl;
+    close(_standbyFd);
+    _standbyFd = -1;
+
+    for (std::deque<Message>::iterator it = _outbox.begin(); it != _outbox.end(); ++it) {
+        for (std::vector<int>::iterator fd = it->fds.begin(); fd != it->fds.end(); ++fd)
+            close(*fd);
+    }
+    _outbox.clear();
+    _outboxBytes = 0;
+    _batch.clear();
+    _unacked.clear();
+    _mirroredClients.clear();
+    _mirroredChannels.clear();
+    _fdsSent = 0;
+    _lagUs = 0;
+}
+
+// Same state an upgrade hands over, with the sockets passed alongside
+void Replication::sendSnapshot() {
+    StateWriter state;
+    std::vector<int> fds(1, _serverFd);
+    _server.saveState(state, fds);
+
+    for (size_t first = 0; first < fds.size(); first += FDS_PER_MESSAGE) {
+        std::vector<int> chunk;
+        for (size_t i = first; i < fds.size() && i < first + FDS_PER_MESSAGE; ++i)
+            chunk.push_back(fcntl(fds[i], F_DUPFD_CLOEXEC, 0));
+        queue('F', "", chunk);
+    }
+    _fdsSent = fds.size();
+
+    const std::map<int, Client*>& clients = _server.getClients();
+    for (std::map<int, Client*>::const_iterator it = clients.begin(); it != clients.end(); ++it) {
+        if (!it->second->isDisconnecting() && it->second->getLinkState() == Client::LINK_NONE)
+            _mirroredClients[it->second->getSerial()] = it->first;
+    }
+    const std::map<std::string, Client*>& sessions = _server.getDetachedSessions();
+    for (std::map<std::string, Client*>::const_iterator it = sessions.begin(); it != sessions.end(); ++it)
+        _mirroredClients[it->second->getSerial()] = -1;
+    const std::map<std::string, Channel*>& channels = _server.getChannels();
+    for (std::map<std::string, Channel*>::const_iterator it = channels.begin(); it != channels.end(); ++it)
+        _mirroredChannels.insert(it->first);
+    _historyMark = _server.getLastMsgid();
+
+    std::cout << "Replication: standby connected, snapshot of " << _mirroredClients.size() << " clients and "
+              << _mirroredChannels.size() << " channels (" << state.data().length() << " bytes)" << std::endl;
+    _batch.clear();
+    addRecord(REC_SNAPSHOT, state.data());
+    flush();
+}
+
+void Replication::passSocket(int fd) {
+    queue('F', "", std::vector<int>(1, fcntl(fd, F_DUPFD_CLOEXEC, 0)));
+    ++_fdsSent;
+}
+
+void Replication::addRecord(RecordType type, const std::string& body) {
+    StateWriter record;
+    record.putInt(type);
+    record.putString(body);
+    _batch += record.data();
+}
+
+// Users on other servers and server links stay with the primary's network
+void Replication::clientChanged(Client* client) {
+    if (_standbyFd == -1 || client->isRemote())
+        return;
+
+    std::map<unsigned long, int>::iterator known = _mirroredClients.find(client->getSerial());
+    if (client->getLinkState() != Client::LINK_NONE || client->isDisconnecting()) {
+        if (known != _mirroredClients.end())
+            clientGone(client);
+        return;
+    }
+
+    long slot = SLOT_UNCHANGED;
+    if (client->getFd() < 0) {
+        slot = SLOT_NONE;
+    } else if (known == _mirroredClients.end() || known->second != client->getFd()) {
+        slot = _fdsSent;
+        passSocket(client->getFd());
+    }
+    _mirroredClients[client->getSerial()] = client->getFd();
+
+    StateWriter body;
+    body.putInt(client->getSerial());
+    body.putInt(slot);
+    client->saveIdentity(body);
+    addRecord(REC_CLIENT, body.data());
+}
+
+void Replication::clientGone(Client* client) {
+    if (_standbyFd == -1 || _mirroredClients.erase(client->getSerial()) == 0)
+        return;
+
+    StateWriter body;
+    body.putInt(client->getSerial());
+    addRecord(REC_CLIENT_GONE, body.data());
+}
+
+void Replication::channelChanged(Channel* channel, unsigned flags) {
+    if (_standbyFd == -1)
+        return;
+
+    if (flags & (Channel::DIRTY_SETTINGS | Channel::DIRTY_MEMBERS)) {
+        StateWriter body;
+        body.putString(channel->getName());
+        channel->saveSettings(body);
+        channel->saveMembership(body);
+        addRecord(REC_CHANNEL, body.data());
+        _mirroredChannels.insert(channel->getName());
+    }
+    if (flags & Channel::DIRTY_HISTORY) {
+        StateWriter body;
+        body.putString(channel->getName());
+        channel->saveHistorySince(body, _historyMark);
+        addRecord(REC_HISTORY, body.data());
+    }
+}
+
+void Replication::channelGone(const std::string& name) {
+    if (_standbyFd == -1 || _mirroredChannels.erase(name) == 0)
+        return;
+
+    StateWriter body;
+    body.putString(name);
+    addRecord(REC_CHANNEL_GONE, body.data());
+}
+
+// Close the tick's batch: "<seq> <sent sec> <sent usec> <records>", length-prefixed
+void Replication::flush() {
+    if (_standbyFd == -1)
+        return;
+
+    if (!_batch.empty()) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+
+        StateWriter header;
+        header.putInt(++_seq);
+        header.putInt(now.tv_sec);
+        header.putInt(now.tv_usec);
+        StateWriter frame;
+        frame.putString(header.data() + _batch);
+        _batch.clear();
+        _historyMark = _server.getLastMsgid();
+        _unacked.push_back(std::make_pair(_seq, now));
+
+        const std::string& data = frame.data();
+        for (size_t offset = 0; offset < data.length(); offset += MESSAGE_SIZE)
+            queue('D', data.substr(offset, MESSAGE_SIZE), std::vector<int>());
+    }
+
+    if (!sendOutbox())
+        dropStandby("replication stream failed");
+    else if (_outboxBytes > MAX_BACKLOG)
+        dropStandby("standby too far behind");
+}
+
+void Replication::queue(char type, const std::string& data, const std::vector<int>& fds) {
+    Message message;
+    message.type = type;
+    message.data = data;
+    message.fds = fds;
+    _outbox.push_back(message);
+    _outboxBytes += data.length() + 1;
+}
+
+// Non-blocking: what the socket does not take now waits for the next tick
+bool Replication::sendOutbox() {
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE));
+
+    while (!_outbox.empty()) {
+        Message& message = _outbox.front();
+        std::string payload(1, message.type);
+        payload += message.data;
+
+        struct iovec iov;
+        iov.iov_base = &payload[0];
+        iov.iov_len = payload.length();
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        if (!message.fds.empty()) {
+            msg.msg_control = &control[0];
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * message.fds.size());
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * message.fds.size());
+            std::memcpy(CMSG_DATA(cmsg), &message.fds[0], sizeof(int) * message.fds.size());
+        }
+
+        if (sendmsg(_standbyFd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == -1)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+
+        for (std::vector<int>::iterator it = message.fds.begin(); it != message.fds.end(); ++it)
+            close(*it);
+        _outboxBytes -= message.data.length() + 1;
+        _outbox.pop_front();
+    }
+    return true;
+}
+
+bool Replication::hasStandby() const {
+    return _standbyFd != -1;
+}
+
+void Replication::logStatus() const {
+    if (_standbyFd != -1) {
+        std::cout << "Replication: standby at seq " << _ackedSeq << "/" << _seq << ", lag "
+                  << getLagMillis() << " ms, " << _outboxBytes << " bytes queued" << std::endl;
+    } else if (_primaryFd != -1) {
+        std::cout << "Standby: applied seq " << _appliedSeq << ", lag " << getLagMillis() << " ms" << std::endl;
+    }
+}
+
+// One line for STATS r and the metrics dump
+void Replication::report(std::vector<std::string>& lines) const {
+    std::ostringstream line;
+    if (_standbyFd != -1)
+        line << "replication standby seq " << _ackedSeq << "/" << _seq << " lag " << getLagMillis() << "ms queued " << _outboxBytes;
+    else if (_primaryFd != -1)
+        line << "replication following seq " << _appliedSeq << " lag " << getLagMillis() << "ms";
+    else
+        line << "replication none";
+    lines.push_back(line.str());
+}
+
+long Replication::getLagMillis() const {
+    return _lagUs / 1000;
+}
+
+// -------- STANDBY --------
+
+bool Replication::connectToPrimary(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return false;
+    }
+    if (!peerIsSameUser(fd)) {
+        std::cerr << "Standby: " << path << " is served by another user, not following" << std::endl;
+        close(fd);
+        return false;
+    }
+    _path = path;
+    _primaryFd = fd;
+    return true;
+}
+
+// Someone accepting on the path means the primary (or its upgraded successor)
+// is alive: a standby that lost its stream must resync, not take over
+bool Replication::primaryAlive(const std::string& path) {
+    struct sockaddr_un addr;
+    if (!fillAddress(path, addr))
+        return false;
+
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return false;
+    bool alive = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    close(fd);
+    return alive;
+}
+
+bool Replication::follow(int timeoutMs) {
+    struct pollfd pfd;
+    pfd.fd = _primaryFd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    int ready = ::poll(&pfd, 1, timeoutMs);
+    if (ready == -1)
+        return errno == EINTR;
+    if (ready == 0)
+        return true;
+    bool open = receive();
+    applyBatches();
+    if (_refused)
+        open = false;
+    if (!open) {
+        close(_primaryFd);
+        _primaryFd = -1;
+        _clients.clear();
+        _inbox.clear();
+    }
+    return open;
+}
+
+bool Replication::receive() {
+    std::vector<char> buffer(MESSAGE_SIZE + 1);
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * FDS_PER_MESSAGE));
+
+    while (true) {
+        struct iovec iov;
+        iov.iov_base = &buffer[0];
+        iov.iov_len = buffer.size();
+        struct msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = &control[0];
+        msg.msg_controllen = control.size();
+
+        // Close-on-exec: a standby that resyncs re-execs itself without them
+        ssize_t got = recvmsg(_primaryFd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        if (got <= 0)
+            return false;
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* fds = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            _receivedFds.insert(_receivedFds.end(), fds, fds + count);
+        }
+        if (buffer[0] == 'D')
+            _inbox.append(&buffer[1], got - 1);
+    }
+}
+
+// Batches are applied whole, so a primary dying mid-batch leaves the last complete state
+void Replication::applyBatches() {
+    size_t consumed = 0;
+    while (true) {
+        StateReader frame(_inbox.data() + consumed, _inbox.length() - consumed);
+        const char* batch;
+        size_t length;
+        if (!frame.getBytes(batch, length))
+            break;
+        consumed += frame.position();
+
+        StateReader in(batch, length);
+        unsigned long seq = in.getInt();
+        struct timeval sent;
+        sent.tv_sec = in.getInt();
+        sent.tv_usec = in.getInt();
+        while (in.ok() && !in.atEnd()) {
+            int type = in.getInt();
+            const char* body;
+            size_t bodyLength;
+            if (!in.getBytes(body, bodyLength))
+                break;
+            StateReader record(body, bodyLength);
+            applyRecord(type, record);
+        }
+        if (_refused)
+            return;
+        _server.dropChanges();
+
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        _lagUs = (now.tv_sec - sent.tv_sec) * 1000000L + (now.tv_usec - sent.tv_usec);
+        _appliedSeq = seq;
+
+        StateWriter ack;
+        ack.putInt(seq);
+        std::string message = "A" + ack.data();
+        send(_primaryFd, message.data(), message.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    _inbox.erase(0, consumed);
+}
+
+void Replication::applyRecord(int type, StateReader& in) {
+    if (type == REC_SNAPSHOT) {
+        if (!_server.loadState(in, _receivedFds, _clients)) {
+            _refused = true;
+            return;
+        }
+
+        // Connected clients' buffers are the primary's business; a detached
+        // session keeps the backlog it will replay on resume
+        for (std::map<unsigned long, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+            if (it->second->getFd() >= 0) {
+                it->second->takePendingOutput();
+                it->second->clearInputBuffer();
+            }
+        }
+        return;
+    }
+
+    if (type == REC_CLIENT) {
+        unsigned long serial = in.getInt();
+        long slot = in.getInt();
+        std::map<unsigned long, Client*>::iterator it = _clients.find(serial);
+        Client* client = (it != _clients.end()) ? it->second : NULL;
+
+        int fd = client ? client->getFd() : -1;
+        if (slot == SLOT_NONE || slot >= 0) {
+            if (fd >= 0)
+                close(fd);
+            fd = (slot >= 0) ? takeSocket(slot) : -1;
+        }
+        _clients[serial] = _server.mirrorClient(client, fd, in);
+        return;
+    }
+
+    if (type == REC_CLIENT_GONE) {
+        std::map<unsigned long, Client*>::iterator it = _clients.find(in.getInt());
+        if (it == _clients.end())
+            return;
+        int fd = it->second->getFd();
+        _server.discardClient(it->second);
+        _clients.erase(it);
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    std::string name = in.getString();
+    if (type == REC_CHANNEL) {
+        Channel* channel = _server.getChannel(name);
+        if (!channel)
+            channel = _server.createChannel(name);
+        channel->loadSettings(in);
+        channel->loadMembership(in, _clients);
+    } else if (type == REC_CHANNEL_GONE) {
+        _server.discardChannel(name);
+    } else if (type == REC_HISTORY) {
+        Channel* channel = _server.getChannel(name);
+        if (channel)
+            channel->loadHistory(in);
+    }
+}
+
+int Replication::takeSocket(long slot) {
+    if (slot < 0 || slot >= static_cast<long>(_receivedFds.size()))
+        return -1;
+    int fd = _receivedFds[slot];
+    _receivedFds[slot] = -1;
+    return fd;
+}
+
+bool Replication::isSynced() const {
+    return _appliedSeq > 0;
+}
+
+bool Replication::refusedSnapshot() const {
+    return _refused;
+}
+
+int Replication::getServerFd() const {
+    return _receivedFds.empty() ? -1 : _receivedFds[0];
+}
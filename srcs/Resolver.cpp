@@ -0,0 +1,194 @@
+#include "Resolver.hpp"
+#include "Server.hpp"
+#include "Command.hpp"
+#include <cstring>
+#include <cctype>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+namespace {
+    class LookupTask : public WorkerPool::Task {
+    private:
+        Resolver* _resolver;
+        Resolver::ResolveFunction _resolve;
+        std::string _ip;
+        std::string _hostname;
+
+    public:
+        LookupTask(Resolver* resolver, Resolver::ResolveFunction resolve, const std::string& ip)
+            : _resolver(resolver), _resolve(resolve), _ip(ip) {}
+
+        void run() {
+            _hostname = _resolve(_ip);
+        }
+
+        void complete() {
+            _resolver->finish(_ip, _hostname);
+        }
+    };
+
+    bool validHostname(const std::string& hostname) {
+        if (hostname.empty() || hostname.length() > Resolver::HOSTNAME_MAX || hostname[0] == '-' || hostname[0] == '.')
+            return false;
+        for (size_t i = 0; i < hostname.length(); ++i) {
+            char c = hostname[i];
+            if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '.')
+                return false;
+        }
+        return true;
+    }
+}
+
+Resolver::Resolver(Server& server) : _server(server), _dispatcher(NULL), _resolve(&Resolver::resolve) {}
+
+bool Resolver::start() {
+    return _pool.start(THREADS);
+}
+
+void Resolver::setDispatcher(Command* dispatcher) {
+    _dispatcher = dispatcher;
+}
+
+void Resolver::setResolveFunction(ResolveFunction resolve) {
+    _resolve = resolve;
+}
+
+int Resolver::getWakeFd() const {
+    return _pool.getWakeFd();
+}
+
+// -------- LOOKUPS --------
+
+void Resolver::lookup(Client* client) {
+    const std::string& ip = client->getIp();
+    std::map<std::string, CacheEntry>::iterator cached = _cache.find(ip);
+    if (cached != _cache.end() && cached->second.expires > time(NULL)) {
+        settle(client, cached->second.hostname, true);
+        return;
+    }
+
+    // A flood of new addresses would queue lookups without end; past the cap
+    // clients keep their IP, as after a timeout
+    if (_inflight.size() >= MAX_INFLIGHT && _inflight.find(ip) == _inflight.end()) {
+        settle(client, "", false);
+        return;
+    }
+
+    _server.queueMessage(client, ":" + std::string("ircserv") + " NOTICE * :*** Looking up your hostname...\r\n");
+    client->setLookupDeadline(time(NULL) + LOOKUP_TIMEOUT);
+    _waiting[client->getFd()] = client->getSerial();
+
+    // A burst of connections from one address costs one lookup
+    std::vector<std::pair<int, unsigned long> >& waiters = _inflight[ip];
+    waiters.push_back(std::make_pair(client->getFd(), client->getSerial()));
+    if (waiters.size() == 1)
+        _pool.submit(new LookupTask(this, _resolve, ip));
+}
+
+// PTR, then forward confirmation: the name must resolve back to the address
+std::string Resolver::resolve(const std::string& ip) {
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+        return "";
+
+    char host[NI_MAXHOST];
+    if (getnameinfo((struct sockaddr*)&addr, sizeof(addr), host, sizeof(host), NULL, 0, NI_NAMEREQD) != 0)
+        return "";
+    std::string hostname = host;
+    if (!validHostname(hostname))
+        return "";
+
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* results;
+    if (getaddrinfo(hostname.c_str(), NULL, &hints, &results) != 0)
+        return "";
+
+    bool confirmed = false;
+    for (struct addrinfo* it = results; it && !confirmed; it = it->ai_next) {
+        const struct sockaddr_in* forward = reinterpret_cast<const struct sockaddr_in*>(it->ai_addr);
+        confirmed = forward->sin_addr.s_addr == addr.sin_addr.s_addr;
+    }
+    freeaddrinfo(results);
+    return confirmed ? hostname : "";
+}
+
+void Resolver::finish(const std::string& ip, const std::string& hostname) {
+    remember(ip, hostname);
+
+    std::map<std::string, std::vector<std::pair<int, unsigned long> > >::iterator it = _inflight.find(ip);
+    if (it == _inflight.end())
+        return;
+    std::vector<std::pair<int, unsigned long> > waiters;
+    waiters.swap(it->second);
+    _inflight.erase(it);
+
+    // Clients that left, or gave up waiting, are skipped
+    for (std::vector<std::pair<int, unsigned long> >::iterator wit = waiters.begin(); wit != waiters.end(); ++wit) {
+        Client* client = _server.getClient(wit->first);
+        if (client && client->getSerial() == wit->second && client->getLookupDeadline() != 0)
+            settle(client, hostname, false);
+    }
+}
+
+void Resolver::poll() {
+    _pool.runCompletions();
+
+    time_t now = time(NULL);
+    std::vector<Client*> expired;
+    for (std::map<int, unsigned long>::iterator it = _waiting.begin(); it != _waiting.end(); ) {
+        Client* client = _server.getClient(it->first);
+        if (!client || client->getSerial() != it->second || client->getLookupDeadline() == 0) {
+            _waiting.erase(it++);
+            continue;
+        }
+        if (now >= client->getLookupDeadline())
+            expired.push_back(client);
+        ++it;
+    }
+
+    for (std::vector<Client*>::iterator it = expired.begin(); it != expired.end(); ++it)
+        settle(*it, "", false);
+}
+
+void Resolver::settle(Client* client, const std::string& hostname, bool cached) {
+    client->setLookupDeadline(0);
+    _waiting.erase(client->getFd());
+
+    std::string notice;
+    if (!hostname.empty()) {
+        _server.setClientHostname(client, hostname);
+        notice = "*** Found your hostname" + std::string(cached ? " (cached)" : "") + ": " + hostname;
+    } else {
+        notice = "*** Couldn't look up your hostname, using your IP address instead";
+    }
+    _server.queueMessage(client, ":" + std::string("ircserv") + " NOTICE * :" + notice + "\r\n");
+
+    if (_dispatcher && !client->isDisconnecting())
+        _dispatcher->continueRegistration(client);
+}
+
+// Expired entries go first when the cache is full; if none has, start over
+void Resolver::remember(const std::string& ip, const std::string& hostname) {
+    time_t now = time(NULL);
+    if (_cache.size() >= CACHE_LIMIT) {
+        for (std::map<std::string, CacheEntry>::iterator it = _cache.begin(); it != _cache.end(); ) {
+            if (it->second.expires <= now)
+                _cache.erase(it++);
+            else
+                ++it;
+        }
+        if (_cache.size() >= CACHE_LIMIT)
+            _cache.clear();
+    }
+
+    CacheEntry& entry = _cache[ip];
+    entry.hostname = hostname;
+    entry.expires = now + (hostname.empty() ? NEGATIVE_TTL : POSITIVE_TTL);
+}
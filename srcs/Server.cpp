@@ -1,228 +1,946 @@
-#include "Server.hpp"
-#include <iostream>
-#include <ctime>
-#include <unistd.h>
-
-// Constructor/Destructor
-Server::Server() {}
-
-Server::Server(const std::string& password) : _password(password) {}
-
-Server::~Server() {
-    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
-        delete it->second;
-    for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
-        delete it->second;
-}
-
-// Configuration
-void Server::setPassword(const std::string& password) {
-    _password = password;
-}
-
-const std::string& Server::getPassword() const {
-    return _password;
-}
-
-// -------- CLIENT METHODS --------
-
-void Server::addClient(int fd) {
-    if (_clients.find(fd) == _clients.end())
-        _clients[fd] = new Client(fd);
-}
-
-void Server::removeClient(int fd) {
-    std::map<int, Client*>::iterator it = _clients.find(fd);
-    if (it != _clients.end()) {
-        removeClientFromAllChannels(it->second);
-        delete it->second;
-        _clients.erase(it);
-    }
-}
-
-Client* Server::getClient(int fd) {
-    std::map<int, Client*>::iterator it = _clients.find(fd);
-    return (it != _clients.end()) ? it->second : NULL;
-}
-
-Client* Server::findClientByNick(const std::string& nickname) {
-    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
-        if (it->second->getNickname() == nickname)
-            return it->second;
-    }
-    return NULL;
-}
-
-bool Server::isNicknameInUse(const std::string& nickname) {
-    return findClientByNick(nickname) != NULL;
-}
-
-// -------- CHANNEL METHODS --------
-
-Channel* Server::getChannel(const std::string& name) {
-    std::map<std::string, Channel*>::iterator it = _channels.find(name);
-    return (it != _channels.end()) ? it->second : NULL;
-}
-
-Channel* Server::createChannel(const std::string& name) {
-    if (_channels.find(name) == _channels.end())
-        _channels[name] = new Channel(name);
-    return _channels[name];
-}
-
-void Server::removeClientFromAllChannels(Client* client) {
-    std::vector<Channel*> channelsToCheck;
-
-    // First, collect all channels that have this client
-    for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
-        if (it->second->hasClient(client)) {
-            channelsToCheck.push_back(it->second);
-        }
-    }
-
-    // Then remove the client from each channel and check if empty
-    for (std::vector<Channel*>::iterator it = channelsToCheck.begin(); it != channelsToCheck.end(); ++it) {
-        (*it)->removeClient(client);
-        deleteChannelIfEmpty(*it);
-    }
-}
-
-void Server::deleteChannelIfEmpty(Channel* channel) {
-    if (!channel)
-        return;
-
-    // Check if it's in the map
-    std::map<std::string, Channel*>::iterator it = _channels.find(channel->getName());
-    if (it == _channels.end())
-        return;
-
-    // If no members, delete and erase
-    if (channel->getMembers().empty()) {
-        delete channel;
-        _channels.erase(it);
-    }
-}
-
-// -------- MESSAGING --------
-
-void Server::queueMessage(int clientFd, const std::string& message) {
-    Client* client = getClient(clientFd);
-    if (client)
-        client->enqueueMessage(message);
-}
-
-void Server::sendMessage(int clientFd, const std::string& message) {
-    queueMessage(clientFd, message);
-}
-
-void Server::broadcast(const std::set<int>& targets, const std::string& message) {
-    for (std::set<int>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
-        queueMessage(*it, message);
-    }
-}
-
-// -------- I/O INTERFACE METHODS --------
-
-void Server::flushClientMessages(int clientFd) {
-    Client* client = getClient(clientFd);
-    if (client) {
-        client->flushMessagesToOutputBuffer();
-    }
-}
-
-bool Server::hasClientMessagesToSend(int clientFd) const {
-    Client* client = const_cast<Server*>(this)->getClient(clientFd);
-    return client ? client->hasMessagesToSend() : false;
-}
-
-// -------- TIMEOUT HANDLING --------
-
-// void Server::disconnectIdleClients(int timeoutSeconds) {
-//     std::vector<int> clientsToDisconnect;
-//     time_t currentTime = time(NULL);
-
-//     for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
-//         if (currentTime - it->second->getLastActive() > timeoutSeconds) {
-//             clientsToDisconnect.push_back(it->first);
-//         }
-//     }
-
-//     for (std::vector<int>::iterator it = clientsToDisconnect.begin(); it != clientsToDisconnect.end(); ++it) {
-//         int fd = *it;
-//         Client* client = getClient(fd);
-//         if (client && client->isRegistered()) {
-//             // Broadcast QUIT to channels to inform peers
-//             std::vector<Channel*> chans = getClientChannels(client);
-//             std::string quitMsg = ":" + client->getHostmask() + " QUIT :Ping timeout" + "\r\n";
-//             for (std::vector<Channel*>::iterator cit = chans.begin(); cit != chans.end(); ++cit) {
-//                 (*cit)->broadcast(quitMsg, client);
-//             }
-//         }
-//         std::cout << "Disconnecting idle client: fd=" << fd << std::endl;
-//         close(fd);
-//         removeClient(fd);
-//     }
-// }
-
-void Server::disconnectIdleClients(int timeoutSeconds) {
-    std::vector<int> clientsToDisconnect;
-    time_t currentTime = time(NULL);
-
-    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
-        if (currentTime - it->second->getLastActive() > timeoutSeconds) {
-            clientsToDisconnect.push_back(it->first);
-        }
-    }
-
-    for (std::vector<int>::iterator it = clientsToDisconnect.begin(); it != clientsToDisconnect.end(); ++it) {
-        int fd = *it;
-        std::cout << "Disconnecting idle client: fd=" << fd << std::endl;
-        close(fd);
-        handleClientDisconnection(fd);  // Use the new method instead of manual handling
-    }
-}
-
-// -------- CHANNEL UTILITIES --------
-
-std::vector<Channel*> Server::getClientChannels(Client* client) {
-    std::vector<Channel*> clientChannels;
-    
-    for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it) {
-        if (it->second->hasClient(client)) {
-            clientChannels.push_back(it->second);
-        }
-    }
-    
-    return clientChannels;
-}
-
-void Server::handleClientDisconnection(int fd) {
-    Client* client = getClient(fd);
-    if (!client) {
-        return;
-    }
-
-    // Get channels before removing client
-    std::vector<Channel*> clientChannels = getClientChannels(client);
-    
-    // Send QUIT message to channels if client was registered
-    if (client->isRegistered()) {
-        std::string quitMsg = ":" + client->getHostmask() + " QUIT :Client disconnected\r\n";
-        for (std::vector<Channel*>::iterator it = clientChannels.begin();
-             it != clientChannels.end(); ++it) {
-            (*it)->broadcast(quitMsg, client);
-        }
-    }
-
-    // Remove client from all channels
-    removeClientFromAllChannels(client);
-
-    // Check each channel for operator succession
-    for (std::vector<Channel*>::iterator it = clientChannels.begin();
-         it != clientChannels.end(); ++it) {
-        (*it)->promoteNewOperatorIfNeeded();
-    }
-
-    // Remove the client
-    removeClient(fd);
-}
\ No newline at end of file
+#include "Server.hpp"
+#include "Command.hpp"
+#include "Probes.hpp"
+#include "AllocProfile.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <ctime>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+// Constructor/Destructor
+Server::Server()
+    : _network(*this), _fanoutEpoch(0), _historyBudget(HISTORY_MEMORY_BUDGET), _nextSerial(1), _replication(*this), _resolver(*this),
+      _stateEpoch(0), _querySnapshot(NULL), _transport(&_tcp), _rejectLongLines(false) {}
+
+Server::Server(const std::string& password)
+    : _password(password), _network(*this), _fanoutEpoch(0), _historyBudget(HISTORY_MEMORY_BUDGET),
+      _nextSerial(1), _replication(*this), _resolver(*this), _stateEpoch(0), _querySnapshot(NULL),
+      _transport(&_tcp), _rejectLongLines(false) {}
+
+// Channels first: they unlink themselves from the clients they invited
+Server::~Server() {
+    for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+        delete it->second;
+    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+        delete it->second;
+    for (std::map<std::string, Client*>::iterator it = _detachedSessions.begin(); it != _detachedSessions.end(); ++it)
+        delete it->second;
+    for (std::set<Client*>::iterator it = _remoteClients.begin(); it != _remoteClients.end(); ++it)
+        delete *it;
+    if (_querySnapshot)
+        _querySnapshot->release();
+}
+
+// Configuration
+void Server::setPassword(const std::string& password) {
+    _password = password;
+}
+
+const std::string& Server::getPassword() const {
+    return _password;
+}
+
+void Server::setTransport(Transport* transport) {
+    _transport = transport ? transport : &_tcp;
+}
+
+Transport& Server::getTransport() {
+    return *_transport;
+}
+
+void Server::setRejectLongLines(bool reject) {
+    _rejectLongLines = reject;
+}
+
+bool Server::rejectsLongLines() const {
+    return _rejectLongLines;
+}
+
+void Server::setSocketTuning(const SocketTuning& tuning) {
+    _socketTuning = tuning;
+}
+
+const SocketTuning& Server::getSocketTuning() const {
+    return _socketTuning;
+}
+
+// -------- CLIENT METHODS --------
+
+void Server::addClient(int fd) {
+    if (_clients.find(fd) == _clients.end()) {
+        Client* client = new Client(fd);
+        client->setSerial(_nextSerial++);
+        client->setFlushList(&_pendingFlush);
+        client->setDirtyList(&_dirtyClients, &_stateEpoch);
+        _clients[fd] = client;
+        ++_stateEpoch;
+    }
+}
+
+void Server::removeClient(int fd) {
+    Client* client = getClient(fd);
+    if (client) {
+        removeClientFromAllChannels(client);
+        destroyClient(client);
+    }
+}
+
+// Drop the client from the indexes and free it; channel membership must already be gone
+void Server::destroyClient(Client* client) {
+    unindexClient(client);
+    ++_stateEpoch;
+    if (client->getFd() >= 0)
+        _streamingFds.erase(client->getFd());
+    _remoteClients.erase(client);
+    _network.forgetClient(client);
+
+    // Pending invites of a client that never joined
+    std::vector<Channel*> invitedTo = client->getInvitedTo();
+    for (std::vector<Channel*>::iterator it = invitedTo.begin(); it != invitedTo.end(); ++it)
+        (*it)->removeInvite(client);
+
+    if (client->isDirtyScheduled())
+        _dirtyClients.erase(std::find(_dirtyClients.begin(), _dirtyClients.end(), client));
+    _replication.clientGone(client);
+    if (client->isCaptured())
+        _capture.sessionClosed(client);
+
+    delete client;
+}
+
+// Register a local client or detached session restored from saved state
+void Server::indexClient(Client* client) {
+    if (client->getFd() >= 0)
+        _clients[client->getFd()] = client;
+    else
+        _detachedSessions[client->getResumeToken()] = client;
+
+    if (!client->getNickname().empty())
+        _nickIndex[IRCUtils::casefold(client->getNickname())] = client;
+    if (!client->getUsername().empty())
+        _userIndex.insert(std::make_pair(IRCUtils::casefold(client->getUsername()), client));
+    _hostIndex.insert(std::make_pair(IRCUtils::casefold(client->getHostname()), client));
+}
+
+void Server::unindexClient(Client* client) {
+    std::map<int, Client*>::iterator it = _clients.find(client->getFd());
+    if (client->getFd() >= 0 && it != _clients.end() && it->second == client)
+        _clients.erase(it);
+
+    std::map<std::string, Client*>::iterator sit = _detachedSessions.find(client->getResumeToken());
+    if (sit != _detachedSessions.end() && sit->second == client)
+        _detachedSessions.erase(sit);
+
+    std::map<std::string, Client*>::iterator nit = _nickIndex.find(IRCUtils::casefold(client->getNickname()));
+    if (nit != _nickIndex.end() && nit->second == client)
+        _nickIndex.erase(nit);
+    indexRemove(_userIndex, IRCUtils::casefold(client->getUsername()), client);
+    indexRemove(_hostIndex, IRCUtils::casefold(client->getHostname()), client);
+}
+
+Client* Server::getClient(int fd) {
+    std::map<int, Client*>::iterator it = _clients.find(fd);
+    return (it != _clients.end()) ? it->second : NULL;
+}
+
+Client* Server::findClientByNick(const std::string& nickname) {
+    std::map<std::string, Client*>::iterator it = _nickIndex.find(IRCUtils::casefold(nickname));
+    return (it != _nickIndex.end()) ? it->second : NULL;
+}
+
+bool Server::isNicknameInUse(const std::string& nickname) {
+    return findClientByNick(nickname) != NULL;
+}
+
+const std::map<int, Client*>& Server::getClients() const {
+    return _clients;
+}
+
+const std::map<std::string, Client*>& Server::getUsersByNick() const {
+    return _nickIndex;
+}
+
+// Users introduced by a linked server have no socket of their own
+void Server::addRemoteClient(Client* client) {
+    client->setSerial(_nextSerial++);
+    _remoteClients.insert(client);
+    ++_stateEpoch;
+}
+
+Network& Server::getNetwork() {
+    return _network;
+}
+
+// -------- CLIENT INDEXES --------
+
+// The epoch is bumped here as well: remote users do not track their own changes
+
+void Server::setClientNickname(Client* client, const std::string& nickname) {
+    std::map<std::string, Client*>::iterator it = _nickIndex.find(IRCUtils::casefold(client->getNickname()));
+    if (it != _nickIndex.end() && it->second == client)
+        _nickIndex.erase(it);
+
+    client->setNickname(nickname);
+    client->setNickTs(time(NULL));
+    if (!nickname.empty())
+        _nickIndex[IRCUtils::casefold(nickname)] = client;
+    ++_stateEpoch;
+}
+
+void Server::setClientUsername(Client* client, const std::string& username) {
+    indexRemove(_userIndex, IRCUtils::casefold(client->getUsername()), client);
+    client->setUsername(username);
+    _userIndex.insert(std::make_pair(IRCUtils::casefold(username), client));
+    ++_stateEpoch;
+}
+
+void Server::setClientHostname(Client* client, const std::string& hostname) {
+    indexRemove(_hostIndex, IRCUtils::casefold(client->getHostname()), client);
+    client->setHostname(hostname);
+    _hostIndex.insert(std::make_pair(IRCUtils::casefold(hostname), client));
+    ++_stateEpoch;
+}
+
+void Server::indexRemove(std::multimap<std::string, Client*>& index, const std::string& key, Client* client) {
+    std::pair<std::multimap<std::string, Client*>::iterator,
+              std::multimap<std::string, Client*>::iterator> range = index.equal_range(key);
+    for (std::multimap<std::string, Client*>::iterator it = range.first; it != range.second; ++it) {
+        if (it->second == client) {
+            index.erase(it);
+            return;
+        }
+    }
+}
+
+template <typename Index>
+static void collectByPrefix(const Index& index, const Mask& mask, std::set<unsigned long>& serials) {
+    const std::string& prefix = mask.getLiteralPrefix();
+    typename Index::const_iterator it = index.lower_bound(prefix);
+
+    // Only keys sharing the literal prefix can match; stop at the end of that range
+    for (; it != index.end() && it->first.compare(0, prefix.length(), prefix) == 0; ++it) {
+        if (mask.isLiteral() && it->first != prefix)
+            break;
+        if (mask.matchesFolded(it->first))
+            serials.insert(it->second->getSerial());
+    }
+}
+
+void Server::collectClientsByMask(const Mask& mask, int fields, std::set<unsigned long>& serials) const {
+    if (fields & INDEX_NICK)
+        collectByPrefix(_nickIndex, mask, serials);
+    if (fields & INDEX_USER)
+        collectByPrefix(_userIndex, mask, serials);
+    if (fields & INDEX_HOST)
+        collectByPrefix(_hostIndex, mask, serials);
+}
+
+// -------- CHANNEL METHODS --------
+
+Channel* Server::getChannel(const std::string& name) {
+    std::map<std::string, Channel*>::iterator it = _channels.find(name);
+    return (it != _channels.end()) ? it->second : NULL;
+}
+
+Channel* Server::createChannel(const std::string& name, bool* restored) {
+    if (restored)
+        *restored = false;
+    if (_channels.find(name) == _channels.end()) {
+        Channel* channel = new Channel(name);
+        channel->attachHistory(&_historyBudget);
+        _channels[name] = channel;
+
+        // Settings saved before a restart come back with the channel
+        const char* settings;
+        size_t length;
+        channel->setDirtyList(&_dirtyChannels, &_stateEpoch);
+        if (_store.isOpen() && _store.find(name, settings, length)) {
+            StateReader in(settings, length);
+            channel->loadSettings(in);
+            if (restored)
+                *restored = true;
+        } else {
+            channel->markDirty(Channel::DIRTY_SETTINGS);
+        }
+    }
+    return _channels[name];
+}
+
+const std::map<std::string, Channel*>& Server::getChannels() const {
+    return _channels;
+}
+
+void Server::removeClientFromAllChannels(Client* client) {
+    // Copy: removeClient() edits the client's own channel list
+    std::vector<Channel*> channelsToCheck = client->getChannels();
+
+    // Remove the client from each channel and check if empty
+    for (std::vector<Channel*>::iterator it = channelsToCheck.begin(); it != channelsToCheck.end(); ++it) {
+        (*it)->removeClient(client);
+        deleteChannelIfEmpty(*it);
+    }
+}
+
+void Server::deleteChannelIfEmpty(Channel* channel) {
+    if (!channel)
+        return;
+
+    // Check if it's in the map
+    std::map<std::string, Channel*>::iterator it = _channels.find(channel->getName());
+    if (it == _channels.end())
+        return;
+
+    // If no members, delete and erase
+    if (channel->getMemberCount() == 0) {
+        _store.remove(channel->getName());
+        _replication.channelGone(channel->getName());
+        delete channel;
+        _channels.erase(it);
+        ++_stateEpoch;
+    }
+}
+
+// -------- ACCOUNTS --------
+
+void Server::openAccounts(const std::string& path) {
+    _accounts.open(path);
+}
+
+AccountStore& Server::getAccounts() {
+    return _accounts;
+}
+
+WelcomeBurst& Server::getWelcome() {
+    return _welcome;
+}
+
+WorkerPool& Server::getWorkers() {
+    return _workers;
+}
+
+Resolver& Server::getResolver() {
+    return _resolver;
+}
+
+WorkerPool& Server::getQueryWorkers() {
+    return _queryWorkers;
+}
+
+Capture& Server::getCapture() {
+    return _capture;
+}
+
+Metrics& Server::getMetrics() {
+    return _metrics;
+}
+
+// -------- CHANNEL PERSISTENCE --------
+
+bool Server::openChannelStore(const std::string& prefix) {
+    return _store.open(prefix);
+}
+
+void Server::syncChannelStore() {
+    publishChanges();
+    if (_store.isOpen())
+        _store.sync();
+}
+
+// -------- CHANGE PUBLICATION --------
+
+// Clients go first so that the standby knows every member a channel record
+// names. Channels and clients deleted since they changed were already
+// removed from the store and the standby.
+void Server::publishChanges() {
+    _replication.poll();
+
+    std::vector<Client*> clients;
+    clients.swap(_dirtyClients);
+    for (std::vector<Client*>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        (*it)->clearDirtyScheduled();
+        _replication.clientChanged(*it);
+    }
+
+    std::vector<std::string> channels;
+    channels.swap(_dirtyChannels);
+    for (std::vector<std::string>::iterator it = channels.begin(); it != channels.end(); ++it) {
+        Channel* channel = getChannel(*it);
+        if (!channel)
+            continue;
+
+        unsigned flags = channel->takeDirtyFlags();
+        if (flags & Channel::DIRTY_SETTINGS) {
+            StateWriter settings;
+            channel->saveSettings(settings);
+            _store.put(*it, settings.data());
+        }
+        if (flags)
+            _replication.channelChanged(channel, flags);
+    }
+
+    if (_store.compactionDue()) {
+        std::set<std::string> live;
+        for (std::map<std::string, Channel*>::iterator it = _channels.begin(); it != _channels.end(); ++it)
+            live.insert(it->first);
+        _store.compact(live);
+    }
+
+    _replication.flush();
+    _capture.flush();
+}
+
+Replication& Server::getReplication() {
+    return _replication;
+}
+
+unsigned long Server::getLastMsgid() const {
+    return _historyBudget.lastMsgid();
+}
+
+// -------- MESSAGING --------
+
+void Server::queueMessage(int clientFd, const std::string& message) {
+    Client* client = getClient(clientFd);
+    if (client)
+        client->enqueueMessage(message);
+}
+
+// Delivery to another user by pointer: a detached session still gets its
+// backlog, and a remote user's copy is routed towards its server
+void Server::queueMessage(Client* client, const std::string& message) {
+    if (!client)
+        return;
+    if (!client->isRemote())
+        client->enqueueMessage(message);
+    else if (client->getUplink() && !client->isDisconnecting())
+        client->getUplink()->enqueueMessage(message);
+}
+
+void Server::sendMessage(int clientFd, const std::string& message) {
+    queueMessage(clientFd, message);
+}
+
+void Server::broadcast(const std::set<int>& targets, const std::string& message) {
+    for (std::set<int>::const_iterator it = targets.begin(); it != targets.end(); ++it) {
+        queueMessage(*it, message);
+    }
+}
+
+// -------- I/O INTERFACE METHODS --------
+
+void Server::flushClientMessages(int clientFd) {
+    Client* client = getClient(clientFd);
+    if (client) {
+        client->flushMessagesToOutputBuffer();
+    }
+}
+
+bool Server::hasClientMessagesToSend(int clientFd) const {
+    Client* client = const_cast<Server*>(this)->getClient(clientFd);
+    return client ? client->hasMessagesToSend() : false;
+}
+
+void Server::takePendingFlush(std::vector<int>& fds) {
+    fds.clear();
+    fds.swap(_pendingFlush);
+    for (std::vector<int>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        Client* client = getClient(*it);
+        if (client)
+            client->clearFlushScheduled();
+    }
+}
+
+// -------- CONNECTION I/O --------
+
+void Server::readFromClient(int fd, Command& commands) {
+    Client* client = getClient(fd);
+    if (!client) {
+        return;
+    }
+
+    char buffer[4096];
+    ssize_t bytesRead = _transport->receive(fd, buffer, sizeof(buffer));
+    std::string name = client->getNickname().empty() ? "(unknown)" : client->getNickname();
+
+    if (bytesRead <= 0) {
+        if (bytesRead == 0) {
+            std::cout << "Client " << fd << " (" << name << ") disconnected" << std::endl;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else {
+            std::cout << "Client " << fd << " (" << name << ") connection error: " << strerror(errno) << std::endl;
+        }
+
+        handleConnectionLost(fd, bytesRead == 0 ? "Client disconnected" : "Connection reset by peer");
+        return;
+    }
+
+    IRCSERV_PROBE2(client__recv, fd, bytesRead);
+    client->appendToInputBuffer(buffer, bytesRead);
+
+    bool wasRegistered = client->isRegistered();
+    commands.processClientBuffer(client);
+    if (!wasRegistered && client->isRegistered()) {
+        std::cout << "Client " << fd << " (" << client->getNickname() << ") registered successfully" << std::endl;
+    }
+}
+
+void Server::writeToClient(int fd) {
+    Client* client = getClient(fd);
+    if (!client) {
+        return;
+    }
+
+    // Flush queued messages to output buffer
+    flushClientMessages(fd);
+
+    std::string& outputBuffer = client->getOutputBuffer();
+    if (outputBuffer.empty()) {
+        client->setNeedsPollOut(false);
+        return;
+    }
+
+    ssize_t bytesSent = _transport->transmit(fd, outputBuffer.c_str(), outputBuffer.length());
+
+    if (bytesSent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            IRCSERV_PROBE2(client__send__blocked, fd, outputBuffer.length());
+            client->setNeedsPollOut(true);
+        } else if (errno != EPIPE && errno != ECONNRESET) {
+            perror("send");
+        }
+        return;
+    }
+
+    // Remove sent bytes from buffer; wait for POLLOUT only if the connection took less than we had
+    outputBuffer.erase(0, bytesSent);
+    IRCSERV_PROBE3(client__send, fd, bytesSent, outputBuffer.length());
+    client->setNeedsPollOut(!outputBuffer.empty());
+    if (outputBuffer.empty()) {
+        unsigned long long queuedSince = client->takeQueuedSince();
+        if (queuedSince)
+            _metrics.recordSendQueue(Metrics::now() - queuedSince);
+    }
+}
+
+// Try to send output produced during this tick right away instead of waiting a
+// full poll() round trip for POLLOUT. Clients already blocked on a full socket
+// are left to POLLOUT. A corking profile holds each socket's partial frames
+// until its whole flush is written.
+void Server::flushPendingWrites() {
+    std::vector<int> fds;
+    takePendingFlush(fds);
+    bool cork = _socketTuning.profile().cork != 0;
+
+    for (std::vector<int>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        Client* client = getClient(*it);
+        if (client && !client->needsPollOut()) {
+            if (cork)
+                _transport->setCorked(*it, true);
+            writeToClient(*it);
+            if (cork)
+                _transport->setCorked(*it, false);
+        }
+    }
+}
+
+// -------- STREAMED REPLIES --------
+
+void Server::startReplyStream(Client* client, ReplyStream* stream) {
+    client->pushReplyStream(stream);
+    _streamingFds.insert(client->getFd());
+    if (client->getSendQueueSize() < ReplyStream::SENDQ_LOW_WATERMARK)
+        pumpReplyStream(client);
+}
+
+void Server::pumpReplyStream(Client* client) {
+    while (client->hasReplyStreams() && client->getSendQueueSize() < ReplyStream::SENDQ_HIGH_WATERMARK) {
+        ReplyStream* stream = client->currentReplyStream();
+        if (!stream->isReady())
+            break;
+        if (stream->produce(*this, client))
+            client->popReplyStream();
+    }
+    if (!client->hasReplyStreams())
+        _streamingFds.erase(client->getFd());
+}
+
+// The snapshot is shared until something visible changes, or it gets too old
+// for idle times to mean much; the query itself runs on a worker
+void Server::startSnapshotQuery(Client* client, SnapshotQuery* query) {
+    if (_querySnapshot && (_querySnapshot->getEpoch() != _stateEpoch ||
+                           time(NULL) - _querySnapshot->getCapturedAt() > SNAPSHOT_MAX_AGE)) {
+        QuerySnapshot* previous = _querySnapshot;
+        _querySnapshot = new QuerySnapshot(*this, _stateEpoch, previous);
+        previous->release();
+    }
+    if (!_querySnapshot)
+        _querySnapshot = new QuerySnapshot(*this, _stateEpoch, NULL);
+
+    _querySnapshot->retain();
+    startReplyStream(client, PreparedReply::submit(_queryWorkers, _querySnapshot, query));
+}
+
+void Server::pumpReplyStreams() {
+    std::vector<int> fds(_streamingFds.begin(), _streamingFds.end());
+
+    for (std::vector<int>::iterator it = fds.begin(); it != fds.end(); ++it) {
+        Client* client = getClient(*it);
+        if (!client) {
+            _streamingFds.erase(*it);
+            continue;
+        }
+        // Resume only once the client has drained most of what we already queued
+        if (client->getSendQueueSize() < ReplyStream::SENDQ_LOW_WATERMARK)
+            pumpReplyStream(client);
+    }
+}
+
+// -------- TIMEOUT HANDLING --------
+
+void Server::disconnectIdleClients(int timeoutSeconds) {
+    time_t currentTime = time(NULL);
+    std::vector<int> idle;
+
+    for (std::map<int, Client*>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        if (!it->second->isDisconnecting() && currentTime - it->second->getLastActive() > timeoutSeconds)
+            idle.push_back(it->first);
+    }
+
+    // Collected first: detaching a session removes it from _clients
+    for (std::vector<int>::iterator it = idle.begin(); it != idle.end(); ++it) {
+        std::cout << "Disconnecting idle client: fd=" << *it << std::endl;
+        handleConnectionLost(*it, "Ping timeout");
+    }
+}
+
+// -------- CHANNEL UTILITIES --------
+
+std::vector<Channel*> Server::getClientChannels(Client* client) {
+    return client->getChannels();
+}
+
+// Queue a message once to every client sharing at least one channel with `client`
+void Server::broadcastToCommonChannels(Client* client, const std::string& message, bool includeSelf) {
+    IRCSERV_ALLOC_SCOPE("(fanout)");
+    unsigned long epoch = ++_fanoutEpoch;
+
+    client->setFanoutMark(epoch);
+    if (includeSelf)
+        client->enqueueMessage(message);
+
+    const std::vector<Channel*>& channels = client->getChannels();
+    for (std::vector<Channel*>::const_iterator cit = channels.begin(); cit != channels.end(); ++cit) {
+        // Nobody else in a +D channel knows about a member that never revealed itself
+        if ((*cit)->isHidden(client))
+            continue;
+
+        const std::vector<Channel::Member>& members = (*cit)->getMembers();
+        for (std::vector<Channel::Member>::const_iterator mit = members.begin(); mit != members.end(); ++mit) {
+            Client* peer = mit->client;
+            if (peer->getFanoutMark() == epoch)
+                continue;
+            peer->setFanoutMark(epoch);
+            // Peers leaving in the same batch would never read it
+            if (!peer->isDisconnecting())
+                peer->enqueueMessage(message);
+        }
+    }
+}
+
+// -------- DISCONNECTION --------
+
+void Server::handleClientDisconnection(int fd, const std::string& reason) {
+    Client* client = getClient(fd);
+    if (client)
+        scheduleDisconnection(client, reason);
+}
+
+void Server::scheduleDisconnection(Client* client, const std::string& reason) {
+    if (client->isDisconnecting())
+        return;
+
+    IRCSERV_PROBE2(client__disconnect, client->getFd(), reason.c_str());
+    client->markDisconnecting(reason);
+    _pendingDisconnects.push_back(client);
+}
+
+// A registered client holding a resume token keeps its nick and memberships
+// while detached; nobody sees a QUIT unless the grace period runs out.
+void Server::handleConnectionLost(int fd, const std::string& reason) {
+    Client* client = getClient(fd);
+    if (!client || client->isDisconnecting())
+        return;
+
+    if (!client->isRegistered() || client->getResumeToken().empty()) {
+        scheduleDisconnection(client, reason);
+        return;
+    }
+
+    std::cout << "Client " << fd << " (" << client->getNickname() << ") detached" << std::endl;
+    IRCSERV_PROBE2(client__disconnect, fd, reason.c_str());
+    _clients.erase(fd);
+    _streamingFds.erase(fd);
+    client->detach(reason);
+    _detachedSessions[client->getResumeToken()] = client;
+    _releasedFds.push_back(fd);
+}
+
+Client* Server::findDetachedSession(const std::string& token) {
+    std::map<std::string, Client*>::iterator it = _detachedSessions.find(token);
+    return (it != _detachedSessions.end()) ? it->second : NULL;
+}
+
+// The fresh connection is retired at the end of the tick and its fd handed to
+// the session (see reattachSession)
+const std::map<std::string, Client*>& Server::getDetachedSessions() const {
+    return _detachedSessions;
+}
+
+const std::set<Client*>& Server::getRemoteClients() const {
+    return _remoteClients;
+}
+
+void Server::resumeSession(Client* fresh, Client* session) {
+    _detachedSessions.erase(session->getResumeToken());
+    fresh->setResumeTarget(session);
+    scheduleDisconnection(fresh, "Session resumed");
+}
+
+void Server::expireDetachedSessions() {
+    time_t now = time(NULL);
+    std::vector<Client*> expired;
+
+    for (std::map<std::string, Client*>::iterator it = _detachedSessions.begin(); it != _detachedSessions.end(); ++it) {
+        Client* session = it->second;
+        if (now - session->getDetachedAt() > RESUME_GRACE_PERIOD
+            || session->getSendQueueSize() > RESUME_BACKLOG_LIMIT)
+            expired.push_back(session);
+    }
+
+    for (std::vector<Client*>::iterator it = expired.begin(); it != expired.end(); ++it) {
+        _detachedSessions.erase((*it)->getResumeToken());
+        scheduleDisconnection(*it, (*it)->getQuitReason());
+    }
+}
+
+void Server::reattachSession(Client* fresh, Client* session) {
+    int fd = fresh->getFd();
+    std::string backlog = session->takePendingOutput();
+    std::string leftover = fresh->getInputBuffer();
+
+    destroyClient(fresh);
+    _clients[fd] = session;
+    session->attachFd(fd);
+    session->setResumeToken(IRCUtils::randomToken(16));
+
+    session->enqueueMessage(":" + std::string("ircserv") + " RESUME SUCCESS " + session->getNickname() + "\r\n");
+    if (!session->getResumeToken().empty())
+        session->enqueueMessage(":" + std::string("ircserv") + " RESUME TOKEN " + session->getResumeToken() + "\r\n");
+    if (!backlog.empty())
+        session->enqueueMessage(backlog);
+    session->appendToInputBuffer(leftover);
+    std::cout << "Client " << fd << " (" << session->getNickname() << ") resumed" << std::endl;
+}
+
+bool Server::hasPendingDisconnections() const {
+    return !_pendingDisconnects.empty() || !_releasedFds.empty();
+}
+
+const std::vector<Client*>& Server::getPendingDisconnections() const {
+    return _pendingDisconnects;
+}
+
+// Tear down every client disconnected during this tick as one batch: one QUIT
+// per surviving peer, one compaction pass per affected channel.
+void Server::processPendingDisconnections(std::vector<int>& closedFds) {
+    std::vector<Client*> clients;
+    clients.swap(_pendingDisconnects);
+
+    std::set<Channel*> touched;
+    for (std::vector<Client*>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client* client = *it;
+        if (client->isRegistered()) {
+            std::string quitMsg = client->buildMessage("QUIT", "", client->getQuitReason());
+            broadcastToCommonChannels(client, quitMsg, false);
+            _network.propagateQuit(client, quitMsg);
+        }
+        touched.insert(client->getChannels().begin(), client->getChannels().end());
+    }
+
+    for (std::set<Channel*>::iterator it = touched.begin(); it != touched.end(); ++it) {
+        (*it)->removeDisconnectingClients();
+        (*it)->promoteNewOperatorIfNeeded();
+        deleteChannelIfEmpty(*it);
+    }
+
+    for (std::vector<Client*>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        Client* client = *it;
+        int fd = client->getFd();
+        if (client->getResumeTarget()) {
+            reattachSession(client, client->getResumeTarget());
+            continue;
+        }
+        destroyClient(client);
+        if (fd >= 0)
+            closedFds.push_back(fd);
+    }
+
+    closedFds.insert(closedFds.end(), _releasedFds.begin(), _releasedFds.end());
+    _releasedFds.clear();
+}
+
+// Give each client a last chance to receive pending output (e.g. the ERROR
+// line after QUIT), tear the batch down, then close the connections
+bool Server::reapDisconnections() {
+    expireDetachedSessions();
+    if (!hasPendingDisconnections()) {
+        return false;
+    }
+
+    for (std::vector<Client*>::const_iterator it = _pendingDisconnects.begin(); it != _pendingDisconnects.end(); ++it) {
+        // Expired detached sessions and remote users have no connection to write to
+        if ((*it)->getFd() >= 0 && !(*it)->getResumeTarget()) {
+            writeToClient((*it)->getFd());
+        }
+    }
+
+    std::vector<int> closedFds;
+    processPendingDisconnections(closedFds);
+    for (std::vector<int>::iterator it = closedFds.begin(); it != closedFds.end(); ++it) {
+        _transport->close(*it);
+    }
+    return true;
+}
+
+// -------- BINARY UPGRADE --------
+
+// Server links and remote users are not carried over: the caller drops the
+// links first and the new process relinks on its own.
+static const char* const STATE_MAGIC = "ircserv-state";
+
+void Server::saveState(StateWriter& out, std::vector<int>& fds) const {
+    out.putString(STATE_MAGIC);
+    out.putInt(STATE_VERSION);
+
+    std::vector<Client*> clients;
+    for (std::map<int, Client*>::const_iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        if (!it->second->isDisconnecting() && it->second->getLinkState() == Client::LINK_NONE)
+            clients.push_back(it->second);
+    }
+    for (std::map<std::string, Client*>::const_iterator it = _detachedSessions.begin(); it != _detachedSessions.end(); ++it)
+        clients.push_back(it->second);
+
+    out.putInt(clients.size());
+    for (std::vector<Client*>::iterator it = clients.begin(); it != clients.end(); ++it) {
+        if ((*it)->getFd() >= 0) {
+            out.putInt(fds.size());
+            fds.push_back((*it)->getFd());
+        } else {
+            out.putInt(-1);
+        }
+        (*it)->saveState(out);
+    }
+
+    out.putInt(_channels.size());
+    for (std::map<std::string, Channel*>::const_iterator it = _channels.begin(); it != _channels.end(); ++it) {
+        out.putString(it->first);
+        it->second->saveState(out);
+    }
+}
+
+bool Server::readStateHeader(StateReader& in) {
+    std::string magic = in.getString();
+    long version = in.getInt();
+    if (in.ok() && magic == STATE_MAGIC && version == STATE_VERSION)
+        return true;
+    std::cerr << "State: not an ircserv state of version " << STATE_VERSION
+              << " (got " << (magic == STATE_MAGIC ? "version " : "unknown format ") << version << ")" << std::endl;
+    return false;
+}
+
+bool Server::loadState(StateReader& in, const std::vector<int>& fds, std::map<unsigned long, Client*>& clients) {
+    if (!readStateHeader(in))
+        return false;
+
+    long count = in.getInt();
+    for (long i = 0; i < count && in.ok(); ++i) {
+        long slot = in.getInt();
+        int fd = (slot >= 0 && slot < static_cast<long>(fds.size())) ? fds[slot] : -1;
+
+        Client* client = new Client(fd);
+        client->setFlushList(&_pendingFlush);
+        client->setDirtyList(&_dirtyClients, &_stateEpoch);
+        client->loadState(in);
+        clients[client->getSerial()] = client;
+        if (client->getSerial() >= _nextSerial)
+            _nextSerial = client->getSerial() + 1;
+        indexClient(client);
+    }
+
+    long channels = in.getInt();
+    for (long i = 0; i < channels && in.ok(); ++i) {
+        Channel* channel = createChannel(in.getString());
+        channel->loadState(in, clients);
+    }
+    return in.ok();
+}
+
+// -------- STANDBY --------
+
+// The primary's record replaces the whole identity; the socket is the
+// standby's own duplicate (-1 for a detached session)
+Client* Server::mirrorClient(Client* client, int fd, StateReader& in) {
+    if (client) {
+        unindexClient(client);
+    } else {
+        client = new Client(fd);
+        client->setFlushList(&_pendingFlush);
+        client->setDirtyList(&_dirtyClients, &_stateEpoch);
+    }
+    client->loadIdentity(in);
+    client->setFd(fd);
+    if (client->getSerial() >= _nextSerial)
+        _nextSerial = client->getSerial() + 1;
+    indexClient(client);
+    return client;
+}
+
+// The primary already told everyone; channel records follow in the same batch
+void Server::discardClient(Client* client) {
+    std::vector<Channel*> channels = client->getChannels();
+    for (std::vector<Channel*>::iterator it = channels.begin(); it != channels.end(); ++it)
+        (*it)->removeClient(client);
+    destroyClient(client);
+}
+
+void Server::discardChannel(const std::string& name) {
+    std::map<std::string, Channel*>::iterator it = _channels.find(name);
+    if (it == _channels.end())
+        return;
+
+    Channel* channel = it->second;
+    std::vector<Channel::Member> members = channel->getMembers();
+    for (std::vector<Channel::Member>::iterator mit = members.begin(); mit != members.end(); ++mit)
+        channel->removeClient(mit->client);
+    _channels.erase(it);
+    delete channel;
+}
+
+// Applying records marks clients and channels changed like any edit would;
+// nothing on the standby publishes them, so the lists would only grow
+void Server::dropChanges() {
+    for (std::vector<Client*>::iterator it = _dirtyClients.begin(); it != _dirtyClients.end(); ++it)
+        (*it)->clearDirtyScheduled();
+    _dirtyClients.clear();
+
+    for (std::vector<std::string>::iterator it = _dirtyChannels.begin(); it != _dirtyChannels.end(); ++it) {
+        Channel* channel = getChannel(*it);
+        if (channel)
+            channel->takeDirtyFlags();
+    }
+    _dirtyChannels.clear();
+}
@@ -0,0 +1,234 @@
+#include "Simulation.hpp"
+#include "Replay.hpp"
+#include "AllocProfile.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <ctime>
+#include <algorithm>
+
+static const char* const SIMULATION_PASSWORD = "simulation";
+
+Simulation::Simulation(size_t clients, size_t rounds, unsigned long long seed)
+    : _clientCount(clients), _rounds(rounds), _seed(seed), _state(seed), _server(SIMULATION_PASSWORD),
+      _commands(&_server), _linesSent(0), _linesReceived(0), _bytesReceived(0),
+      _digest(14695981039346656037ULL), _ticks(0) {
+    _server.setTransport(&_transport);
+}
+
+// 64-bit LCG, high bits: plenty for picking traffic
+unsigned long Simulation::random(unsigned long bound) {
+    _state = _state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return static_cast<unsigned long>((_state >> 33) % bound);
+}
+
+void Simulation::send(VirtualClient& client, const std::string& line) {
+    _transport.deliver(client.fd, line + "\r\n");
+    ++_linesSent;
+}
+
+const std::string& Simulation::pickChannel(const VirtualClient& client) {
+    return _channelNames[client.channels[random(client.channels.size())]];
+}
+
+// -------- TICKS --------
+
+// One pass of the event loop, with readiness taken from the transport instead of poll()
+bool Simulation::tick() {
+    _server.reapDisconnections();
+    _server.getQueryWorkers().runCompletions();
+    _server.pumpReplyStreams();
+    _server.getWorkers().runCompletions();
+    _server.getResolver().poll();
+    _server.publishChanges();
+    _server.flushPendingWrites();
+
+    bool moved = false;
+    for (std::vector<VirtualClient>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        if (_transport.hasInput(it->fd)) {
+            _server.readFromClient(it->fd, _commands);
+            moved = true;
+        }
+        Client* client = _server.getClient(it->fd);
+        if (client && !client->isDisconnecting() && (client->needsPollOut() || client->hasReadyReplyStream()))
+            _server.writeToClient(it->fd);
+    }
+
+    ++_ticks;
+    return collectOutput() || moved;
+}
+
+void Simulation::settle() {
+    for (size_t quiet = 0; quiet < QUIET_TICKS; )
+        quiet = tick() ? 0 : quiet + 1;
+}
+
+// What the clients received, line by line into the digest
+bool Simulation::collectOutput() {
+    bool received = false;
+    std::string output;
+    for (size_t i = 0; i < _clients.size(); ++i) {
+        VirtualClient& client = _clients[i];
+        output.clear();
+        _transport.takeOutput(client.fd, output);
+        if (output.empty())
+            continue;
+        received = true;
+        _bytesReceived += output.length();
+
+        client.partial += output;
+        std::ostringstream prefix;
+        prefix << i << " ";
+        size_t start = 0, end;
+        while ((end = client.partial.find("\r\n", start)) != std::string::npos) {
+            std::string line = Replay::normalize(client.partial.substr(start, end - start));
+            start = end + 2;
+            ++_linesReceived;
+
+            size_t space = line.find(' ');
+            if (space != std::string::npos && line.compare(space, 5, " 001 ") == 0)
+                client.welcomed = true;
+
+            // FNV-1a over "<client> <line>\n"
+            line.insert(0, prefix.str());
+            line += '\n';
+            for (size_t b = 0; b < line.length(); ++b) {
+                _digest ^= static_cast<unsigned char>(line[b]);
+                _digest *= 1099511628211ULL;
+            }
+        }
+        client.partial.erase(0, start);
+    }
+    return received;
+}
+
+// -------- TRAFFIC --------
+
+// Per mille: messages dominate, queries and membership churn stay rare since
+// each of them costs a snapshot or a NAMES burst
+void Simulation::playRound(size_t round) {
+    for (std::vector<VirtualClient>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        std::ostringstream text;
+        text << "round " << round << " from " << it->nickname;
+
+        unsigned long pick = random(1000);
+        if (pick < 700) {
+            send(*it, "PRIVMSG " + pickChannel(*it) + " :" + text.str());
+        } else if (pick < 900) {
+            send(*it, "PRIVMSG " + _clients[random(_clients.size())].nickname + " :" + text.str());
+        } else if (pick < 980) {
+            send(*it, "PING :" + text.str());
+        } else if (pick < 990) {
+            send(*it, "TOPIC " + pickChannel(*it) + " :" + text.str());
+        } else if (pick < 993) {
+            send(*it, "NAMES " + pickChannel(*it));
+        } else if (pick < 996) {
+            send(*it, "WHO " + pickChannel(*it));
+        } else {
+            const std::string& channel = pickChannel(*it);
+            send(*it, "PART " + channel + " :" + text.str());
+            send(*it, "JOIN " + channel);
+        }
+    }
+}
+
+int Simulation::run() {
+    if (_clientCount == 0) {
+        std::cerr << "Simulation: no clients" << std::endl;
+        return 1;
+    }
+
+    // The server's own logging would dominate the profile
+    std::ofstream discard("/dev/null");
+    std::streambuf* console = std::cout.rdbuf(discard.rdbuf());
+
+    struct timespec startedAt;
+    clock_gettime(CLOCK_MONOTONIC, &startedAt);
+
+    size_t channelCount = (_clientCount + CLIENTS_PER_CHANNEL - 1) / CLIENTS_PER_CHANNEL;
+    for (size_t i = 0; i < channelCount; ++i) {
+        std::ostringstream name;
+        name << "#sim" << i;
+        _channelNames.push_back(name.str());
+    }
+
+    // Connect and register everyone, then join
+    _clients.resize(_clientCount);
+    for (size_t i = 0; i < _clientCount; ++i) {
+        VirtualClient& client = _clients[i];
+        std::ostringstream nickname;
+        nickname << "sim" << i;
+        client.nickname = nickname.str();
+        client.welcomed = false;
+        client.fd = _transport.connect();
+
+        std::ostringstream ip;
+        ip << "10." << (i >> 16 & 0xff) << "." << (i >> 8 & 0xff) << "." << (i & 0xff);
+        _server.addClient(client.fd);
+        Client* connection = _server.getClient(client.fd);
+        connection->setIp(ip.str());
+        _server.setClientHostname(connection, ip.str());
+
+        send(client, std::string("PASS ") + SIMULATION_PASSWORD);
+        send(client, "NICK " + client.nickname);
+        send(client, "USER " + client.nickname + " 0 * :Simulated client");
+    }
+    settle();
+
+    for (std::vector<VirtualClient>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        for (size_t c = 0; c < CHANNELS_PER_CLIENT && c < channelCount; ++c) {
+            size_t channel = random(channelCount);
+            while (std::find(it->channels.begin(), it->channels.end(), channel) != it->channels.end())
+                channel = (channel + 1) % channelCount;
+            it->channels.push_back(channel);
+            send(*it, "JOIN " + _channelNames[channel]);
+        }
+    }
+    settle();
+
+    for (size_t round = 0; round < _rounds; ++round) {
+        playRound(round);
+        settle();
+    }
+
+    for (std::vector<VirtualClient>::iterator it = _clients.begin(); it != _clients.end(); ++it)
+        send(*it, "QUIT :simulation over");
+    settle();
+
+    struct timespec endedAt;
+    clock_gettime(CLOCK_MONOTONIC, &endedAt);
+    double seconds = (endedAt.tv_sec - startedAt.tv_sec) + (endedAt.tv_nsec - startedAt.tv_nsec) / 1e9;
+    std::cout.rdbuf(console);
+
+    size_t unwelcomed = 0, lingering = 0;
+    for (std::vector<VirtualClient>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+        if (!it->welcomed)
+            ++unwelcomed;
+        if (_transport.isOpen(it->fd))
+            ++lingering;
+    }
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Simulation: " << _clientCount << " clients in " << channelCount << " channels, "
+              << _rounds << " rounds, seed " << _seed << ", " << _ticks << " ticks" << std::endl
+              << "Simulation: " << _linesSent << " lines sent, " << _linesReceived << " lines ("
+              << _bytesReceived / (1024.0 * 1024.0) << " MB) received in " << seconds << " s ("
+              << (seconds > 0 ? _linesSent / seconds : 0) << " lines/s in, "
+              << (seconds > 0 ? _linesReceived / seconds : 0) << " lines/s out)" << std::endl
+              << "Simulation: output digest " << std::hex << _digest << std::dec << std::endl;
+
+    // Same traffic every run: the place to check allocation-elimination work
+    if (AllocProfile::enabled()) {
+        std::vector<std::string> lines;
+        AllocProfile::report(lines);
+        for (std::vector<std::string>::const_iterator it = lines.begin(); it != lines.end(); ++it)
+            std::cout << "Simulation: allocations " << *it << std::endl;
+    }
+
+    if (unwelcomed)
+        std::cout << "Simulation: " << unwelcomed << " clients never registered" << std::endl;
+    if (lingering)
+        std::cout << "Simulation: " << lingering << " clients still connected after QUIT" << std::endl;
+    return (unwelcomed || lingering) ? 1 : 0;
+}
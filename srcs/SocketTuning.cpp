@@ -0,0 +1,353 @@
+#include "SocketTuning.hpp"
+#include "Metrics.hpp"
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#ifndef TCP_NOTSENT_LOWAT
+#define TCP_NOTSENT_LOWAT -1
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL -1
+#endif
+
+namespace {
+
+enum Target { ON_LISTENER, ON_CLIENT, ON_FLUSH };
+
+struct OptionSpec {
+    const char* key;
+    int SocketProfile::* field;
+    Target target;
+    int level;
+    int name;               // -1: not available on this system
+};
+
+const OptionSpec OPTIONS[] = {
+    { "nodelay",       &SocketProfile::nodelay,      ON_CLIENT,   IPPROTO_TCP, TCP_NODELAY },
+    { "cork",          &SocketProfile::cork,         ON_FLUSH,    IPPROTO_TCP, TCP_CORK },
+    { "notsent_lowat", &SocketProfile::notsentLowat, ON_CLIENT,   IPPROTO_TCP, TCP_NOTSENT_LOWAT },
+    { "defer_accept",  &SocketProfile::deferAccept,  ON_LISTENER, IPPROTO_TCP, TCP_DEFER_ACCEPT },
+    { "rcvbuf",        &SocketProfile::rcvbuf,       ON_LISTENER, SOL_SOCKET,  SO_RCVBUF },
+    { "sndbuf",        &SocketProfile::sndbuf,       ON_LISTENER, SOL_SOCKET,  SO_SNDBUF },
+    { "busy_poll",     &SocketProfile::busyPoll,     ON_CLIENT,   SOL_SOCKET,  SO_BUSY_POLL },
+    { "keepalive",     &SocketProfile::keepalive,    ON_CLIENT,   IPPROTO_TCP, TCP_KEEPIDLE },
+    { "keepintvl",     &SocketProfile::keepInterval, ON_CLIENT,   IPPROTO_TCP, TCP_KEEPINTVL },
+    { "keepcnt",       &SocketProfile::keepCount,    ON_CLIENT,   IPPROTO_TCP, TCP_KEEPCNT },
+};
+const size_t OPTION_COUNT = sizeof(OPTIONS) / sizeof(OPTIONS[0]);
+
+// Written the way an operator would override them
+struct NamedProfile {
+    const char* name;
+    const char* options;
+};
+
+const NamedProfile PROFILES[] = {
+    { "default", "" },
+    { "latency", "nodelay=1,notsent_lowat=16384,busy_poll=50,defer_accept=10,keepalive=120,keepintvl=30,keepcnt=4" },
+    { "bulk",    "cork=1,sndbuf=1048576,defer_accept=10,keepalive=120,keepintvl=30,keepcnt=4" },
+};
+const size_t PROFILE_COUNT = sizeof(PROFILES) / sizeof(PROFILES[0]);
+
+bool setOption(int fd, int level, int name, int value) {
+    return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+}
+
+// "key=value,key=value" onto profile
+bool applyOptions(const std::string& options, SocketProfile& profile, std::string& error) {
+    std::istringstream list(options);
+    std::string option;
+    while (std::getline(list, option, ',')) {
+        if (option.empty())
+            continue;
+        size_t equals = option.find('=');
+        std::string key = option.substr(0, equals);
+        const OptionSpec* spec = NULL;
+        for (size_t i = 0; i < OPTION_COUNT; ++i) {
+            if (key == OPTIONS[i].key)
+                spec = &OPTIONS[i];
+        }
+        if (!spec) {
+            error = "unknown socket option " + key;
+            return false;
+        }
+        char* end = NULL;
+        long value = equals == std::string::npos ? -1 : std::strtol(option.c_str() + equals + 1, &end, 10);
+        if (value < 0 || value > 0x7fffffff || *end) {
+            error = "bad value for socket option " + key;
+            return false;
+        }
+        profile.*(spec->field) = static_cast<int>(value);
+    }
+    return true;
+}
+
+}
+
+SocketProfile::SocketProfile()
+    : nodelay(0), cork(0), notsentLowat(0), deferAccept(0), rcvbuf(0), sndbuf(0),
+      busyPoll(0), keepalive(0), keepInterval(0), keepCount(0) {}
+
+SocketTuning::SocketTuning() : _name("default"), _warned(0) {}
+
+bool SocketTuning::configure(const std::string& spec, std::string& error) {
+    std::string name = spec.substr(0, spec.find(','));
+    std::string overrides = name.length() < spec.length() ? spec.substr(name.length() + 1) : "";
+
+    for (size_t i = 0; i < PROFILE_COUNT; ++i) {
+        if (name != PROFILES[i].name)
+            continue;
+        SocketProfile profile;
+        if (!applyOptions(PROFILES[i].options, profile, error) || !applyOptions(overrides, profile, error))
+            return false;
+        _name = name;
+        _profile = profile;
+        return true;
+    }
+    error = "unknown socket profile " + name;
+    return false;
+}
+
+const SocketProfile& SocketTuning::profile() const {
+    return _profile;
+}
+
+std::string SocketTuning::describe() const {
+    std::ostringstream out;
+    out << _name << ":";
+    for (size_t i = 0; i < OPTION_COUNT; ++i) {
+        if (_profile.*(OPTIONS[i].field))
+            out << " " << OPTIONS[i].key << "=" << _profile.*(OPTIONS[i].field);
+    }
+    return out.str();
+}
+
+// A failing option is reported once, not for every connection
+void SocketTuning::apply(int fd, int target) const {
+    for (size_t i = 0; i < OPTION_COUNT; ++i) {
+        const OptionSpec& spec = OPTIONS[i];
+        int value = _profile.*(spec.field);
+        if (spec.target != target || value == 0)
+            continue;
+
+        bool applied = spec.name != -1;
+        if (applied && spec.field == &SocketProfile::keepalive)
+            applied = setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+        if (applied)
+            applied = setOption(fd, spec.level, spec.name, value);
+        if (!applied && !(_warned & (1U << i))) {
+            _warned |= 1U << i;
+            std::cerr << "Socket tuning: cannot set " << spec.key << ": "
+                      << (spec.name == -1 ? "not supported here" : strerror(errno)) << std::endl;
+        }
+    }
+}
+
+void SocketTuning::applyToListener(int fd) const {
+    apply(fd, ON_LISTENER);
+}
+
+void SocketTuning::applyToClient(int fd) const {
+    apply(fd, ON_CLIENT);
+}
+
+void SocketTuning::setCorked(int fd, bool corked) {
+    setOption(fd, IPPROTO_TCP, TCP_CORK, corked ? 1 : 0);
+}
+
+// -------- BENCHMARK --------
+
+namespace {
+
+struct BenchSockets {
+    int listener;
+    std::vector<int> server;        // accepted, tuned, non-blocking
+    std::vector<int> clients;       // the far ends, non-blocking
+
+    BenchSockets() : listener(-1) {}
+    ~BenchSockets() {
+        if (listener != -1)
+            close(listener);
+        for (size_t i = 0; i < server.size(); ++i)
+            close(server[i]);
+        for (size_t i = 0; i < clients.size(); ++i)
+            close(clients[i]);
+    }
+};
+
+// count connections over loopback, accepted through a listener set up as the server does it
+bool connectPairs(const SocketTuning& tuning, size_t count, BenchSockets& sockets) {
+    sockets.listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(addr);
+    tuning.applyToListener(sockets.listener);
+    if (bind(sockets.listener, (struct sockaddr*)&addr, sizeof(addr)) == -1
+        || listen(sockets.listener, SOMAXCONN) == -1
+        || getsockname(sockets.listener, (struct sockaddr*)&addr, &length) == -1) {
+        perror("SocketTuning: listener");
+        return false;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        int client = socket(AF_INET, SOCK_STREAM, 0);
+        if (client == -1 || connect(client, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+            perror("SocketTuning: connect");
+            return false;
+        }
+        setOption(client, IPPROTO_TCP, TCP_NODELAY, 1);
+        sockets.clients.push_back(client);
+
+        // Deferred accept only returns once the client has spoken
+        if (send(client, "\n", 1, 0) != 1) {
+            perror("SocketTuning: send");
+            return false;
+        }
+        int accepted = accept(sockets.listener, NULL, NULL);
+        char newline;
+        if (accepted == -1 || recv(accepted, &newline, 1, 0) != 1) {
+            perror("SocketTuning: accept");
+            return false;
+        }
+        tuning.applyToClient(accepted);
+        fcntl(accepted, F_SETFL, O_NONBLOCK);
+        fcntl(client, F_SETFL, O_NONBLOCK);
+        sockets.server.push_back(accepted);
+    }
+    return true;
+}
+
+// Flushing as Server does it: corked for the duration when the profile says so
+bool flush(const SocketProfile& profile, int fd, const std::string& data, size_t& sent) {
+    if (profile.cork)
+        SocketTuning::setCorked(fd, true);
+    while (sent < data.length()) {
+        ssize_t n = send(fd, data.data() + sent, data.length() - sent, MSG_NOSIGNAL);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    if (profile.cork)
+        SocketTuning::setCorked(fd, false);
+    return sent == data.length() || errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Reads fd until wanted bytes arrived, spinning like a client that is waiting on us
+bool drain(int fd, size_t wanted, unsigned long long deadline) {
+    char buffer[65536];
+    while (wanted) {
+        ssize_t n = recv(fd, buffer, std::min(wanted, sizeof(buffer)), 0);
+        if (n > 0) {
+            wanted -= n;
+        } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK) || Metrics::now() > deadline) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A request, answered in two writes as when a reply goes out over two ticks
+bool roundTrips(const SocketTuning& tuning, LatencyHistogram& latencies) {
+    static const size_t ROUNDS = 5000;
+    static const unsigned long long BUDGET = 3000000000ULL;    // ns; a Nagle stall is 40 ms a round
+
+    BenchSockets sockets;
+    if (!connectPairs(tuning, 1, sockets))
+        return false;
+    int server = sockets.server[0], client = sockets.clients[0];
+    std::string request = "PRIVMSG #bench :ping\r\n";
+    std::string reply = ":nick!user@host PRIVMSG #bench :pong\r\n";
+
+    unsigned long long startedAt = Metrics::now();
+    for (size_t round = 0; round < ROUNDS && Metrics::now() - startedAt < BUDGET; ++round) {
+        unsigned long long sentAt = Metrics::now();
+        if (send(client, request.data(), request.length(), 0) != static_cast<ssize_t>(request.length())
+            || !drain(server, request.length(), sentAt + BUDGET))
+            return false;
+        if (tuning.profile().cork)
+            SocketTuning::setCorked(server, true);
+        for (int write = 0; write < 2; ++write) {
+            if (send(server, reply.data(), reply.length(), 0) != static_cast<ssize_t>(reply.length()))
+                return false;
+        }
+        if (tuning.profile().cork)
+            SocketTuning::setCorked(server, false);
+        if (!drain(client, 2 * reply.length(), sentAt + BUDGET))
+            return false;
+        latencies.record(Metrics::now() - sentAt);
+    }
+    return true;
+}
+
+// A burst of channel lines to every member, one flush per member
+bool fanOut(const SocketTuning& tuning, LatencyHistogram& latencies, double& megabytesPerSecond) {
+    static const size_t MEMBERS = 200;
+    static const size_t ROUNDS = 300;
+    static const size_t LINES = 10;
+
+    BenchSockets sockets;
+    if (!connectPairs(tuning, MEMBERS, sockets))
+        return false;
+    std::string burst;
+    for (size_t i = 0; i < LINES; ++i)
+        burst += ":nick!user@host PRIVMSG #bench :a line of ordinary channel chatter, about this long\r\n";
+
+    unsigned long long startedAt = Metrics::now();
+    for (size_t round = 0; round < ROUNDS; ++round) {
+        unsigned long long roundAt = Metrics::now();
+        std::vector<size_t> sent(MEMBERS, 0);
+        for (size_t i = 0; i < MEMBERS; ++i) {
+            if (!flush(tuning.profile(), sockets.server[i], burst, sent[i]))
+                return false;
+        }
+        // Whatever did not fit goes out as the member reads
+        for (size_t i = 0; i < MEMBERS; ++i) {
+            for (size_t received = 0; received < burst.length(); received = sent[i]) {
+                if (!drain(sockets.clients[i], sent[i] - received, roundAt + 3000000000ULL)
+                    || !flush(tuning.profile(), sockets.server[i], burst, sent[i]))
+                    return false;
+            }
+        }
+        latencies.record(Metrics::now() - roundAt);
+    }
+    double seconds = (Metrics::now() - startedAt) / 1e9;
+    megabytesPerSecond = burst.length() * MEMBERS * ROUNDS / 1e6 / seconds;
+    return true;
+}
+
+}
+
+int SocketTuning::benchmark() {
+    for (size_t i = 0; i < PROFILE_COUNT; ++i) {
+        SocketTuning tuning;
+        std::string error;
+        tuning.configure(PROFILES[i].name, error);
+
+        LatencyHistogram roundTrip, fanOutRound;
+        double megabytesPerSecond = 0;
+        if (!roundTrips(tuning, roundTrip) || !fanOut(tuning, fanOutRound, megabytesPerSecond)) {
+            std::cerr << "SocketTuning: " << PROFILES[i].name << " benchmark failed" << std::endl;
+            return 1;
+        }
+        std::cout << "SocketTuning: " << tuning.describe() << std::endl
+                  << "SocketTuning:   round trip " << roundTrip.summary() << std::endl
+                  << "SocketTuning:   fan-out    " << fanOutRound.summary() << ", "
+                  << std::fixed << std::setprecision(0) << megabytesPerSecond << " MB/s" << std::endl;
+    }
+    return 0;
+}
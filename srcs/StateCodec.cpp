@@ -0,0 +1,97 @@
+#include "StateCodec.hpp"
+#include <sstream>
+
+// -------- WRITER --------
+
+void StateWriter::putInt(long value) {
+    std::ostringstream oss;
+    oss << value << ' ';
+    _data += oss.str();
+}
+
+void StateWriter::putString(const std::string& value) {
+    std::ostringstream oss;
+    oss << value.length() << ':';
+    _data += oss.str();
+    _data += value;
+}
+
+void StateWriter::putBytes(const char* bytes, size_t length) {
+    std::ostringstream oss;
+    oss << length << ':';
+    _data += oss.str();
+    _data.append(bytes, length);
+}
+
+const std::string& StateWriter::data() const {
+    return _data;
+}
+
+// -------- READER --------
+
+StateReader::StateReader(const std::string& data)
+    : _data(data.data()), _length(data.length()), _pos(0), _ok(true) {}
+
+StateReader::StateReader(const char* data, size_t length)
+    : _data(data), _length(length), _pos(0), _ok(true) {}
+
+// Parsed in place: the reader may be walking a large mapped file
+long StateReader::readNumber(char terminator) {
+    size_t pos = _pos;
+    bool negative = (pos < _length && _data[pos] == '-');
+    if (negative)
+        ++pos;
+
+    long value = 0;
+    size_t digits = 0;
+    while (pos < _length && _data[pos] >= '0' && _data[pos] <= '9' && digits < 19) {
+        value = value * 10 + (_data[pos] - '0');
+        ++pos;
+        ++digits;
+    }
+    if (!_ok || digits == 0 || pos >= _length || _data[pos] != terminator) {
+        _ok = false;
+        return 0;
+    }
+    _pos = pos + 1;
+    return negative ? -value : value;
+}
+
+long StateReader::getInt() {
+    return readNumber(' ');
+}
+
+std::string StateReader::getString() {
+    long length = readNumber(':');
+    if (!_ok || length < 0 || static_cast<size_t>(length) > _length - _pos) {
+        _ok = false;
+        return "";
+    }
+    std::string value(_data + _pos, length);
+    _pos += length;
+    return value;
+}
+
+bool StateReader::getBytes(const char*& bytes, size_t& length) {
+    long value = readNumber(':');
+    if (!_ok || value < 0 || static_cast<size_t>(value) > _length - _pos) {
+        _ok = false;
+        return false;
+    }
+    bytes = _data + _pos;
+    length = value;
+    _pos += value;
+    return true;
+}
+
+bool StateReader::ok() const {
+    return _ok;
+}
+
+bool StateReader::atEnd() const {
+    return _pos >= _length;
+}
+
+size_t StateReader::position() const {
+    return _pos;
+}
@@ -0,0 +1,135 @@
+#include "Transport.hpp"
+#include "SocketTuning.hpp"
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+
+// -------- TCP --------
+
+ssize_t TcpTransport::receive(int fd, char* buffer, size_t length) {
+    return recv(fd, buffer, length, 0);
+}
+
+ssize_t TcpTransport::transmit(int fd, const char* data, size_t length) {
+    return send(fd, data, length, 0);
+}
+
+void TcpTransport::setCorked(int fd, bool corked) {
+    SocketTuning::setCorked(fd, corked);
+}
+
+// A standby's duplicate of the socket would otherwise keep the connection open
+void TcpTransport::close(int fd) {
+    shutdown(fd, SHUT_RDWR);
+    ::close(fd);
+}
+
+// -------- IN MEMORY --------
+
+MemoryTransport::MemoryTransport() {}
+
+MemoryTransport::Endpoint* MemoryTransport::find(int fd) {
+    if (fd < FIRST_FD || static_cast<size_t>(fd - FIRST_FD) >= _endpoints.size())
+        return NULL;
+    return &_endpoints[fd - FIRST_FD];
+}
+
+const MemoryTransport::Endpoint* MemoryTransport::find(int fd) const {
+    return const_cast<MemoryTransport*>(this)->find(fd);
+}
+
+int MemoryTransport::connect() {
+    Endpoint endpoint;
+    endpoint.inboundRead = 0;
+    endpoint.open = true;
+    endpoint.hungUp = false;
+    _endpoints.push_back(endpoint);
+    return FIRST_FD + static_cast<int>(_endpoints.size() - 1);
+}
+
+void MemoryTransport::deliver(int fd, const std::string& data) {
+    Endpoint* endpoint = find(fd);
+    if (endpoint && endpoint->open && !endpoint->hungUp)
+        endpoint->inbound += data;
+}
+
+void MemoryTransport::hangUp(int fd) {
+    Endpoint* endpoint = find(fd);
+    if (endpoint)
+        endpoint->hungUp = true;
+}
+
+// Readable, in poll() terms: data, or the end of the stream
+bool MemoryTransport::hasInput(int fd) const {
+    const Endpoint* endpoint = find(fd);
+    return endpoint && endpoint->open && (endpoint->inboundRead < endpoint->inbound.length() || endpoint->hungUp);
+}
+
+bool MemoryTransport::isOpen(int fd) const {
+    const Endpoint* endpoint = find(fd);
+    return endpoint && endpoint->open;
+}
+
+void MemoryTransport::takeOutput(int fd, std::string& out) {
+    Endpoint* endpoint = find(fd);
+    if (!endpoint)
+        return;
+    out += endpoint->outbound;
+    endpoint->outbound.clear();
+}
+
+ssize_t MemoryTransport::receive(int fd, char* buffer, size_t length) {
+    Endpoint* endpoint = find(fd);
+    if (!endpoint || !endpoint->open) {
+        errno = EBADF;
+        return -1;
+    }
+
+    size_t available = endpoint->inbound.length() - endpoint->inboundRead;
+    if (available == 0) {
+        if (endpoint->hungUp)
+            return 0;
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t n = std::min(available, length);
+    std::memcpy(buffer, endpoint->inbound.data() + endpoint->inboundRead, n);
+    endpoint->inboundRead += n;
+    if (endpoint->inboundRead == endpoint->inbound.length()) {
+        endpoint->inbound.clear();
+        endpoint->inboundRead = 0;
+    }
+    return n;
+}
+
+ssize_t MemoryTransport::transmit(int fd, const char* data, size_t length) {
+    Endpoint* endpoint = find(fd);
+    if (!endpoint || !endpoint->open) {
+        errno = EBADF;
+        return -1;
+    }
+    if (endpoint->hungUp) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (endpoint->outbound.length() >= SEND_CAPACITY) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t n = std::min(SEND_CAPACITY - endpoint->outbound.length(), length);
+    endpoint->outbound.append(data, n);
+    return n;
+}
+
+void MemoryTransport::close(int fd) {
+    Endpoint* endpoint = find(fd);
+    if (!endpoint)
+        return;
+    endpoint->open = false;
+    std::string().swap(endpoint->inbound);
+    endpoint->inboundRead = 0;
+}
@@ -0,0 +1,234 @@
+#include "Upgrade.hpp"
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+#include <climits>
+
+const char* const Upgrade::ENV_FD = "IRCSERV_UPGRADE_FD";
+
+namespace {
+    std::string g_executable;
+
+    // Sent first; both processes run on the same machine, so raw is fine
+    struct Header {
+        long startedSec;
+        long startedUsec;
+        unsigned long stateLength;
+        unsigned long fdCount;
+    };
+
+    bool sendAll(int channel, const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t sent = send(channel, data, length, 0);
+            if (sent == -1) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    bool recvAll(int channel, char* data, size_t length) {
+        while (length > 0) {
+            ssize_t got = recv(channel, data, length, 0);
+            if (got == -1 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            data += got;
+            length -= got;
+        }
+        return true;
+    }
+
+    // One data byte per message so the receiver can read the chunks back one by one
+    bool sendFds(int channel, const std::vector<int>& fds) {
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * Upgrade::FDS_PER_MESSAGE));
+
+        for (size_t first = 0; first < fds.size(); first += Upgrade::FDS_PER_MESSAGE) {
+            size_t count = std::min(fds.size() - first, Upgrade::FDS_PER_MESSAGE);
+            char byte = 'F';
+            struct iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            std::memcpy(CMSG_DATA(cmsg), &fds[first], sizeof(int) * count);
+
+            if (sendmsg(channel, &msg, 0) != 1)
+                return false;
+        }
+        return true;
+    }
+
+    bool recvFds(int channel, size_t expected, std::vector<int>& fds) {
+        std::vector<char> control(CMSG_SPACE(sizeof(int) * Upgrade::FDS_PER_MESSAGE));
+
+        while (fds.size() < expected) {
+            char byte;
+            struct iovec iov;
+            iov.iov_base = &byte;
+            iov.iov_len = 1;
+
+            struct msghdr msg;
+            std::memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = &control[0];
+            msg.msg_controllen = control.size();
+
+            if (recvmsg(channel, &msg, 0) != 1 || (msg.msg_flags & MSG_CTRUNC))
+                return false;
+
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                return false;
+
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* received = reinterpret_cast<const int*>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), received, received + count);
+        }
+        return fds.size() == expected;
+    }
+
+    void setTimeout(int channel, int option, int milliseconds) {
+        struct timeval tv;
+        tv.tv_sec = milliseconds / 1000;
+        tv.tv_usec = (milliseconds % 1000) * 1000;
+        setsockopt(channel, SOL_SOCKET, option, &tv, sizeof(tv));
+    }
+}
+
+void Upgrade::rememberExecutable(const char* argv0) {
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length > 0) {
+        g_executable.assign(path, length);
+        return;
+    }
+    // Without /proc, as good as it gets: argv[0] against the starting directory
+    if (realpath(argv0, path))
+        g_executable = path;
+    else
+        g_executable = argv0;
+}
+
+const char* Upgrade::executable() {
+    return g_executable.c_str();
+}
+
+bool Upgrade::handOver(char* argv[], const struct timeval& startedAt, const std::string& state,
+                       const std::vector<int>& fds, const std::vector<int>& openFds) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1) {
+        perror("upgrade socketpair");
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("upgrade fork");
+        close(pair[0]);
+        close(pair[1]);
+        return false;
+    }
+
+    if (pid == 0) {
+        // The new binary starts with nothing open but its end of the channel
+        close(pair[0]);
+        for (std::vector<int>::const_iterator it = openFds.begin(); it != openFds.end(); ++it)
+            close(*it);
+
+        std::ostringstream oss;
+        oss << pair[1];
+        setenv(ENV_FD, oss.str().c_str(), 1);
+        execv(executable(), argv);
+        perror("upgrade execv");
+        _exit(127);
+    }
+
+    close(pair[1]);
+    setTimeout(pair[0], SO_SNDTIMEO, ACK_TIMEOUT_MS);
+
+    Header header;
+    header.startedSec = startedAt.tv_sec;
+    header.startedUsec = startedAt.tv_usec;
+    header.stateLength = state.length();
+    header.fdCount = fds.size();
+
+    bool ok = sendAll(pair[0], reinterpret_cast<const char*>(&header), sizeof(header))
+        && sendAll(pair[0], state.data(), state.length())
+        && sendFds(pair[0], fds);
+
+    // Wait until the new process has restored everything and is about to serve
+    if (ok) {
+        struct pollfd ack;
+        ack.fd = pair[0];
+        ack.events = POLLIN;
+        ack.revents = 0;
+        char byte = 0;
+        ok = poll(&ack, 1, ACK_TIMEOUT_MS) == 1 && recv(pair[0], &byte, 1, 0) == 1;
+    }
+    close(pair[0]);
+
+    if (!ok) {
+        std::cerr << "Upgrade failed: new process did not take over, still serving" << std::endl;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return ok;
+}
+
+int Upgrade::takeoverChannel() {
+    const char* value = getenv(ENV_FD);
+    if (!value)
+        return -1;
+
+    int channel = std::atoi(value);
+    unsetenv(ENV_FD);
+    return channel;
+}
+
+bool Upgrade::receive(int channel, std::string& state, std::vector<int>& fds, struct timeval& startedAt) {
+    setTimeout(channel, SO_RCVTIMEO, ACK_TIMEOUT_MS);
+
+    Header header;
+    if (!recvAll(channel, reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+
+    startedAt.tv_sec = header.startedSec;
+    startedAt.tv_usec = header.startedUsec;
+    state.resize(header.stateLength);
+    if (header.stateLength > 0 && !recvAll(channel, &state[0], header.stateLength))
+        return false;
+    return recvFds(channel, header.fdCount, fds);
+}
+
+void Upgrade::acknowledge(int channel) {
+    char byte = 'A';
+    if (send(channel, &byte, 1, 0) != 1)
+        perror("upgrade ack");
+    close(channel);
+}
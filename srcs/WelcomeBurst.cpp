@@ -0,0 +1,166 @@
+#include "WelcomeBurst.hpp"
+#include "IRCProtocol.hpp"
+#include "Channel.hpp"
+#include <iostream>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// -------- TEMPLATES --------
+
+WelcomeBurst::Template::Template() : literalLength(0) {
+    pieces.push_back("");
+}
+
+void WelcomeBurst::Template::clear() {
+    pieces.assign(1, "");
+    holes.clear();
+    literalLength = 0;
+}
+
+void WelcomeBurst::Template::text(const std::string& literal) {
+    pieces.back() += literal;
+    literalLength += literal.length();
+}
+
+void WelcomeBurst::Template::hole(Hole hole) {
+    holes.push_back(hole);
+    pieces.push_back("");
+}
+
+void WelcomeBurst::Template::render(const std::string& nick, const std::string& hostmask, std::string& out) const {
+    out.reserve(out.length() + literalLength + holes.size() * std::max(nick.length(), hostmask.length()));
+    for (size_t i = 0; i < holes.size(); ++i) {
+        out += pieces[i];
+        out += (holes[i] == NICK) ? nick : hostmask;
+    }
+    out += pieces.back();
+}
+
+// -------- RENDERING --------
+
+WelcomeBurst::WelcomeBurst() : _createdAt(time(NULL)), _motdMtime(0) {
+    buildRegistration();
+    buildMotd(NULL);
+}
+
+void WelcomeBurst::buildRegistration() {
+    char created[64];
+    strftime(created, sizeof(created), "%a %b %d %Y at %H:%M:%S %Z", localtime(&_createdAt));
+    std::string prefix = ":" + std::string("ircserv") + " ";
+
+    _registration.clear();
+    _registration.text(prefix + IRC::RPL_WELCOME + " ");
+    _registration.hole(NICK);
+    _registration.text(" :Welcome to the IRC Network ");
+    _registration.hole(HOSTMASK);
+    _registration.text("\r\n" + prefix + IRC::RPL_YOURHOST + " ");
+    _registration.hole(NICK);
+    _registration.text(" :Your host is ircserv, running version 1.0\r\n" + prefix + IRC::RPL_CREATED + " ");
+    _registration.hole(NICK);
+    _registration.text(std::string(" :This server was created ") + created + "\r\n" + prefix + IRC::RPL_MYINFO + " ");
+    _registration.hole(NICK);
+    _registration.text(" ircserv 1.0 o o\r\n" + prefix + IRC::RPL_ISUPPORT + " ");
+    _registration.hole(NICK);
+    _registration.text(" CHANTYPES=# PREFIX=" + Channel::prefixToken() + " CHANMODES=" + Channel::chanModesToken() + " EXCEPTS INVEX MAXLIST=beI:500 CHATHISTORY=100 MSGREFTYPES=msgid,timestamp CASEMAPPING=rfc1459 :are supported by this server\r\n");
+}
+
+// lines NULL: no MOTD file
+void WelcomeBurst::buildMotd(const std::vector<std::string>* lines) {
+    std::string prefix = ":" + std::string("ircserv") + " ";
+
+    _motd.clear();
+    if (!lines) {
+        _motd.text(prefix + IRC::ERR_NOMOTD + " ");
+        _motd.hole(NICK);
+        _motd.text(" :MOTD File is missing\r\n");
+        return;
+    }
+
+    _motd.text(prefix + IRC::RPL_MOTDSTART + " ");
+    _motd.hole(NICK);
+    _motd.text(" :- ircserv Message of the day - \r\n");
+    for (std::vector<std::string>::const_iterator it = lines->begin(); it != lines->end(); ++it) {
+        _motd.text(prefix + IRC::RPL_MOTD + " ");
+        _motd.hole(NICK);
+        _motd.text(" :- " + *it + "\r\n");
+    }
+    _motd.text(prefix + IRC::RPL_ENDOFMOTD + " ");
+    _motd.hole(NICK);
+    _motd.text(" :End of /MOTD command.\r\n");
+}
+
+// -------- MOTD FILE --------
+
+void WelcomeBurst::open(const std::string& motdPath) {
+    _motdPath = motdPath;
+    _motdMtime = 0;
+    reloadIfChanged();
+}
+
+// A stat() per minute from the loop's housekeeping
+void WelcomeBurst::reloadIfChanged() {
+    struct stat info;
+    time_t mtime = (!_motdPath.empty() && stat(_motdPath.c_str(), &info) == 0) ? info.st_mtime : 0;
+    if (mtime == _motdMtime)
+        return;
+
+    std::vector<std::string> lines;
+    bool loaded = mtime != 0 && readMotd(lines);
+    buildMotd(loaded ? &lines : NULL);
+    _motdMtime = loaded ? mtime : 0;
+    if (loaded)
+        std::cout << "MOTD: " << lines.size() << " lines from " << _motdPath << std::endl;
+}
+
+bool WelcomeBurst::readMotd(std::vector<std::string>& lines) {
+    int fd = ::open(_motdPath.c_str(), O_RDONLY);
+    if (fd == -1)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) == -1) {
+        ::close(fd);
+        return false;
+    }
+
+    size_t length = info.st_size;
+    const char* data = NULL;
+    if (length) {
+        void* mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+    }
+    ::close(fd);
+
+    // Split on '\n', dropping '\r' and anything past MOTD_LINE_LENGTH
+    for (size_t start = 0; start < length; ) {
+        size_t end = start;
+        while (end < length && data[end] != '\n')
+            ++end;
+        size_t stop = end;
+        if (stop > start && data[stop - 1] == '\r')
+            --stop;
+        lines.push_back(std::string(data + start, std::min(stop - start, static_cast<size_t>(MOTD_LINE_LENGTH))));
+        start = end + 1;
+    }
+
+    if (length)
+        munmap(const_cast<char*>(data), length);
+    return true;
+}
+
+// -------- OUTPUT --------
+
+void WelcomeBurst::render(const std::string& nick, const std::string& hostmask, std::string& out) const {
+    _registration.render(nick, hostmask, out);
+    _motd.render(nick, hostmask, out);
+}
+
+void WelcomeBurst::renderMotd(const std::string& nick, std::string& out) const {
+    _motd.render(nick, "", out);
+}
@@ -0,0 +1,175 @@
+#include "WhoQuery.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Channel.hpp"
+#include "Network.hpp"
+#include "IRCProtocol.hpp"
+#include "utils.hpp"
+#include <sstream>
+#include <ctime>
+
+WhoQuery::WhoQuery(Server& server, const Client* requester, const std::string& target, const std::string& options)
+    : _requester(requester->getNickname()), _requesterSerial(requester->getSerial()),
+      _requesterIsOper(server.getAccounts().isOperator(requester->getAccount())), _target(target),
+      _matchFields(MATCH_NICK | MATCH_USER | MATCH_HOST | MATCH_SERVER), _serverMatches(false), _whox(false), _narrowed(false) {
+    if (_target.empty() || _target == "0") {
+        _target = "*";
+    }
+    if (_target[0] == '#') {
+        _channel = _target;
+    } else {
+        _mask.compile(_target);
+        _serverMatches = _mask.matches(server.getNetwork().getName());
+    }
+    parseOptions(options);
+    collectCandidates(server);
+}
+
+WhoQuery::~WhoQuery() {}
+
+void WhoQuery::parseOptions(const std::string& options) {
+    size_t percent = options.find('%');
+    std::string flags = options.substr(0, percent);
+
+    int selected = 0;
+    for (size_t i = 0; i < flags.length(); ++i) {
+        switch (flags[i]) {
+            case 'n': selected |= MATCH_NICK; break;
+            case 'u': selected |= MATCH_USER; break;
+            case 'h': selected |= MATCH_HOST; break;
+            case 's': selected |= MATCH_SERVER; break;
+            case 'r': selected |= MATCH_REALNAME; break;
+            default: break;
+        }
+    }
+    if (selected != 0) {
+        _matchFields = selected;
+    }
+
+    if (percent != std::string::npos) {
+        _whox = true;
+        std::string fields = options.substr(percent + 1);
+        size_t comma = fields.find(',');
+        if (comma != std::string::npos) {
+            _token = fields.substr(comma + 1, 3);
+            fields.erase(comma);
+        }
+        _whoxFields = fields;
+    }
+}
+
+// The sorted indexes are cheap enough to use on the loop; everything else is
+// left to the full match on the worker. Every user is on the same server, so
+// the server field either matches all of them (nothing to narrow) or none,
+// in which case the indexes still serve the other fields.
+void WhoQuery::collectCandidates(Server& server) {
+    if ((_matchFields & MATCH_SERVER) && _serverMatches)
+        return;
+    if (!_channel.empty() || (_matchFields & MATCH_REALNAME) || _mask.getLiteralPrefix().empty())
+        return;
+
+    int fields = 0;
+    if (_matchFields & MATCH_NICK) fields |= Server::INDEX_NICK;
+    if (_matchFields & MATCH_USER) fields |= Server::INDEX_USER;
+    if (_matchFields & MATCH_HOST) fields |= Server::INDEX_HOST;
+
+    server.collectClientsByMask(_mask, fields, _candidates);
+    _narrowed = true;
+}
+
+bool WhoQuery::matchesUser(const QuerySnapshot::User& target) const {
+    if ((_matchFields & MATCH_NICK) && _mask.matchesFolded(target.foldedNickname))
+        return true;
+    if ((_matchFields & MATCH_USER) && _mask.matchesFolded(target.foldedUsername))
+        return true;
+    if ((_matchFields & MATCH_HOST) && _mask.matchesFolded(target.foldedHostname))
+        return true;
+    if ((_matchFields & MATCH_SERVER) && _serverMatches)
+        return true;
+    if ((_matchFields & MATCH_REALNAME) && _mask.matchesFolded(target.foldedRealname))
+        return true;
+    return false;
+}
+
+std::string WhoQuery::formatReply(const QuerySnapshot::User& target, const std::string& channelName, char prefix, time_t now) const {
+    std::string flags = "H";
+    if (prefix) flags += prefix;
+
+    if (!_whox) {
+        return ":" + std::string("ircserv") + " " + IRC::RPL_WHOREPLY + " " + _requester + " " + channelName + " " +
+               target.username + " " + target.hostname + " " + target.server + " " +
+               target.nickname + " " + flags + " :0 " + target.realname + "\r\n";
+    }
+
+    std::ostringstream oss;
+    oss << ":ircserv " << IRC::RPL_WHOSPCRPL << " " << _requester;
+
+    const char* order = "tcuihsnfdlaor";
+    for (const char* f = order; *f; ++f) {
+        if (_whoxFields.find(*f) == std::string::npos) {
+            continue;
+        }
+        switch (*f) {
+            case 't': oss << " " << (_token.empty() ? "0" : _token); break;
+            case 'c': oss << " " << channelName; break;
+            case 'u': oss << " " << target.username; break;
+            case 'i': {
+                bool visible = !target.ip.empty() && (target.serial == _requesterSerial || _requesterIsOper);
+                oss << " " << (visible ? target.ip : "255.255.255.255");
+                break;
+            }
+            case 'h': oss << " " << target.hostname; break;
+            case 's': oss << " " << target.server; break;
+            case 'n': oss << " " << target.nickname; break;
+            case 'f': oss << " " << flags; break;
+            case 'd': oss << " 0"; break;
+            case 'l': oss << " " << (now - target.lastActive); break;
+            case 'a': oss << " " << (target.account.empty() ? "0" : target.account); break;
+            case 'o': oss << " n/a"; break;
+            case 'r': oss << " :" << target.realname; break;
+        }
+    }
+    oss << "\r\n";
+    return oss.str();
+}
+
+// Channel queries list the members in join order, hiding +D joins from
+// everyone but the member and the channel operators, and +s or +p channels
+// from non-members; mask queries look at local connections only, and at
+// just the candidates when the indexes narrowed them
+void WhoQuery::render(const QuerySnapshot& snapshot, std::string& out) const {
+    time_t now = time(NULL);
+
+    if (!_channel.empty()) {
+        const QuerySnapshot::ChannelInfo* channel = snapshot.findChannel(_channel);
+        const QuerySnapshot::Member* self = channel ? snapshot.findMember(*channel, _requesterSerial) : NULL;
+        if (channel && !self && (channel->modes & (Channel::MODE_SECRET | Channel::MODE_PRIVATE)))
+            channel = NULL;
+        if (channel) {
+            bool viewerIsOp = self && (self->flags & Channel::MEMBER_OP);
+            for (std::vector<QuerySnapshot::Member>::const_iterator it = channel->members.begin(); it != channel->members.end(); ++it) {
+                const QuerySnapshot::User* target = snapshot.findUser(it->serial);
+                if (!target || !target->registered)
+                    continue;
+                if ((it->flags & Channel::MEMBER_HIDDEN) && target->serial != _requesterSerial && !viewerIsOp)
+                    continue;
+                out += formatReply(*target, channel->name, Channel::memberPrefix(it->flags), now);
+            }
+        }
+    } else if (_narrowed) {
+        for (std::set<unsigned long>::const_iterator it = _candidates.begin(); it != _candidates.end(); ++it) {
+            const QuerySnapshot::User* target = snapshot.findUser(*it);
+            if (target && target->connected && target->registered && matchesUser(*target))
+                out += formatReply(*target, "*", 0, now);
+        }
+    } else {
+        const std::vector<const QuerySnapshot::User*>& users = snapshot.getUsers();
+        for (std::vector<const QuerySnapshot::User*>::const_iterator it = users.begin(); it != users.end(); ++it) {
+            const QuerySnapshot::User& target = **it;
+            if (target.connected && target.registered && matchesUser(target))
+                out += formatReply(target, "*", 0, now);
+        }
+    }
+
+    out += ":" + std::string("ircserv") + " " + IRC::RPL_ENDOFWHO + " " + _requester + " " + _target + " :End of WHO list\r\n";
+}
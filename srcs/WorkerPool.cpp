@@ -0,0 +1,148 @@
+#include "WorkerPool.hpp"
+#include <iostream>
+#include <cstdio>
+#include <csignal>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+WorkerPool::WorkerPool() : _stopping(false), _pending(0) {
+    _wakePipe[0] = -1;
+    _wakePipe[1] = -1;
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_wake, NULL);
+}
+
+WorkerPool::~WorkerPool() {
+    stop();
+    pthread_cond_destroy(&_wake);
+    pthread_mutex_destroy(&_mutex);
+}
+
+bool WorkerPool::start(size_t threads) {
+    if (isStarted())
+        return true;
+
+    if (pipe2(_wakePipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+        perror("worker pipe");
+        return false;
+    }
+
+    // Signals must reach the event loop, never a worker
+    sigset_t all, previous;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &previous);
+    for (size_t i = 0; i < threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &WorkerPool::workerMain, this) != 0)
+            break;
+        _threads.push_back(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    if (_threads.empty()) {
+        std::cerr << "Worker pool: cannot start any thread" << std::endl;
+        stop();
+        return false;
+    }
+    return true;
+}
+
+void WorkerPool::stop() {
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_broadcast(&_wake);
+    pthread_mutex_unlock(&_mutex);
+    for (std::vector<pthread_t>::iterator it = _threads.begin(); it != _threads.end(); ++it)
+        pthread_join(*it, NULL);
+    _threads.clear();
+    _stopping = false;
+
+    for (std::deque<Task*>::iterator it = _queued.begin(); it != _queued.end(); ++it)
+        delete *it;
+    for (std::deque<Task*>::iterator it = _finished.begin(); it != _finished.end(); ++it)
+        delete *it;
+    _queued.clear();
+    _finished.clear();
+    _pending = 0;
+
+    for (int i = 0; i < 2; ++i) {
+        if (_wakePipe[i] != -1)
+            close(_wakePipe[i]);
+        _wakePipe[i] = -1;
+    }
+}
+
+bool WorkerPool::isStarted() const {
+    return !_threads.empty();
+}
+
+void WorkerPool::submit(Task* task) {
+    if (!isStarted()) {
+        task->run();
+        task->complete();
+        delete task;
+        return;
+    }
+
+    ++_pending;
+    pthread_mutex_lock(&_mutex);
+    _queued.push_back(task);
+    pthread_cond_signal(&_wake);
+    pthread_mutex_unlock(&_mutex);
+}
+
+size_t WorkerPool::getPending() const {
+    return _pending;
+}
+
+int WorkerPool::getWakeFd() const {
+    return _wakePipe[0];
+}
+
+// complete() may submit again; tasks finishing meanwhile wait for the next call
+void WorkerPool::runCompletions() {
+    char drain[256];
+    while (_wakePipe[0] != -1 && read(_wakePipe[0], drain, sizeof(drain)) > 0)
+        ;
+
+    std::deque<Task*> finished;
+    pthread_mutex_lock(&_mutex);
+    finished.swap(_finished);
+    pthread_mutex_unlock(&_mutex);
+
+    for (std::deque<Task*>::iterator it = finished.begin(); it != finished.end(); ++it) {
+        --_pending;
+        (*it)->complete();
+        delete *it;
+    }
+}
+
+void* WorkerPool::workerMain(void* pool) {
+    static_cast<WorkerPool*>(pool)->runWorker();
+    return NULL;
+}
+
+void WorkerPool::runWorker() {
+    pthread_mutex_lock(&_mutex);
+    while (true) {
+        while (_queued.empty() && !_stopping)
+            pthread_cond_wait(&_wake, &_mutex);
+        if (_stopping)
+            break;
+
+        Task* task = _queued.front();
+        _queued.pop_front();
+        pthread_mutex_unlock(&_mutex);
+
+        task->run();
+
+        pthread_mutex_lock(&_mutex);
+        _finished.push_back(task);
+        // A full pipe already guarantees a wakeup
+        char byte = 0;
+        while (write(_wakePipe[1], &byte, 1) == -1 && errno == EINTR)
+            ;
+    }
+    pthread_mutex_unlock(&_mutex);
+}
@@ -1,62 +1,127 @@
-#include "utils.hpp"
-#include <sstream>
-
-namespace IRCUtils {
-    std::vector<std::string> extractLines(std::string& buffer) {
-        std::vector<std::string> lines;
-        size_t pos = 0;
-
-        while ((pos = buffer.find("\r\n")) != std::string::npos) {
-            lines.push_back(buffer.substr(0, pos));
-            buffer.erase(0, pos + 2);
-        }
-
-        return lines;
-    }
-
-    IRCMessage parseIRCMessage(const std::string& line) {
-        IRCMessage msg;
-        std::istringstream iss(line);
-        std::string token;
-
-        // Check for prefix
-        if (line[0] == ':') {
-            iss >> msg.prefix;
-            msg.prefix = msg.prefix.substr(1); // Remove the ':'
-        }
-
-        // Get command
-        iss >> msg.command;
-
-        // Get parameters
-        std::string param;
-        while (iss >> param) {
-            if (param[0] == ':') {
-                // Trailing parameter - collect rest of line
-                std::string trailing = param.substr(1);
-                std::string rest;
-                std::getline(iss, rest);
-                if (!rest.empty()) {
-                    trailing += rest;
-                }
-                msg.params.push_back(trailing);
-                break;
-            } else {
-                msg.params.push_back(param);
-            }
-        }
-
-        return msg;
-    }
-
-    std::string formatReply(int code, const std::string& target, const std::string& message) {
-        std::ostringstream oss;
-        oss << ":" << "irc.server.local" << " ";
-
-        if (code < 100) oss << "0";
-        if (code < 10) oss << "0";
-        oss << code << " " << target << " " << message;
-
-        return oss.str();
-    }
-}
+#include "utils.hpp"
+#include <iostream>
+#include <sstream>
+#include <fstream>
+
+namespace IRCUtils {
+    std::vector<std::string> extractLines(std::string& buffer) {
+        std::vector<std::string> lines;
+        size_t pos = 0;
+
+        while ((pos = buffer.find("\r\n")) != std::string::npos) {
+            lines.push_back(buffer.substr(0, pos));
+            buffer.erase(0, pos + 2);
+        }
+
+        return lines;
+    }
+
+    IRCMessage parseIRCMessage(const std::string& line) {
+        IRCMessage msg;
+        std::istringstream iss(line);
+        std::string token;
+
+        // Check for prefix
+        if (line[0] == ':') {
+            iss >> msg.prefix;
+            msg.prefix = msg.prefix.substr(1); // Remove the ':'
+        }
+
+        // Get command
+        iss >> msg.command;
+
+        // Get parameters
+        std::string param;
+        while (iss >> param) {
+            if (param[0] == ':') {
+                // Trailing parameter - collect rest of line
+                std::string trailing = param.substr(1);
+                std::string rest;
+                std::getline(iss, rest);
+                if (!rest.empty()) {
+                    trailing += rest;
+                }
+                msg.params.push_back(trailing);
+                break;
+            } else {
+                msg.params.push_back(param);
+            }
+        }
+
+        return msg;
+    }
+
+    char casefoldChar(char c) {
+        if (c >= 'A' && c <= 'Z') return c - 'A' + 'a';
+        if (c == '[') return '{';
+        if (c == ']') return '}';
+        if (c == '\\') return '|';
+        if (c == '~') return '^';
+        return c;
+    }
+
+    std::string casefold(const std::string& str) {
+        std::string folded(str);
+        for (size_t i = 0; i < folded.length(); ++i) {
+            folded[i] = casefoldChar(folded[i]);
+        }
+        return folded;
+    }
+
+    std::string randomToken(size_t bytes) {
+        static const char hex[] = "0123456789abcdef";
+        std::ifstream urandom("/dev/urandom", std::ios::binary);
+        std::string token;
+
+        for (size_t i = 0; i < bytes; ++i) {
+            unsigned char byte;
+            if (!urandom.get(reinterpret_cast<char&>(byte))) {
+                // Anything guessable would hand out sessions: no token at all
+                std::cerr << "Error: cannot read /dev/urandom, no token issued" << std::endl;
+                return "";
+            }
+            token += hex[byte >> 4];
+            token += hex[byte & 0x0f];
+        }
+        return token;
+    }
+
+    bool base64Decode(const std::string& input, std::string& output) {
+        static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        if (input.length() % 4 != 0)
+            return false;
+
+        output.clear();
+        unsigned long bits = 0;
+        int count = 0;
+        for (size_t i = 0; i < input.length(); ++i) {
+            if (input[i] == '=') {
+                // Padding only in the last two positions
+                if (i < input.length() - 2 || (i == input.length() - 2 && input[i + 1] != '='))
+                    return false;
+                break;
+            }
+            size_t value = alphabet.find(input[i]);
+            if (value == std::string::npos)
+                return false;
+            bits = (bits << 6) | value;
+            count += 6;
+            if (count >= 8) {
+                count -= 8;
+                output += static_cast<char>((bits >> count) & 0xff);
+            }
+        }
+        return true;
+    }
+
+    std::string formatReply(int code, const std::string& target, const std::string& message) {
+        std::ostringstream oss;
+        oss << ":" << "irc.server.local" << " ";
+
+        if (code < 100) oss << "0";
+        if (code < 10) oss << "0";
+        oss << code << " " << target << " " << message;
+
+        return oss.str();
+    }
+}
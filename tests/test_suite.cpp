@@ -0,0 +1,1085 @@
+#include "Server.hpp"
+#include "Command.hpp"
+#include "Transport.hpp"
+#include "Mask.hpp"
+#include "ChannelStore.hpp"
+#include "PasswordHash.hpp"
+#include "Capture.hpp"
+#include "utils.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <set>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Unit and scenario tests. Scenarios run the command layer over a
+// MemoryTransport, ticked by hand as in Simulation: no sockets, no poll(),
+// no worker threads (without started workers every task completes inline),
+// so each run sees exactly the same traffic.
+
+namespace {
+
+int g_checks = 0;
+int g_failures = 0;
+
+void check(bool condition, const char* expression, const char* file, int line) {
+    ++g_checks;
+    if (condition)
+        return;
+    ++g_failures;
+    std::cerr << file << ":" << line << ": check failed: " << expression << std::endl;
+}
+
+#define CHECK(expression) check((expression), #expression, __FILE__, __LINE__)
+
+// -------- HARNESS --------
+
+const char* const PASSWORD = "testpass";
+
+// One server and its transport. Servers linked with TestServer::link share a
+// group: settling any of them ticks all of them, and bytes written to a link
+// are delivered to the other side's end of it.
+class TestServer {
+private:
+    struct Bridge {
+        TestServer* peer;
+        int peerFd;
+    };
+
+    MemoryTransport _transport;
+    Server _server;
+    Command _commands;
+    std::vector<int> _fds;
+    std::map<int, std::string> _received;   // by fd, not read by the test yet
+    std::map<int, Bridge> _bridges;         // link fd -> the other server's end
+    std::vector<TestServer*> _ownGroup;
+    std::vector<TestServer*>* _group;
+    std::string _linksPath;
+
+    TestServer(const TestServer&);
+    TestServer& operator=(const TestServer&);
+
+    bool tick() {
+        _server.reapDisconnections();
+        _server.getQueryWorkers().runCompletions();
+        _server.pumpReplyStreams();
+        _server.getWorkers().runCompletions();
+        _server.getResolver().poll();
+        _server.publishChanges();
+        _server.flushPendingWrites();
+
+        bool moved = false;
+        for (std::vector<int>::const_iterator it = _fds.begin(); it != _fds.end(); ++it) {
+            if (_transport.hasInput(*it)) {
+                _server.readFromClient(*it, _commands);
+                moved = true;
+            }
+            Client* client = _server.getClient(*it);
+            if (client && !client->isDisconnecting() && (client->needsPollOut() || client->hasReplyStreams()))
+                _server.writeToClient(*it);
+        }
+        for (std::vector<int>::const_iterator it = _fds.begin(); it != _fds.end(); ++it) {
+            std::map<int, Bridge>::iterator bridge = _bridges.find(*it);
+            if (bridge == _bridges.end()) {
+                size_t before = _received[*it].length();
+                _transport.takeOutput(*it, _received[*it]);
+                moved = moved || _received[*it].length() != before;
+                continue;
+            }
+
+            std::string bytes;
+            _transport.takeOutput(*it, bytes);
+            if (!bytes.empty()) {
+                bridge->second.peer->_transport.deliver(bridge->second.peerFd, bytes);
+                moved = true;
+            }
+            if (!_transport.isOpen(*it)) {
+                bridge->second.peer->_transport.hangUp(bridge->second.peerFd);
+                bridge->second.peer->_bridges.erase(bridge->second.peerFd);
+                _bridges.erase(bridge);
+                moved = true;
+            }
+        }
+        return moved;
+    }
+
+public:
+    TestServer() : _server(PASSWORD), _commands(&_server), _ownGroup(1, this), _group(&_ownGroup) {
+        _server.setTransport(&_transport);
+    }
+
+    // A network node; connectBlocks holds its links file, one block per line
+    TestServer(const std::string& name, const std::string& connectBlocks)
+        : _server(PASSWORD), _commands(&_server), _ownGroup(1, this), _group(&_ownGroup) {
+        _server.setTransport(&_transport);
+        _server.getNetwork().setName(name);
+
+        std::ostringstream path;
+        path << "/tmp/irc_tests-" << getpid() << "-" << name << ".links";
+        _linksPath = path.str();
+        std::ofstream file(_linksPath.c_str());
+        file << connectBlocks;
+        file.close();
+        _server.getNetwork().openConnectBlocks(_linksPath);
+    }
+
+    ~TestServer() {
+        if (!_linksPath.empty())
+            unlink(_linksPath.c_str());
+    }
+
+    Server& server() { return _server; }
+    MemoryTransport& transport() { return _transport; }
+
+    int connect(const std::string& ip = "10.0.0.1") {
+        int fd = _transport.connect();
+        _fds.push_back(fd);
+        _server.addClient(fd);
+        Client* client = _server.getClient(fd);
+        client->setIp(ip);
+        _server.setClientHostname(client, ip);
+        return fd;
+    }
+
+    // Connected and registered, welcome burst already read
+    int connectAs(const std::string& nick) {
+        int fd = connect();
+        send(fd, std::string("PASS ") + PASSWORD);
+        send(fd, "NICK " + nick);
+        send(fd, "USER " + nick + " 0 * :Test " + nick);
+        take(fd);
+        return fd;
+    }
+
+    // An outgoing link from this server to the one expected to be called name,
+    // arriving there from address; returns this side's fd
+    int link(TestServer& other, const std::string& name, const std::string& address) {
+        if (_group != other._group) {
+            for (size_t i = 0; i < other._group->size(); ++i)
+                _group->push_back((*other._group)[i]);
+            for (size_t i = 0; i < _group->size(); ++i)
+                (*_group)[i]->_group = _group;
+        }
+
+        Network& network = _server.getNetwork();
+        network.addLinkTarget(name, address, 0);
+        std::vector<Network::LinkTarget*> due;
+        network.collectDueLinks(due);
+
+        int fd = connect("127.0.0.1");
+        int otherFd = other.connect(address);
+        Bridge forward = { &other, otherFd };
+        Bridge backward = { this, fd };
+        _bridges[fd] = forward;
+        other._bridges[otherFd] = backward;
+        if (!due.empty())
+            network.beginOutgoingLink(due.back(), _server.getClient(fd));
+        settle();
+        return fd;
+    }
+
+    void send(int fd, const std::string& line) {
+        _transport.deliver(fd, line + "\r\n");
+        settle();
+    }
+
+    void settle() {
+        for (int quiet = 0; quiet < 2; ) {
+            bool moved = false;
+            for (size_t i = 0; i < _group->size(); ++i)
+                moved = (*_group)[i]->tick() || moved;
+            quiet = moved ? 0 : quiet + 1;
+        }
+    }
+
+    // Everything the client received since the last call
+    std::string take(int fd) {
+        settle();
+        std::string out;
+        out.swap(_received[fd]);
+        return out;
+    }
+
+    bool isOpen(int fd) const { return _transport.isOpen(fd); }
+};
+
+bool has(const std::string& output, const std::string& needle) {
+    return output.find(needle) != std::string::npos;
+}
+
+size_t count(const std::string& output, const std::string& needle) {
+    size_t n = 0;
+    for (size_t at = output.find(needle); at != std::string::npos; at = output.find(needle, at + 1))
+        ++n;
+    return n;
+}
+
+// -------- UNITS --------
+
+void testCasefold() {
+    CHECK(IRCUtils::casefold("Nick[A]\\~") == "nick{a}|^");
+    CHECK(IRCUtils::casefoldChar('Z') == 'z');
+    CHECK(IRCUtils::casefoldChar('1') == '1');
+}
+
+void testMask() {
+    Mask prefix("ali*");
+    CHECK(prefix.matches("alice"));
+    CHECK(prefix.matches("ALICE"));
+    CHECK(!prefix.matches("bob"));
+    CHECK(prefix.getLiteralPrefix() == "ali");
+
+    Mask single("b?b");
+    CHECK(single.matches("bob"));
+    CHECK(!single.matches("bobb"));
+    CHECK(Mask("*").matchesEverything());
+    CHECK(Mask("carol").isLiteral());
+}
+
+// Removals from the front, middle and end, checking every lookup and the join order after each
+void testMemberIndex() {
+    Channel channel("#index");
+    std::vector<Client*> clients;
+    for (int i = 0; i < 200; ++i) {
+        clients.push_back(new Client(i));
+        channel.addClient(clients.back());
+    }
+    channel.setMemberFlag(clients[150], Channel::MEMBER_VOICE, true);
+
+    std::vector<Client*> remaining(clients);
+    unsigned long state = 7;
+    bool consistent = true;
+    while (remaining.size() > 1) {
+        state = state * 1103515245UL + 12345UL;
+        size_t victim = (state >> 8) % remaining.size();
+        channel.removeClient(remaining[victim]);
+        consistent = consistent && !channel.hasClient(remaining[victim]);
+        remaining.erase(remaining.begin() + victim);
+
+        const std::vector<Channel::Member>& members = channel.getMembers();
+        consistent = consistent && members.size() == remaining.size();
+        for (size_t i = 0; consistent && i < remaining.size(); ++i)
+            consistent = members[i].client == remaining[i] && channel.hasClient(remaining[i]);
+    }
+    CHECK(consistent);
+    bool voiced = remaining[0] == clients[150];
+    CHECK(channel.getMemberFlags(remaining[0]) == (voiced ? static_cast<unsigned>(Channel::MEMBER_VOICE) : 0u));
+
+    channel.removeClient(remaining[0]);
+    CHECK(channel.getMemberCount() == 0);
+    for (size_t i = 0; i < clients.size(); ++i)
+        delete clients[i];
+}
+
+// Every byte charged to the budget comes back, whether records leave by a
+// channel's own limits, by the shared budget, or with their channel
+void testHistoryBudget() {
+    HistoryBudget budget(16 * 1024);
+    {
+        MessageHistory busy, quiet;
+        busy.attach(&budget);
+        quiet.attach(&budget);
+        std::string line = ":nick!user@host PRIVMSG #chan :";
+        for (int i = 0; i < 3000; ++i) {
+            line += static_cast<char>('a' + i % 26);
+            if (line.size() > 300)
+                line.resize(40);
+            (i % 4 ? busy : quiet).append(line);
+        }
+        CHECK(budget.getUsed() <= 16 * 1024);
+        CHECK(!busy.empty() && !quiet.empty());
+        for (int i = 0; i < 50; ++i)
+            busy.evictOldest();
+
+        // A record whose string has spare capacity, as one read back from a snapshot can
+        HistoryRecord restored;
+        restored.msgid = budget.nextMsgid();
+        restored.time = 0;
+        restored.millis = 0;
+        restored.line.reserve(4096);
+        restored.line = ":nick!user@host PRIVMSG #chan :restored";
+        quiet.restore(restored);
+    }
+    CHECK(budget.getUsed() == 0);
+}
+
+// -------- SCENARIOS --------
+
+// A per-run path under /tmp for stores, sockets and account files
+std::string tempPath(const std::string& name) {
+    std::ostringstream path;
+    path << "/tmp/irc_tests-" << getpid() << "-" << name;
+    return path.str();
+}
+
+void removeStore(const std::string& prefix) {
+    unlink((prefix + ".snap").c_str());
+    unlink((prefix + ".log").c_str());
+}
+
+void testRegistration() {
+    TestServer t;
+    int fd = t.connect();
+    t.send(fd, std::string("PASS ") + PASSWORD);
+    t.send(fd, "NICK alice");
+    t.send(fd, "USER alice 0 * :Alice");
+    std::string out = t.take(fd);
+    CHECK(has(out, ":ircserv 001 alice :Welcome to the IRC Network alice!alice@10.0.0.1\r\n"));
+    CHECK(has(out, " 005 alice "));
+    CHECK(has(out, " 422 alice "));
+
+    int wrong = t.connect();
+    t.send(wrong, "PASS nope");
+    t.send(wrong, "NICK mallory");
+    t.send(wrong, "USER mallory 0 * :M");
+    CHECK(!has(t.take(wrong), " 001 "));
+
+    int taken = t.connect();
+    t.send(taken, std::string("PASS ") + PASSWORD);
+    t.send(taken, "NICK ALICE");
+    CHECK(has(t.take(taken), " 433 "));
+}
+
+std::string base64(const std::string& data) {
+    static const char* const ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < data.length(); i += 3) {
+        unsigned long group = static_cast<unsigned char>(data[i]) << 16;
+        if (i + 1 < data.length())
+            group |= static_cast<unsigned char>(data[i + 1]) << 8;
+        if (i + 2 < data.length())
+            group |= static_cast<unsigned char>(data[i + 2]);
+        out += ALPHABET[(group >> 18) & 63];
+        out += ALPHABET[(group >> 12) & 63];
+        out += (i + 1 < data.length()) ? ALPHABET[(group >> 6) & 63] : '=';
+        out += (i + 2 < data.length()) ? ALPHABET[group & 63] : '=';
+    }
+    return out;
+}
+
+// Real password workers here, so that a check is still pending while the
+// client sends more
+void testSasl() {
+    std::string path = tempPath("accounts");
+    {
+        std::ofstream file(path.c_str());
+        file << "alice " << PasswordHash::hash("secret") << "\n";
+    }
+    TestServer t;
+    t.server().openAccounts(path);
+    CHECK(t.server().getWorkers().start(1));
+
+    int fd = t.connect();
+    std::string response = base64(std::string("\0alice\0secret", 13));
+    t.send(fd, std::string("PASS ") + PASSWORD);
+    t.send(fd, "AUTHENTICATE PLAIN");
+    CHECK(has(t.take(fd), "AUTHENTICATE +"));
+    t.transport().deliver(fd, "AUTHENTICATE " + response + "\r\nAUTHENTICATE *\r\nAUTHENTICATE PLAIN\r\nAUTHENTICATE " + response + "\r\n");
+    t.settle();
+    for (int i = 0; i < 200 && t.server().getWorkers().getPending() > 0; ++i) {
+        usleep(10000);
+        t.settle();
+    }
+    std::string out = t.take(fd);
+    CHECK(count(out, " 904 ") == 1);    // the second check while the first runs
+    CHECK(!has(out, " 903 "));          // the first was aborted
+
+    t.send(fd, "AUTHENTICATE PLAIN");
+    t.send(fd, "AUTHENTICATE " + response);
+    out.clear();
+    for (int i = 0; i < 200 && !has(out, " 903 "); ++i) {
+        usleep(10000);
+        out += t.take(fd);
+    }
+    CHECK(has(out, ":ircserv 900 * ") && has(out, "@10.0.0.1 alice :You are now logged in as alice\r\n"));
+    CHECK(has(out, ":ircserv 903 * :SASL authentication successful\r\n"));
+
+    // Far past anything a password hash should ever be fed
+    int other = t.connect();
+    t.send(other, "AUTHENTICATE PLAIN");
+    t.send(other, "AUTHENTICATE " + base64(std::string("\0alice\0", 7) + std::string(PasswordHash::MAX_PASSWORD_LENGTH + 1, 'x')));
+    CHECK(has(t.take(other), " 904 "));
+    CHECK(!PasswordHash::verify(std::string(PasswordHash::MAX_PASSWORD_LENGTH + 1, 'x'), PasswordHash::hash("x")));
+
+    t.server().getWorkers().stop();
+    unlink(path.c_str());
+}
+
+void testChannelFanout() {
+    TestServer t;
+    int alice = t.connectAs("alice");
+    int bob = t.connectAs("bob");
+    int carol = t.connectAs("carol");
+
+    t.send(alice, "JOIN #room");
+    t.send(bob, "JOIN #room");
+    t.send(carol, "JOIN #room");
+    CHECK(has(t.take(alice), ":bob!bob@10.0.0.1 JOIN :#room"));
+    t.take(bob);
+    t.take(carol);
+
+    t.send(alice, "PRIVMSG #room :hello");
+    CHECK(!has(t.take(alice), "hello"));
+    CHECK(has(t.take(bob), ":alice!alice@10.0.0.1 PRIVMSG #room :hello\r\n"));
+    CHECK(has(t.take(carol), "PRIVMSG #room :hello"));
+
+    // A member leaving from the middle of the table
+    t.send(bob, "PART #room");
+    CHECK(has(t.take(carol), ":bob!bob@10.0.0.1 PART #room"));
+    t.send(carol, "PRIVMSG #room :still here");
+    CHECK(has(t.take(alice), "still here"));
+    CHECK(!has(t.take(bob), "still here"));
+
+    Channel* room = t.server().getChannel("#room");
+    CHECK(room && room->hasClient(t.server().getClient(alice)) && room->hasClient(t.server().getClient(carol)));
+    CHECK(room && !room->hasClient(t.server().getClient(bob)));
+}
+
+void testNickAndQuitFanoutOnce() {
+    TestServer t;
+    int alice = t.connectAs("alice");
+    int bob = t.connectAs("bob");
+    t.send(alice, "JOIN #one");
+    t.send(alice, "JOIN #two");
+    t.send(bob, "JOIN #one");
+    t.send(bob, "JOIN #two");
+    t.take(alice);
+    t.take(bob);
+
+    t.send(alice, "NICK alicia");
+    CHECK(count(t.take(bob), " NICK ") == 1);
+    CHECK(t.server().findClientByNick("alicia") != NULL);
+    CHECK(t.server().findClientByNick("alice") == NULL);
+
+    t.send(alice, "QUIT :bye");
+    CHECK(count(t.take(bob), " QUIT :") == 1);
+    CHECK(!t.isOpen(alice));
+}
+
+void testChannelRestrictions() {
+    TestServer t;
+    int op = t.connectAs("op");
+    int guest = t.connectAs("guest");
+    t.send(op, "JOIN #locked");
+    t.send(op, "MODE #locked +k sesame");
+    t.send(guest, "JOIN #locked");
+    CHECK(has(t.take(guest), " 475 "));
+    t.send(guest, "JOIN #locked sesame");
+    CHECK(has(t.take(guest), "JOIN :#locked"));
+
+    t.send(op, "JOIN #banned");
+    t.send(op, "MODE #banned +b guest!*@*");
+    t.send(guest, "JOIN #banned");
+    CHECK(has(t.take(guest), " 474 "));
+
+    // Read-only MODE queries never hand out ops, even on an opless channel
+    t.send(op, "MODE #locked -o op");
+    t.send(guest, "MODE #locked");
+    t.send(guest, "MODE #locked b");
+    Channel* locked = t.server().getChannel("#locked");
+    CHECK(!locked->isOperator(t.server().getClient(guest)));
+    CHECK(!has(t.take(guest), " MODE #locked +o "));
+
+    // Someone leaving does
+    t.send(op, "PART #locked");
+    CHECK(locked->isOperator(t.server().getClient(guest)));
+}
+
+// -n +m: outsiders may speak to the channel only if its members could
+void testModeratedChannel() {
+    TestServer t;
+    int op = t.connectAs("op");
+    int member = t.connectAs("member");
+    int outsider = t.connectAs("outsider");
+    t.send(op, "JOIN #quiet");
+    t.send(member, "JOIN #quiet");
+    t.send(op, "MODE #quiet -n+m");
+    t.take(op);
+    t.take(member);
+
+    t.send(member, "PRIVMSG #quiet :from a member");
+    CHECK(has(t.take(member), " 404 member #quiet :Cannot send to channel (+m)"));
+    t.send(outsider, "PRIVMSG #quiet :from outside");
+    CHECK(has(t.take(outsider), " 404 outsider #quiet :Cannot send to channel (+m)"));
+    CHECK(!has(t.take(op), "from"));
+
+    t.send(op, "MODE #quiet -m");
+    t.send(outsider, "PRIVMSG #quiet :now allowed");
+    CHECK(has(t.take(op), "PRIVMSG #quiet :now allowed"));
+}
+
+// +D members stay out of sight, WHOIS included, until they speak
+void testDelayedJoin() {
+    TestServer t;
+    int op = t.connectAs("op");
+    int lurker = t.connectAs("lurker");
+    int member = t.connectAs("member");
+    int outsider = t.connectAs("outsider");
+    t.send(op, "JOIN #d");
+    t.send(op, "MODE #d +D");
+    t.send(member, "JOIN #d");
+    t.send(member, "PRIVMSG #d :hello");
+    t.send(lurker, "JOIN #d");
+    t.take(op);
+    t.take(member);
+
+    t.send(outsider, "WHOIS lurker");
+    CHECK(!has(t.take(outsider), "#d"));
+    t.send(member, "WHOIS lurker");
+    CHECK(!has(t.take(member), "#d"));
+    t.send(op, "WHOIS lurker");
+    CHECK(has(t.take(op), " 319 op lurker :#d"));
+    t.send(lurker, "WHOIS lurker");
+    CHECK(has(t.take(lurker), " 319 lurker lurker :#d"));
+
+    t.send(lurker, "PRIVMSG #d :here");
+    CHECK(has(t.take(member), ":lurker!lurker@10.0.0.1 JOIN :#d"));
+    t.send(outsider, "WHOIS lurker");
+    CHECK(has(t.take(outsider), " 319 outsider lurker :#d"));
+}
+
+// Settings saved before a restart bind the first joiner too
+void testRestoredChannel() {
+    std::string prefix = tempPath("restored");
+    {
+        TestServer before;
+        CHECK(before.server().openChannelStore(prefix));
+        int op = before.connectAs("op");
+        before.send(op, "JOIN #vault");
+        before.send(op, "MODE #vault +k sesame");
+        before.send(op, "JOIN #banned");
+        before.send(op, "MODE #banned +b guest!*@*");
+        before.server().syncChannelStore();
+    }
+    {
+        TestServer after;
+        CHECK(after.server().openChannelStore(prefix));
+        int guest = after.connectAs("guest");
+        after.send(guest, "JOIN #vault");
+        CHECK(has(after.take(guest), " 475 "));
+        CHECK(after.server().getChannel("#vault") == NULL);
+        after.send(guest, "JOIN #banned");
+        CHECK(has(after.take(guest), " 474 "));
+
+        // Let in with the key, and opped as the first one in so the
+        // channel can be managed again
+        after.send(guest, "JOIN #vault sesame");
+        std::string out = after.take(guest);
+        CHECK(has(out, "JOIN :#vault"));
+        CHECK(has(out, "@guest"));
+        CHECK(after.server().getChannel("#vault")->isOperator(after.server().getClient(guest)));
+        int late = after.connectAs("late");
+        after.send(late, "JOIN #vault sesame");
+        CHECK(!after.server().getChannel("#vault")->isOperator(after.server().getClient(late)));
+
+        // A brand-new channel still ops its creator
+        after.send(guest, "JOIN #fresh");
+        CHECK(has(after.take(guest), "@guest"));
+        after.server().syncChannelStore();
+    }
+    removeStore(prefix);
+}
+
+void testChannelStoreCompaction() {
+    std::string prefix = tempPath("compaction");
+    std::set<std::string> live;
+    {
+        ChannelStore store;
+        CHECK(store.open(prefix));
+        for (int i = 0; i < 2000; ++i) {
+            std::ostringstream name;
+            name << "#c" << i;
+            store.put(name.str(), "old");
+            live.insert(name.str());
+        }
+        store.compact(live);
+        store.put("#c1", "new");
+        store.remove("#c2");
+
+        const char* settings;
+        size_t length;
+        CHECK(store.find("#c1", settings, length) && std::string(settings, length) == "new");
+        CHECK(store.find("#c1999", settings, length) && std::string(settings, length) == "old");
+        CHECK(!store.find("#c2", settings, length));
+        store.compact(live);
+        CHECK(store.find("#c1", settings, length) && std::string(settings, length) == "new");
+        CHECK(!store.find("#c2", settings, length));
+        store.sync();
+    }
+    {
+        ChannelStore store;
+        CHECK(store.open(prefix));
+        const char* settings;
+        size_t length;
+        CHECK(store.find("#c1", settings, length) && std::string(settings, length) == "new");
+        CHECK(store.find("#c0", settings, length) && std::string(settings, length) == "old");
+        CHECK(!store.find("#c2", settings, length));
+    }
+    removeStore(prefix);
+}
+
+// Applies whatever the primary publishes until both sides are quiet
+void catchUp(TestServer& primary, Replication& follower) {
+    for (int i = 0; i < 20; ++i) {
+        primary.settle();
+        follower.follow(10);
+    }
+}
+
+// A standby over a real socket. The in-memory clients' descriptors are made
+// real (copies of /dev/null) so that they can be passed with the snapshot.
+void testReplication() {
+    std::string path = tempPath("repl");
+    int null = open("/dev/null", O_RDWR);
+    for (int fd = MemoryTransport::FIRST_FD; fd < MemoryTransport::FIRST_FD + 2; ++fd)
+        dup2(null, fd);
+    {
+        TestServer primary;
+        CHECK(primary.server().getReplication().listen(path, null));
+        int alice = primary.connectAs("alice");
+        primary.send(alice, "JOIN #room");
+
+        TestServer standby;
+        Replication& follower = standby.server().getReplication();
+        CHECK(follower.connectToPrimary(path));
+        catchUp(primary, follower);
+        CHECK(follower.isSynced());
+        Channel* room = standby.server().getChannel("#room");
+        CHECK(room && room->getMemberCount() == 1);
+
+        int bob = primary.connectAs("bob");
+        primary.send(bob, "JOIN #room");
+        primary.send(alice, "TOPIC #room :mirrored");
+        primary.send(alice, "JOIN #new");
+        catchUp(primary, follower);
+        room = standby.server().getChannel("#room");
+        CHECK(room && room->getMemberCount() == 2 && room->getTopic() == "mirrored");
+
+        // Nothing applied stays queued for publishing on the standby
+        Channel* created = standby.server().getChannel("#new");
+        CHECK(created && created->takeDirtyFlags() == 0);
+        CHECK(room && room->takeDirtyFlags() == 0);
+
+        std::vector<std::string> lines;
+        primary.server().getReplication().report(lines);
+        follower.report(lines);
+        CHECK(lines.size() == 2);
+        CHECK(lines[0].find("replication standby seq ") == 0);
+        CHECK(lines[1].find("replication following seq ") == 0);
+    }
+    for (int fd = MemoryTransport::FIRST_FD; fd < MemoryTransport::FIRST_FD + 2; ++fd)
+        close(fd);
+    close(null);
+    unlink(path.c_str());
+}
+
+void testWhoMask() {
+    TestServer t;
+    int alice = t.connectAs("alice");
+    t.connectAs("alina");
+    t.connectAs("bob");
+
+    t.send(alice, "WHO ali*");
+    std::string out = t.take(alice);
+    CHECK(count(out, " 352 ") == 2);
+    CHECK(has(out, " alina "));
+    CHECK(!has(out, " bob "));
+    CHECK(has(out, " 315 alice ali* "));
+
+    // The server name matches everyone
+    t.send(alice, "WHO irc*");
+    CHECK(count(t.take(alice), " 352 ") == 3);
+}
+
+void testWhoxIp() {
+    std::string path = tempPath("opers");
+    {
+        std::ofstream file(path.c_str());
+        file << "boss " << PasswordHash::hash("secret") << " oper\n";
+    }
+    TestServer t;
+    t.server().openAccounts(path);
+    int alice = t.connectAs("alice");
+    int bob = t.connectAs("bob");
+    t.server().getClient(bob)->setIp("10.0.0.2");
+
+    t.send(alice, "WHO bob %ni");
+    CHECK(has(t.take(alice), " 354 alice 255.255.255.255 bob\r\n"));
+    t.send(alice, "WHO alice %ni");
+    CHECK(has(t.take(alice), " 354 alice 10.0.0.1 alice\r\n"));
+
+    t.server().getClient(alice)->setAccount("boss");
+    t.send(alice, "WHO bob %ni");
+    CHECK(has(t.take(alice), " 354 alice 10.0.0.2 bob\r\n"));
+    unlink(path.c_str());
+}
+
+// Snapshots share the users and channels that did not change: a nick change
+// between two queries must still show in both NAMES and WHO
+void testSnapshotReuse() {
+    TestServer t;
+    int alice = t.connectAs("alice");
+    int bob = t.connectAs("bob");
+    t.connectAs("carol");
+    t.send(alice, "JOIN #a");
+    t.send(bob, "JOIN #a");
+    t.send(alice, "NAMES #a");
+    CHECK(has(t.take(alice), " bob"));
+    t.take(bob);
+
+    t.send(bob, "NICK robert");
+    t.send(alice, "NAMES #a");
+    std::string out = t.take(alice);
+    CHECK(has(out, " robert"));
+    CHECK(!has(out, " bob"));
+    t.send(alice, "WHO #a");
+    out = t.take(alice);
+    CHECK(count(out, " 352 ") == 2);
+    CHECK(has(out, " robert "));
+    t.send(alice, "WHO carol");
+    CHECK(count(t.take(alice), " 352 ") == 1);
+
+    t.send(bob, "PART #a");
+    t.send(alice, "NAMES #a");
+    CHECK(!has(t.take(alice), " robert"));
+}
+
+void testCaptureMasking() {
+    std::string path = tempPath("capture");
+    unlink(path.c_str());
+    TestServer t;
+    Capture& capture = t.server().getCapture();
+    CHECK(capture.open(path, ""));
+    int fd = t.connect();
+    capture.sessionOpened(t.server().getClient(fd));
+    t.send(fd, "PASS hunter2");
+    t.send(fd, "RESUME sometoken");
+    t.send(fd, "NICK alice");
+    capture.sync();
+    capture.close();
+
+    struct stat info;
+    CHECK(stat(path.c_str(), &info) == 0 && (info.st_mode & 0777) == 0600);
+    std::vector<Capture::Record> records;
+    CHECK(Capture::load(path, records));
+    std::string lines;
+    for (size_t i = 0; i < records.size(); ++i)
+        lines += records[i].data + "\n";
+    CHECK(has(lines, "PASS *\nRESUME *\nNICK alice\n"));
+    CHECK(!has(lines, "hunter2"));
+    CHECK(!has(lines, "sometoken"));
+    unlink(path.c_str());
+}
+
+// -------- RESOLVER --------
+
+// Offline names: 10.0.0.7 has one, anything else none. A held lookup blocks
+// its worker until released, so lookups stay in flight.
+pthread_mutex_t g_lookupMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_lookupReleased = PTHREAD_COND_INITIALIZER;
+bool g_holdLookups = false;
+
+std::string stubResolve(const std::string& ip) {
+    pthread_mutex_lock(&g_lookupMutex);
+    while (g_holdLookups)
+        pthread_cond_wait(&g_lookupReleased, &g_lookupMutex);
+    pthread_mutex_unlock(&g_lookupMutex);
+    return ip == "10.0.0.7" ? "host.example" : "";
+}
+
+void holdLookups(bool hold) {
+    pthread_mutex_lock(&g_lookupMutex);
+    g_holdLookups = hold;
+    pthread_cond_broadcast(&g_lookupReleased);
+    pthread_mutex_unlock(&g_lookupMutex);
+}
+
+int connectLookedUp(TestServer& t, const std::string& ip) {
+    int fd = t.connect(ip);
+    t.server().getResolver().lookup(t.server().getClient(fd));
+    return fd;
+}
+
+void testResolver() {
+    TestServer t;
+    Resolver& resolver = t.server().getResolver();
+    resolver.setResolveFunction(&stubResolve);
+
+    // Without started workers each lookup finishes inline
+    int named = connectLookedUp(t, "10.0.0.7");
+    t.send(named, std::string("PASS ") + PASSWORD);
+    t.send(named, "NICK named");
+    t.send(named, "USER named 0 * :Named");
+    std::string out = t.take(named);
+    CHECK(has(out, "Found your hostname: host.example"));
+    CHECK(has(out, " 001 named :Welcome to the IRC Network named!named@host.example\r\n"));
+
+    int unnamed = connectLookedUp(t, "10.0.0.8");
+    CHECK(has(t.take(unnamed), "using your IP address instead"));
+
+    // With every slot held, the next new address is not looked up
+    CHECK(resolver.start());
+    holdLookups(true);
+    std::vector<int> held;
+    for (size_t i = 0; i < Resolver::MAX_INFLIGHT; ++i) {
+        std::ostringstream ip;
+        ip << "10.1." << i / 256 << "." << i % 256;
+        held.push_back(connectLookedUp(t, ip.str()));
+    }
+    int overflow = connectLookedUp(t, "10.2.0.1");
+    out = t.take(overflow);
+    CHECK(has(out, "using your IP address instead"));
+    CHECK(!has(out, "Looking up your hostname"));
+    CHECK(has(t.take(held.back()), "Looking up your hostname"));
+    holdLookups(false);
+}
+
+void testChatHistory() {
+    TestServer t;
+    int alice = t.connectAs("alice");
+    int bob = t.connectAs("bob");
+    t.send(alice, "JOIN #log");
+    for (int i = 0; i < 5; ++i) {
+        std::ostringstream line;
+        line << "PRIVMSG #log :line " << i;
+        t.send(alice, line.str());
+    }
+    t.send(bob, "JOIN #log");
+    t.take(bob);
+    t.send(bob, "CHATHISTORY LATEST #log * 3");
+    std::string out = t.take(bob);
+    CHECK(!has(out, ":line 1\r\n"));
+    CHECK(has(out, ":line 2\r\n") && has(out, ":line 4\r\n"));
+}
+
+// The state a binary upgrade hands over: loaded whole by the same build,
+// refused untouched when the header does not match
+void testStateHeader() {
+    TestServer source;
+    int alice = source.connectAs("alice");
+    source.send(alice, "JOIN #kept");
+    StateWriter out;
+    std::vector<int> fds;
+    source.server().saveState(out, fds);
+
+    {
+        Server target(PASSWORD);
+        StateReader in(out.data());
+        std::map<unsigned long, Client*> clients;
+        CHECK(target.loadState(in, fds, clients));
+        CHECK(target.findClientByNick("alice") != NULL);
+        CHECK(target.getChannel("#kept") != NULL);
+    }
+    {
+        StateWriter other;
+        other.putString("ircserv-state");
+        other.putInt(Server::STATE_VERSION + 1);
+        std::string data = out.data();
+        StateReader header(data);
+        header.getString();
+        header.getInt();
+        data.replace(0, header.position(), other.data());
+
+        Server target(PASSWORD);
+        StateReader in(data);
+        std::map<unsigned long, Client*> clients;
+        CHECK(!target.loadState(in, fds, clients));
+        CHECK(target.getClients().empty() && target.getChannels().empty());
+    }
+}
+
+// -------- NETWORK --------
+
+const char* const LINKS_A = "b secret-ab 10.9.0.2\n";
+const char* const LINKS_B = "# a may only link from its own address\na secret-ab 10.9.0.1\n";
+
+bool linked(TestServer& server, const std::string& name) {
+    return server.server().getNetwork().isKnownServer(name);
+}
+
+void testLinkAuthentication() {
+    {
+        TestServer a("a", "b wrong-password\n"), b("b", LINKS_B);
+        a.link(b, "b", "10.9.0.1");
+        CHECK(!linked(a, "b") && !linked(b, "a"));
+    }
+    {
+        TestServer a("a", LINKS_A), b("b", LINKS_B);
+        a.link(b, "b", "10.9.0.99");        // right password, wrong source
+        CHECK(!linked(a, "b") && !linked(b, "a"));
+    }
+    {
+        TestServer a("a", "c secret-ab\n"), b("b", "a secret-ab\n");
+        a.link(b, "c", "10.9.0.1");         // b answers, but a called for c
+        CHECK(!linked(a, "b"));
+    }
+    {
+        // The client password does not make a server
+        TestServer b("b", LINKS_B);
+        int fd = b.connect("10.9.0.1");
+        b.send(fd, std::string("PASS ") + PASSWORD);
+        b.send(fd, "SERVER a 1 :intruder");
+        CHECK(has(b.take(fd), "ERROR :Closing Link: a (No link password given)"));
+        CHECK(!linked(b, "a"));
+    }
+    {
+        TestServer a("a", LINKS_A), b("b", LINKS_B);
+        a.link(b, "b", "10.9.0.1");
+        CHECK(linked(a, "b") && linked(b, "a"));
+    }
+}
+
+// a - b - c in a line: c's users reach a through b
+void testLinkedChannels() {
+    TestServer a("a", LINKS_A), b("b", std::string(LINKS_B) + "c secret-bc 10.9.0.3\n"), c("c", "b secret-bc\n");
+    int alice = a.connectAs("alice");
+    int bob = b.connectAs("bob");
+    int carol = c.connectAs("carol");
+    a.send(alice, "JOIN #net");
+    b.send(bob, "JOIN #net");
+    c.send(carol, "JOIN #net");
+    a.link(b, "b", "10.9.0.1");
+    c.link(b, "b", "10.9.0.3");
+    CHECK(linked(a, "c") && linked(c, "a"));
+
+    std::string seenByAlice = a.take(alice);
+    CHECK(has(seenByAlice, ":bob!bob@10.0.0.1 JOIN :#net"));
+    CHECK(has(seenByAlice, ":carol!carol@10.0.0.1 JOIN :#net"));
+    CHECK(has(b.take(bob), ":alice!alice@10.0.0.1 JOIN :#net"));
+    CHECK(has(c.take(carol), ":alice!alice@10.0.0.1 JOIN :#net"));
+
+    a.send(alice, "PRIVMSG #net :across the link");
+    CHECK(has(b.take(bob), ":alice!alice@10.0.0.1 PRIVMSG #net :across the link"));
+    CHECK(count(c.take(carol), "across the link") == 1);
+    b.send(bob, "PRIVMSG alice :direct");
+    CHECK(has(a.take(alice), ":bob!bob@10.0.0.1 PRIVMSG alice :direct"));
+
+    a.send(alice, "NICK alicia");
+    CHECK(has(b.take(bob), ":alice!alice@10.0.0.1 NICK :alicia"));
+    CHECK(b.server().findClientByNick("alicia") != NULL);
+    CHECK(has(c.take(carol), " NICK :alicia"));
+
+    // WHO names each member's own server, and mask queries the local one
+    a.send(alice, "WHO #net %sn");
+    std::string who = a.take(alice);
+    CHECK(has(who, " 354 alicia a alicia\r\n"));
+    CHECK(has(who, " 354 alicia b bob\r\n"));
+    CHECK(has(who, " 354 alicia c carol\r\n"));
+    c.send(carol, "WHO car* %sn");
+    CHECK(has(c.take(carol), " 354 carol c carol\r\n"));
+}
+
+// A hidden +D member is hidden on the other servers too: neither its JOIN
+// nor its PART reaches their users
+void testLinkedDelayedJoin() {
+    TestServer a("a", LINKS_A), b("b", LINKS_B);
+    int alice = a.connectAs("alice");
+    int lurker = b.connectAs("lurker");
+    a.link(b, "b", "10.9.0.1");
+    CHECK(linked(a, "b"));
+    a.send(alice, "JOIN #d");
+    a.send(alice, "MODE #d +D");
+    a.take(alice);
+
+    b.send(lurker, "JOIN #d");
+    CHECK(b.server().getChannel("#d")->isHidden(b.server().getClient(lurker)));
+    CHECK(!has(a.take(alice), "lurker"));
+    Client* remote = a.server().findClientByNick("lurker");
+    CHECK(a.server().getChannel("#d")->isHidden(remote));
+
+    b.send(lurker, "PART #d");
+    CHECK(!has(a.take(alice), "lurker"));
+    CHECK(!a.server().getChannel("#d")->hasClient(remote));
+
+    b.send(lurker, "JOIN #d");
+    b.send(lurker, "PRIVMSG #d :hi");
+    std::string seen = a.take(alice);
+    CHECK(has(seen, ":lurker!lurker@10.0.0.1 JOIN :#d"));
+    CHECK(has(seen, "PRIVMSG #d :hi"));
+}
+
+void testNetsplitAndRejoin() {
+    TestServer a("a", LINKS_A), b("b", LINKS_B);
+    int alice = a.connectAs("alice");
+    int bob = b.connectAs("bob");
+    a.send(alice, "JOIN #net");
+    b.send(bob, "JOIN #net");
+    int link = a.link(b, "b", "10.9.0.1");
+    a.take(alice);
+    b.take(bob);
+
+    // The link drops on a's side; each side loses the other's users
+    a.transport().hangUp(link);
+    a.settle();
+    CHECK(!linked(a, "b") && !linked(b, "a"));
+    CHECK(has(b.take(bob), ":alice!alice@10.0.0.1 QUIT :"));
+    CHECK(has(a.take(alice), ":bob!bob@10.0.0.1 QUIT :"));
+    CHECK(b.server().findClientByNick("alice") == NULL);
+
+    // Messages during the split stay on their side
+    a.send(alice, "PRIVMSG #net :alone");
+    CHECK(!has(b.take(bob), "alone"));
+
+    // b links back; the bursts put everyone in the channel again
+    b.link(a, "a", "10.9.0.2");
+    CHECK(linked(a, "b") && linked(b, "a"));
+    CHECK(has(b.take(bob), ":alice!alice@10.0.0.1 JOIN :#net"));
+    CHECK(has(a.take(alice), ":bob!bob@10.0.0.1 JOIN :#net"));
+    b.send(bob, "PRIVMSG #net :back");
+    CHECK(has(a.take(alice), "PRIVMSG #net :back"));
+}
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+const TestCase TESTS[] = {
+    { "casefold", testCasefold },
+    { "mask", testMask },
+    { "member index", testMemberIndex },
+    { "history budget", testHistoryBudget },
+    { "registration", testRegistration },
+    { "sasl", testSasl },
+    { "channel fan-out", testChannelFanout },
+    { "nick and quit fan-out once", testNickAndQuitFanoutOnce },
+    { "channel restrictions", testChannelRestrictions },
+    { "moderated channel", testModeratedChannel },
+    { "delayed join", testDelayedJoin },
+    { "restored channel", testRestoredChannel },
+    { "channel store compaction", testChannelStoreCompaction },
+    { "replication", testReplication },
+    { "who mask", testWhoMask },
+    { "whox ip", testWhoxIp },
+    { "snapshot reuse", testSnapshotReuse },
+    { "capture masking", testCaptureMasking },
+    { "resolver", testResolver },
+    { "chathistory", testChatHistory },
+    { "state header", testStateHeader },
+    { "link authentication", testLinkAuthentication },
+    { "linked channels", testLinkedChannels },
+    { "linked delayed join", testLinkedDelayedJoin },
+    { "netsplit and rejoin", testNetsplitAndRejoin },
+};
+
+}
+
+int main() {
+    // The server logs every connection; keep the report readable
+    std::ofstream discard("/dev/null");
+    std::streambuf* console = std::cout.rdbuf(discard.rdbuf());
+
+    for (size_t i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); ++i) {
+        int failuresBefore = g_failures;
+        TESTS[i].run();
+        std::cerr << (g_failures == failuresBefore ? "ok    " : "FAIL  ") << TESTS[i].name << std::endl;
+    }
+
+    std::cout.rdbuf(console);
+    std::cout << g_checks << " checks, " << g_failures << " failed" << std::endl;
+    return g_failures ? 1 : 0;
+}